@@ -29,11 +29,18 @@
 #include <errno.h>
 #include "constants.ini"
 #include "compute_md5.h"
+#include "tracker_conn.h"
+#include "peer_download.h"
+#include "peer_seed.h"
 
 /**
- * Socket variable for connecting the tracker server.
+ * Binary connection to the tracker server. Every command to the tracker is sent over this one connection.
  */
-int server_sock;
+struct tracker_conn server_conn;
+/**
+ * Text form of each \a proto_status, used to print the tracker server's responses the way the text protocol spells them.
+ */
+const char *status_names[] = {"succ", "fail", "ferr", "invalid"};
 /**
  * Socket variable accepting connections from other clients. Client listens for connections on this socket.
  */
@@ -42,6 +49,10 @@ int seed_sock;
  * Port that other clients can connect to this client on.
  */
 int seed_port;
+/**
+ * 1 once \a seed_sock is listening and a thread is serving it, so that chunks can be announced as available on \a seed_port.
+ */
+int seeding = 0;
 /**
  * Time interval (in seconds) that the client contacts the server with an <updatetracker> command.
  */
@@ -79,6 +90,10 @@ int max_client;
  * The maximum size (in bytes) of a message sent between two hosts.
  */
 int chunk_size;
+/**
+ * The most chunk requests a download keeps outstanding on one peer connection. Optional in the config file.
+ */
+int max_outstanding = MAX_OUTSTANDING;
 
 /**
  * Represents a peer (client) application.
@@ -112,12 +127,20 @@ void setUpPeerArray();
  */
 int findPeerArrayOpening();
 /**
- * Opens the "picture-wallpaper.jpg.track" tracker file. Parses out the port of a peer currently sharing a file chunk, and connects to that peer.
+ * Downloads the file described by a tracker file, from the peers listed in it, into this client's folder (see downloadFile()).
+ * The tracker is watched while the download runs, for chunks that peers announce in the meantime.
+ * Chunks are announced to the tracker server as they arrive, and the finished file is checked against the MD5 in the tracker file.
  * Used when the server is in DOWNLOAD mode.
+ * @param tracker_filename Name of the tracker file, allocated with malloc(). Freed by the thread.
+ */
+void *download(void * tracker_filename);
+/**
+ * Enables the peer to accept TCP connections from other peers on \a seed_port, through \a seed_sock.
+ * @return 0 on success, -1 if the socket could not be opened.
  */
-void *download(void * index);
+int openSeedSocket();
 /**
- * First enables the peer to accept TCP connections from other peers. Listens for up to \a MAX_CLIENT peers, and prints a message whenever another peer has made a connection.
+ * Serves the chunks of this client's files to any number of downloading peers at once (see seedFiles()), over the socket opened by openSeedSocket().
  */
 void *client_handler(void * index);
 
@@ -128,15 +151,15 @@ void *client_handler(void * index);
  */
  
 /**
- * Reads in \a server_port, \a max_client, \a chunk_size, and \a server_update_frequency (in that order) from a config file.
- * If the config file cannot be opened, or is not found, these variables are given default values: 3456, 10, 1024, and 900 respectfully.
+ * Reads in \a server_port, \a max_client, \a chunk_size, \a server_update_frequency, and \a max_outstanding (in that order) from a config file.
+ * If the config file cannot be opened, or is not found, these variables are given default values: 3456, 10, 1024, 900, and \a MAX_OUTSTANDING respectfully.
  */
 void readConfig();
 
 /**
  * When client.out is executed, the client will operate in one of two modes.
  * In SEED mode, the client first connects to the tracker server and creates a tracker file. It spins of a thread to accept and serve connections (client_handler()), and then updates the tracker server every \a server_update_frequency seconds with new chunks that it is sharing.
- * In download mode, the client contacts the server every 5 seconds, looking to see if anyone is currently sharing "picture-wallpaper.jpg". Once the server responds with this information, the client downloads the "picture-wallpaper.jpg.track " tracker file from the server, and spins off threads to download the image.
+ * In download mode, the client watches the "picture-wallpaper.jpg" tracker on the server, and asks once whether anyone is currently sharing it. If nobody is, the server tells the client as soon as someone starts to. Once the client knows, the client downloads the "picture-wallpaper.jpg.track " tracker file from the server, and spins off a thread that downloads the image from several peers at once. The client also seeds from the start (client_handler()), so every chunk it announces as it arrives can be fetched from it.
  *
  */
 int main(int argc, const char* argv[])
@@ -178,42 +201,42 @@ int main(int argc, const char* argv[])
 	
 	if (mode == SEED)
 	{
-		/** Initialize a TCP connection to the tracker server. */
-		struct sockaddr_in server_addr = { AF_INET, htons( server_port ) };
-		
-		if( ( server_sock = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 )
-		{
-			perror( "Error: socket failed" );
-			exit( 1 );
-		}
-
-		/** Connect to the server.
-		 * Now when we need to communicate to the server, we do it over "server_sock".
+		/** Open the binary connection to the tracker server.
+		 * Now when we need to communicate to the server, we do it over "server_conn".
 		*/
-		if (connect( server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr) ) == -1 )
+		if (trackerConnect(&server_conn, &server_addr, 1) != TRACKER_OK)
 		{
-			perror( "Error: Connection Issue" );
 			exit(1);
 		}
 		
+		int status;
 		memset(buf, '\0', sizeof(buf));
 		
 		/** Calculate the MD5 of the picture file we will be sharing. */
 		sprintf(buf, "test_clients/client_%d/picture-wallpaper.jpg", client_i);
 		char *md5 = computeMD5(buf);
 		/** Contact the tracker server, and try to create a tracker file. */
-		sprintf(buf, "<createtracker picture-wallpaper.jpg 35738 img %s localhost %d>", md5, seed_port); 
-		write(server_sock, buf , strlen(buf));
+		if ((status = trackerCreate(&server_conn, "picture-wallpaper.jpg", 35738, "img", md5, "localhost", seed_port)) >= PROTO_SUCC)
+		{
+			printf("<createtracker %s>\n", status_names[status]);
+		}
 		free(md5);
 		
 		/** Spin off a single thread that will accept connections, and share chunks. */
 		/* We use the 0th element of the peers array since we only need 1 thread to upload (as per Final Demo requirement. */
+		if (openSeedSocket() == -1)
+		{
+			exit(1);
+		}
 		if (pthread_create(&(peers[0].m_thread), NULL, &client_handler, &(client_i)) != 0)
 		{
 			printf("Error Creating Thread\n");
 			exit(1);
 		}
 
+		/* Split the file into the 20 segments we share 4 of. */
+		initSegments(35738);
+		
 		/* Clocks used to wait a predetermined amount of time between contacting the server for a list of tracker files.*/
 		clock_t elapsed_time, start = clock();
 		/* The initial lower bound of the segment percentage we are sharing. (ie 21% for client_i = 1) */
@@ -226,24 +249,15 @@ int main(int argc, const char* argv[])
 			/* If it has been so many seconds... */
 			if (((float)elapsed_time/CLOCKS_PER_SEC) >= server_update_frequency)
 			{
-				if((server_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-				{
-					perror( "Error: socket failed" );
-					exit( 1 );
-				}
-				/* Reconnect the the tracker server. */
-				if (connect( server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr) ) == -1 )
-				{
-					perror( "Error: Connection Issue" );
-					exit(1);
-				}
 				increment = (percentage == 0)? (5) : (4);			
 				
 				printf("I am client_%d, and I am advertising the following chunk of the file: %d%% to %d%%.\n", client_i, percentage, percentage + increment);
 
-				/* Update the server, letting it know that we are now sharing an additional 5% of the file. If we had more time, we would have calculated the actual start and end bytes. */
-				sprintf(buf, "<updatetracker picture-wallpaper.jpg %d %d localhost %d>", percentage /*start byte*/, percentage + increment /*end byte*/, seed_port);
-				write(server_sock, buf , strlen(buf));
+				/* Update the server, letting it know that we are now sharing an additional 5% of the file: the bytes of the next of the 20 segments, 4 of which are ours. */
+				/* The update goes over the same connection; it is re-opened if the server dropped it. */
+				struct segment_struct *segment = &file_segment[(client_i - 1) * 4 + segment_num];
+				long end_byte = (segment->end_chunk + 1) * CHUNK_SIZE - 1;
+				trackerUpdate(&server_conn, "picture-wallpaper.jpg", segment->start_chunk * CHUNK_SIZE, (end_byte < 35738) ? end_byte : 35737, "localhost", seed_port);
 				
 				/**Increment the percentage of the file we are sharing. */ 
 				(percentage == 0)? (percentage+=6) : (percentage+=5);
@@ -252,19 +266,49 @@ int main(int argc, const char* argv[])
 				start = clock();
 			}
 		}
+		trackerClose(&server_conn);
 	}
 	
 	/* When foundPic = 1, this means that the server has responded to the <REQ LIST> command indicating that someone is sharing "picture-wallpaper.jpg"
-	   Every 5 seconds, the client will send the <REQ LIST> command and check the servers response. Once somone is sharing the file we want, foundPic = 1.*/
+	   Until then, the client waits for the server to push the creation of its tracker, and then sends the <REQ LIST> command again. Once somone is sharing the file we want, foundPic = 1.*/
 	int foundPic = 0;
-	int sent;
+	/* Connection the picture-wallpaper.jpg tracker is watched over, until someone is sharing it. */
+	struct tracker_conn watch_conn;
+	/* Set to 1 once the server has been asked for the picture-wallpaper.jpg tracker, after which the client waits to hear about it. */
+	int listed = 0;
+	/* Response from the tracker server, and its length. */
+	char *response;
+	size_t response_len;
 	/**
-	 * When presenting in DOWNLOAD mode, the client will automatically contact the tracker server every 5 seconds until someone is sharing the picture-wallpaper.jpg.
+	 * When presenting in DOWNLOAD mode, the client will automatically ask the tracker server for the picture-wallpaper.jpg, and again whenever the server tells it the tracker has been created, until someone is sharing it.
 	 * The client will then call the <GET> command, download the tracker file from the server, and spin off a download thread.
 	 * The client will then allow the user to input commands from the keyboard until the client is closed.
+	 * All of these commands are sent over a single binary connection to the tracker server. Commands typed in the text syntax are converted.
 	 */
 	if (mode == DOWNLOAD)
 	{
+		/* The chunks we download are served to other peers as soon as they are announced, by a seeding thread of our own (the 0th
+		 * element of the peers array is taken by the download thread). Without it, nothing is announced. */
+		if (openSeedSocket() == 0)
+		{
+			if (pthread_create(&(peers[1].m_thread), NULL, &client_handler, &(client_i)) == 0)
+			{
+				seeding = 1;
+			}
+			else
+			{
+				perror("Error creating seeding thread");
+				close(seed_sock);
+			}
+		}
+
+		/* The tracker is watched before it is first asked for, so that it can not be created unnoticed in between. */
+		if (trackerConnect(&server_conn, &server_addr, 1) != TRACKER_OK || trackerConnect(&watch_conn, &server_addr, 1) != TRACKER_OK
+			|| trackerWatch(&watch_conn, "picture-wallpaper.jpg") != TRACKER_OK)
+		{
+			exit(1);
+		}
+		
 		while (1)
 		{
 			/* Once we begin downloading the picture, we will allow the user to input commands. */
@@ -272,143 +316,181 @@ int main(int argc, const char* argv[])
 			{
 				fgets(buf, sizeof(buf), stdin);
 			}
-			else
+			else if (listed == 1)
 			{
-				/* Wait 5 seconds. */
-				clock_t elapsed_time, start = clock();
+				/* Sleep until the server pushes the creation of the tracker, skipping the response to the watch. */
+				struct tracker_event event;
+				int rtn;
 				do
 				{
-					elapsed_time = clock() - start;
-				} while (((float)elapsed_time/CLOCKS_PER_SEC) < 5);
+					rtn = trackerNextEvent(&watch_conn, &event);
+				} while (rtn == TRACKER_OK && event.kind == PROTO_WATCH && event.status == PROTO_SUCC);
+				/* If the watch was lost, wait 5 seconds, watch again, and ask the server again in case the tracker was created meanwhile. */
+				if (rtn != TRACKER_OK || event.kind == PROTO_WATCH)
+				{
+					sleep(5);
+					trackerClose(&watch_conn);
+					if (trackerConnect(&watch_conn, &server_addr, 1) == TRACKER_OK)
+					{
+						trackerWatch(&watch_conn, "picture-wallpaper.jpg");
+					}
+				}
 			}
-			/* For presenting mode, the <REQ LIST> command will automatically be called (the foundPic == 0 will always be evaluated to true). */
-			if ((strncmp(buf, "<REQ LIST>", strlen("<REQ LIST>")) == 0) || foundPic == 0)
+			listed = 1;
+			/* For presenting mode, the server is automatically asked for the picture-wallpaper.jpg tracker (the foundPic == 0 will always be evaluated to true).
+			   Only trackers starting with its name are listed, rather than every tracker on the server. */
+			if ((strncmp(buf, "<REQ LIST", strlen("<REQ LIST")) == 0) || foundPic == 0)
 			{
-				/* create a socket */
-				/* internet stream socket, TCP */
-				if( ( server_sock = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 )
+				/* Send the server the <REQ LIST> command, or <REQ LIST prefix cursor limit [substring]> for a single page. */
+				struct tracker_entry *entries;
+				char prefix[CHUNK_SIZE] = "", cursor[CHUNK_SIZE] = "", substring[CHUNK_SIZE] = "";
+				int num_entries, i, limit, status, fields = 0;
+				if (foundPic == 0)
 				{
-					perror( "Error: socket failed" );
-					exit( 1 );
+					strcpy(prefix, "picture-wallpaper.jpg");
+					fields = 3;
+					limit = 1;
 				}
-
-				/* connect to the server */
-				if (connect( server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr) ) == -1 )
+				else
 				{
-					perror( "Error: Connection Issue" );
-					exit(1);
+					fields = sscanf(buf, "<REQ LIST %s %s %d %[^>]>", prefix, cursor, &limit, substring);
 				}
-			
-				/* Send the server the <REQ LIST> command. */
-				write(server_sock, "<REQ LIST>", strlen("<REQ LIST>"));
+				/* '-' stands for no prefix, or no cursor. */
+				if (strcmp(prefix, "-") == 0) prefix[0] = '\0';
+				if (strcmp(cursor, "-") == 0) cursor[0] = '\0';
 				memset(buf, '\0', sizeof(buf));
-				while((sent = read(server_sock, buf, sizeof(buf))) > 0)
+				status = (fields >= 3) ? trackerSearch(&server_conn, prefix, substring, cursor, limit, &entries, &num_entries)
+						: trackerList(&server_conn, &entries, &num_entries);
+				if (status == PROTO_SUCC)
 				{
-					/* Search the server's message for the picture-wallpaper tracker file. */
-					if (strstr(buf, "picture-wallpaper.jpg") != NULL)
+					printf("<REP LIST %d>\n", num_entries);
+					for (i = 0; i < num_entries; i++)
+					{
+						/* Search the server's message for the picture-wallpaper tracker file. */
+						if (strcmp(entries[i].filename, "picture-wallpaper.jpg") == 0)
+						{
+							/*Once we find it, set foundPic to 1 to allow keyboard input after the download has begun. */
+							foundPic = 1;
+						}
+						printf("<%d %s %llu %s>\n", i + 1, entries[i].filename, entries[i].filesize, entries[i].md5);
+					}
+					/* A page is followed by the cursor to ask for the next page with, if there is one. */
+					if (cursor[0] != '\0')
+					{
+						printf("<REP LIST END %s>\n", cursor);
+					}
+					else
 					{
-						/*Once we find it, set foundPic to 1 to allow keyboard input after the download has begun. */
-						foundPic = 1;
+						printf("<REP LIST END>\n");
 					}
-					printf("%s", buf);
-					memset(buf, '\0', sizeof(buf));
+					free(entries);
 				}
 				
-				/* Since buf now contains a <GET> statement, the <GET> command should be invoked below. */
+				/* Since buf now contains a <GET> statement, the <GET> command should be invoked below. Nothing more needs to be watched. */
 				if (foundPic == 1)
 				{
+					trackerClose(&watch_conn);
 					strcpy(buf, "<GET picture-wallpaper.jpg.track>");
 				}
 			}
 			if (strncmp(buf, "<createtracker", strlen("<createtracker")) == 0)
-			{		
-				if( ( server_sock = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 )
-				{
-					perror( "Error: socket failed" );
-					exit( 1 );
-				}
-				if (connect( server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr) ) == -1 )
-				{
-					perror( "Error: Connection Issue" );
-					exit(1);
-				}
-				
-				/* Send the server the <createtracker> command. */
-				write(server_sock, buf, strlen(buf));
-				memset(buf, '\0', sizeof(buf));
-				while((sent = read(server_sock, buf, sizeof(buf))) > 0)
+			{
+				/* Send the server the <createtracker> command, with its fields taken from the text syntax. */
+				char filename[CHUNK_SIZE], description[CHUNK_SIZE], md5[CHUNK_SIZE], ip_addr[CHUNK_SIZE];
+				unsigned long long filesize;
+				int port, status = PROTO_FAIL;
+				if (sscanf(buf, "<createtracker %s %llu %s %s %s %d>", filename, &filesize, description, md5, ip_addr, &port) == 6)
 				{
-					printf("%s", buf);
+					status = trackerCreate(&server_conn, filename, filesize, description, md5, ip_addr, port);
 				}
+				printf("<createtracker %s>\n", status_names[(status >= PROTO_SUCC) ? status : PROTO_FAIL]);
 			}
 			if (strncmp(buf, "<updatetracker", strlen("<updatetracker")) == 0)
 			{
-				if( ( server_sock = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 )
+				/* Send the server the <updatetracker> command, with its fields taken from the text syntax. */
+				char filename[CHUNK_SIZE], ip_addr[CHUNK_SIZE], list[CHUNK_SIZE];
+				long start_byte, end_byte;
+				int port, status = PROTO_FAIL;
+				if (sscanf(buf, "<updatetracker %s %ld %ld %s %d>", filename, &start_byte, &end_byte, ip_addr, &port) == 5)
 				{
-					perror( "Error: socket failed" );
-					exit( 1 );
+					status = trackerUpdate(&server_conn, filename, start_byte, end_byte, ip_addr, port);
 				}
-				if (connect( server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr) ) == -1 )
+				/* A list of "start:end" ranges, separated by commas, is announced as a single change. */
+				else if (sscanf(buf, "<updatetracker %s %s %s %d>", filename, list, ip_addr, &port) == 4)
 				{
-					perror( "Error: Connection Issue" );
-					exit(1);
-				}
-			
-				write(server_sock, buf, strlen(buf));
-				memset(buf, '\0', sizeof(buf));
-				while((sent = read(server_sock, buf, sizeof(buf))) > 0)
-				{
-					printf("%s", buf);
+					struct tracker_range ranges[CHUNK_SIZE / 4];
+					int count = 0;
+					char *range = strtok(list, ",");
+					while (range != NULL && count < CHUNK_SIZE / 4 && sscanf(range, "%ld:%ld", &ranges[count].start_byte, &ranges[count].end_byte) == 2)
+					{
+						count++;
+						range = strtok(NULL, ",");
+					}
+					if (range == NULL && count > 0)
+					{
+						status = trackerUpdateRanges(&server_conn, filename, ranges, count, ip_addr, port);
+					}
 				}
-				printf("\n");
+				printf("<updatetracker %s>\n", status_names[(status >= PROTO_SUCC) ? status : PROTO_FAIL]);
 			}
 			/* When presenting, this code will automatically be executed once someone is sharing the picture-wallpaper.jpg file. */
 			if (strncmp(buf, "<GET", strlen("<GET")) == 0)
 			{
 				FILE *file;
 				char tokenize[CHUNK_SIZE], filename[CHUNK_SIZE];
-				char *line;
-				if( ( server_sock = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 )
-				{
-					perror( "Error: socket failed" );
-					exit( 1 );
-				}
-				if (connect( server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr) ) == -1 )
-				{
-					perror( "Error: Connection Issue" );
-					exit(1);
-				}
-			
-				/* Send the tracker server the command. */
-				write(server_sock, buf, strlen(buf));
+				char *line, *md5;
+				long start_byte, end_byte;
+				int max_peers, fields = 0, status = PROTO_INVALID;
 				
 				strcpy(tokenize, buf);
-				/*Get the tracker filename*/
+				/*Get the tracker filename, and the byte range if only part of the tracker file is wanted*/
 				line = strtok(tokenize, " ");
 				line  = strtok(NULL, ">");
-				strcpy(filename, line);
+				if (line != NULL)
+				{
+					fields = sscanf(line, "%s %ld %ld %d", filename, &start_byte, &end_byte, &max_peers);
+				}
 				
-				/* Create an empty file to save the tracker file in. */
-				file = fopen(filename, "wb");
-
-				memset(buf, '\0', sizeof(buf));
-				while((sent = read(server_sock, buf, sizeof(buf))) > 0)
+				/* Send the tracker server the command. */
+				if (fields == 1)
 				{
-					/* Save the tracker file (sent from server). */
-					fwrite(buf, sizeof(char), strlen(buf), file);
-					memset(buf, '\0', sizeof(buf));
+					status = trackerGet(&server_conn, filename, &response, &response_len);
+				}
+				else if (fields == 4)
+				{
+					status = trackerSelect(&server_conn, filename, start_byte, end_byte, max_peers, &response, &response_len);
+				}
+				if (status != PROTO_SUCC)
+				{
+					printf("<GET invalid>\n");
+					continue;
 				}
 				
-				fclose(file);
+				/* The server sends the MD5 of the tracker file with it; make sure it arrived intact. */
+				md5 = computeMD5Buffer(response, response_len);
+				if (strcmp(md5, server_conn.md5) != 0)
+				{
+					printf("[ERROR] Tracker file %s is corrupt\n", filename);
+					free(md5);
+					free(response);
+					continue;
+				}
+				free(md5);
 				
-				/* Spin off 5 downloads thread. */
-				int i;
-				for (i = 0; i < 1; i++) /* For debugging purposes, we only spin off 1 thread. */
+				/* Save the tracker file (sent from server). */
+				if ((file = fopen(filename, "wb")) != NULL)
 				{
-					if (pthread_create(&(peers[i].m_thread), NULL, &download, &(peers[i].m_index)) != 0)
-					{
-						perror("Error creating download thread");
-					}
+					fwrite(response, sizeof(char), response_len, file);
+					fclose(file);
+				}
+				free(response);
+				
+				/* Spin off the download thread. It downloads from several peers at once by itself. */
+				char *tracker_filename = strdup(filename);
+				if (pthread_create(&(peers[0].m_thread), NULL, &download, tracker_filename) != 0)
+				{
+					perror("Error creating download thread");
+					free(tracker_filename);
 				}
 			}
 			
@@ -418,7 +500,6 @@ int main(int argc, const char* argv[])
 				//call xiao's appendSegment() function too piece together everything
 			}
 			*/
-			close(server_sock);
 		}
 	}
 	
@@ -433,138 +514,143 @@ int main(int argc, const char* argv[])
 	return 0;
 }
 
-void *download(void * index)
+void *download(void * tracker_filename)
 {
-	//index indicates what segment they are responsible for
-	// i = 0 -> 1st sub-chunk (0->20%)
-	// i = 1 -> second sub-chunk (21%->40%)
+	char filename[CHUNK_SIZE], description[CHUNK_SIZE], md5[CHUNK_SIZE], path[CHUNK_SIZE + 64];
+	long filesize;
+	/* Completed chunks are announced over a connection of our own: server_conn belongs to the main thread. */
+	struct tracker_conn announce_conn;
+	/* Connection the tracker is watched over, so that chunks peers announce while we download are fetched too. */
+	struct tracker_conn watch_conn;
+	int watching = 0;
 	
-	//int client_index = *((int *) index);
+	/* Parse the tracker file into live_chunks, the peers we can download from. */
+	if (tracker_file_parser((char *) tracker_filename, filename, &filesize, description, md5) != NO_ERROR)
+	{
+		printf("Could not open tracker file.");
+		free(tracker_filename);
+		return NULL;
+	}
 	
-	//find that chunk
-	//connect to client who has that chunk
-	//download it
-	//update tracker <updatetracker picture-wallpaper.jpg start end localhost seed_port>
-	//repeat
+	int announce = (trackerConnect(&announce_conn, &server_conn.addr, 1) == TRACKER_OK);
 	
-	size_t len = 0;
-	int port;
-	char *line, *temp;
-	/* Open tracker file. */
-	FILE *tracker;
-	if ((tracker = fopen("picture-wallpaper.jpg.track", "r")) != NULL)
+	/* Once the watch is in place, the tracker file is fetched again, so that no chunk announced since it was saved is missed. */
+	if (announce && trackerConnect(&watch_conn, &server_conn.addr, 1) == TRACKER_OK)
 	{
-		/* Read past of the tracker file information. We are currently interested in chunk info. */
-		do
-		{
-			getline(&line, &len, tracker);
-		} while (strncmp(line, "MD5:", 4) != 0);
-		
-		/* Get the port number of a peer sharing a chunk. */
-		getline(&line, &len, tracker);
-		strtok(line, ":");
-		temp = strtok(NULL, ":");
-		port = atoi(temp);
-		
-		/* Connect to the peer at that port. */
-		struct sockaddr_in server_addr = {AF_INET, htons(port)}; 
-		struct hostent *hp; 
-		hp = gethostbyname("localhost");
-		bcopy( hp->h_addr_list[0], (char*)&server_addr.sin_addr, hp->h_length );
+		struct tracker_event *event = (struct tracker_event *) malloc(sizeof(struct tracker_event));
+		char *contents, *contents_md5;
+		size_t length;
+		FILE *file;
 		
-		int new_sock = socket( AF_INET, SOCK_STREAM, 0 );
-		connect(new_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)); /*Connect. */
-
-		/* Send the serving peer our download request. */
-		char buf[CHUNK_SIZE];
-		/* If we had more time, we would have calculated the actual start and end byte of the chunk we want using the index argument. */
-		strcpy(buf, "<download picture-wallpaper.jpg.track 0 35738>");
-		
-		/* For demo purposes, we are showing that we have successfully sent another peer some data. */
-		/* We wanted to sure that we successfully implemented peer-peer communication. */
-		int sent = write(new_sock, buf, sizeof(buf));
-		printf("%d\n", sent);
-		
-		free(line);
-		fclose(tracker);
+		if (trackerWatch(&watch_conn, filename) == TRACKER_OK && trackerNextEvent(&watch_conn, event) == TRACKER_OK
+			&& event->kind == PROTO_WATCH && event->status == PROTO_SUCC)
+		{
+			watching = 1;
+			if (trackerGet(&announce_conn, (char *) tracker_filename, &contents, &length) == PROTO_SUCC)
+			{
+				contents_md5 = computeMD5Buffer(contents, length);
+				if (strcmp(contents_md5, announce_conn.md5) == 0 && (file = fopen((char *) tracker_filename, "wb")) != NULL)
+				{
+					fwrite(contents, sizeof(char), length, file);
+					fclose(file);
+					tracker_file_parser((char *) tracker_filename, filename, &filesize, description, md5);
+				}
+				free(contents_md5);
+				free(contents);
+			}
+		}
+		else
+		{
+			trackerClose(&watch_conn);
+		}
+		free(event);
 	}
-	else
+	free(tracker_filename);
+	
+	/* Download over as many peer connections at once as we may have clients, straight into the file, rarest chunks first. */
+	sprintf(path, "test_clients/client_%d/%s", client_i, filename);
+	/* Chunks are only announced when this client is seeding them. */
+	if (downloadFile(filename, filesize, path, (max_client > 0) ? max_client : MAX_CLIENT, max_outstanding,
+					 (announce && seeding) ? &announce_conn : NULL, watching ? &watch_conn : NULL, "localhost", seed_port) == NO_ERROR)
 	{
-		printf("Could not open tracker file.");
+		/* Make sure the file we put together is the one that is being shared. */
+		char *downloaded_md5 = computeMD5(path);
+		if (strcmp(downloaded_md5, md5) == 0)
+		{
+			printf("[INFO] Downloaded %s\n", path);
+		}
+		else
+		{
+			printf("[ERROR] Downloaded %s does not match its MD5\n", path);
+		}
+		free(downloaded_md5);
 	}
+	
+	if (watching)
+	{
+		trackerClose(&watch_conn);
+	}
+	if (announce)
+	{
+		trackerClose(&announce_conn);
+	}
+	return NULL;
 }
 
-void *client_handler(void * index)
+int openSeedSocket()
 {
-	/* Dereference the index passed as a parameter by the pthread_create() function */
-	//int client_index = *((int *) index);
-	
 	struct sockaddr_in server_addr = { AF_INET, htons( seed_port ) };
-	struct sockaddr *client_addr = NULL;
-	socklen_t *length = NULL;
 
 	/* Enable this client to accept connections from other peers. */
 	
 	if((seed_sock = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 )
 	{
 		perror( "Error: socket failed" );
-		exit( 1 );
+		return -1;
 	}
 	
 	int setsock = 1;
 	if(setsockopt(seed_sock, SOL_SOCKET, SO_REUSEADDR, &setsock, sizeof(setsock)) == -1)
 	{
 		perror("Server Error: Setsockopt failed");
-		exit(1);
+		close(seed_sock);
+		return -1;
 	}
 	
 	/* Bind the socket to an internet port. */
 	if (bind(seed_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1 )
 	{
 		perror("Server Error: Bind Failed");
-		exit(1);
+		close(seed_sock);
+		return -1;
 	}
 	
-	/* We will listen for multiple peers. */
-	if (listen(seed_sock, MAX_CLIENT) == -1)
+	/* We will listen for as many peers as want to download from us at once. */
+	if (listen(seed_sock, SOMAXCONN) == -1)
 	{
 		perror("Server Error: Listen failed");
-		exit(1);
+		close(seed_sock);
+		return -1;
 	}
-	
-	/* The plan was to continuously listen for connections.
-	 * Peers would send a <download> command indicating which chunk they desired.
-	 * We would then send the chunk, disconnect from that peer, and then wait for annother connection. */
-	if ((peers[0].m_peer_socket = accept(seed_sock, client_addr, length)) == -1)
-	{
-		perror("Server Error: Accepting issue"); 
-		exit(1);
-	}
-	else
-	{
-		/* Used to show that we had successfully implemented peer-peer communication. */
-		printf("A downloading client has connected.\n");
+	return 0;
+}
 
-		/* read download command
-		sent = read(seed_sock, buf, sizeof(buf));
-		*/
-		
-	}
+void *client_handler(void * index)
+{
+	/* Dereference the index passed as a parameter by the pthread_create() function */
+	//int client_index = *((int *) index);
 	
-	/*When we're done sharing*/
-	if (close(peers[0].m_peer_socket) != 0)
-	{
-		perror("Closing socket issue");
-	}
+	/* Serve the chunks of our shared files to every peer that asks, until the client is closed. */
+	char directory[CHUNK_SIZE];
+	sprintf(directory, "test_clients/client_%d", client_i);
+	seedFiles(seed_sock, directory);
+	
+	perror("Server Error: Seeding failed");
 	if (close(seed_sock) != 0)
 	{
 		perror("Closing socket issue");
 	}
-	if (pthread_cancel(peers[0].m_thread) != 0)
-	{
-		perror("Ending thread issue");
-		exit(1);
-	}
+	return NULL;
 }
 
 void setUpPeerArray()
@@ -625,6 +711,10 @@ void readConfig()
 				case 3:
 					server_update_frequency = atoi(line);
 					break;
+				/** The fifth line, if present, contains the most chunk requests a download keeps outstanding on one peer connection. */
+				case 4:
+					max_outstanding = atoi(line);
+					break;
 			}
 			lineCount++;
 		}
@@ -633,8 +723,9 @@ void readConfig()
 	/** If a config file could not be opened, default values will be assigned:
 	 * server_port = 3456, 
 	 * max_client = 5,
-	 * chunk_size = 1024 bytes, and 
-	 * server_update_frequency = 900 seconds (15 minutes)
+	 * chunk_size = 1024 bytes, 
+	 * server_update_frequency = 900 seconds (15 minutes), and
+	 * max_outstanding = MAX_OUTSTANDING requests
 	 */
 	else
 	{
@@ -642,6 +733,7 @@ void readConfig()
  		max_client = 5;
  		chunk_size = 1024;
 		server_update_frequency = 900;
+		max_outstanding = MAX_OUTSTANDING;
 	}
 	
 	return;
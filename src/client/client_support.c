@@ -35,10 +35,10 @@ std::vector<segment_struct> file_segment;
             Functions
 -----------------------------------*/
 
-int tracker_file_parser( char* tracker_file_name, char* filename, long filesize, char* description, char* md5 )
+int tracker_file_parser( char* tracker_file_name, char* filename, long* filesize, char* description, char* md5 )
 {
 	FILE *tracker_file;							///< File handle for tracker file
-	char *line;									///< Line buffer
+	char *line = NULL;							///< Line buffer, allocated by \c getline
 	char *pch;									///< \c strtok buffer
 	char temp_line[ DESCRIPTION_SIZE ];			///< Temp line buffer to be strtok-ed
 	char temp;									///< Temp char buffer
@@ -64,7 +64,7 @@ int tracker_file_parser( char* tracker_file_name, char* filename, long filesize,
 		{
 			getline(&line, &len, tracker_file);
 		} while (strncmp(line, "#", 1) == 0);
-		sscanf( line, "Filesize: %ld\n", &filesize );
+		sscanf( line, "Filesize: %ld\n", filesize );
 		
 		/** Get next line, if it's comment, get next line; if not, get description  */
 		do
@@ -88,7 +88,7 @@ int tracker_file_parser( char* tracker_file_name, char* filename, long filesize,
 		if( DEBUG_MODE == 1)
 		{
 			printf( "\n\r[DEBUG]Filename 	%s\n", filename );
-			printf( "[DEBUG]Filesize 	%ld\n", filesize );
+			printf( "[DEBUG]Filesize 	%ld\n", *filesize );
 			printf( "[DEBUG]Description 	%s\n", description );
 			printf( "[DEBUG]MD5		%s\n", md5 );
 		}
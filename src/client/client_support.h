@@ -71,13 +71,15 @@ struct segment_struct
  */
 enum rtn_val
 {
+	INVALID_DOWNLOAD_FILE = -5,			///< Error creating the file to download into - downloadFile()
 	INVALID_TRACKER_INFO = -4,			///< \b tracked_file_info object error
 	INVALID_PENDING_CHUNK_TABLE = -3,	///< \b pending_chunks vector error
 	INVALID_CHUNK_TABLE = -2,			///< \b live_chunks vector error
 	INVALID_TRACKER_FILE = -1,			///< Error accessing tracker file
 	NO_ERROR = 0,						///< Normal return value
 	NO_NEXT_CHUNK = 1,					///< No matched next chunk found - findNextChunk()
-	NOT_LIVE_CHUNK = 2					///< Test chunk is not live - isLiveChunk()
+	NOT_LIVE_CHUNK = 2,					///< Test chunk is not live - isLiveChunk()
+	DOWNLOAD_INCOMPLETE = 3				///< Some chunks could not be downloaded from any peer - downloadFile()
 };
 
 /*-----------------------------------
@@ -152,7 +154,7 @@ int findNextChunk( long start, long end );
  *
  * @return \b NO_ERROR, \b NO_NEXT_CHUNK, \b INVALID_CHUNK_TABLE
  */
-int tracker_file_parser( char* tracker_file_name, char* filename, long filesize, char* description, char* md5 );
+int tracker_file_parser( char* tracker_file_name, char* filename, long* filesize, char* description, char* md5 );
 
 
 /**
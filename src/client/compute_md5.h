@@ -69,4 +69,32 @@ char * computeMD5(const char * filename)
 	}
 }
 
+/**
+ * Computes and returns the MD5 of a block of memory, formatted the same way as computeMD5().
+ * Uses the OpenSSL library.
+ *
+ * Note: You should call free() of the char* variable storing the return value of this function.
+ *
+ * @param data Bytes to be hashed by MD5.
+ * @param length Number of bytes in \a data.
+ *
+ * @return a char pointer to the calculated MD5 value.
+ */
+char * computeMD5Buffer(const char * data, size_t length)
+{
+	int i;
+	/* Used to store md5 of the data */
+	unsigned char md5_sum[MD5_DIGEST_LENGTH];
+
+	MD5((const unsigned char *) data, length, md5_sum);
+
+	char * md5String;
+	md5String = (char*) malloc (33);
+	for (i = 0; i < 16; i++)
+	{
+		sprintf(&md5String[i*2], "%02x", (unsigned int)md5_sum[i]);
+	}
+	return md5String;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,934 @@
+/**
+ * @file peer_download.c
+ * @authors Matthew Lindner, Xiao Deng, Madeline Cameron
+ *
+ * @section COMPILE
+ * g++ -c ./peer_download.c
+ *  (or use make in root directory)
+ */
+
+/*-----------------------------------
+            Includes
+-----------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "peer_download.h"
+
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * Download state of a chunk.
+ */
+enum chunk_state
+{
+	CHUNK_MISSING = 0,			///< Not downloaded yet, and not being downloaded
+	CHUNK_ACTIVE = 1,			///< Being downloaded by a worker
+	CHUNK_DONE = 2				///< Written to the file
+};
+
+/**
+ * What missing chunks are picked by: their replica count, then their rank. The rarest chunks come first, and chunks that are
+ * as rare come in random order, so that peers downloading the same file fetch different chunks first.
+ */
+typedef std::pair<int, int> chunk_key;
+
+/**
+ * A chunk of the file being downloaded.
+ */
+struct download_chunk
+{
+	long	start_byte;					///< First byte of the chunk
+	long	end_byte;					///< Last byte of the chunk
+	int		state;						///< One of \a chunk_state
+	int		replicas;					///< Number of \a holders not given up on
+	int		rank;						///< Random order of the chunk among chunks with as many replicas
+	std::vector<int> holders;			///< Indices in \a download_job::peers of the peers that have the chunk
+};
+
+/**
+ * What has been measured of a peer.
+ */
+struct peer_score
+{
+	double	throughput;					///< Average bytes per second the peer sends, over all the workers connected to it
+	double	rtt;						///< Average seconds from sending a request to receiving its response line
+	int		samples;					///< Number of requests measured
+};
+
+/**
+ * A peer that has chunks of the file.
+ */
+struct download_peer
+{
+	char	ip_addr[ IP_ADDR_SIZE + 1 ];	///< IP address of the peer
+	int		port_num;					///< Port the peer shares the file on
+	int		failures;					///< Requests to the peer in a row that failed
+	int		connections;				///< Workers connected to the peer
+	struct peer_score score;			///< What has been measured of the peer
+	std::vector<int> chunks;			///< Chunks the peer has
+	std::set<chunk_key> wanted;			///< Keys of the missing chunks the peer has, empty once it is given up on
+};
+
+/**
+ * State shared by the workers of a download. The chunks' byte ranges are fixed before the workers start, everything else is
+ * guarded by \a lock: peers may be added while the download runs.
+ */
+struct download_job
+{
+	const char* filename;				///< Name of the shared file
+	int		fd;							///< File being downloaded into
+	std::vector<download_chunk> chunks;	///< Chunks of the file, in file order
+	std::vector<download_peer> peers;	///< Peers listed in \b live_chunks
+	std::set<chunk_key> wanted;			///< Keys of the missing chunks that a peer not given up on has
+	std::vector<int> ranked;			///< Chunk of each rank
+	int		remaining;					///< Chunks not written yet
+	int		in_flight;					///< Chunks being downloaded
+	int		workers;					///< Workers still running
+	struct tracker_conn* watch;			///< Connection watching the file's tracker, or NULL
+	int		watching;					///< 1 while peers may still announce chunks over \a watch
+	time_t	last_change;				///< When a chunk was last written, or a peer last announced new chunks
+	const char* ip_addr;				///< IP address this client shares the file on
+	int		port_num;					///< Port this client shares the file on
+	unsigned int seed;					///< State of the random numbers that rank chunks and pick peers to probe
+	int		max_outstanding;			///< Most requests a worker keeps outstanding to its peer
+	std::vector<int> completed;			///< Chunks written since the last announcement to the tracker server
+	pthread_mutex_t lock;				///< Guards the download state
+	pthread_cond_t changed;				///< Signalled when a chunk finishes or a worker exits
+};
+
+/**
+ * A request sent to a peer and not answered yet.
+ */
+struct pending_request
+{
+	int		chunk;						///< Index of the requested chunk
+	double	sent;						///< When the request was sent
+	long	delivered;					///< Bytes of chunks the connection had delivered when the request was sent
+	int		idle;						///< 1 if no other request was outstanding when it was sent, so its response times a round trip
+};
+
+/**
+ * A worker's connection to one peer.
+ */
+struct peer_link
+{
+	int		peer;						///< Index in \a download_job::peers of the peer, -1 if none
+	char	ip_addr[ IP_ADDR_SIZE + 1 ];	///< IP address of the peer
+	int		port_num;					///< Port of the peer
+	int		sock;						///< Socket connected to the peer, -1 if not connected
+	char	buf[ CHUNK_SIZE ];			///< Bytes received from the peer but not consumed yet
+	size_t	len;						///< Number of bytes in \a buf
+	size_t	pos;						///< Index of the first unconsumed byte in \a buf
+	std::deque<struct pending_request> pending;	///< Requests outstanding, oldest first
+	long	delivered;					///< Bytes of chunks received over the connection
+	size_t	answered;					///< Responses received since the connection was opened
+	int		resend;						///< 1 if the requests were sent on a connection that had sat idle, and no response came yet
+};
+
+
+/*-----------------------------------
+            Variables
+-----------------------------------*/
+/**
+ * Score table: what has been measured of every peer downloaded from, keyed on "ip_addr:port_num".
+ * Kept across downloads, so that a download starts out knowing which peers were fast.
+ */
+static std::map<std::string, struct peer_score> peer_scores;
+
+static pthread_mutex_t scores_lock = PTHREAD_MUTEX_INITIALIZER;		///< Guards \b peer_scores
+
+
+/*-----------------------------------
+        Internal functions
+-----------------------------------*/
+
+/**
+ * Key of a peer in the score table.
+ */
+static std::string scoreKey( const char* ip_addr, int port_num )
+{
+	char key[ IP_ADDR_SIZE + 16 ];
+	snprintf( key, sizeof( key ), "%s:%d", ip_addr, port_num );
+	return key;
+}
+
+/**
+ * Seconds on a clock that only moves forward.
+ */
+static double monotonicSeconds()
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Index of a peer in the job's peer table, adding it if it is new.
+ */
+static int findPeer( struct download_job* job, const char* ip_addr, int port_num )
+{
+	for( size_t i = 0; i < job->peers.size(); i++ )
+	{
+		if( job->peers[i].port_num == port_num && strcmp( job->peers[i].ip_addr, ip_addr ) == 0 ) return i;
+	}
+	job->peers.push_back( download_peer() );
+	struct download_peer *peer = &job->peers.back();
+	strncpy( peer->ip_addr, ip_addr, IP_ADDR_SIZE );
+	peer->ip_addr[ IP_ADDR_SIZE ] = '\0';
+	peer->port_num = port_num;
+	peer->failures = 0;
+	peer->connections = 0;
+
+	pthread_mutex_lock( &scores_lock );
+	std::map<std::string, struct peer_score>::iterator known = peer_scores.find( scoreKey( peer->ip_addr, port_num ) );
+	if( known != peer_scores.end() ) peer->score = known->second;
+	else memset( &peer->score, 0, sizeof( peer->score ) );
+	pthread_mutex_unlock( &scores_lock );
+	return job->peers.size() - 1;
+}
+
+/**
+ * Whether a peer has not been given up on.
+ */
+static int peerAlive( struct download_job* job, int peer )
+{
+	return job->peers[ peer ].failures < DOWNLOAD_PEER_FAILURES;
+}
+
+/**
+ * Add a missing chunk to, or take it off, the sets of chunks wanted from its peers. Must be called with the job locked,
+ * on either side of any change to the chunk's state or replica count.
+ */
+static void wantChunk( struct download_job* job, int i, int wanted )
+{
+	struct download_chunk *chunk = &job->chunks[i];
+	if( chunk->state != CHUNK_MISSING || chunk->replicas == 0 ) return;
+
+	chunk_key key( chunk->replicas, chunk->rank );
+	if( wanted ) job->wanted.insert( key );
+	else job->wanted.erase( key );
+	for( size_t h = 0; h < chunk->holders.size(); h++ )
+	{
+		if( !peerAlive( job, chunk->holders[h] ) ) continue;
+		if( wanted ) job->peers[ chunk->holders[h] ].wanted.insert( key );
+		else job->peers[ chunk->holders[h] ].wanted.erase( key );
+	}
+}
+
+/**
+ * Record that a peer has a chunk. Must be called with the job locked.
+ *
+ * @return 1 if the peer was not known to have it yet, else 0.
+ */
+static int addHolder( struct download_job* job, int i, int peer )
+{
+	std::vector<int> *holders = &job->chunks[i].holders;
+	if( std::find( holders->begin(), holders->end(), peer ) != holders->end() ) return 0;
+
+	wantChunk( job, i, 0 );
+	holders->push_back( peer );
+	job->peers[ peer ].chunks.push_back( i );
+	if( peerAlive( job, peer ) ) job->chunks[i].replicas++;
+	wantChunk( job, i, 1 );
+	return 1;
+}
+
+/**
+ * Give up on a peer: its chunks count one replica less, and it is not picked again. Must be called with the job locked.
+ */
+static void dropPeer( struct download_job* job, int peer )
+{
+	const std::vector<int> *chunks = &job->peers[ peer ].chunks;
+
+	for( size_t n = 0; n < chunks->size(); n++ ) wantChunk( job, ( *chunks )[n], 0 );
+	job->peers[ peer ].failures = DOWNLOAD_PEER_FAILURES;
+	for( size_t n = 0; n < chunks->size(); n++ )
+	{
+		job->chunks[ ( *chunks )[n] ].replicas--;
+		wantChunk( job, ( *chunks )[n], 1 );
+	}
+}
+
+/**
+ * Record that a peer has the chunks that lie wholly within a byte range. Must be called with the job locked.
+ *
+ * @return Number of chunks the peer was not known to have yet.
+ */
+static int addRange( struct download_job* job, const char* ip_addr, int port_num, long start_byte, long end_byte )
+{
+	/** Skip our own records, left over from an earlier download. */
+	if( port_num == job->port_num && strncmp( ip_addr, job->ip_addr, IP_ADDR_SIZE ) == 0 ) return 0;
+	if( start_byte < 0 || end_byte < start_byte ) return 0;
+
+	int peer = findPeer( job, ip_addr, port_num );
+	int added = 0;
+	for( long i = ( start_byte + CHUNK_SIZE - 1 ) / CHUNK_SIZE; i < (long) job->chunks.size() && job->chunks[i].end_byte <= end_byte; i++ )
+	{
+		added += addHolder( job, i, peer );
+	}
+	return added;
+}
+
+/**
+ * Split the file into chunks, rank them at random, and record which peers in \b live_chunks have each of them.
+ */
+static void buildChunks( struct download_job* job, long filesize )
+{
+	long num_chunks = ( filesize + CHUNK_SIZE - 1 ) / CHUNK_SIZE;
+
+	job->chunks.resize( num_chunks );
+	job->ranked.resize( num_chunks );
+	for( long i = 0; i < num_chunks; i++ )
+	{
+		job->chunks[i].start_byte = i * CHUNK_SIZE;
+		job->chunks[i].end_byte = std::min( ( i + 1 ) * CHUNK_SIZE, filesize ) - 1;
+		job->chunks[i].state = CHUNK_MISSING;
+		job->chunks[i].replicas = 0;
+		job->ranked[i] = i;
+	}
+	for( long i = num_chunks - 1; i > 0; i-- ) std::swap( job->ranked[i], job->ranked[ rand_r( &job->seed ) % ( i + 1 ) ] );
+	for( long rank = 0; rank < num_chunks; rank++ ) job->chunks[ job->ranked[ rank ] ].rank = rank;
+
+	for( size_t n = 0; n < live_chunks.size(); n++ )
+	{
+		addRange( job, live_chunks[n].ip_addr, live_chunks[n].port_num, live_chunks[n].start_byte, live_chunks[n].end_byte );
+	}
+}
+
+/**
+ * Seconds a worker can expect to wait for a chunk from a peer: a round trip, plus the chunk's share of the peer's throughput
+ * once the worker joins those already connected to it, plus a round trip to connect unless the worker is connected already.
+ * Peers not measured yet are expected to be instant, so that each is tried.
+ */
+static double expectedWait( struct download_job* job, int p, int current )
+{
+	const struct download_peer *candidate = &job->peers[p];
+	if( candidate->score.samples == 0 ) return 0;
+
+	int workers = candidate->connections + ( ( p == current ) ? 0 : 1 );
+	double wait = candidate->score.rtt + (double) CHUNK_SIZE * workers / std::max( candidate->score.throughput, 1.0 );
+	return ( p == current ) ? wait : wait + candidate->score.rtt;
+}
+
+/**
+ * Pick the next chunk to download: the rarest missing chunk. Of the peers that have a chunk that rare, the one expected to
+ * deliver it soonest is picked, and the chunk is that peer's rarest. One pick in DOWNLOAD_PROBE_ODDS goes to one of those
+ * peers at random instead, so that slower peers keep being measured. Must be called with the job locked.
+ *
+ * @return Index of the chunk, with its peer in \a peer, or -1 if no chunk can be downloaded right now.
+ */
+static int pickChunk( struct download_job* job, int current, int* peer )
+{
+	if( job->wanted.empty() ) return -1;
+
+	int rarest = job->wanted.begin()->first;
+	int best = -1, candidates = 0;
+	double best_wait = 0;
+	for( size_t p = 0; p < job->peers.size(); p++ )
+	{
+		if( job->peers[p].wanted.empty() || job->peers[p].wanted.begin()->first != rarest ) continue;
+		candidates++;
+
+		double wait = expectedWait( job, p, current );
+		if( best == -1 || wait < best_wait || ( wait == best_wait && (int) p == current ) )
+		{
+			best = p;
+			best_wait = wait;
+		}
+	}
+
+	if( candidates > 1 && rand_r( &job->seed ) % DOWNLOAD_PROBE_ODDS == 0 )
+	{
+		int n = rand_r( &job->seed ) % candidates;
+		for( size_t p = 0; p < job->peers.size(); p++ )
+		{
+			if( job->peers[p].wanted.empty() || job->peers[p].wanted.begin()->first != rarest ) continue;
+			if( n-- == 0 )
+			{
+				best = p;
+				break;
+			}
+		}
+	}
+
+	*peer = best;
+	return job->ranked[ job->peers[ best ].wanted.begin()->second ];
+}
+
+/**
+ * Add a request's measurements to its peer's averages. Must be called with the job locked.
+ *
+ * @param rtt Seconds from sending the request to receiving its response line, or -1 if that was not a round trip, INPUT.
+ * @param elapsed Seconds from sending the request to receiving its last byte, INPUT.
+ * @param length Bytes received over the connection in that time, INPUT.
+ */
+static void scorePeer( struct download_job* job, int peer, double rtt, double elapsed, long length )
+{
+	struct peer_score *score = &job->peers[ peer ].score;
+
+	/** Every connected worker gets about as much as this one did, so the peer sends that many times as much. */
+	double throughput = length * job->peers[ peer ].connections / std::max( elapsed, 1e-6 );
+	if( score->samples == 0 ) score->throughput = throughput;
+	else score->throughput += DOWNLOAD_EWMA_WEIGHT * ( throughput - score->throughput );
+	score->samples++;
+
+	if( rtt < 0 ) return;
+	if( score->rtt == 0 ) score->rtt = rtt;
+	else score->rtt += DOWNLOAD_EWMA_WEIGHT * ( rtt - score->rtt );
+}
+
+/**
+ * Number of requests a worker keeps outstanding on its connection: twice the bandwidth-delay product of a connection to the
+ * peer, in chunks, so that the window keeps growing for as long as more requests in flight still raise the throughput. 1 until
+ * the peer has been measured, and at most the job's \a max_outstanding. A new connection starts with one request, and opens up
+ * by one per response, so that a peer that drops the connection does not take a full window of requests with it. Must be called
+ * with the job locked.
+ */
+static size_t windowSize( struct download_job* job, struct peer_link* link )
+{
+	if( link->peer == -1 ) return 1;
+
+	const struct peer_score *score = &job->peers[ link->peer ].score;
+	if( score->samples == 0 || score->rtt == 0 ) return 1;
+
+	double per_connection = score->throughput / std::max( job->peers[ link->peer ].connections, 1 );
+	double window = ceil( 2 * per_connection * score->rtt / CHUNK_SIZE );
+	window = std::min( window, (double) std::min( (size_t) job->max_outstanding, link->answered + 1 ) );
+	return (size_t) std::max( window, 1.0 );
+}
+
+/**
+ * Close a worker's connection.
+ */
+static void closeLink( struct peer_link* link )
+{
+	if( link->sock != -1 )
+	{
+		close( link->sock );
+		link->sock = -1;
+	}
+	link->len = 0;
+	link->pos = 0;
+	link->answered = 0;
+}
+
+/**
+ * Connect a worker to its peer, with DOWNLOAD_TIMEOUT on every send and receive.
+ */
+static int openLink( struct peer_link* link )
+{
+	struct addrinfo hints, *addrs;
+	char port[ 16 ];
+
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf( port, "%d", link->port_num );
+	if( getaddrinfo( link->ip_addr, port, &hints, &addrs ) != 0 ) return -1;
+
+	link->sock = socket( AF_INET, SOCK_STREAM, 0 );
+	if( link->sock != -1 )
+	{
+		struct timeval timeout = { DOWNLOAD_TIMEOUT, 0 };
+		setsockopt( link->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+		setsockopt( link->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof( timeout ) );
+		if( connect( link->sock, addrs->ai_addr, addrs->ai_addrlen ) == -1 ) closeLink( link );
+	}
+	freeaddrinfo( addrs );
+	link->len = 0;
+	link->pos = 0;
+	return ( link->sock == -1 ) ? -1 : 0;
+}
+
+/**
+ * Receive more bytes from the peer into the link's buffer, compacting it first.
+ */
+static int fillLink( struct peer_link* link )
+{
+	if( link->pos > 0 )
+	{
+		memmove( link->buf, link->buf + link->pos, link->len - link->pos );
+		link->len -= link->pos;
+		link->pos = 0;
+	}
+	if( link->len == sizeof( link->buf ) ) return -1;
+
+	ssize_t received;
+	do
+	{
+		received = recv( link->sock, link->buf + link->len, sizeof( link->buf ) - link->len, 0 );
+	} while( received == -1 && errno == EINTR );
+
+	if( received <= 0 ) return -1;
+	link->len += received;
+	return 0;
+}
+
+/**
+ * Read the '\\n' terminated response line of a request, NUL terminated without the '\\n'.
+ */
+static int readHeader( struct peer_link* link, char* header, size_t size )
+{
+	char *newline;
+	while( ( newline = (char*) memchr( link->buf + link->pos, '\n', link->len - link->pos ) ) == NULL )
+	{
+		if( fillLink( link ) != 0 ) return -1;
+	}
+
+	size_t n = newline - ( link->buf + link->pos );
+	if( n >= size ) return -1;
+	memcpy( header, link->buf + link->pos, n );
+	header[ n ] = '\0';
+	link->pos += n + 1;
+	return 0;
+}
+
+/**
+ * Read exactly \a length bytes: first what is left in the link's buffer, then straight from the socket.
+ */
+static int readData( struct peer_link* link, char* data, size_t length )
+{
+	size_t have = std::min( link->len - link->pos, length );
+	memcpy( data, link->buf + link->pos, have );
+	link->pos += have;
+
+	while( have < length )
+	{
+		ssize_t received = recv( link->sock, data + have, length - have, 0 );
+		if( received == -1 && errno == EINTR ) continue;
+		if( received <= 0 ) return -1;
+		have += received;
+	}
+	return 0;
+}
+
+/**
+ * Send a whole buffer to the peer.
+ */
+static int sendLink( struct peer_link* link, const char* data, size_t length )
+{
+	size_t sent = 0;
+	while( sent < length )
+	{
+		ssize_t n = send( link->sock, data + sent, length - sent, MSG_NOSIGNAL );
+		if( n == -1 && errno == EINTR ) continue;
+		if( n <= 0 ) return -1;
+		sent += n;
+	}
+	return 0;
+}
+
+/**
+ * Write a whole buffer at an offset of the file.
+ */
+static int writeAt( int fd, const char* data, size_t length, long offset )
+{
+	size_t written = 0;
+	while( written < length )
+	{
+		ssize_t n = pwrite( fd, data + written, length - written, offset + written );
+		if( n == -1 && errno == EINTR ) continue;
+		if( n <= 0 ) return -1;
+		written += n;
+	}
+	return 0;
+}
+
+/**
+ * Send the requests in the link's \a pending from \a first on, in one go, opening the connection if needed.
+ */
+static int sendRequests( struct download_job* job, struct peer_link* link, size_t first )
+{
+	std::string requests;
+	char request[ CHUNK_SIZE ];
+
+	if( link->sock == -1 && openLink( link ) != 0 ) return -1;
+
+	for( size_t n = first; n < link->pending.size(); n++ )
+	{
+		const struct download_chunk *chunk = &job->chunks[ link->pending[n].chunk ];
+		int length = snprintf( request, sizeof( request ), "<download %s %ld %ld>", job->filename, chunk->start_byte, chunk->end_byte );
+		if( length >= (int) sizeof( request ) ) return -1;
+		requests.append( request, length );
+	}
+
+	double now = monotonicSeconds();
+	for( size_t n = first; n < link->pending.size(); n++ )
+	{
+		link->pending[n].sent = now;
+		link->pending[n].delivered = link->delivered;
+	}
+	return sendLink( link, requests.data(), requests.size() );
+}
+
+/**
+ * Receive the response to the oldest outstanding request, and write its chunk into the file.
+ *
+ * @param rtt Seconds from sending the request to receiving its response line if it was sent on an idle connection, else -1, OUTPUT.
+ * @param elapsed Seconds from sending the request to receiving the chunk's last byte, OUTPUT.
+ * @param delivered Bytes of chunks the connection delivered in that time, this one included. Over a pipelined connection that
+ * is more than one chunk, so that the rate measures the connection rather than how long the response sat in the buffers, OUTPUT.
+ *
+ * @return 0 once the chunk is written, 1 if the peer refused it, or -1 if it could not be downloaded.
+ */
+static int receiveChunk( struct download_job* job, struct peer_link* link, char* data, double* rtt, double* elapsed,
+						 long* delivered )
+{
+	const struct pending_request *request = &link->pending.front();
+	const struct download_chunk *chunk = &job->chunks[ request->chunk ];
+	long length = chunk->end_byte - chunk->start_byte + 1;
+	long received_length;
+	char header[ 64 ];
+
+	if( readHeader( link, header, sizeof( header ) ) != 0 ) return -1;
+	*rtt = ( request->idle ) ? monotonicSeconds() - request->sent : -1;
+	link->answered++;
+	if( strcmp( header, "<download fail>" ) == 0 ) return 1;
+
+	if( sscanf( header, "<download succ %ld>", &received_length ) != 1 || received_length != length
+		|| readData( link, data, length ) != 0 )
+	{
+		return -1;
+	}
+	*elapsed = monotonicSeconds() - request->sent;
+	link->delivered += length;
+	*delivered = link->delivered - request->delivered;
+
+	return writeAt( job->fd, data, length, chunk->start_byte );
+}
+
+/**
+ * Worker thread: download chunks over one peer connection at a time until no chunk is left that it could download, keeping
+ * a window of requests outstanding on the connection (see windowSize()).
+ */
+static void* downloadWorker( void* arg )
+{
+	struct download_job *job = (struct download_job*) arg;
+	struct peer_link *link = new peer_link;
+	char *data = (char*) malloc( CHUNK_SIZE );
+
+	link->peer = -1;
+	link->sock = -1;
+	link->delivered = 0;
+	link->resend = 0;
+	closeLink( link );
+
+	pthread_mutex_lock( &job->lock );
+	while( 1 )
+	{
+		/** Top the window up. Requests are only pipelined to one peer: when the next chunk should come from another, the
+		    requests outstanding drain first. */
+		size_t first = link->pending.size();
+		size_t window = windowSize( job, link );
+		while( link->pending.size() < window )
+		{
+			int peer;
+			int i = pickChunk( job, link->peer, &peer );
+			if( i == -1 ) break;
+			if( peer != link->peer )
+			{
+				if( !link->pending.empty() ) break;
+				if( link->peer != -1 ) job->peers[ link->peer ].connections--;
+				job->peers[ peer ].connections++;
+				closeLink( link );
+				link->peer = peer;
+				strcpy( link->ip_addr, job->peers[ peer ].ip_addr );
+				link->port_num = job->peers[ peer ].port_num;
+				window = windowSize( job, link );
+			}
+
+			wantChunk( job, i, 0 );
+			job->chunks[i].state = CHUNK_ACTIVE;
+			job->in_flight++;
+			struct pending_request request;
+			request.chunk = i;
+			request.idle = link->pending.empty();
+			link->pending.push_back( request );
+		}
+
+		if( link->pending.empty() )
+		{
+			/** Nothing to do until a chunk another worker is downloading fails, or a peer announces more chunks. */
+			if( job->remaining == 0 || ( job->in_flight == 0 && job->watching == 0 ) ) break;
+			pthread_cond_wait( &job->changed, &job->lock );
+			continue;
+		}
+		int peer = link->peer;
+		pthread_mutex_unlock( &job->lock );
+
+		double rtt, elapsed;
+		long delivered;
+		int rtn = 0;
+		if( first < link->pending.size() )
+		{
+			if( first == 0 ) link->resend = ( link->sock != -1 );
+			rtn = sendRequests( job, link, first );
+		}
+		if( rtn == 0 ) rtn = receiveChunk( job, link, data, &rtt, &elapsed, &delivered );
+		if( rtn == -1 && link->resend )
+		{
+			/** The peer may have closed the connection while it sat idle: open it again, and send the requests once more. */
+			closeLink( link );
+			link->resend = 0;
+			rtn = sendRequests( job, link, 0 );
+			if( rtn == 0 ) rtn = receiveChunk( job, link, data, &rtt, &elapsed, &delivered );
+		}
+		link->resend = 0;
+
+		pthread_mutex_lock( &job->lock );
+		if( rtn == 0 )
+		{
+			int i = link->pending.front().chunk;
+			link->pending.pop_front();
+			job->in_flight--;
+			job->chunks[i].state = CHUNK_DONE;
+			job->completed.push_back( i );
+			job->remaining--;
+			job->last_change = time( NULL );
+			if( peerAlive( job, peer ) ) job->peers[ peer ].failures = 0;
+			scorePeer( job, peer, rtt, elapsed, delivered );
+		}
+		else
+		{
+			/** A peer that refused a chunk still answers the other requests in order, so only that chunk is handed back. Otherwise
+			    every outstanding chunk is, and the next pick chooses among their peers afresh. A connection that broke after it
+			    delivered was hung up by the peer, and is not held against it. Another worker may have given up on the peer already,
+			    and it must only be dropped once. */
+			int counted = ( peerAlive( job, peer ) && ( rtn == 1 || link->answered == 0 ) );
+			int drop = ( counted && job->peers[ peer ].failures + 1 >= DOWNLOAD_PEER_FAILURES );
+			size_t failed = ( rtn == 1 && counted && !drop ) ? 1 : link->pending.size();
+			for( size_t n = 0; n < failed; n++ )
+			{
+				int i = link->pending.front().chunk;
+				link->pending.pop_front();
+				job->chunks[i].state = CHUNK_MISSING;
+				wantChunk( job, i, 1 );
+				job->in_flight--;
+			}
+			if( link->pending.empty() )
+			{
+				closeLink( link );
+				job->peers[ peer ].connections--;
+				link->peer = -1;
+			}
+			job->peers[ peer ].score.throughput /= 2;
+			if( drop ) dropPeer( job, peer );
+			else if( counted ) job->peers[ peer ].failures++;
+		}
+		pthread_cond_broadcast( &job->changed );
+	}
+
+	if( link->peer != -1 ) job->peers[ link->peer ].connections--;
+	job->workers--;
+	pthread_cond_broadcast( &job->changed );
+	pthread_mutex_unlock( &job->lock );
+
+	closeLink( link );
+	delete link;
+	free( data );
+	return NULL;
+}
+
+/**
+ * Watcher thread: add the chunks that peers announce while the download runs, until the watch connection is closed.
+ */
+static void* watchHolders( void* arg )
+{
+	struct download_job *job = (struct download_job*) arg;
+	struct tracker_event *event = (struct tracker_event*) malloc( sizeof( struct tracker_event ) );
+
+	while( trackerNextEvent( job->watch, event ) == TRACKER_OK )
+	{
+		if( event->kind != PROTO_UPDATE_RANGES || strcmp( event->filename, job->filename ) != 0 ) continue;
+
+		pthread_mutex_lock( &job->lock );
+		int added = 0;
+		for( int r = 0; r < event->count; r++ )
+		{
+			added += addRange( job, event->ip_addr, event->port_num, event->ranges[r].start_byte, event->ranges[r].end_byte );
+		}
+		if( added > 0 )
+		{
+			job->last_change = time( NULL );
+			pthread_cond_broadcast( &job->changed );
+		}
+		pthread_mutex_unlock( &job->lock );
+	}
+
+	pthread_mutex_lock( &job->lock );
+	job->watching = 0;
+	pthread_cond_broadcast( &job->changed );
+	pthread_mutex_unlock( &job->lock );
+	free( event );
+	return NULL;
+}
+
+/**
+ * Announce completed chunks to the tracker server, as runs of consecutive chunks.
+ */
+static void announceChunks( struct download_job* job, std::vector<int>& batch, struct tracker_conn* tracker, const char* ip_addr, int port_num )
+{
+	std::vector<struct tracker_range> ranges;
+
+	std::sort( batch.begin(), batch.end() );
+	for( size_t n = 0; n < batch.size(); n++ )
+	{
+		const struct download_chunk *chunk = &job->chunks[ batch[n] ];
+		if( n > 0 && batch[n] == batch[ n - 1 ] + 1 ) ranges.back().end_byte = chunk->end_byte;
+		else
+		{
+			struct tracker_range range = { chunk->start_byte, chunk->end_byte };
+			ranges.push_back( range );
+		}
+	}
+
+	int rtn = trackerUpdateRanges( tracker, job->filename, &ranges[0], ranges.size(), ip_addr, port_num );
+	if( rtn != PROTO_SUCC ) printf( "[WARN] Could not announce %d downloaded chunks of \"%s\" to the tracker server\n", (int) batch.size(), job->filename );
+}
+
+
+/*-----------------------------------
+            Functions
+-----------------------------------*/
+
+int downloadFile( const char* filename, long filesize, const char* path, int num_connections, int max_outstanding,
+				  struct tracker_conn* tracker, struct tracker_conn* watch, const char* ip_addr, int port_num )
+{
+	struct download_job job;
+	int fd, rtn;
+
+	/** Size the file up front, so that every chunk can be written at its offset as soon as it arrives. */
+	if( ( fd = open( path, O_RDWR | O_CREAT, 0644 ) ) == -1 )
+	{
+		perror( "Error: open failed" );
+		return INVALID_DOWNLOAD_FILE;
+	}
+	if( ftruncate( fd, filesize ) == -1 )
+	{
+		perror( "Error: ftruncate failed" );
+		close( fd );
+		return INVALID_DOWNLOAD_FILE;
+	}
+	if( filesize > 0 && ( rtn = posix_fallocate( fd, 0, filesize ) ) != 0 && rtn != EOPNOTSUPP && rtn != EINVAL )
+	{
+		printf( "[ERROR] Could not allocate %ld bytes for \"%s\": %s\n", filesize, path, strerror( rtn ) );
+		close( fd );
+		return INVALID_DOWNLOAD_FILE;
+	}
+
+	job.filename = filename;
+	job.fd = fd;
+	job.in_flight = 0;
+	job.workers = 0;
+	job.watch = watch;
+	job.watching = ( watch != NULL );
+	job.last_change = time( NULL );
+	job.ip_addr = ip_addr;
+	job.port_num = port_num;
+	job.seed = time( NULL ) ^ getpid();
+	job.max_outstanding = std::max( max_outstanding, 1 );
+	pthread_mutex_init( &job.lock, NULL );
+	pthread_cond_init( &job.changed, NULL );
+	buildChunks( &job, filesize );
+	job.remaining = job.chunks.size();
+
+	pthread_t watcher;
+	if( job.watching && pthread_create( &watcher, NULL, watchHolders, &job ) != 0 ) job.watching = 0;
+	int watcher_started = job.watching;
+
+	printf( "[INFO] Downloading \"%s\" (%d chunks) from %d peers over %d connections ...\n",
+			filename, (int) job.chunks.size(), (int) job.peers.size(), num_connections );
+
+	/** Start the workers. The job is locked until they are all started, so none of them exits before it is counted. */
+	std::vector<pthread_t> threads( std::max( num_connections, 1 ) );
+	pthread_mutex_lock( &job.lock );
+	for( size_t i = 0; i < threads.size() && i < job.chunks.size(); i++ )
+	{
+		if( pthread_create( &threads[i], NULL, downloadWorker, &job ) != 0 ) break;
+		job.workers++;
+	}
+	int num_threads = job.workers;
+
+	/** Announce completed chunks in batches of DOWNLOAD_ANNOUNCE_CHUNKS, or whatever completed within the last second. */
+	size_t done = 0;
+	while( 1 )
+	{
+		struct timespec deadline;
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_sec += 1;
+		while( job.workers > 0 && job.completed.size() < DOWNLOAD_ANNOUNCE_CHUNKS )
+		{
+			if( pthread_cond_timedwait( &job.changed, &job.lock, &deadline ) == ETIMEDOUT ) break;
+		}
+
+		/** Stop waiting for peers to announce the chunks nobody has, once none have for DOWNLOAD_STALL_TIMEOUT. */
+		if( job.watching && job.in_flight == 0 && job.wanted.empty() && time( NULL ) - job.last_change >= DOWNLOAD_STALL_TIMEOUT )
+		{
+			job.watching = 0;
+			pthread_cond_broadcast( &job.changed );
+		}
+
+		std::vector<int> batch;
+		batch.swap( job.completed );
+		int finished = ( job.workers == 0 );
+		pthread_mutex_unlock( &job.lock );
+
+		if( batch.size() > 0 )
+		{
+			done += batch.size();
+			printf( "[INFO] %d of %d chunks of \"%s\" downloaded\n", (int) done, (int) job.chunks.size(), filename );
+			if( tracker != NULL ) announceChunks( &job, batch, tracker, ip_addr, port_num );
+		}
+		if( finished ) break;
+		pthread_mutex_lock( &job.lock );
+	}
+
+	for( int i = 0; i < num_threads; i++ ) pthread_join( threads[i], NULL );
+	if( watcher_started )
+	{
+		shutdown( watch->sock, SHUT_RDWR );
+		pthread_join( watcher, NULL );
+	}
+	pthread_cond_destroy( &job.changed );
+	pthread_mutex_destroy( &job.lock );
+	close( fd );
+
+	/** Remember what was measured of the peers for the next download. */
+	pthread_mutex_lock( &scores_lock );
+	for( size_t p = 0; p < job.peers.size(); p++ )
+	{
+		const struct download_peer *peer = &job.peers[p];
+		if( peer->score.samples == 0 ) continue;
+		peer_scores[ scoreKey( peer->ip_addr, peer->port_num ) ] = peer->score;
+		printf( "[INFO] Peer %s:%d: %.1f KB/s, round trip %.2f ms\n", peer->ip_addr, peer->port_num, peer->score.throughput / 1024, peer->score.rtt * 1000 );
+	}
+	pthread_mutex_unlock( &scores_lock );
+
+	if( done < job.chunks.size() )
+	{
+		printf( "[ERROR] %d chunks of \"%s\" could not be downloaded from any peer\n", (int)( job.chunks.size() - done ), filename );
+		return DOWNLOAD_INCOMPLETE;
+	}
+	return NO_ERROR;
+}
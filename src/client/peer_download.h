@@ -0,0 +1,64 @@
+/**
+ * @file peer_download.h
+ * @authors Matthew Lindner, Xiao Deng, Madeline Cameron
+ *
+ * @brief Header file for peer_download.c
+ * @details Parallel download of a shared file from the peers listed in its tracker file.
+ *
+ * The file is split into chunks of CHUNK_SIZE bytes, and each chunk is fetched from a peer whose record in \b live_chunks covers it.
+ * Several connections, each to one peer, fetch chunks at the same time, and every chunk is written straight to its offset in the
+ * downloaded file, which is allocated at its full size up front. The chunks the fewest peers have are fetched first, so that
+ * they spread before those peers leave, and chunks that peers announce while the download runs are picked up from the file's
+ * watched tracker. Each peer's throughput and round-trip time are measured as its chunks arrive, and of the peers that have a
+ * chunk, the one expected to deliver it soonest is asked. Chunks are announced to the tracker server as they complete, so that other clients can fetch them from us
+ * before the whole file is in.
+ *
+ * A peer is asked for a chunk with
+ *
+ *		\<download filename start_byte end_byte\>
+ *
+ * (\a end_byte inclusive, as in the tracker file), and answers with "\<download succ length\>\n" followed by exactly \a length
+ * bytes, or with "\<download fail\>\n". The connection stays open for further requests, and requests may be pipelined: the
+ * downloader keeps as many outstanding as it takes to cover a round trip to the peer, which answers them in order.
+ */
+
+#ifndef __PEER_DOWNLOAD_H__
+#define __PEER_DOWNLOAD_H__
+
+#include "client_support.h"
+#include "tracker_conn.h"
+
+/*-----------------------------------
+            Defines
+-----------------------------------*/
+#define DOWNLOAD_ANNOUNCE_CHUNKS 64		///< Completed chunks gathered into one announcement to the tracker server
+#define DOWNLOAD_PEER_FAILURES 3		///< Failed requests in a row after which a peer is given up on
+#define DOWNLOAD_TIMEOUT 10				///< Seconds to wait for a peer before the request is failed
+#define DOWNLOAD_STALL_TIMEOUT 1800		///< Seconds to wait for a peer to announce the chunks nobody has, when watching
+#define DOWNLOAD_EWMA_WEIGHT 0.125		///< Weight of each request in a peer's average throughput and round-trip time
+#define DOWNLOAD_PROBE_ODDS 16			///< One pick in this many goes to a random peer rather than the fastest
+
+/*-----------------------------------
+            Prototypes
+-----------------------------------*/
+/**
+ * Download a shared file from the peers in \b live_chunks (see tracker_file_parser()).
+ * Returns once every chunk has been written, or once the remaining chunks cannot be fetched from any peer.
+ *
+ * @param filename Name of the shared file, as in its tracker file, INPUT.
+ * @param filesize Size of the shared file, INPUT.
+ * @param path Path of the file to download into. Created if needed, and sized to \a filesize, INPUT.
+ * @param num_connections Most peer connections to download over at once, INPUT.
+ * @param max_outstanding Most requests kept outstanding on a peer connection, INPUT.
+ * @param tracker Binary connection the completed chunks are announced over, or NULL not to announce them, INPUT.
+ * @param watch Binary connection watching the file's tracker (see trackerWatch()), or NULL. The chunks peers announce over it
+ * are added as they arrive, and the download waits for the chunks nobody has yet. It is shut down once the download ends, INPUT.
+ * @param ip_addr IP address this client shares the file on, INPUT.
+ * @param port_num Port this client shares the file on, INPUT.
+ *
+ * @return \b NO_ERROR, \b DOWNLOAD_INCOMPLETE, or \b INVALID_DOWNLOAD_FILE.
+ */
+int downloadFile( const char* filename, long filesize, const char* path, int num_connections, int max_outstanding,
+				  struct tracker_conn* tracker, struct tracker_conn* watch, const char* ip_addr, int port_num );
+
+#endif
@@ -0,0 +1,278 @@
+/**
+ * @file peer_seed.c
+ * @authors Matthew Lindner, Xiao Deng, Madeline Cameron
+ *
+ * @section COMPILE
+ * g++ -c ./peer_seed.c
+ *  (or use make in root directory)
+ */
+
+/*-----------------------------------
+            Includes
+-----------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+#include "peer_seed.h"
+
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * A downloading peer's connection.
+ */
+struct seed_conn
+{
+	int		sock;							///< Socket connected to the peer
+	uint32_t events;						///< Events the socket is registered for
+	char	in[ SEED_REQUEST_SIZE ];		///< Requests received but not answered yet
+	size_t	in_len;							///< Number of bytes in \a in
+	char	header[ 64 ];					///< Response line of the request being answered
+	size_t	header_len;						///< Length of \a header
+	size_t	header_sent;					///< Bytes of \a header sent so far
+	int		file;							///< Shared file last requested, -1 if none
+	char	file_name[ SEED_REQUEST_SIZE ];	///< Name of \a file
+	off_t	file_size;						///< Size of \a file
+	off_t	offset;							///< Next byte of \a file to send
+	off_t	remaining;						///< Bytes of \a file left to send
+};
+
+
+/*-----------------------------------
+        Internal functions
+-----------------------------------*/
+
+/**
+ * Close a peer's connection. Closing the socket also takes it out of the event loop.
+ */
+static void closeSeedConn( struct seed_conn* conn )
+{
+	if( conn->file != -1 ) close( conn->file );
+	close( conn->sock );
+	free( conn );
+}
+
+/**
+ * Register the socket for \a events, if it is not already.
+ */
+static int watchSeedConn( int epoll_fd, struct seed_conn* conn, uint32_t events )
+{
+	if( conn->events == events ) return 0;
+
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = conn;
+	if( epoll_ctl( epoll_fd, EPOLL_CTL_MOD, conn->sock, &event ) == -1 ) return -1;
+	conn->events = events;
+	return 0;
+}
+
+/**
+ * Open a shared file for a request, unless it is the one the peer asked for last.
+ * Only plain names are served, so that a request can not reach outside \a directory.
+ */
+static int openSharedFile( struct seed_conn* conn, const char* directory, const char* name )
+{
+	char path[ 2 * SEED_REQUEST_SIZE ];
+	struct stat info;
+
+	if( conn->file != -1 && strcmp( conn->file_name, name ) == 0 ) return 0;
+	if( strchr( name, '/' ) != NULL || strcmp( name, "." ) == 0 || strcmp( name, ".." ) == 0 ) return -1;
+
+	if( conn->file != -1 )
+	{
+		close( conn->file );
+		conn->file = -1;
+	}
+	snprintf( path, sizeof( path ), "%s/%s", directory, name );
+	if( ( conn->file = open( path, O_RDONLY ) ) == -1 ) return -1;
+	if( fstat( conn->file, &info ) == -1 )
+	{
+		close( conn->file );
+		conn->file = -1;
+		return -1;
+	}
+	strcpy( conn->file_name, name );
+	conn->file_size = info.st_size;
+	return 0;
+}
+
+/**
+ * Take the oldest request off the connection's buffer, and prepare its response.
+ *
+ * @return 1 if a request was taken, 0 if no complete request has arrived, or -1 if the buffer is full without holding one.
+ */
+static int startResponse( struct seed_conn* conn, const char* directory )
+{
+	char request[ SEED_REQUEST_SIZE + 1 ];
+	char name[ SEED_REQUEST_SIZE ];
+	long start_byte, end_byte;
+
+	char *end = (char*) memchr( conn->in, '>', conn->in_len );
+	if( end == NULL ) return ( conn->in_len == sizeof( conn->in ) ) ? -1 : 0;
+
+	size_t length = end - conn->in + 1;
+	memcpy( request, conn->in, length );
+	request[ length ] = '\0';
+	memmove( conn->in, conn->in + length, conn->in_len - length );
+	conn->in_len -= length;
+
+	/** Answer with the chunk if the request is well formed and the chunk lies within the file, else with a failure. */
+	conn->remaining = 0;
+	if( sscanf( request, " <download %s %ld %ld>", name, &start_byte, &end_byte ) == 3
+		&& openSharedFile( conn, directory, name ) == 0
+		&& start_byte >= 0 && start_byte <= end_byte && end_byte < conn->file_size )
+	{
+		conn->offset = start_byte;
+		conn->remaining = end_byte - start_byte + 1;
+		conn->header_len = sprintf( conn->header, "<download succ %ld>\n", end_byte - start_byte + 1 );
+	}
+	else conn->header_len = sprintf( conn->header, "<download fail>\n" );
+	conn->header_sent = 0;
+	return 1;
+}
+
+/**
+ * Send as much of the response in progress as the socket takes.
+ *
+ * @return 1 once the response is sent, 0 if the socket is full, or -1 if the connection failed.
+ */
+static int sendResponse( struct seed_conn* conn )
+{
+	while( conn->header_sent < conn->header_len )
+	{
+		int flags = MSG_NOSIGNAL | ( ( conn->remaining > 0 ) ? MSG_MORE : 0 );
+		ssize_t n = send( conn->sock, conn->header + conn->header_sent, conn->header_len - conn->header_sent, flags );
+		if( n == -1 && errno == EINTR ) continue;
+		if( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) return 0;
+		if( n <= 0 ) return -1;
+		conn->header_sent += n;
+	}
+
+	/** sendfile() may send less than asked; the offset it advances is where the next call picks up. */
+	int budget = SEED_SENDFILE_MAX;
+	while( conn->remaining > 0 )
+	{
+		if( budget <= 0 ) return 0;
+		size_t count = ( conn->remaining < budget ) ? conn->remaining : budget;
+		ssize_t n = sendfile( conn->sock, conn->file, &conn->offset, count );
+		if( n == -1 && errno == EINTR ) continue;
+		if( n == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) return 0;
+		if( n <= 0 ) return -1;
+		conn->remaining -= n;
+		budget -= n;
+	}
+	return 1;
+}
+
+/**
+ * Answer the requests a peer has sent, one after the other, until one of them fills the socket.
+ *
+ * @return 0, or -1 if the connection should be closed.
+ */
+static int serviceSeedConn( int epoll_fd, struct seed_conn* conn, const char* directory )
+{
+	if( conn->in_len < sizeof( conn->in ) && ( conn->events & EPOLLIN ) )
+	{
+		ssize_t received = recv( conn->sock, conn->in + conn->in_len, sizeof( conn->in ) - conn->in_len, 0 );
+		if( received == 0 ) return -1;
+		if( received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) return -1;
+		if( received > 0 ) conn->in_len += received;
+	}
+
+	while( 1 )
+	{
+		if( conn->header_sent == conn->header_len && conn->remaining == 0 )
+		{
+			int rtn = startResponse( conn, directory );
+			if( rtn == -1 ) return -1;
+			if( rtn == 0 ) break;
+		}
+
+		int rtn = sendResponse( conn );
+		if( rtn == -1 ) return -1;
+		if( rtn == 0 ) return watchSeedConn( epoll_fd, conn, EPOLLOUT );
+	}
+	return watchSeedConn( epoll_fd, conn, EPOLLIN );
+}
+
+/**
+ * Accept every peer that is waiting to connect.
+ */
+static void acceptPeers( int epoll_fd, int listen_sock )
+{
+	int sock;
+	while( ( sock = accept4( listen_sock, NULL, NULL, SOCK_NONBLOCK ) ) != -1 )
+	{
+		struct seed_conn *conn = (struct seed_conn*) malloc( sizeof( struct seed_conn ) );
+		struct epoll_event event;
+
+		conn->sock = sock;
+		conn->events = EPOLLIN;
+		conn->in_len = 0;
+		conn->header_len = 0;
+		conn->header_sent = 0;
+		conn->file = -1;
+		conn->remaining = 0;
+
+		event.events = EPOLLIN;
+		event.data.ptr = conn;
+		if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, sock, &event ) == -1 ) closeSeedConn( conn );
+	}
+	if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) perror( "Error: accept failed" );
+}
+
+
+/*-----------------------------------
+            Functions
+-----------------------------------*/
+
+int seedFiles( int listen_sock, const char* directory )
+{
+	struct epoll_event events[ SEED_EVENTS ];
+	struct epoll_event event;
+	int epoll_fd;
+
+	/** sendfile() has no MSG_NOSIGNAL: a peer that hangs up mid-chunk must not kill the client. */
+	signal( SIGPIPE, SIG_IGN );
+
+	if( fcntl( listen_sock, F_SETFL, fcntl( listen_sock, F_GETFL ) | O_NONBLOCK ) == -1 ) return -1;
+	if( ( epoll_fd = epoll_create1( 0 ) ) == -1 ) return -1;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, listen_sock, &event ) == -1 )
+	{
+		close( epoll_fd );
+		return -1;
+	}
+
+	while( 1 )
+	{
+		int ready = epoll_wait( epoll_fd, events, SEED_EVENTS, -1 );
+		if( ready == -1 && errno == EINTR ) continue;
+		if( ready == -1 ) break;
+
+		for( int i = 0; i < ready; i++ )
+		{
+			struct seed_conn *conn = (struct seed_conn*) events[i].data.ptr;
+			if( conn == NULL ) acceptPeers( epoll_fd, listen_sock );
+			else if( serviceSeedConn( epoll_fd, conn, directory ) == -1 ) closeSeedConn( conn );
+		}
+	}
+
+	int error = errno;
+	close( epoll_fd );
+	errno = error;
+	return -1;
+}
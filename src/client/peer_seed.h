@@ -0,0 +1,37 @@
+/**
+ * @file peer_seed.h
+ * @authors Matthew Lindner, Xiao Deng, Madeline Cameron
+ *
+ * @brief Header file for peer_seed.c
+ * @details Serves the chunks of shared files to downloading peers (see peer_download.h for the requests).
+ *
+ * A single event loop serves every connected peer. The bytes of a chunk are sent straight from the shared file to the peer's
+ * socket with sendfile(), so they are never copied through the client. A peer that can not take the whole chunk at once gets the
+ * rest as its socket drains, while the other peers are served. A peer may send several requests without waiting for the
+ * responses; they are answered in order.
+ */
+
+#ifndef __PEER_SEED_H__
+#define __PEER_SEED_H__
+
+/*-----------------------------------
+            Defines
+-----------------------------------*/
+#define SEED_REQUEST_SIZE 1024			///< Size of the receive buffer of a peer connection, and so the longest request
+#define SEED_EVENTS 64					///< Most events handled per wake-up of the event loop
+#define SEED_SENDFILE_MAX 1048576		///< Most bytes sent to one peer before the other peers get their turn
+
+/*-----------------------------------
+            Prototypes
+-----------------------------------*/
+/**
+ * Serve \<download\> requests from any number of peers at once. Only returns if the event loop fails.
+ *
+ * @param listen_sock Socket listening for peers, INPUT.
+ * @param directory Folder the shared files are in, INPUT.
+ *
+ * @return -1, with \a errno set.
+ */
+int seedFiles( int listen_sock, const char* directory );
+
+#endif
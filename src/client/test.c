@@ -46,7 +46,7 @@ int main()
 	//run tracker_file_parser()
 	tracker_file_parser( 	test_tracker_filename,
 							tracked_file_info.filename,
-							tracked_file_info.filesize,
+							&tracked_file_info.filesize,
 							tracked_file_info.description,
 							tracked_file_info.md5
 							);
@@ -0,0 +1,142 @@
+/**
+ * @file test_download.c
+ * @authors Xiao Deng, Matthew Lindner
+ *
+ * @brief Behavior tests for the rarest-first chunk picker of peer_download.c.
+ * @details The picker is internal to peer_download.c, which is included here rather than linked. Exits with the number of
+ * checks that failed.
+ *
+ * @section COMPILE
+ * Run "make test-download" in root directory
+ */
+
+#include "peer_download.c"
+
+
+/*-----------------------------------
+            Helpers
+-----------------------------------*/
+static int failures = 0;				///< Number of failed checks
+
+/**
+ * Report one check.
+ */
+static void check( int passed, const char* name )
+{
+	printf( "[TEST] %s ... %s\n", name, passed ? "PASSED" : "FAILED" );
+	if( !passed ) failures++;
+}
+
+/**
+ * Add a record to \b live_chunks.
+ */
+static void addLiveChunk( const char* ip_addr, int port_num, long start_byte, long end_byte )
+{
+	struct chunks_struct chunk;
+	strncpy( chunk.ip_addr, ip_addr, IP_ADDR_SIZE - 1 );
+	chunk.ip_addr[ IP_ADDR_SIZE - 1 ] = '\0';
+	chunk.port_num = port_num;
+	chunk.start_byte = start_byte;
+	chunk.end_byte = end_byte;
+	chunk.time_stamp = 0;
+	live_chunks.push_back( chunk );
+}
+
+/**
+ * Check every chunk's replica count against \a expected, and that the job wants exactly the missing chunks some live peer has.
+ */
+static void checkReplicas( struct download_job* job, const int* expected, const char* name )
+{
+	int passed = 1;
+	size_t wanted = 0;
+
+	for( size_t i = 0; i < job->chunks.size(); i++ )
+	{
+		if( job->chunks[i].replicas != expected[i] )
+		{
+			printf( "       chunk %zu has %d replicas, expected %d\n", i, job->chunks[i].replicas, expected[i] );
+			passed = 0;
+		}
+		if( expected[i] > 0 ) wanted++;
+	}
+	check( passed && job->wanted.size() == wanted, name );
+}
+
+/**
+ * Check that the next pick is the chunk \a expected, from a live peer that has it.
+ */
+static void checkPick( struct download_job* job, int expected, const char* name )
+{
+	int peer = -1;
+	int chunk = pickChunk( job, -1, &peer );
+
+	if( expected == -1 )
+	{
+		check( chunk == -1, name );
+		return;
+	}
+	check( chunk == expected && peer != -1 && peerAlive( job, peer )
+		&& std::find( job->chunks[ chunk ].holders.begin(), job->chunks[ chunk ].holders.end(), peer ) != job->chunks[ chunk ].holders.end(), name );
+}
+
+
+/*-----------------------------------
+            Main for testing
+-----------------------------------*/
+int main()
+{
+	struct download_job job;
+
+	job.ip_addr = "10.0.0.9";
+	job.port_num = 9;
+	job.seed = 1;
+
+	/** Chunk i is held by 4 - i peers. Our own records, and a range that covers no whole chunk, add no replicas. */
+	addLiveChunk( "10.0.0.1", 1, 0, 4 * CHUNK_SIZE - 1 );
+	addLiveChunk( "10.0.0.2", 2, 0, 3 * CHUNK_SIZE - 1 );
+	addLiveChunk( "10.0.0.3", 3, 0, 2 * CHUNK_SIZE - 1 );
+	addLiveChunk( "10.0.0.4", 4, 0, CHUNK_SIZE - 1 );
+	addLiveChunk( "10.0.0.9", 9, 0, 4 * CHUNK_SIZE - 1 );
+	addLiveChunk( "10.0.0.5", 5, 1, CHUNK_SIZE + 5 );
+	buildChunks( &job, 4 * CHUNK_SIZE );
+
+	const int announced[] = { 4, 3, 2, 1 };
+	checkReplicas( &job, announced, "counts the peers that have each chunk" );
+	checkPick( &job, 3, "picks the rarest chunk" );
+
+	/** Each peer dropped takes a replica off every chunk it has; a chunk no live peer has is not wanted. */
+	dropPeer( &job, findPeer( &job, "10.0.0.1", 1 ) );
+	const int without_first[] = { 3, 2, 1, 0 };
+	checkReplicas( &job, without_first, "drops a replica of each chunk a dropped peer has" );
+	checkPick( &job, 2, "picks the rarest chunk a live peer has" );
+
+	dropPeer( &job, findPeer( &job, "10.0.0.2", 2 ) );
+	const int without_second[] = { 2, 1, 0, 0 };
+	checkReplicas( &job, without_second, "drops a replica of each chunk a second dropped peer has" );
+	checkPick( &job, 1, "picks the rarest chunk left" );
+
+	/** A dropped peer announcing again is still given up on, while a new one brings a chunk back. */
+	check( addRange( &job, "10.0.0.1", 1, 0, 4 * CHUNK_SIZE - 1 ) == 0, "ignores ranges a dropped peer announces again" );
+	check( addRange( &job, "10.0.0.6", 6, 3 * CHUNK_SIZE, 4 * CHUNK_SIZE - 1 ) == 1, "adds the chunks a new peer announces" );
+	const int with_new[] = { 2, 1, 0, 1 };
+	checkReplicas( &job, with_new, "counts a replica for a new peer" );
+
+	int peer = -1;
+	int chunk = pickChunk( &job, -1, &peer );
+	check( ( chunk == 1 || chunk == 3 ) && job.chunks[ chunk ].replicas == 1, "picks one of the chunks that are equally rare" );
+
+	/** A chunk that is being downloaded is no longer wanted. */
+	wantChunk( &job, 3, 0 );
+	job.chunks[3].state = CHUNK_ACTIVE;
+	checkPick( &job, 1, "does not pick a chunk being downloaded" );
+
+	dropPeer( &job, findPeer( &job, "10.0.0.3", 3 ) );
+	dropPeer( &job, findPeer( &job, "10.0.0.4", 4 ) );
+	dropPeer( &job, findPeer( &job, "10.0.0.6", 6 ) );
+	const int none[] = { 0, 0, 0, 0 };
+	checkReplicas( &job, none, "counts no replicas once every peer is dropped" );
+	checkPick( &job, -1, "picks nothing once every peer is dropped" );
+
+	printf( "\n[TEST] %d check(s) failed\n", failures );
+	return failures;
+}
@@ -0,0 +1,666 @@
+/**
+ * @file tracker_conn.c
+ * @authors Matthew Lindner, Xiao Deng, Madeline Cameron
+ *
+ * @section COMPILE
+ * g++ -c ./tracker_conn.c
+ *  (or use make in root directory)
+ */
+
+/*-----------------------------------
+            Includes
+-----------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "tracker_conn.h"
+
+
+/*-----------------------------------
+        Internal functions
+-----------------------------------*/
+
+/**
+ * Receive more bytes from the server into the connection's buffer, compacting it first.
+ */
+static int fillBuffer( struct tracker_conn* conn )
+{
+	if( conn->pos > 0 )
+	{
+		memmove( conn->buf, conn->buf + conn->pos, conn->len - conn->pos );
+		conn->len -= conn->pos;
+		conn->pos = 0;
+	}
+
+	ssize_t received;
+	do
+	{
+		received = recv( conn->sock, conn->buf + conn->len, sizeof( conn->buf ) - conn->len, 0 );
+	} while( received == -1 && errno == EINTR );
+
+	if( received <= 0 ) return TRACKER_DISCONNECTED;
+	conn->len += received;
+	return TRACKER_OK;
+}
+
+/**
+ * Append bytes to a growing response.
+ */
+static int appendResponse( char** response, size_t* length, size_t* capacity, const char* data, size_t n )
+{
+	if( *length + n + 1 > *capacity )
+	{
+		size_t grown_capacity = ( *capacity == 0 ) ? 256 : *capacity;
+		while( grown_capacity < *length + n + 1 ) grown_capacity *= 2;
+		char *grown = (char*) realloc( *response, grown_capacity );
+		if( grown == NULL ) return TRACKER_ERROR;
+		*response = grown;
+		*capacity = grown_capacity;
+	}
+	memcpy( *response + *length, data, n );
+	*length += n;
+	( *response )[ *length ] = '\0';
+	return TRACKER_OK;
+}
+
+/**
+ * Read one '\\n' terminated line (including the '\\n') and append it to the response.
+ * \a line_start is set to the offset of the line in the response.
+ */
+static int readLine( struct tracker_conn* conn, char** response, size_t* length, size_t* capacity, size_t* line_start )
+{
+	*line_start = *length;
+	while( 1 )
+	{
+		char *newline = (char*) memchr( conn->buf + conn->pos, '\n', conn->len - conn->pos );
+		size_t n = ( newline != NULL ) ? (size_t)( newline - ( conn->buf + conn->pos ) ) + 1 : conn->len - conn->pos;
+
+		if( appendResponse( response, length, capacity, conn->buf + conn->pos, n ) != TRACKER_OK ) return TRACKER_ERROR;
+		conn->pos += n;
+
+		if( newline != NULL ) return TRACKER_OK;
+
+		int rtn = fillBuffer( conn );
+		if( rtn != TRACKER_OK ) return rtn;
+	}
+}
+
+/**
+ * Read exactly \a n bytes and append them to the response.
+ */
+static int readExact( struct tracker_conn* conn, char** response, size_t* length, size_t* capacity, size_t n )
+{
+	while( n > 0 )
+	{
+		if( conn->pos == conn->len )
+		{
+			int rtn = fillBuffer( conn );
+			if( rtn != TRACKER_OK ) return rtn;
+		}
+		size_t available = conn->len - conn->pos;
+		size_t take = ( available < n ) ? available : n;
+
+		if( appendResponse( response, length, capacity, conn->buf + conn->pos, take ) != TRACKER_OK ) return TRACKER_ERROR;
+		conn->pos += take;
+		n -= take;
+	}
+	return TRACKER_OK;
+}
+
+/**
+ * Send a whole buffer.
+ */
+static int sendAll( struct tracker_conn* conn, const void* data, size_t length )
+{
+	const char *bytes = (const char*) data;
+	size_t sent = 0;
+
+	if( conn->sock == -1 ) return TRACKER_DISCONNECTED;
+
+	while( sent < length )
+	{
+		ssize_t n = send( conn->sock, bytes + sent, length - sent, MSG_NOSIGNAL );
+		if( n == -1 && errno == EINTR ) continue;
+		if( n <= 0 ) return TRACKER_DISCONNECTED;
+		sent += n;
+	}
+	return TRACKER_OK;
+}
+
+
+/*-----------------------------------
+            Functions
+-----------------------------------*/
+
+int trackerConnect( struct tracker_conn* conn, const struct sockaddr_in* addr, int binary )
+{
+	conn->addr = *addr;
+	conn->binary = binary;
+	conn->len = 0;
+	conn->pos = 0;
+	conn->md5[0] = '\0';
+
+	if( ( conn->sock = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 )
+	{
+		perror( "Error: socket failed" );
+		return TRACKER_ERROR;
+	}
+	if( connect( conn->sock, (struct sockaddr*) &conn->addr, sizeof( conn->addr ) ) == -1 )
+	{
+		perror( "Error: Connection Issue" );
+		trackerClose( conn );
+		return TRACKER_ERROR;
+	}
+
+	/** Switch the connection into keep-alive mode, or binary mode. */
+	const char *command = ( binary == 1 ) ? "<BINARY>" : "<KEEPALIVE>";
+	const char *reply = ( binary == 1 ) ? "<BINARY ok>" : "<KEEPALIVE ok>";
+	char *response = NULL;
+	size_t length;
+	int rtn = trackerSend( conn, command );
+	if( rtn == TRACKER_OK ) rtn = trackerReceive( conn, &response, &length );
+	if( rtn != TRACKER_OK || strncmp( response, reply, strlen( reply ) ) != 0 )
+	{
+		printf( "[ERROR] Tracker server refused %s mode\n", ( binary == 1 ) ? "binary" : "keep-alive" );
+		trackerClose( conn );
+		rtn = TRACKER_ERROR;
+	}
+	free( response );
+
+	return rtn;
+}
+
+void trackerClose( struct tracker_conn* conn )
+{
+	if( conn->sock != -1 )
+	{
+		close( conn->sock );
+		conn->sock = -1;
+	}
+	conn->len = 0;
+	conn->pos = 0;
+}
+
+int trackerSend( struct tracker_conn* conn, const char* command )
+{
+	return sendAll( conn, command, strlen( command ) );
+}
+
+int trackerReceive( struct tracker_conn* conn, char** response, size_t* length )
+{
+	size_t capacity = 0;
+	size_t line_start;
+	int rtn;
+
+	*response = NULL;
+	*length = 0;
+
+	if( conn->sock == -1 ) return TRACKER_DISCONNECTED;
+
+	/** Every response starts with a single line. */
+	if( ( rtn = readLine( conn, response, length, &capacity, &line_start ) ) != TRACKER_OK )
+	{
+		free( *response );
+		*response = NULL;
+		return rtn;
+	}
+
+	/** A LIST continues until its \<REP LIST END\> line. */
+	if( strncmp( *response, "<REP LIST ", strlen( "<REP LIST " ) ) == 0 && strncmp( *response, "<REP LIST END>", strlen( "<REP LIST END>" ) ) != 0 )
+	{
+		do
+		{
+			rtn = readLine( conn, response, length, &capacity, &line_start );
+		} while( rtn == TRACKER_OK && strncmp( *response + line_start, "<REP LIST END>", strlen( "<REP LIST END>" ) ) != 0 );
+	}
+	/** A GET is \<REP GET BEGIN length\>, the tracker file, and \<REP GET END md5\>. Only the tracker file is returned. */
+	else if( strncmp( *response, "<REP GET BEGIN ", strlen( "<REP GET BEGIN " ) ) == 0 )
+	{
+		size_t file_length = strtoul( *response + strlen( "<REP GET BEGIN " ), NULL, 10 );
+		*length = 0;
+
+		if( ( rtn = readExact( conn, response, length, &capacity, file_length ) ) == TRACKER_OK )
+		{
+			/** The footer starts on a new line, after the tracker file. */
+			size_t file_end = *length;
+			rtn = readLine( conn, response, length, &capacity, &line_start );
+			if( rtn == TRACKER_OK )
+			{
+				rtn = readLine( conn, response, length, &capacity, &line_start );
+			}
+			if( rtn == TRACKER_OK && sscanf( *response + line_start, "<REP GET END %32[0-9a-f]>", conn->md5 ) != 1 )
+			{
+				rtn = TRACKER_ERROR;
+			}
+			*length = file_end;
+			( *response )[ file_end ] = '\0';
+		}
+		if( rtn == TRACKER_OK ) rtn = TRACKER_FILE;
+	}
+
+	if( rtn < TRACKER_OK )
+	{
+		free( *response );
+		*response = NULL;
+		*length = 0;
+		/** The stream can not be trusted after a partial response. */
+		trackerClose( conn );
+	}
+	return rtn;
+}
+
+/**
+ * Whether a command only reads from the server, so that sending it again can not apply anything twice.
+ */
+static int idempotentCommand( const char* command )
+{
+	return strncmp( command, "<REQ ", 5 ) == 0 || strncmp( command, "<GET ", 5 ) == 0;
+}
+
+int trackerRequest( struct tracker_conn* conn, const char* command, char** response, size_t* length )
+{
+	*response = NULL;
+	*length = 0;
+
+	/** A connection closed by an earlier request is re-opened before anything is sent on it. */
+	if( conn->sock == -1 && trackerConnect( conn, &conn->addr, conn->binary ) != TRACKER_OK ) return TRACKER_DISCONNECTED;
+
+	int rtn = trackerSend( conn, command );
+	if( rtn == TRACKER_OK ) rtn = trackerReceive( conn, response, length );
+
+	/** If the server dropped the connection (e.g. it was restarted), reconnect once and try again. A create or update may have been
+	 * applied before the connection was lost, so it is not sent again; the connection is re-opened by the next request instead. */
+	if( rtn == TRACKER_DISCONNECTED )
+	{
+		trackerClose( conn );
+		if( idempotentCommand( command ) == 0 ) return rtn;
+		if( trackerConnect( conn, &conn->addr, conn->binary ) == TRACKER_OK )
+		{
+			rtn = trackerSend( conn, command );
+			if( rtn == TRACKER_OK ) rtn = trackerReceive( conn, response, length );
+		}
+	}
+	return rtn;
+}
+
+int trackerSendFrame( struct tracker_conn* conn, int opcode, const void* payload, size_t length )
+{
+	unsigned char header[ PROTO_HEADER_SIZE ];
+	protoWriteHeader( header, opcode, PROTO_SUCC, length );
+
+	int rtn = sendAll( conn, header, sizeof( header ) );
+	if( rtn == TRACKER_OK && length > 0 ) rtn = sendAll( conn, payload, length );
+	return rtn;
+}
+
+/**
+ * Receive the next frame from the server, whatever its opcode. The opcode is returned without \a PROTO_RESPONSE.
+ */
+static int receiveFrame( struct tracker_conn* conn, int* opcode, int* status, unsigned char** payload, size_t* length )
+{
+	char *frame = NULL;
+	size_t frame_len = 0, capacity = 0;
+	int rtn;
+
+	*payload = NULL;
+	*length = 0;
+
+	if( conn->sock == -1 ) return TRACKER_DISCONNECTED;
+
+	/** The header says how long the payload is. */
+	if( ( rtn = readExact( conn, &frame, &frame_len, &capacity, PROTO_HEADER_SIZE ) ) == TRACKER_OK )
+	{
+		struct proto_reader header = { (const unsigned char*) frame, PROTO_HEADER_SIZE, 0, 0 };
+		*opcode = (int) protoReadInt( &header, 1 );
+		*status = (int) protoReadInt( &header, 1 );
+		protoReadInt( &header, 2 );
+		size_t payload_len = (size_t) protoReadInt( &header, 4 );
+
+		if( ( *opcode & PROTO_RESPONSE ) == 0 )
+		{
+			rtn = TRACKER_ERROR;
+		}
+		else if( ( rtn = readExact( conn, &frame, &frame_len, &capacity, payload_len ) ) == TRACKER_OK )
+		{
+			/** Hand back only the payload, NUL terminated. */
+			memmove( frame, frame + PROTO_HEADER_SIZE, payload_len + 1 );
+			*payload = (unsigned char*) frame;
+			*length = payload_len;
+			*opcode &= ~PROTO_RESPONSE;
+			return TRACKER_OK;
+		}
+	}
+
+	free( frame );
+	/** The stream can not be trusted after a partial response. */
+	trackerClose( conn );
+	return rtn;
+}
+
+int trackerReceiveFrame( struct tracker_conn* conn, int* status, unsigned char** payload, size_t* length )
+{
+	int opcode;
+
+	return receiveFrame( conn, &opcode, status, payload, length );
+}
+
+/**
+ * Whether a frame only reads from the server, so that sending it again can not apply anything twice.
+ */
+static int idempotentOpcode( int opcode )
+{
+	return opcode == PROTO_LIST || opcode == PROTO_GET || opcode == PROTO_SELECT || opcode == PROTO_STATS || opcode == PROTO_WATCH;
+}
+
+/**
+ * Send a frame and wait for its response, reconnecting once if the connection has been lost. Only frames that read are sent again.
+ * Returns the response's status, or a negative \a tracker_rtn_val.
+ */
+static int trackerTransact( struct tracker_conn* conn, int opcode, const struct proto_writer* request, unsigned char** payload, size_t* length )
+{
+	int status = PROTO_FAIL;
+	if( conn->sock == -1 && trackerConnect( conn, &conn->addr, conn->binary ) != TRACKER_OK ) return TRACKER_DISCONNECTED;
+
+	int rtn = trackerSendFrame( conn, opcode, request->m_data, request->m_len );
+	if( rtn == TRACKER_OK ) rtn = trackerReceiveFrame( conn, &status, payload, length );
+
+	if( rtn == TRACKER_DISCONNECTED )
+	{
+		trackerClose( conn );
+		if( idempotentOpcode( opcode ) == 0 ) return rtn;
+		if( trackerConnect( conn, &conn->addr, conn->binary ) == TRACKER_OK )
+		{
+			rtn = trackerSendFrame( conn, opcode, request->m_data, request->m_len );
+			if( rtn == TRACKER_OK ) rtn = trackerReceiveFrame( conn, &status, payload, length );
+		}
+	}
+	return ( rtn == TRACKER_OK ) ? status : rtn;
+}
+
+/**
+ * Send a \a PROTO_GET or \a PROTO_SELECT frame, and unpack the tracker file in its response. The MD5 is stored in \a conn->md5.
+ * Returns the response's status, or a negative \a tracker_rtn_val.
+ */
+static int trackerFetch( struct tracker_conn* conn, int opcode, const struct proto_writer* request, char** contents, size_t* length )
+{
+	unsigned char *payload;
+	size_t payload_len;
+
+	int rtn = trackerTransact( conn, opcode, request, &payload, &payload_len );
+	if( rtn != PROTO_SUCC || payload_len < PROTO_MD5_SIZE )
+	{
+		if( rtn >= 0 ) free( payload );
+		return ( rtn == PROTO_SUCC ) ? TRACKER_ERROR : rtn;
+	}
+
+	/** The payload is the raw MD5, then the tracker file. */
+	for( int n = 0; n < PROTO_MD5_SIZE; n++ )
+	{
+		sprintf( &conn->md5[ n * 2 ], "%02x", (unsigned int) payload[n] );
+	}
+	*length = payload_len - PROTO_MD5_SIZE;
+	memmove( payload, payload + PROTO_MD5_SIZE, *length + 1 );
+	*contents = (char*) payload;
+	return PROTO_SUCC;
+}
+
+int trackerCreate( struct tracker_conn* conn, const char* filename, unsigned long long filesize, const char* description, const char* md5, const char* ip_addr, int port_num )
+{
+	unsigned char buffer[ TRACKER_CONN_BUF_SIZE ];
+	struct proto_writer request = { buffer, sizeof( buffer ), 0, 0 };
+	unsigned char *payload;
+	size_t length;
+
+	protoWriteInt( &request, filesize, 8 );
+	protoWriteInt( &request, port_num, 2 );
+	protoWriteString( &request, filename );
+	protoWriteString( &request, description );
+	protoWriteString( &request, md5 );
+	protoWriteString( &request, ip_addr );
+	if( request.m_error == 1 ) return TRACKER_ERROR;
+
+	int rtn = trackerTransact( conn, PROTO_CREATE, &request, &payload, &length );
+	if( rtn >= 0 ) free( payload );
+	return rtn;
+}
+
+int trackerUpdate( struct tracker_conn* conn, const char* filename, long start_byte, long end_byte, const char* ip_addr, int port_num )
+{
+	unsigned char buffer[ TRACKER_CONN_BUF_SIZE ];
+	struct proto_writer request = { buffer, sizeof( buffer ), 0, 0 };
+	unsigned char *payload;
+	size_t length;
+
+	protoWriteInt( &request, start_byte, 8 );
+	protoWriteInt( &request, end_byte, 8 );
+	protoWriteInt( &request, port_num, 2 );
+	protoWriteString( &request, filename );
+	protoWriteString( &request, ip_addr );
+	if( request.m_error == 1 ) return TRACKER_ERROR;
+
+	int rtn = trackerTransact( conn, PROTO_UPDATE, &request, &payload, &length );
+	if( rtn >= 0 ) free( payload );
+	return rtn;
+}
+
+int trackerUpdateRanges( struct tracker_conn* conn, const char* filename, const struct tracker_range* ranges, int count, const char* ip_addr, int port_num )
+{
+	unsigned char buffer[ PROTO_MAX_FRAME - PROTO_HEADER_SIZE ];
+	unsigned char *payload;
+	size_t length;
+	int rtn = PROTO_SUCC, n = 0;
+
+	while( n < count && rtn == PROTO_SUCC )
+	{
+		struct proto_writer request = { buffer, sizeof( buffer ), 0, 0 };
+		protoWriteInt( &request, port_num, 2 );
+		protoWriteString( &request, filename );
+		protoWriteString( &request, ip_addr );
+		size_t count_pos = request.m_len;
+		protoWriteInt( &request, 0, 2 );
+		if( request.m_error == 1 || request.m_len + 16 > request.m_cap ) return TRACKER_ERROR;
+
+		/** Fill the frame, merging each range with the ones right after it that overlap or touch it. */
+		int packed = 0;
+		while( n < count && request.m_len + 16 <= request.m_cap )
+		{
+			struct tracker_range range = ranges[ n++ ];
+			while( n < count && ranges[n].start_byte >= range.start_byte && ranges[n].start_byte <= range.end_byte + 1 )
+			{
+				if( ranges[n].end_byte > range.end_byte ) range.end_byte = ranges[n].end_byte;
+				n++;
+			}
+			protoWriteInt( &request, range.start_byte, 8 );
+			protoWriteInt( &request, range.end_byte, 8 );
+			packed++;
+		}
+		struct proto_writer count_field = { buffer + count_pos, 2, 0, 0 };
+		protoWriteInt( &count_field, packed, 2 );
+
+		rtn = trackerTransact( conn, PROTO_UPDATE_RANGES, &request, &payload, &length );
+		if( rtn >= 0 ) free( payload );
+	}
+	return rtn;
+}
+
+/**
+ * Send a \a PROTO_LIST frame, and unpack the entries in its response. If \a cursor is not NULL, the cursor that follows the entries
+ * is stored in it.
+ * Returns the response's status, or a negative \a tracker_rtn_val.
+ */
+static int trackerListFrame( struct tracker_conn* conn, const struct proto_writer* request, struct tracker_entry** entries, int* count, char* cursor )
+{
+	unsigned char *payload;
+	size_t length;
+
+	*entries = NULL;
+	*count = 0;
+
+	int rtn = trackerTransact( conn, PROTO_LIST, request, &payload, &length );
+	if( rtn != PROTO_SUCC )
+	{
+		if( rtn >= 0 ) free( payload );
+		return rtn;
+	}
+
+	struct proto_reader response = { payload, length, 0, 0 };
+	int num_entries = (int) protoReadInt( &response, 4 );
+	/** Every entry takes at least 12 bytes, which bounds a bogus count before anything is allocated. */
+	if( response.m_error == 1 || (size_t) num_entries > length / 12
+		|| ( *entries = (struct tracker_entry*) malloc( ( num_entries > 0 ? num_entries : 1 ) * sizeof( struct tracker_entry ) ) ) == NULL )
+	{
+		free( payload );
+		return TRACKER_ERROR;
+	}
+	for( int n = 0; n < num_entries; n++ )
+	{
+		protoReadString( &response, ( *entries )[n].filename, TRACKER_NAME_SIZE );
+		( *entries )[n].filesize = protoReadInt( &response, 8 );
+		protoReadString( &response, ( *entries )[n].md5, TRACKER_NAME_SIZE );
+	}
+	if( cursor != NULL )
+	{
+		protoReadString( &response, cursor, TRACKER_NAME_SIZE );
+	}
+	free( payload );
+
+	if( response.m_error == 1 )
+	{
+		free( *entries );
+		*entries = NULL;
+		return TRACKER_ERROR;
+	}
+	*count = num_entries;
+	return PROTO_SUCC;
+}
+
+int trackerList( struct tracker_conn* conn, struct tracker_entry** entries, int* count )
+{
+	struct proto_writer request = { NULL, 0, 0, 0 };
+
+	return trackerListFrame( conn, &request, entries, count, NULL );
+}
+
+int trackerSearch( struct tracker_conn* conn, const char* prefix, const char* substring, char* cursor, int limit, struct tracker_entry** entries, int* count )
+{
+	unsigned char buffer[ TRACKER_CONN_BUF_SIZE ];
+	struct proto_writer request = { buffer, sizeof( buffer ), 0, 0 };
+
+	*entries = NULL;
+	*count = 0;
+
+	protoWriteString( &request, prefix );
+	protoWriteString( &request, cursor );
+	protoWriteInt( &request, limit, 4 );
+	protoWriteString( &request, substring );
+	if( request.m_error == 1 ) return TRACKER_ERROR;
+
+	return trackerListFrame( conn, &request, entries, count, cursor );
+}
+
+int trackerGet( struct tracker_conn* conn, const char* tracker_filename, char** contents, size_t* length )
+{
+	unsigned char buffer[ TRACKER_CONN_BUF_SIZE ];
+	struct proto_writer request = { buffer, sizeof( buffer ), 0, 0 };
+
+	*contents = NULL;
+	*length = 0;
+
+	protoWriteString( &request, tracker_filename );
+	if( request.m_error == 1 ) return TRACKER_ERROR;
+
+	return trackerFetch( conn, PROTO_GET, &request, contents, length );
+}
+
+int trackerSelect( struct tracker_conn* conn, const char* tracker_filename, long start_byte, long end_byte, int max_peers,
+				   char** contents, size_t* length )
+{
+	unsigned char buffer[ TRACKER_CONN_BUF_SIZE ];
+	struct proto_writer request = { buffer, sizeof( buffer ), 0, 0 };
+
+	*contents = NULL;
+	*length = 0;
+
+	if( start_byte < 0 || end_byte < 0 || max_peers < 0 ) return TRACKER_ERROR;
+	protoWriteString( &request, tracker_filename );
+	protoWriteInt( &request, start_byte, 8 );
+	protoWriteInt( &request, end_byte, 8 );
+	protoWriteInt( &request, max_peers, 4 );
+	if( request.m_error == 1 ) return TRACKER_ERROR;
+
+	return trackerFetch( conn, PROTO_SELECT, &request, contents, length );
+}
+
+int trackerWatch( struct tracker_conn* conn, const char* filename )
+{
+	unsigned char buffer[ TRACKER_CONN_BUF_SIZE ];
+	struct proto_writer request = { buffer, sizeof( buffer ), 0, 0 };
+
+	protoWriteString( &request, filename );
+	if( request.m_error == 1 ) return TRACKER_ERROR;
+
+	return trackerSendFrame( conn, PROTO_WATCH, request.m_data, request.m_len );
+}
+
+int trackerNextEvent( struct tracker_conn* conn, struct tracker_event* event )
+{
+	unsigned char *payload;
+	size_t length;
+	int opcode, status;
+
+	int rtn = receiveFrame( conn, &opcode, &status, &payload, &length );
+	if( rtn != TRACKER_OK ) return rtn;
+
+	memset( event, 0, sizeof( struct tracker_event ) );
+	event->kind = opcode;
+	event->status = status;
+	if( opcode == PROTO_WATCH )
+	{
+		free( payload );
+		return TRACKER_OK;
+	}
+	/** Events were lost, and the server closes the connection. */
+	if( opcode != PROTO_EVENT || status != PROTO_SUCC )
+	{
+		free( payload );
+		trackerClose( conn );
+		return ( opcode == PROTO_EVENT ) ? TRACKER_DISCONNECTED : TRACKER_ERROR;
+	}
+
+	struct proto_reader response = { payload, length, 0, 0 };
+	event->kind = (int) protoReadInt( &response, 1 );
+	protoReadString( &response, event->filename, TRACKER_NAME_SIZE );
+	if( event->kind == PROTO_CREATE )
+	{
+		event->filesize = protoReadInt( &response, 8 );
+		protoReadString( &response, event->description, TRACKER_NAME_SIZE );
+		protoReadString( &response, event->md5, TRACKER_NAME_SIZE );
+	}
+	else if( event->kind == PROTO_UPDATE_RANGES )
+	{
+		event->port_num = (int) protoReadInt( &response, 2 );
+		protoReadString( &response, event->ip_addr, TRACKER_NAME_SIZE );
+		int count = (int) protoReadInt( &response, 2 );
+		for( int n = 0; n < count; n++ )
+		{
+			long start_byte = (long) protoReadInt( &response, 8 );
+			long end_byte = (long) protoReadInt( &response, 8 );
+			/** Ranges past the first TRACKER_EVENT_RANGES are dropped. */
+			if( event->count < TRACKER_EVENT_RANGES )
+			{
+				event->ranges[ event->count ].start_byte = start_byte;
+				event->ranges[ event->count ].end_byte = end_byte;
+				event->count++;
+			}
+		}
+	}
+	free( payload );
+
+	return ( response.m_error == 1 ) ? TRACKER_ERROR : TRACKER_OK;
+}
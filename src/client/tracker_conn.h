@@ -0,0 +1,299 @@
+/**
+ * @file tracker_conn.h
+ * @authors Matthew Lindner, Xiao Deng, Madeline Cameron
+ *
+ * @brief Header file for tracker_conn.c
+ * @details Persistent (keep-alive) connection to the tracker server.
+ *
+ * The connection is opened once and switched into keep-alive mode with \<KEEPALIVE\>, after which any number of
+ * commands can be sent over it. Commands may be pipelined: send several with trackerSend(), then collect their
+ * responses, in the same order, with trackerReceive().
+ *
+ * A connection opened in binary mode is switched to the binary framing of tracker_proto.h with \<BINARY\> instead, and
+ * is used through trackerCreate(), trackerUpdate(), trackerList(), trackerSearch(), trackerGet() and trackerSelect(), or trackerSendFrame() and
+ * trackerReceiveFrame() to pipeline.
+ *
+ * A binary connection can also watch trackers with trackerWatch(). The server then pushes every change to them, which trackerNextEvent()
+ * waits for. Since events arrive whenever the changes happen, a connection that watches is best kept for watching only.
+ */
+
+#ifndef __TRACKER_CONN_H__
+#define __TRACKER_CONN_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "tracker_proto.h"
+
+/*-----------------------------------
+            Defines
+-----------------------------------*/
+#define TRACKER_CONN_BUF_SIZE 4096		///< Size of the receive buffer of a tracker connection
+#define TRACKER_NAME_SIZE 256			///< String size of the fields of a LIST entry
+#define TRACKER_EVENT_RANGES 256		///< Most ranges in an event
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * A keep-alive connection to the tracker server.
+ */
+struct tracker_conn
+{
+	int		sock;								///< Socket connected to the tracker server, -1 if not connected
+	struct sockaddr_in addr;					///< Address of the tracker server, used to reconnect
+	char	buf[ TRACKER_CONN_BUF_SIZE ];		///< Bytes received from the server but not consumed yet
+	size_t	len;								///< Number of bytes in \a buf
+	size_t	pos;								///< Index of the first unconsumed byte in \a buf
+	char	md5[ 33 ];							///< MD5 from the footer of the last GET response
+	int		binary;								///< 1 if the connection uses binary frames
+};
+
+/**
+ * A byte range announced by trackerUpdateRanges().
+ */
+struct tracker_range
+{
+	long	start_byte;							///< Starting byte of the range
+	long	end_byte;							///< Ending byte of the range
+};
+
+/**
+ * One tracker in a binary LIST response.
+ */
+struct tracker_entry
+{
+	char	filename[ TRACKER_NAME_SIZE ];		///< Name of the shared file
+	unsigned long long filesize;				///< Size of the shared file
+	char	md5[ TRACKER_NAME_SIZE ];			///< MD5 of the shared file
+};
+
+/**
+ * A change to a watched tracker, or the server's response to trackerWatch(), returned by trackerNextEvent().
+ */
+struct tracker_event
+{
+	int		kind;								///< PROTO_WATCH, PROTO_CREATE or PROTO_UPDATE_RANGES
+	int		status;								///< For PROTO_WATCH: the response's \a proto_status
+	char	filename[ TRACKER_NAME_SIZE ];		///< Name of the shared file (not set for PROTO_WATCH)
+	unsigned long long filesize;				///< PROTO_CREATE: size of the shared file
+	char	description[ TRACKER_NAME_SIZE ];	///< PROTO_CREATE: description of the shared file
+	char	md5[ TRACKER_NAME_SIZE ];			///< PROTO_CREATE: MD5 of the shared file
+	char	ip_addr[ TRACKER_NAME_SIZE ];		///< PROTO_UPDATE_RANGES: IP address of the sharing peer
+	int		port_num;							///< PROTO_UPDATE_RANGES: port of the sharing peer
+	int		count;								///< PROTO_UPDATE_RANGES: number of \a ranges
+	struct tracker_range ranges[ TRACKER_EVENT_RANGES ];	///< PROTO_UPDATE_RANGES: the ranges the peer announced
+};
+
+/*-----------------------------------
+        Enums & const string
+-----------------------------------*/
+/**
+ * Return values of the tracker connection functions.
+ */
+enum tracker_rtn_val
+{
+	TRACKER_DISCONNECTED = -2,			///< The connection to the server was lost
+	TRACKER_ERROR = -1,					///< The server could not be reached, or sent a malformed response
+	TRACKER_OK = 0,						///< Normal return value, \a response holds the server's response line(s)
+	TRACKER_FILE = 1					///< \a response holds the contents of a tracker file (GET)
+};
+
+/*-----------------------------------
+            Prototypes
+-----------------------------------*/
+/**
+ * Connect to the tracker server, and switch the connection into keep-alive mode, or binary mode.
+ *
+ * @param conn Connection to open, OUTPUT.
+ * @param addr Address of the tracker server, INPUT.
+ * @param binary 1 to use binary frames, 0 for text commands, INPUT.
+ *
+ * @return \b TRACKER_OK, or \b TRACKER_ERROR.
+ */
+int trackerConnect( struct tracker_conn* conn, const struct sockaddr_in* addr, int binary );
+
+/**
+ * Close the connection to the tracker server.
+ *
+ * @param conn Connection to close, INPUT.
+ */
+void trackerClose( struct tracker_conn* conn );
+
+/**
+ * Send a command without waiting for its response, so that several commands can be pipelined.
+ *
+ * @param conn Connection to send on, INPUT.
+ * @param command The command, e.g. "<REQ LIST>", INPUT.
+ *
+ * @return \b TRACKER_OK, or \b TRACKER_DISCONNECTED.
+ */
+int trackerSend( struct tracker_conn* conn, const char* command );
+
+/**
+ * Receive the response to the oldest command that has not been answered yet.
+ * Note: You should call free() on \a response.
+ *
+ * @param conn Connection to receive on, INPUT.
+ * @param response The response, NUL terminated. For a GET, the tracker file contents without framing, OUTPUT.
+ * @param length Number of bytes in \a response, OUTPUT.
+ *
+ * @return \b TRACKER_OK, \b TRACKER_FILE, \b TRACKER_ERROR, or \b TRACKER_DISCONNECTED.
+ */
+int trackerReceive( struct tracker_conn* conn, char** response, size_t* length );
+
+/**
+ * Send a command and wait for its response. If the connection has been lost, it is re-opened once and, if the command only reads
+ * (REQ or GET), retried. A create or update that was cut off is reported as \b TRACKER_DISCONNECTED, since the server may have applied it.
+ * Note: You should call free() on \a response.
+ *
+ * @param conn Connection to use, INPUT.
+ * @param command The command, INPUT.
+ * @param response The response, see trackerReceive(), OUTPUT.
+ * @param length Number of bytes in \a response, OUTPUT.
+ *
+ * @return \b TRACKER_OK, \b TRACKER_FILE, \b TRACKER_ERROR, or \b TRACKER_DISCONNECTED.
+ */
+int trackerRequest( struct tracker_conn* conn, const char* command, char** response, size_t* length );
+
+/**
+ * Send a binary frame without waiting for its response.
+ *
+ * @param conn Binary connection to send on, INPUT.
+ * @param opcode One of \a proto_opcode, INPUT.
+ * @param payload The payload, INPUT.
+ * @param length Number of bytes in \a payload, INPUT.
+ *
+ * @return \b TRACKER_OK, or \b TRACKER_DISCONNECTED.
+ */
+int trackerSendFrame( struct tracker_conn* conn, int opcode, const void* payload, size_t length );
+
+/**
+ * Receive the response frame to the oldest frame that has not been answered yet.
+ * Note: You should call free() on \a payload.
+ *
+ * @param conn Binary connection to receive on, INPUT.
+ * @param status The response's \a proto_status, OUTPUT.
+ * @param payload The response's payload, OUTPUT.
+ * @param length Number of bytes in \a payload, OUTPUT.
+ *
+ * @return \b TRACKER_OK, \b TRACKER_ERROR, or \b TRACKER_DISCONNECTED.
+ */
+int trackerReceiveFrame( struct tracker_conn* conn, int* status, unsigned char** payload, size_t* length );
+
+/**
+ * Create a tracker (binary \<createtracker\>).
+ *
+ * @return The response's \a proto_status, or \b TRACKER_ERROR or \b TRACKER_DISCONNECTED.
+ */
+int trackerCreate( struct tracker_conn* conn, const char* filename, unsigned long long filesize, const char* description, const char* md5, const char* ip_addr, int port_num );
+
+/**
+ * Announce a chunk (binary \<updatetracker\>).
+ *
+ * @return The response's \a proto_status, or \b TRACKER_ERROR or \b TRACKER_DISCONNECTED.
+ */
+int trackerUpdate( struct tracker_conn* conn, const char* filename, long start_byte, long end_byte, const char* ip_addr, int port_num );
+
+/**
+ * Announce several chunks at once (binary \<updatetracker\> with a list of ranges).
+ * Runs of consecutive ranges are merged, and as many ranges as fit are packed into each frame. The server records each frame as a
+ * single change, so a seeder announcing a whole file needs a round trip per frame rather than one per chunk.
+ *
+ * @param conn Binary connection, INPUT.
+ * @param filename Name of the shared file, INPUT.
+ * @param ranges The ranges, INPUT.
+ * @param count Number of \a ranges, INPUT.
+ * @param ip_addr IP address of the sharing peer, INPUT.
+ * @param port_num Port of the sharing peer, INPUT.
+ *
+ * @return The status of the first response that was not \a PROTO_SUCC (or \a PROTO_SUCC), or \b TRACKER_ERROR or \b TRACKER_DISCONNECTED.
+ */
+int trackerUpdateRanges( struct tracker_conn* conn, const char* filename, const struct tracker_range* ranges, int count, const char* ip_addr, int port_num );
+
+/**
+ * List every tracker (binary \<REQ LIST\>).
+ * Note: You should call free() on \a entries.
+ *
+ * @param conn Binary connection, INPUT.
+ * @param entries The trackers, OUTPUT.
+ * @param count Number of \a entries, OUTPUT.
+ *
+ * @return The response's \a proto_status, or \b TRACKER_ERROR or \b TRACKER_DISCONNECTED.
+ */
+int trackerList( struct tracker_conn* conn, struct tracker_entry** entries, int* count );
+
+/**
+ * List one page of the trackers, in filename order (binary \<REQ LIST prefix cursor limit substring\>).
+ * Note: You should call free() on \a entries.
+ *
+ * @param conn Binary connection, INPUT.
+ * @param prefix Only trackers whose filename starts with it are listed. Empty for every tracker, INPUT.
+ * @param substring Only trackers whose filename or description contains it are listed. Empty for every tracker, INPUT.
+ * @param cursor Where the page starts: empty for the first page, then the \a cursor returned with the previous page, INPUT/OUTPUT.
+ * Must hold at least TRACKER_NAME_SIZE bytes. Set to the empty string once the last page has been listed.
+ * @param limit Most trackers to list. The server may list fewer, INPUT.
+ * @param entries The trackers, OUTPUT.
+ * @param count Number of \a entries, OUTPUT.
+ *
+ * @return The response's \a proto_status, or \b TRACKER_ERROR or \b TRACKER_DISCONNECTED.
+ */
+int trackerSearch( struct tracker_conn* conn, const char* prefix, const char* substring, char* cursor, int limit, struct tracker_entry** entries, int* count );
+
+/**
+ * Download a tracker file (binary \<GET\>). Its MD5, as sent by the server, is stored in \a conn->md5.
+ * Note: You should call free() on \a contents.
+ *
+ * @param conn Binary connection, INPUT.
+ * @param tracker_filename Name of the tracker file (filename.track), INPUT.
+ * @param contents The tracker file, NUL terminated, OUTPUT.
+ * @param length Number of bytes in \a contents, OUTPUT.
+ *
+ * @return The response's \a proto_status, or \b TRACKER_ERROR or \b TRACKER_DISCONNECTED.
+ */
+int trackerGet( struct tracker_conn* conn, const char* tracker_filename, char** contents, size_t* length );
+
+/**
+ * Download the part of a tracker file that covers a byte range (binary \<GET filename.track start end max_peers\>): the header, then
+ * one record per contiguous range each peer has announced within [\a start_byte, \a end_byte), freshest peers first. Its MD5, as sent
+ * by the server, is stored in \a conn->md5.
+ * Note: You should call free() on \a contents.
+ *
+ * @param conn Binary connection, INPUT.
+ * @param tracker_filename Name of the tracker file (filename.track), INPUT.
+ * @param start_byte Starting byte of the range, INPUT.
+ * @param end_byte Ending byte of the range, INPUT.
+ * @param max_peers Most peers to return, or 0 for no limit, INPUT.
+ * @param contents The selected records, laid out as a tracker file, NUL terminated, OUTPUT.
+ * @param length Number of bytes in \a contents, OUTPUT.
+ *
+ * @return The response's \a proto_status, or \b TRACKER_ERROR or \b TRACKER_DISCONNECTED.
+ */
+int trackerSelect( struct tracker_conn* conn, const char* tracker_filename, long start_byte, long end_byte, int max_peers,
+				   char** contents, size_t* length );
+
+/**
+ * Watch a tracker, which need not exist yet (binary \<WATCH filename\>). Only the request is sent: its response is returned by
+ * trackerNextEvent(), as an event of kind PROTO_WATCH, ahead of any change made after the watch was in place.
+ *
+ * @param conn Binary connection, INPUT.
+ * @param filename Name of the shared file, INPUT.
+ *
+ * @return \b TRACKER_OK, \b TRACKER_ERROR, or \b TRACKER_DISCONNECTED.
+ */
+int trackerWatch( struct tracker_conn* conn, const char* filename );
+
+/**
+ * Wait for the next event pushed to a watching connection.
+ *
+ * @param conn Binary connection that has watched trackers with trackerWatch(), INPUT.
+ * @param event The event, OUTPUT.
+ *
+ * @return \b TRACKER_OK, \b TRACKER_ERROR, or \b TRACKER_DISCONNECTED. The connection is closed once the server reports that the
+ * client fell too far behind and events were lost, and \b TRACKER_DISCONNECTED is returned: watch again, and catch up with a LIST.
+ */
+int trackerNextEvent( struct tracker_conn* conn, struct tracker_event* event );
+
+#endif
@@ -0,0 +1,599 @@
+/**
+ * @file bench.c
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @brief Load generator for the tracker server.
+ * @details Simulates many peers, each holding a keep-alive connection to server.out, and has every one of them issue a random mix of
+ * createtracker, updatetracker, REQ LIST and GET commands back-to-back for a fixed time. Each peer waits for the response to one command
+ * before sending the next, so the load follows the server's latency. The connections are spread over a few threads, each multiplexing its
+ * share over one epoll instance.
+ *
+ * Before the run, a set of trackers is created for the updatetracker and GET commands to use; trackers created during the run get names of
+ * their own, so they succeed. When the run is over, one line of JSON is written to standard output with the throughput, and for each
+ * command the number sent, the error rate and the latency percentiles, counted with the server's own histograms (server_stats.c).
+ *
+ * Usage: bench.out [-h host] [-p port] [-c connections] [-t threads] [-d seconds] [-f trackers] [-m create:update:list:get]
+ *
+ * @section COMPILE
+ * Run "make bench-server" in root directory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "server_constants.ini"
+#include "tracker_proto.h"
+#include "server_stats.h"
+
+/**
+ * A simulated peer: one keep-alive connection, with at most one command outstanding.
+ */
+struct bench_peer
+{
+	int m_socket; ///< Connection to the server.
+	int m_id; ///< Number of the peer, which its address and port are made from.
+	int m_command; ///< Opcode of the outstanding command, or 0 if there is none.
+	unsigned long long m_sent_ns; ///< When the outstanding command was sent.
+	char *m_in; ///< Bytes of the response received so far.
+	size_t m_in_len; ///< Number of bytes in \a m_in.
+	size_t m_in_cap; ///< Allocated size of \a m_in.
+	unsigned int m_seed; ///< State of the peer's random number generator.
+};
+
+/**
+ * One thread of the load generator, and the peers it drives.
+ */
+struct bench_thread
+{
+	pthread_t m_thread; ///< The thread.
+	int m_index; ///< Number of the thread.
+	int m_epoll_fd; ///< The epoll instance its peers are registered with.
+	struct bench_peer *m_peers; ///< Its peers.
+	int m_num_peers; ///< Number of peers in \a m_peers.
+	unsigned long m_created; ///< Number of trackers it has created, used to name the next one.
+	unsigned long m_disconnects; ///< Number of its connections the server closed.
+};
+
+/**
+ * Address of the server.
+ */
+struct sockaddr_in server_addr;
+/**
+ * Number of simulated peers.
+ */
+int num_connections = 1000;
+/**
+ * Number of threads driving them.
+ */
+int num_threads = 4;
+/**
+ * Length of the run, in seconds.
+ */
+int duration = 10;
+/**
+ * Number of trackers created before the run.
+ */
+int num_trackers = 100;
+/**
+ * Relative weights of createtracker, updatetracker, REQ LIST and GET in the mix, indexed by opcode.
+ */
+int mix[PROTO_GET + 1] = {0, 1, 60, 4, 35};
+/**
+ * Prefix of every tracker name, unique to the run, so that runs against the same server do not collide.
+ */
+char run_prefix[64];
+/**
+ * When the run ends, on the monotonic clock, in nanoseconds.
+ */
+unsigned long long end_ns;
+
+/**
+ * Current time on the monotonic clock, in nanoseconds.
+ */
+unsigned long long monotonicNs();
+/**
+ * Opens a keep-alive connection to the server.
+ * @return The blocking socket, or -1 if it could not be connected.
+ */
+int connectServer();
+/**
+ * Sends a command over a blocking connection and waits for its one line response.
+ * @param sock The connection.
+ * @param command The command.
+ * @param response Filled in with the response line.
+ * @param size Size of \a response.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int exchange(int sock, const char *command, char *response, size_t size);
+/**
+ * Creates the trackers the run uses.
+ * @return 0 on success, -1 if the server could not be reached.
+ */
+int createTrackers();
+/**
+ * Body of each thread: connects its peers, then keeps them all busy until the run ends.
+ * @param arg The thread's \a bench_thread.
+ */
+void *benchLoop(void *arg);
+/**
+ * Picks the next command for a peer according to \a mix, and sends it.
+ * @param thread The thread driving the peer.
+ * @param peer The peer.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int sendCommand(struct bench_thread *thread, struct bench_peer *peer);
+/**
+ * Reads whatever the server has sent a peer, and counts the response once it is complete.
+ * @param peer The peer.
+ * @return 1 if the response is complete, 0 if more is needed, -1 if the connection failed.
+ */
+int readResponse(struct bench_peer *peer);
+/**
+ * Finds the end of a response of the given kind.
+ * @param command Opcode of the command the response is for.
+ * @param data The bytes received so far.
+ * @param length Number of bytes in \a data.
+ * @param status Filled in with the outcome of the command, as a \a proto_status.
+ * @return The length of the response, or 0 if it is not complete yet.
+ */
+size_t responseLength(int command, const char *data, size_t length, int *status);
+/**
+ * Outcome of a command, from the response line.
+ * @param line The response line.
+ * @return The outcome, as a \a proto_status.
+ */
+int lineStatus(const char *line);
+/**
+ * Writes the results of the run to standard output, as one line of JSON.
+ * @param threads The threads.
+ * @param elapsed Length of the run, in seconds.
+ */
+void report(struct bench_thread *threads, double elapsed);
+
+
+/**
+ * Reads the options, creates the trackers, runs the threads for \a duration seconds and reports.
+ */
+int main(int argc, char *argv[])
+{
+	const char *host = "127.0.0.1";
+	int port = SERVER_PORT;
+	int option, i;
+
+	while ((option = getopt(argc, argv, "h:p:c:t:d:f:m:")) != -1)
+	{
+		switch (option)
+		{
+			case 'h': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': num_connections = atoi(optarg); break;
+			case 't': num_threads = atoi(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'f': num_trackers = atoi(optarg); break;
+			case 'm':
+				if (sscanf(optarg, "%d:%d:%d:%d", &mix[PROTO_CREATE], &mix[PROTO_UPDATE], &mix[PROTO_LIST], &mix[PROTO_GET]) != 4)
+				{
+					fprintf(stderr, "Bench Error: the mix is create:update:list:get\n");
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-t threads] [-d seconds] [-f trackers] "
+					"[-m create:update:list:get]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (num_connections < 1 || num_threads < 1 || duration < 1 || num_trackers < 1
+		|| mix[PROTO_CREATE] + mix[PROTO_UPDATE] + mix[PROTO_LIST] + mix[PROTO_GET] <= 0)
+	{
+		fprintf(stderr, "Bench Error: invalid options\n");
+		return 1;
+	}
+	if (num_threads > num_connections)
+	{
+		num_threads = num_connections;
+	}
+
+	struct hostent *server = gethostbyname(host);
+	if (server == NULL)
+	{
+		fprintf(stderr, "Bench Error: unknown host %s\n", host);
+		return 1;
+	}
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	memcpy(&server_addr.sin_addr, server->h_addr, server->h_length);
+
+	/** Every peer needs a descriptor, so the limit is raised as far as it goes. */
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	snprintf(run_prefix, sizeof(run_prefix), "bench%ld_%d", (long) time(NULL), (int) getpid());
+	if (createTrackers() == -1)
+	{
+		fprintf(stderr, "Bench Error: could not reach the server\n");
+		return 1;
+	}
+
+	struct bench_thread *threads = (struct bench_thread *) calloc(num_threads, sizeof(struct bench_thread));
+	if (threads == NULL)
+	{
+		perror("Bench Error: Out of memory");
+		return 1;
+	}
+
+	/** The connections are made by the threads themselves, before the clock starts. */
+	unsigned long long started = monotonicNs();
+	end_ns = started + 1000000000ULL * duration;
+	for (i = 0; i < num_threads; i++)
+	{
+		threads[i].m_index = i;
+		threads[i].m_num_peers = num_connections / num_threads + ((i < num_connections % num_threads) ? 1 : 0);
+		if (pthread_create(&threads[i].m_thread, NULL, &benchLoop, &threads[i]) != 0)
+		{
+			fprintf(stderr, "Bench Error: could not create thread\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < num_threads; i++)
+	{
+		pthread_join(threads[i].m_thread, NULL);
+	}
+
+	report(threads, (monotonicNs() - started) / 1e9);
+	free(threads);
+	return 0;
+}
+
+unsigned long long monotonicNs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int connectServer()
+{
+	char response[CHUNK_SIZE];
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock == -1)
+	{
+		return -1;
+	}
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (connect(sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1
+		|| exchange(sock, "<KEEPALIVE>", response, sizeof(response)) == -1)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int exchange(int sock, const char *command, char *response, size_t size)
+{
+	size_t length = 0;
+	if (send(sock, command, strlen(command), MSG_NOSIGNAL) != (ssize_t) strlen(command))
+	{
+		return -1;
+	}
+	/* Read a byte at a time, so that nothing after the line is consumed. */
+	while (length < size - 1)
+	{
+		if (recv(sock, &response[length], 1, 0) != 1)
+		{
+			return -1;
+		}
+		if (response[length++] == '\n')
+		{
+			break;
+		}
+	}
+	response[length] = '\0';
+	return 0;
+}
+
+int createTrackers()
+{
+	char command[CHUNK_SIZE], response[CHUNK_SIZE];
+	int sock, i;
+
+	if ((sock = connectServer()) == -1)
+	{
+		return -1;
+	}
+	for (i = 0; i < num_trackers; i++)
+	{
+		snprintf(command, sizeof(command), "<createtracker %s_%d 1048576 bench 0123456789abcdef0123456789abcdef 127.0.0.1 1>",
+			run_prefix, i);
+		if (exchange(sock, command, response, sizeof(response)) == -1)
+		{
+			close(sock);
+			return -1;
+		}
+	}
+	close(sock);
+	return 0;
+}
+
+void *benchLoop(void *arg)
+{
+	struct bench_thread *thread = (struct bench_thread *) arg;
+	struct epoll_event events[MAX_EVENTS];
+	int i, live = 0;
+
+	if ((thread->m_epoll_fd = epoll_create1(0)) == -1
+		|| (thread->m_peers = (struct bench_peer *) calloc(thread->m_num_peers, sizeof(struct bench_peer))) == NULL)
+	{
+		perror("Bench Error: thread setup failed");
+		return NULL;
+	}
+
+	/** Connect every peer, and start it off with its first command. */
+	for (i = 0; i < thread->m_num_peers; i++)
+	{
+		struct bench_peer *peer = &thread->m_peers[i];
+		peer->m_id = i * num_threads + thread->m_index;
+		peer->m_seed = (unsigned int) (peer->m_id * 2654435761U) ^ (unsigned int) time(NULL);
+		if ((peer->m_socket = connectServer()) == -1)
+		{
+			thread->m_disconnects++;
+			continue;
+		}
+
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = peer;
+		if (epoll_ctl(thread->m_epoll_fd, EPOLL_CTL_ADD, peer->m_socket, &event) == -1 || sendCommand(thread, peer) == -1)
+		{
+			close(peer->m_socket);
+			peer->m_socket = -1;
+			thread->m_disconnects++;
+			continue;
+		}
+		live++;
+	}
+
+	/** Whenever a response is complete, the peer sends its next command, until the run is over. */
+	while (live > 0 && monotonicNs() < end_ns)
+	{
+		int num_events = epoll_wait(thread->m_epoll_fd, events, MAX_EVENTS, 100);
+		for (i = 0; i < num_events; i++)
+		{
+			struct bench_peer *peer = (struct bench_peer *) events[i].data.ptr;
+			int status = readResponse(peer);
+			if (status == 1 && monotonicNs() < end_ns)
+			{
+				status = sendCommand(thread, peer);
+			}
+			if (status == -1)
+			{
+				close(peer->m_socket);
+				peer->m_socket = -1;
+				thread->m_disconnects++;
+				live--;
+			}
+		}
+	}
+
+	for (i = 0; i < thread->m_num_peers; i++)
+	{
+		if (thread->m_peers[i].m_socket != -1)
+		{
+			close(thread->m_peers[i].m_socket);
+		}
+		free(thread->m_peers[i].m_in);
+	}
+	free(thread->m_peers);
+	close(thread->m_epoll_fd);
+	return NULL;
+}
+
+int sendCommand(struct bench_thread *thread, struct bench_peer *peer)
+{
+	char command[CHUNK_SIZE];
+	int total = mix[PROTO_CREATE] + mix[PROTO_UPDATE] + mix[PROTO_LIST] + mix[PROTO_GET];
+	int pick = rand_r(&peer->m_seed) % total;
+	int tracker = rand_r(&peer->m_seed) % num_trackers;
+
+	/** Walk the weights until the pick falls within one. */
+	peer->m_command = PROTO_CREATE;
+	while (pick >= mix[peer->m_command])
+	{
+		pick -= mix[peer->m_command];
+		peer->m_command++;
+	}
+
+	switch (peer->m_command)
+	{
+		case PROTO_CREATE:
+			snprintf(command, sizeof(command), "<createtracker %s_t%d_%lu 1048576 bench 0123456789abcdef0123456789abcdef 127.0.0.1 1>",
+				run_prefix, thread->m_index, thread->m_created++);
+			break;
+		/** Each peer announces random 64KiB pieces of the file from its own address and port. */
+		case PROTO_UPDATE:
+		{
+			long start = (rand_r(&peer->m_seed) % 16) * 65536L;
+			snprintf(command, sizeof(command), "<updatetracker %s_%d %ld %ld 10.%d.%d.%d %d>", run_prefix, tracker, start, start + 65536,
+				(peer->m_id >> 16) & 255, (peer->m_id >> 8) & 255, peer->m_id & 255, 1024 + peer->m_id % 60000);
+			break;
+		}
+		case PROTO_LIST:
+			snprintf(command, sizeof(command), "<REQ LIST>");
+			break;
+		default:
+			snprintf(command, sizeof(command), "<GET %s_%d.track>", run_prefix, tracker);
+			break;
+	}
+
+	peer->m_sent_ns = monotonicNs();
+	size_t length = strlen(command);
+	if (send(peer->m_socket, command, length, MSG_NOSIGNAL) != (ssize_t) length)
+	{
+		return -1;
+	}
+	statsTraffic(0, length);
+	return 0;
+}
+
+int readResponse(struct bench_peer *peer)
+{
+	ssize_t received;
+	int status;
+
+	while (1)
+	{
+		if (peer->m_in_cap - peer->m_in_len < CHUNK_SIZE)
+		{
+			size_t capacity = (peer->m_in_cap == 0) ? 4 * CHUNK_SIZE : peer->m_in_cap * 2;
+			char *grown = (char *) realloc(peer->m_in, capacity);
+			if (grown == NULL)
+			{
+				return -1;
+			}
+			peer->m_in = grown;
+			peer->m_in_cap = capacity;
+		}
+
+		received = recv(peer->m_socket, peer->m_in + peer->m_in_len, peer->m_in_cap - peer->m_in_len, MSG_DONTWAIT);
+		if (received > 0)
+		{
+			peer->m_in_len += received;
+			statsTraffic(received, 0);
+		}
+		else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		{
+			return -1;
+		}
+		else if (errno != EINTR)
+		{
+			break;
+		}
+	}
+
+	size_t length = responseLength(peer->m_command, peer->m_in, peer->m_in_len, &status);
+	if (length == 0)
+	{
+		return 0;
+	}
+
+	/** The server never sends anything unasked, so there is nothing after the response. */
+	statsCommand(peer->m_command, status, monotonicNs() - peer->m_sent_ns);
+	peer->m_in_len = 0;
+	peer->m_command = 0;
+	return 1;
+}
+
+size_t responseLength(int command, const char *data, size_t length, int *status)
+{
+	const char *end = (const char *) memchr(data, '\n', length);
+	if (end == NULL)
+	{
+		return 0;
+	}
+	size_t line = end - data + 1;
+	*status = lineStatus(data);
+
+	/** A LIST goes on until its footer line. */
+	if (command == PROTO_LIST && strncmp(data, "<REP LIST ", strlen("<REP LIST ")) == 0)
+	{
+		const char *footer = (const char *) memmem(data, length, "<REP LIST END>\n", strlen("<REP LIST END>\n"));
+		return (footer == NULL) ? 0 : footer - data + strlen("<REP LIST END>\n");
+	}
+
+	/** A GET is the header line, the tracker file, a newline and the footer line. */
+	if (command == PROTO_GET && strncmp(data, "<REP GET BEGIN ", strlen("<REP GET BEGIN ")) == 0)
+	{
+		size_t file_length = strtoul(data + strlen("<REP GET BEGIN "), NULL, 10);
+		if (length < line + file_length + 1)
+		{
+			return 0;
+		}
+		const char *footer = (const char *) memchr(data + line + file_length + 1, '\n', length - line - file_length - 1);
+		return (footer == NULL) ? 0 : footer - data + 1;
+	}
+
+	return line;
+}
+
+int lineStatus(const char *line)
+{
+	const char *word = strchr(line, ' ');
+	if (strncmp(line, "<REP ", strlen("<REP ")) == 0 || (word != NULL && strncmp(word, " succ>", strlen(" succ>")) == 0))
+	{
+		return PROTO_SUCC;
+	}
+	if (word != NULL && strncmp(word, " ferr>", strlen(" ferr>")) == 0)
+	{
+		return PROTO_FERR;
+	}
+	if (word != NULL && strncmp(word, " fail>", strlen(" fail>")) == 0)
+	{
+		return PROTO_FAIL;
+	}
+	return PROTO_INVALID;
+}
+
+void report(struct bench_thread *threads, double elapsed)
+{
+	static const char *names[PROTO_GET + 1] = {NULL, "createtracker", "updatetracker", "LIST", "GET"};
+	struct stats_counts *totals = (struct stats_counts *) malloc(sizeof(struct stats_counts));
+	unsigned long long all = 0, errors = 0;
+	unsigned long disconnects = 0;
+	int i, s;
+
+	if (totals == NULL)
+	{
+		perror("Bench Error: Out of memory");
+		return;
+	}
+	statsCollect(totals);
+	for (i = 0; i < num_threads; i++)
+	{
+		disconnects += threads[i].m_disconnects;
+	}
+	for (i = PROTO_CREATE; i <= PROTO_GET; i++)
+	{
+		for (s = 0; s < STATS_STATUSES; s++)
+		{
+			all += totals->commands[i][s];
+			errors += (s != PROTO_SUCC) ? totals->commands[i][s] : 0;
+		}
+	}
+
+	printf("{\"seconds\": %.3f, \"connections\": %d, \"threads\": %d, \"trackers\": %d, \"commands\": %llu, \"throughput\": %.1f, "
+		"\"error_rate\": %.6f, \"disconnects\": %lu, \"bytes_in\": %llu, \"bytes_out\": %llu",
+		elapsed, num_connections, num_threads, num_trackers, all, all / elapsed, (all > 0) ? (double) errors / all : 0.0, disconnects,
+		totals->bytes_in, totals->bytes_out);
+	for (i = PROTO_CREATE; i <= PROTO_GET; i++)
+	{
+		unsigned long long *outcomes = totals->commands[i];
+		unsigned long long count = outcomes[PROTO_SUCC] + outcomes[PROTO_FAIL] + outcomes[PROTO_FERR] + outcomes[PROTO_INVALID];
+		printf(", \"%s\": {\"count\": %llu, \"throughput\": %.1f, \"error_rate\": %.6f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+			"\"p999_us\": %.1f, \"max_us\": %.1f}",
+			names[i], count, count / elapsed, (count > 0) ? (double) (count - outcomes[PROTO_SUCC]) / count : 0.0,
+			statsPercentile(totals, i, 0.5) / 1000.0, statsPercentile(totals, i, 0.99) / 1000.0,
+			statsPercentile(totals, i, 0.999) / 1000.0, totals->latency_max_ns[i] / 1000.0);
+	}
+	printf("}\n");
+	free(totals);
+}
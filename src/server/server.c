@@ -2,41 +2,92 @@
  * @file server.c
  * @authors Matthew Lindner, Xiao Deng
  *
- * @brief Multi-threaded server that maintains and distributes tracker files.
- * @details Centralized, multi-threaded server whose purpose is to distribute tracker files to clients who what to share files on a P2P network.
+ * @brief Event-driven server that maintains and distributes tracker files.
+ * @details Centralized server whose purpose is to distribute tracker files to clients who what to share files on a P2P network.
  *
  * The server can process four types of requests:
  * 	-# createtracker
  * 	-# updatetracker
  * 	-# LIST
- * 	-# GET
+ * 	-# GET, either the whole tracker file, or with \<GET filename.track start end max_peers\> only the peers that announced bytes in
+ * 	   [start, end] (both inclusive, like every byte range), one record per contiguous range, freshest peers first (see storeSelect())
  *
- * Once the server processes a single request from a client, it closes the connection to that client.
- * Each client is handled in its own thread. This allows the server to handle multiple clients at a single time.
+ * A client may also send \<KEEPALIVE\> to switch its connection into keep-alive mode, or \<BINARY\> to switch it to the binary
+ * framing described in tracker_proto.h (which also keeps it alive). \<REQ STATS\> returns the server's counters: commands processed
+ * and their latencies, errors, traffic, connections and the work queue (see buildStatsReport()). The same report can be written to
+ * \a STATS_FILE periodically (\a stats_interval, see readConfig()).
+ *
+ * Tracker files are held in memory by the tracker store (tracker_store.c), and written back to the "Tracker Files" folder in the background.
+ * Every createtracker and updatetracker is appended to a write-ahead log first, and is only acknowledged once the log has been synced. The
+ * responses to a batch of pipelined commands wait for a single sync, which is shared with whatever the other worker threads logged.
+ * The LIST response is built once and cached until a tracker is created (see storeVersion()); every peer that asks for it is sent the same
+ * shared copy. A GET for a tracker whose file on disk is up to date is sent straight from the file with sendfile().
+ *
+ * Once the server processes a single request from a client, it closes the connection to that client, unless the client is in keep-alive
+ * mode. In keep-alive mode the connection stays open, and the client may pipeline any number of commands; they are processed back-to-back,
+ * and their responses are sent in order. Every keep-alive response is self-delimiting: a single line, a LIST ending in \<REP LIST END\>,
+ * or a GET framed as \<REP GET BEGIN length\>, the tracker file, and \<REP GET END md5\>.
+ * A client that sends \<WATCH filename\> (or a \a PROTO_WATCH frame) keeps its connection open, and every createtracker and updatetracker
+ * of that tracker is pushed to it as an \<EVENT ...\> line (or a \a PROTO_EVENT frame) as soon as the change is applied, so nobody needs
+ * to poll LIST to find out about new trackers or chunks (see notifyWatchers()).
+ * All connections are non-blocking and multiplexed over edge-triggered epoll instances, one per event loop (\a event_loops, see readConfig()).
+ * Each event loop has its own listening socket on the same port (\b SO_REUSEPORT), so accepting is spread across them by the kernel. The
+ * trackers are shared by every event loop, partitioned by filename hash over the store's striped locks, so a command is served by whichever
+ * loop accepted its connection. An event loop only waits and accepts connections; every peer that becomes ready is handed to a fixed
+ * pool of worker threads (\a worker_threads, see readConfig()) through a lock-free queue (work_queue.c), so a worker waiting for the log
+ * to sync never holds up an event loop. Each connection is driven by a small state machine (see \a peer_state), so a slow peer never
+ * ties up a thread, and the number of simultaneous peers is limited only by the number of file descriptors.
  *
  * @section COMPILE
- * g++ server.c -o server.out -lnsl -pthread -lcrypto
+ * g++ server.c tracker_store.c tracker_wal.c work_queue.c timer_wheel.c server_stats.c -o server.out -lnsl -pthread -lcrypto
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include <sys/socket.h>  
-#include <netinet/in.h>  
-#include <netdb.h>      
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netdb.h>
 #include <pthread.h>
 #include <signal.h>
 #include <string.h>
 #include <time.h>
-#include <dirent.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include "server_constants.ini"
 #include "compute_md5.h"
+#include "tracker_store.h"
+#include "tracker_proto.h"
+#include "work_queue.h"
+#include "server_stats.h"
+
+/**
+ * One event loop, with its own listening socket. Every shard's socket is bound to \a server_port with \b SO_REUSEPORT, so the kernel
+ * spreads incoming connections across them, and a connection is serviced through the epoll instance of the shard that accepted it.
+ */
+struct shard
+{
+	int m_sock; ///< Listening socket. Server listens for connections on it.
+	int m_epoll_fd; ///< The epoll instance waited on by the shard's event loop. Holds \a m_sock, \a wake_fd, and the shard's peer sockets.
+	pthread_t m_thread; ///< Thread running the event loop. Shard 0 runs on the main thread.
+	struct peer *m_closed_peers; ///< Watching peers that have been closed, freed by the event loop before it next waits (see freeClosedPeers()).
+	pthread_mutex_t m_closed_lock; ///< Protects \a m_closed_peers.
+};
 
 /**
- * Socket variable for hosting the server. Server listens for connections.
+ * The shards, one per event loop.
+ */
+struct shard *shards;
+/**
+ * Number of shards in \a shards.
  */
-int sock;
+int num_shards;
 /**
  * Port that the server will be running on.
  */
@@ -49,83 +100,649 @@ int max_client;
  * The size of data (in bytes) that will be read from clients/sent to clients.
  */
 int chunk_size;
+/**
+ * Number of worker threads servicing peers.
+ */
+int worker_threads;
+/**
+ * Number of event loops, each with its own listening socket (see \a shard).
+ */
+int event_loops;
+/**
+ * Seconds between writes of the STATS report to \a STATS_FILE, or 0 for none.
+ */
+int stats_interval;
+/**
+ * When the server started, in seconds since the epoch.
+ */
+time_t server_started;
+/**
+ * Seconds after its latest announcement that a peer is dropped from the trackers.
+ */
+long peer_ttl;
 
 int CLOSE_PROGRAM;
 
+/**
+ * Event descriptor written to by signalhandler() to wake the event loops so that they can exit. Every shard's epoll instance holds it.
+ */
+int wake_fd;
+
+/**
+ * Where a connection currently is in its request/response cycle.
+ */
+enum peer_state
+{
+	PEER_READING,		///< Reading and processing commands from the peer.
+	PEER_CLOSING		///< No more commands will be processed. The connection is closed once the responses have been sent.
+};
+
+/**
+ * A growable byte buffer.
+ */
+struct buffer
+{
+	char *m_data; ///< The bytes in the buffer.
+	size_t m_len; ///< Number of bytes stored in \a m_data.
+	size_t m_cap; ///< Allocated size of \a m_data.
+};
+
+/**
+ * The encodings a LIST response is cached in.
+ */
+enum list_format
+{
+	LIST_TEXT,			///< \<REP LIST n\> ... \<REP LIST END\>
+	LIST_BINARY,		///< A single \a PROTO_LIST response frame.
+	LIST_FORMATS		///< Number of formats.
+};
+
+/**
+ * A complete LIST response, from \<REP LIST n\> to \<REP LIST END\>, shared by every peer it is queued for.
+ * The newest one is kept in \a list_cache, and reused for as long as storeVersion() does not change.
+ */
+struct list_response
+{
+	char *m_data; ///< The response bytes. Never changed once built.
+	size_t m_len; ///< Number of bytes in \a m_data.
+	unsigned long m_version; ///< storeVersion() before the response was built.
+	int m_refs; ///< Number of references: one from \a list_cache, and one per queued segment. Protected by \a list_cache_lock.
+};
+
+/**
+ * One piece of a peer's queued response: either bytes in the peer's own \a m_out buffer, a shared LIST response, or a tracker file
+ * sent straight from disk.
+ */
+struct out_segment
+{
+	struct list_response *m_shared; ///< The shared response being sent, or NULL.
+	int m_fd; ///< The tracker file being sent, or -1. Closed once it has been sent.
+	size_t m_offset; ///< Offset of the bytes in \a m_out, or in the file. Unused for a shared response.
+	size_t m_len; ///< Number of bytes in the segment.
+};
+
+/**
+ * A queued response acknowledging a change, which is only sent once the change is durable. If it turns out that the change could not
+ * be logged, its status is changed to "fail" in place before it is sent.
+ */
+struct pending_ack
+{
+	unsigned long m_lsn; ///< LSN of the change.
+	size_t m_status_offset; ///< Offset in \a m_out of the response's status: the word "succ", or the status byte of a binary frame.
+	int m_binary; ///< 1 if the response is a binary frame.
+	int m_command; ///< The command, as counted by statsCommand().
+	unsigned long long m_started; ///< monotonicNs() when the command started, so that its latency includes the wait for the sync.
+};
+
+/**
+ * The contents of a tracker file about to be sent in a GET response: either the file on disk, or a copy built by the store.
+ */
+struct get_contents
+{
+	int m_fd; ///< The tracker file, open for reading, or -1 if \a m_data holds a copy.
+	char *m_data; ///< Copy of the tracker file, or NULL.
+	size_t m_len; ///< Number of bytes to send.
+	char m_md5[33]; ///< MD5 of those bytes.
+};
+
 /**
  * Represents a peer (client) application.
- * Each peer is handled with its own thread.
- * Each peer has it's own: socket, index (in the clients array), buffer (for temporarily storing data), a file pointer, and a thread variable.
+ * Peers are created when a connection is accepted and freed when it is closed. A peer is only ever serviced by one worker thread at a
+ * time, since its socket is registered with \b EPOLLONESHOT and re-armed once the thread is done with it. A watching peer can also be
+ * re-armed by notifyWatchers(), so it is only serviced by the thread that claims it (see claimPeer()).
+ * Each peer has it's own: socket, state, and buffers for the command being read and the response being written.
  */
 struct peer
 {
-	int m_peer_socket; ///< Communication socket for this peer. If value = \b -1, this peer is currently not being used.
-	int m_index; ///< Location of peer in the \a clients array.
-	char m_buf[CHUNK_SIZE];  ///< Character array used to copy data into/out of \a m_peer_socket
-	FILE *m_file; ///< File pointer used to open tracker files.
-	pthread_t m_thread; ///< Thread where commands from peer will be processed.
+	int m_peer_socket; ///< Non-blocking communication socket for this peer.
+	struct shard *m_shard; ///< The shard that accepted the peer, whose epoll instance it is registered with.
+	enum peer_state m_state; ///< Current state of the connection.
+	int m_keepalive; ///< 1 once the peer has switched to keep-alive mode with \<KEEPALIVE\> (or \<BINARY\>).
+	int m_binary; ///< 1 once the peer has switched to binary frames with \<BINARY\>.
+	int m_eof; ///< 1 once the peer has shut down its side of the connection.
+	char m_buf[CHUNK_SIZE];  ///< Scratch buffer used when building paths and response lines.
+	char *m_cmd; ///< The command (or binary frame) being processed. It is not copied out: it points into \a m_in, and a text command is NUL terminated in place of its closing '>'.
+	size_t m_cmd_len; ///< Number of bytes in \a m_cmd.
+	char *m_fields[COMMAND_FIELDS]; ///< The words of the text command, split in place in \a m_cmd.
+	int m_num_fields; ///< Number of words in the text command. Only the first COMMAND_FIELDS are stored in \a m_fields.
+	char m_in[CHUNK_SIZE]; ///< Bytes read from \a m_peer_socket. Always NUL terminated.
+	size_t m_in_start; ///< Offset in \a m_in of the first byte that has not been processed yet.
+	size_t m_in_scanned; ///< Offset in \a m_in up to which no '>' was found, so that a command that arrives in pieces is only scanned once.
+	size_t m_in_len; ///< Number of bytes stored in \a m_in, including those already processed.
+	struct buffer m_out; ///< Response bytes built for this peer, referenced by \a m_segments.
+	struct out_segment m_segments[OUTPUT_SEGMENTS]; ///< The queued response, in the order it is sent.
+	int m_num_segments; ///< Number of segments in \a m_segments.
+	int m_first_segment; ///< Index of the first segment that has not been completely written.
+	size_t m_segment_sent; ///< Number of bytes of the first unwritten segment already written.
+	size_t m_out_queued; ///< Number of bytes queued in \a m_segments.
+	size_t m_out_sent; ///< Number of queued bytes already written.
+	unsigned long m_commit_lsn; ///< LSN of the change made by the command being processed, 0 if it made none.
+	struct buffer m_acks; ///< The \a pending_ack of every queued response that acknowledges a change which may not be durable yet.
+	int m_status; ///< Outcome of the command being processed, as a \a proto_status, for the statistics.
+	int m_watching; ///< 1 once the peer has watched a tracker with \<WATCH\>. From then on notifyWatchers() can wake it too, so the fields below decide which thread services it.
+	struct watch *m_watches; ///< The trackers the peer watches. Only changed by the thread servicing the peer, under \a watch_lock.
+	pthread_mutex_t m_lock; ///< Protects \a m_events, \a m_overflow, \a m_running and \a m_woken of a watching peer.
+	struct buffer m_events; ///< Events pushed by notifyWatchers() that have not been queued for sending yet.
+	int m_overflow; ///< 1 once an event was dropped because \a m_events held WATCH_BACKLOG_LIMIT bytes. The peer is then closed.
+	int m_running; ///< 1 while a thread is servicing the watching peer. Its events are dropped by the event loop meanwhile, since the thread re-arms the socket when it is done. Stays 1 once the peer is closed.
+	int m_woken; ///< 1 once notifyWatchers() has re-armed the socket to get the peer serviced, until a thread starts servicing it.
+	struct peer *m_next_closed; ///< Next peer in its shard's \a m_closed_peers.
+	struct peer *m_next_backlog; ///< Next peer in \a backlog_head.
+};
+
+/**
+ * A peer's watch on one tracker, made with \<WATCH filename\>. Every watch is in two lists: its bucket of \a watches, and its peer's
+ * \a m_watches.
+ */
+struct watch
+{
+	char *m_filename; ///< Name of the watched tracker.
+	struct peer *m_peer; ///< The watching peer.
+	int m_binary; ///< 1 if events are sent to the peer as binary frames.
+	struct watch *m_next; ///< Next watch in the same bucket.
+	struct watch *m_next_of_peer; ///< Next watch of the same peer.
+};
+
+/**
+ * Every watch, hashed by filename into WATCH_BUCKETS buckets.
+ */
+struct watch *watches[WATCH_BUCKETS];
+/**
+ * Protects \a watches and every peer's \a m_watches. notifyWatchers() read locks it; a peer write locks it to watch or stop watching.
+ */
+pthread_rwlock_t watch_lock = PTHREAD_RWLOCK_INITIALIZER;
+/**
+ * Number of watches, so that a change nobody watches costs a single load. Changed under \a watch_lock, read without it.
+ */
+int num_watches;
+
+/**
+ * State passed to listEntry() while building a LIST response.
+ */
+struct list_context
+{
+	enum list_format m_format; ///< The encoding being built.
+	struct buffer m_entries; ///< The LIST lines (or binary entries) built so far.
+	int m_num_files; ///< Number of trackers visited so far.
+	const char *m_last; ///< Filename of the last tracker visited, or NULL if none has been.
 };
 
 /**
- * Array of clients.
- * \a MAX_CLIENT is the maximum number of clients that server can serve at a single time, and the maximum number of threads that can be executed at once.
+ * The most recently built LIST response in each format, or NULL if none has been built yet.
+ */
+struct list_response *list_cache[LIST_FORMATS] = {NULL, NULL};
+/**
+ * Protects \a list_cache and the reference counts of every \a list_response.
+ */
+pthread_mutex_t list_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Worker threads. Each thread takes ready peers off the work queue and services them.
  */
-struct peer clients[MAX_CLIENT];
+pthread_t *worker_pool;
 
 /**
- * Mutex used to prevent a file from being operated on by multiple threads at the same time.
- * Prevents the possibility of race-condition and dead-lock.
- * Since we will only be using one mutex on the server, we can initialize the mutex statically.
+ * Ready peers that did not fit in the work queue, oldest first, linked through \a m_next_backlog. They stay disarmed until there is room
+ * for them in the queue (see requeueBacklog()), so that an event loop never services a peer itself.
+ */
+struct peer *backlog_head;
+/**
+ * Last peer in \a backlog_head.
+ */
+struct peer *backlog_tail;
+/**
+ * Protects \a backlog_head and \a backlog_tail.
  */
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t backlog_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * When a client connects to the server, it's thread of execution is handled by this function.
- * A command (createtracker, updatetracker, LIST, GET) will be read from the client's socket, and processed.
- * @param index Index in the \a clients array where the new client is stored.
+ * Creates a shard's listening socket and epoll instance. Exits the server if either cannot be set up.
+ * @param shard The shard to open.
+ * @param server_addr Address to listen on.
+ */
+void openShard(struct shard *shard, struct sockaddr_in *server_addr);
+/**
+ * Runs a shard's event loop on the calling thread. Waits for events on its \a m_epoll_fd, accepts new peers, and queues ready peers for
+ * the worker threads, until signalhandler() wakes it up to exit.
+ * @param arg The shard.
+ */
+void *event_loop(void * arg);
+/**
+ * Body of each worker thread. Drives the peers taken off the work queue through their state machine, until the queue is closed.
+ * @param arg Unused.
+ */
+void *worker_loop(void * arg);
+/**
+ * Hands a ready peer to the worker threads. If the work queue is full, the peer waits in the backlog instead.
+ * @param client The peer that is ready.
+ */
+void queuePeer(struct peer *client);
+/**
+ * Moves as many peers from the backlog to the work queue as fit, oldest first. Called by the event loops when they add to the backlog,
+ * and by the workers each time they free a slot.
+ */
+void requeueBacklog();
+/**
+ * Accepts every pending connection on a shard's listening socket, makes it non-blocking, and registers it with the shard's epoll instance.
+ * @param shard The shard whose socket is ready.
+ */
+void acceptClients(struct shard *shard);
+/**
+ * Services a peer that its shard's epoll instance reported as ready. Reads commands, processes them, and writes the responses for as long
+ * as the socket allows, and then either re-arms the peer or closes it.
+ * @param client The peer that is ready.
+ */
+void servicePeer(struct peer *client);
+/**
+ * Decides whether a ready watching peer is serviced. A peer being serviced by another thread is left to it.
+ * @param client The watching peer.
+ * @return 1 if the caller should service the peer, 0 if not.
+ */
+int claimPeer(struct peer *client);
+/**
+ * Queues the events pushed to a watching peer behind its responses. A peer that fell too far behind is told so, and closed.
+ * @param client The watching peer.
+ */
+void takeEvents(struct peer *client);
+/**
+ * Waits until the changes acknowledged by the queued responses are durable, and turns the acknowledgement of any change that could not
+ * be logged into a failure.
+ * @param client The peer.
+ */
+void commitChanges(struct peer *client);
+/**
+ * Waits until the change acknowledged by one queued response is durable, turns the acknowledgement into a failure if the change could
+ * not be logged, and counts the command in the statistics.
+ * @param client The peer.
+ * @param ack The acknowledgement.
+ */
+void settleAck(struct peer *client, const struct pending_ack *ack);
+/**
+ * Frees the watching peers that were closed since the shard's event loop last waited, when none of their events can be left in hand.
+ * @param shard The shard.
+ */
+void freeClosedPeers(struct shard *shard);
+/**
+ * Reads everything that is available on the peer's socket into \a m_in, until the socket would block, \a m_in is full, or the peer has
+ * shut down its side of the connection.
+ * The bytes that have not been processed yet are first moved to the front of \a m_in, once per read rather than once per command.
+ * @param client The peer to read from.
+ * @return 0 on success, -1 if the connection should be closed.
+ */
+int readInput(struct peer *client);
+/**
+ * Points \a m_cmd at the next complete command in \a m_in, and consumes it.
+ * A command is complete once its closing '>' has been read, however many reads it took to arrive. Only the bytes that arrived since the
+ * last call are searched. Outside of keep-alive mode, whatever has been read is also taken as the command once \a m_in is full or the
+ * peer has shut down its side of the connection, as a single read of CHUNK_SIZE bytes would have.
+ * @param client The peer to take the command from.
+ * @return 1 if \a m_cmd points at a command, 0 if more data is needed, -1 if the connection should be closed.
+ */
+int nextCommand(struct peer *client);
+/**
+ * Returns whether a complete command (or binary frame) is waiting in \a m_in.
+ * @param client The peer.
+ */
+int commandWaiting(struct peer *client);
+/**
+ * Splits the text command in \a m_cmd into words, in place, and points \a m_fields at them.
+ * The surrounding '<' is skipped, and the whitespace between words is overwritten with NULs, so no copy of the command is made.
+ * @param client The peer whose command should be split.
+ */
+void splitCommand(struct peer *client);
+/**
+ * Writes the peer's queued response until it has all been sent or the socket would block.
+ * Consecutive in-memory segments are handed to the kernel in a single vectored write, and tracker files are sent with sendfile(), so
+ * their contents never pass through user space.
+ * @param client The peer to write to.
+ * @return 1 if everything has been sent, 0 if the socket would block, -1 if the connection should be closed.
+ */
+int writeResponse(struct peer *client);
+/**
+ * Compares the first words of the command in \a m_cmd to each of the commands, and serves the peer.
+ * The response is queued in \a m_out.
+ * @param client The peer whose command should be processed.
+ */
+void processCommand(struct peer *client);
+/**
+ * Sends the peer the \<REP STATS\> report.
+ * @param client The peer that sent \<REQ STATS\>.
+ */
+void reportStats(struct peer *client);
+/**
+ * Builds the lines of the STATS report: uptime, connections, traffic, the work queue, and for each kind of command the number processed
+ * by outcome and percentiles of the time taken to process them.
+ * @param lines Buffer the lines are appended to.
+ * @return Number of lines appended.
+ */
+int buildStatsReport(struct buffer *lines);
+/**
+ * Writes the STATS report to \a STATS_FILE, replacing it in one step.
+ */
+void dumpStats();
+/**
+ * Current time on the monotonic clock, in nanoseconds.
+ */
+unsigned long long monotonicNs();
+/**
+ * Processes the binary frame stored in \a m_cmd.
+ * @param client The peer that sent the frame.
+ */
+void processFrame(struct peer *client);
+/**
+ * Processes a \a PROTO_CREATE frame.
+ * @param client The peer that sent the frame.
+ * @param request The frame's payload.
+ */
+void binaryCreate(struct peer *client, struct proto_reader *request);
+/**
+ * Processes a \a PROTO_UPDATE frame.
+ * @param client The peer that sent the frame.
+ * @param request The frame's payload.
+ */
+void binaryUpdate(struct peer *client, struct proto_reader *request);
+/**
+ * Processes a \a PROTO_UPDATE_RANGES frame.
+ * @param client The peer that sent the frame.
+ * @param request The frame's payload.
+ */
+void binaryUpdateRanges(struct peer *client, struct proto_reader *request);
+/**
+ * Processes a \a PROTO_LIST frame. An empty frame asks for every tracker; otherwise it asks for a page, as listPage() describes.
+ * @param client The peer that sent the frame.
+ * @param request The frame's payload.
+ */
+void binaryList(struct peer *client, struct proto_reader *request);
+/**
+ * Processes a \a PROTO_STATS frame.
+ * @param client The peer that sent the frame.
+ */
+void binaryStats(struct peer *client);
+/**
+ * Processes a binary WATCH frame.
+ * @param client The peer that sent the frame.
+ * @param request The frame's payload.
+ */
+void binaryWatch(struct peer *client, struct proto_reader *request);
+/**
+ * Processes a \a PROTO_GET or \a PROTO_SELECT frame.
+ * @param client The peer that sent the frame.
+ * @param opcode The frame's opcode.
+ * @param request The frame's payload.
+ */
+void binaryGet(struct peer *client, int opcode, struct proto_reader *request);
+/**
+ * Queues a binary response frame.
+ * @param client The peer the frame will be sent to.
+ * @param opcode The request's opcode.
+ * @param status One of \a proto_status.
+ * @param payload The payload. May be NULL if \a length is 0.
+ * @param length Number of bytes in \a payload.
+ */
+void queueFrame(struct peer *client, int opcode, int status, const void *payload, size_t length);
+/**
+ * Returns whether a string received in a binary frame could also have been sent as a word of a text command, which is what the
+ * tracker store (and its log) expects: not empty, and no spaces, control characters, '<' or '>'.
+ * @param text The string.
+ */
+int validWord(const char *text);
+/**
+ * Parses a word of a text command as a decimal number. Unlike atol(), the whole word has to be a number.
+ * @param word The word.
+ * @param value Set to the number.
+ * @return 0 on success, -1 if the word is not a number.
+ */
+int parseNumber(const char *word, long *value);
+/**
+ * Parses a word of a text command as a list of byte ranges, "start:end,start:end,...".
+ * @param word The word.
+ * @param ranges Set to the ranges.
+ * @param size Number of entries in \a ranges.
+ * @return The number of ranges, or -1 if the word is not a list of at most \a size ranges.
+ */
+int parseRanges(const char *word, struct tracker_range *ranges, int size);
+/**
+ * Processes a createtracker command.
+ * @param client The peer that sent the command.
+ */
+void createTracker(struct peer *client);
+/**
+ * Processes an updatetracker command.
+ * @param client The peer that sent the command.
+ */
+void updateTracker(struct peer *client);
+/**
+ * Processes an updatetracker command that announces several byte ranges at once.
+ * @param client The peer that sent the command.
+ */
+void updateRanges(struct peer *client);
+/**
+ * Processes a REQ LIST command, which lists every tracker, or a page of them.
+ * @param client The peer that sent the command.
+ */
+void listTrackers(struct peer *client);
+/**
+ * Processes a WATCH command. The connection stays open, and the changes to the tracker are pushed over it.
+ * @param client The peer that sent the command.
+ */
+void watchTracker(struct peer *client);
+/**
+ * Makes a peer watch a tracker, which need not exist yet. Watching the same tracker twice changes nothing.
+ * @param client The peer, being serviced by the calling thread.
+ * @param filename Name of the tracker.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int addWatch(struct peer *client, const char *filename);
+/**
+ * Removes every watch of a peer, after which notifyWatchers() never reaches it.
+ * @param client The peer.
+ */
+void dropWatches(struct peer *client);
+/**
+ * Returns the bucket of \a watches for a filename.
+ * @param filename The filename.
+ */
+unsigned long watchBucket(const char *filename);
+/**
+ * Pushes the creation of a tracker to the peers watching it.
+ * @param filename Name of the tracker.
+ * @param filesize The file size, as the client sent it.
+ * @param description The description.
+ * @param md5 MD5 of the file.
+ */
+void notifyCreate(const char *filename, const char *filesize, const char *description, const char *md5);
+/**
+ * Pushes the byte ranges a peer announced to the peers watching the tracker.
+ * @param filename Name of the tracker.
+ * @param ip IP address of the announcing peer.
+ * @param port Port of the announcing peer.
+ * @param ranges The ranges, as recorded.
+ * @param count Number of \a ranges.
+ */
+void notifyUpdate(const char *filename, const char *ip, int port, const struct tracker_range *ranges, int count);
+/**
+ * Appends an event to the mailbox of every peer watching the tracker, and wakes those that are not being serviced. A peer that is, takes
+ * its events before it next writes.
+ * The event is pushed as soon as the change is applied. It may reach a watcher before the change is durable, or acknowledged to the peer
+ * that made it.
+ * @param filename Name of the tracker.
+ * @param text The \<EVENT ...\> line, for text peers.
+ * @param frame The \a PROTO_EVENT frame, for binary peers.
+ * @param frame_len Number of bytes in \a frame.
+ */
+void notifyWatchers(const char *filename, const struct buffer *text, const unsigned char *frame, size_t frame_len);
+/**
+ * Builds one page of a LIST response: the trackers whose filename starts with \a prefix and whose filename or description contains
+ * \a substring, in filename order, starting after \a cursor.
+ * A text page is \<REP LIST n\>, the entries, and \<REP LIST END cursor\>, where the cursor is the filename to pass back for the next
+ * page; the last page ends with a plain \<REP LIST END\>. A binary page is the \a PROTO_LIST payload followed by the cursor, which is
+ * empty on the last page.
+ * @param prefix The filename prefix. Empty for every tracker.
+ * @param substring The substring to look for. May be NULL.
+ * @param cursor The last filename of the previous page. May be NULL.
+ * @param limit The most trackers to list. At most LIST_PAGE_MAX are.
+ * @param format The encoding wanted.
+ * @param page Set to the page. The caller should free() its \a m_data.
+ */
+void listPage(const char *prefix, const char *substring, const char *cursor, long limit, enum list_format format, struct buffer *page);
+/**
+ * Returns the LIST response for the current version of the store, building it and replacing \a list_cache if the cached one is out of date.
+ * @param format The encoding wanted.
+ * @return A reference to the response, to be given to queueShared() or releaseListResponse(), or NULL if memory could not be allocated.
+ */
+struct list_response *currentListResponse(enum list_format format);
+/**
+ * Drops a reference to a LIST response, and frees it once nothing refers to it.
+ * @param response The response. May be NULL.
+ */
+void releaseListResponse(struct list_response *response);
+/**
+ * Called by storeForEach() for each tracker. Adds the tracker's LIST line to the response being built.
+ * @param t The tracker.
+ * @param arg The \a list_context being built.
+ */
+void listEntry(const struct tracker *t, void *arg);
+/**
+ * Processes a GET command.
+ * @param client The peer that sent the command.
+ */
+void getTracker(struct peer *client);
+/**
+ * Looks up the tracker file a GET asks for. The file is sent straight from disk when the store's copy on disk is up to date and the peer
+ * has segments to spare for it, and is otherwise copied out of the store.
+ * @param client The peer the file will be sent to.
+ * @param tracker_filename The tracker file name (filename.track).
+ * @param contents Set to the tracker file, to be given to queueContents().
+ * @return 0, or -1 if there is no such tracker.
+ */
+int openContents(struct peer *client, const char *tracker_filename, struct get_contents *contents);
+/**
+ * Builds the part of a tracker file that covers a byte range, for a GET that asks for one.
+ * @param tracker_filename The tracker file name (filename.track).
+ * @param start_byte Starting byte of the range.
+ * @param end_byte Ending byte of the range.
+ * @param max_peers Most peers to include, or 0 for no limit.
+ * @param contents Set to the selected part of the tracker file, to be given to queueContents().
+ * @return 0, or -1 if there is no such tracker.
+ */
+int selectContents(const char *tracker_filename, long start_byte, long end_byte, int max_peers, struct get_contents *contents);
+/**
+ * Queues the tracker file found by openContents() or selectContents(), and releases \a contents.
+ * @param client The peer the file will be sent to.
+ * @param contents The tracker file.
+ */
+void queueContents(struct peer *client, struct get_contents *contents);
+/**
+ * Appends data to a buffer, growing it if necessary.
+ * @param buffer The buffer to append to.
+ * @param data The bytes to append.
+ * @param length Number of bytes in \a data.
+ */
+void appendBuffer(struct buffer *buffer, const char *data, size_t length);
+/**
+ * Appends data to the peer's response buffer.
+ * @param client The peer the data will be sent to.
+ * @param data The bytes to send.
+ * @param length Number of bytes in \a data.
+ */
+void queueResponse(struct peer *client, const char *data, size_t length);
+/**
+ * Appends a NUL terminated string to the peer's response buffer.
+ * @param client The peer the string will be sent to.
+ * @param data The string to send.
+ */
+void queueString(struct peer *client, const char *data);
+/**
+ * Queues a shared LIST response without copying it. If the peer has no free segments left, the response is copied instead.
+ * @param client The peer the response will be sent to.
+ * @param response The response. The caller's reference is handed over to the peer.
+ */
+void queueShared(struct peer *client, struct list_response *response);
+/**
+ * Drops whatever a sent (or abandoned) segment holds: its reference to a shared response, or its file descriptor.
+ * @param segment The segment.
+ */
+void releaseSegment(struct out_segment *segment);
+/**
+ * Returns the number of queued response bytes that have not been written yet.
+ * @param client The peer.
+ */
+size_t pendingOutput(struct peer *client);
+/**
+ * Allocates and initializes a peer for a newly accepted socket.
+ * @param peer_socket The accepted, non-blocking socket.
+ * @param shard The shard that accepted it.
+ * @return The new peer, or NULL if memory could not be allocated.
+ */
+struct peer *createPeer(int peer_socket, struct shard *shard);
+/**
+ * Closes the peer's socket, and frees the peer. A watching peer is freed later, by its event loop (see freeClosedPeers()).
+ * @param client The peer to close, being serviced by the calling thread.
  */
-void *client_handler(void * index);
+void closePeer(struct peer *client);
 /**
- * Initializes each peer in the \a clients array.
- * 
- * Each \a m_index is set to \b i, the index of the array (0 - \a MAX_CLIENT).
- * Each \a m_peer_socket is set to \b -1 to indicate that this peer is currently not being used.
+ * Frees a closed peer's memory.
+ * @param client The peer.
  */
-void setUpClientArray();
+void freePeer(struct peer *client);
 /**
- * Returns an index indicating where a new client can be stored in the \a clients array. Checks each element of the array sequentially until an unused slot is located.
- * @return Index (0 - \a MAX_CLIENT -1) of the \a clients array where new client will be stored, -1 if array is full (server is currently serving the maximum amount of clients).
+ * Puts a descriptor into non-blocking mode.
+ * @param fd The descriptor.
+ * @return 0 on success, -1 on failure.
  */
-int findClientArrayOpening();
+int setNonBlocking(int fd);
 /**
- * Reads in \a server_port, \a max_client, and \a chunk_size (in that order) from a config file.
- * If the config file cannot be opened, or is not found, these variables are given default values: 3456, 10, and 1024 respectfully.
+ * Reads in \a server_port, \a max_client, \a chunk_size, \a worker_threads, \a peer_ttl, \a event_loops, and \a stats_interval (in that
+ * order) from a config file.
+ * If the config file cannot be opened, or is not found, these variables are given default values: 3456, 10, 1024, \a WORKERS_PER_CPU
+ * workers per CPU, and \a PEER_TTL_S respectfully. A missing or zero worker count also means \a WORKERS_PER_CPU workers per CPU, and a
+ * missing or zero peer TTL means \a PEER_TTL_S. A negative peer TTL keeps peers forever. A missing or zero number of event loops means one, and a missing or zero
+ * stats interval means the report is never written to \a STATS_FILE.
  */
 void readConfig();
 /**
- * Captures POSIX signals, in this case CNTRL-C, and initiates the graceful shutdown of the server. Closes \a sock.
+ * Captures POSIX signals, in this case CNTRL-C, and initiates the graceful shutdown of the server. Closes every shard's listening socket.
  */
 void signalhandler(int sig);
 
 
 /**
- * When server.out is executed, the server will listen for peers on a stream socket.
- * When a peer connects, if the server is not already at capacity (\a MAX_CLIENT), a thread will be spun off to handle the peer.
- * Multiple peers can be handled at once.
+ * When server.out is executed, the server will listen for peers on a non-blocking stream socket.
+ * Peers are accepted by the event loop, and are then serviced by the worker threads as data arrives. Multiple peers can be handled at once, without a thread per peer.
  * The server will then read a command from that peer's socket, and process that command.
- * Once that single command has been processed, the server disconnect from the peer.
+ * Once that single command has been processed, the server disconnect from the peer, unless the peer asked for keep-alive mode.
  */
 int main(int argc, const char* argv[])
 {
-	/** 
+	/**
 	 * First checks to see if the server port number was passed in as a parameter.
 	 * Over rides default server port with the value passed.
 	 * If no parameters were passed, readConfig() is called, and a default values are assigned.
 	 */
-	switch(argc) 
+	switch(argc)
 	{
 		case 2:
-		{	
+		{
 			readConfig();
 			server_port = atoi(argv[1]);
 			break;
@@ -137,504 +754,2087 @@ int main(int argc, const char* argv[])
 		}
 	}
 	printf("server_port = %d\n", server_port );
-	
+	server_started = time(NULL);
+
 	struct sockaddr_in server_addr = {AF_INET, htons( server_port )};
-	struct sockaddr *client_addr = NULL;
-	socklen_t *length = NULL;
-	
-	/**
-	 * Create a stream socket. Server will listen on this socket for peers.
-	 */
-	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+
+	/** Create the event descriptor used to wake the event loops on shutdown. */
+	if ((wake_fd = eventfd(0, EFD_NONBLOCK)) == -1)
 	{
-		perror("Server Error: Socket Failed");
+		perror("Server Error: Eventfd failed");
 		exit(1);
 	}
-	
-	/* Variable needed for setsokopt call */
-	int setsock = 1;
-	if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &setsock, sizeof(setsock)) == -1)
+
+	/** Open every shard. Their sockets share the port, and the kernel balances connections across them. */
+	if ((shards = (struct shard *) calloc(event_loops, sizeof(struct shard))) == NULL)
 	{
-		perror("Server Error: Setsockopt failed");
+		perror("Server Error: Out of memory");
 		exit(1);
 	}
-	
-	/** Bind the socket to an internet port. */
-	if (bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1 )
+	for (num_shards = 0; num_shards < event_loops; num_shards++)
 	{
-		perror("Server Error: Bind Failed");
-		exit(1);
+		openShard(&shards[num_shards], &server_addr);
 	}
-	
-	/** Listen for clients. \a MAX_CLIENT = length of queue for pending connections.  */
-	if (listen(sock, MAX_CLIENT) == -1)
+
+	/** Load the tracker files into memory. */
+	if (storeInit("Tracker Files", (peer_ttl > 0) ? peer_ttl : 0) != STORE_OK)
 	{
-		perror("Server Error: Listen failed");
+		printf("Error Starting Tracker Store\n");
 		exit(1);
 	}
-	
-	/** The server will infinitely loop, accepting connections, until this value is set to 1. Set by the signalhandler(). */
+
+	/** The server will loop, servicing connections, until this value is set to 1. Set by the signalhandler(). */
 	CLOSE_PROGRAM = 0;
 	/** Initialize the signalhandler to catch CNTRL-C. */
 	signal(SIGINT, signalhandler);
-	
-	/** Initialize the client array so each element is marked as unused. */
-	setUpClientArray();
-	
-	/** While running, the server will allow up to a predefined number of peers connect at once. 
-	 * When a peer tries to connect, if the server is not at capacity, the peer will be placed in the \a clients array, and a thread will be spun off
-	 * to process that peer. If the server is already at full capacity, the peer will have to wait for an opening.
-	 */
-	while (CLOSE_PROGRAM == 0)
+	/** A peer that disconnects early must not kill the server when we write to it. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/** Spin off the worker threads. They are created once, and serve every peer from then on. */
+	if (workQueueInit(WORK_QUEUE_SIZE) == -1 || (worker_pool = (pthread_t *) malloc(worker_threads * sizeof(pthread_t))) == NULL)
+	{
+		printf("Error Creating Work Queue\n");
+		exit(1);
+	}
+	int i;
+	for (i = 0; i < worker_threads; i++)
 	{
-		int client_array_index;
-		/* The server searches for an opening in the client array. If the array is full, -1 is returned */
-		if ((client_array_index = findClientArrayOpening()) != -1)
+		if (pthread_create(&worker_pool[i], NULL, &worker_loop, NULL) != 0)
 		{
-			/* Accept the client, and store it's socket ID in the clients array. */
-			if ((clients[client_array_index].m_peer_socket = accept(sock, client_addr, length)) == -1)
-			{
-				if (CLOSE_PROGRAM != 1)
-				{
-					perror("Server Error: Accepting issue"); 
-					exit(1);
-				}
-			}
-			else
-			{
-				printf("A client has connected.\n");
-				/* Spin off a thread to process the peer. The peer's index in the clients array is passed as a 
-				 * parameter to indicate which peer is being processed. */
-				if (pthread_create(&(clients[client_array_index].m_thread), NULL, &client_handler, &(clients[client_array_index].m_index)) != 0)
-				{
-					printf("Error Creating Thread\n");
-					exit(1);
-				}
-			}
+			printf("Error Creating Thread\n");
+			exit(1);
+		}
+	}
+
+	/** This thread runs the first shard's event loop until the server is shut down, and a thread is spun off for each of the others. */
+	for (i = 1; i < num_shards; i++)
+	{
+		if (pthread_create(&shards[i].m_thread, NULL, &event_loop, &shards[i]) != 0)
+		{
+			printf("Error Creating Thread\n");
+			exit(1);
 		}
 	}
-	
-	
-	 int i;
-	 for (i = 0; i < MAX_CLIENT; i++)
-	 {
-		pthread_join(clients[i].m_thread, NULL);
-	 }
-	 
+	event_loop(&shards[0]);
+	for (i = 1; i < num_shards; i++)
+	{
+		pthread_join(shards[i].m_thread, NULL);
+	}
+
+	/** Nothing is queued any more. Let the workers finish what is already queued, and exit. */
+	workQueueClose(worker_threads);
+	for (i = 0; i < worker_threads; i++)
+	{
+		pthread_join(worker_pool[i], NULL);
+	}
+	free(worker_pool);
+
+	struct work_stats stats;
+	workQueueStats(&stats);
+	printf("Work queue: %lu peers queued, %lu held back while the queue was full, max depth %llu, mean wait %llu us, max wait %llu us\n",
+		stats.pushed, stats.rejected, stats.max_depth, (stats.popped > 0) ? stats.total_wait_ns / stats.popped / 1000 : 0,
+		stats.max_wait_ns / 1000);
+	workQueueDestroy();
+
+	for (i = 0; i < num_shards; i++)
+	{
+		freeClosedPeers(&shards[i]);
+		close(shards[i].m_epoll_fd);
+	}
+	free(shards);
+	close(wake_fd);
+
+	/** Make sure every change has reached the disk before exiting. */
+	storeShutdown();
+	releaseListResponse(list_cache[LIST_TEXT]);
+	releaseListResponse(list_cache[LIST_BINARY]);
+
 	return 0;
 }
-	
-void *client_handler(void * index)
+
+void openShard(struct shard *shard, struct sockaddr_in *server_addr)
 {
-	/* Dereference the index passed as a parameter by the pthread_create() function */
-	int client_index = *((int *) index);
-	
-	/* Clear the buffer of any data used by a previous peer in the same index of the clients array. */
-	memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf));
-	
 	/**
-	 * Read data from the peer's socket, store it in m_buf.
-	 * Compare the string stored in m_buf to see if it is any of the four commands.
-	 * And then serve the peer.
+	 * Create a stream socket. Server will listen on this socket for peers.
 	 */
-	if (read(clients[client_index].m_peer_socket , clients[client_index].m_buf, CHUNK_SIZE) > 0)
-	{
-		/** <b>CREATETRACKER Command</b> */
-		if (strncmp(clients[client_index].m_buf, "<createtracker", strlen("<createtracker")) == 0)
-		{
-			/* First check if the client send the correct number of arguments */
-			int num_arg = 0;
-			char countArgs[CHUNK_SIZE];
-			char *numArgCheck;
-			
-			stpcpy(countArgs, clients[client_index].m_buf);
-			/* Each argument/param is seperated with a space. */
-			numArgCheck = strtok(countArgs, " ");
-			while (numArgCheck != NULL)
-			{
-				/* For each string of text separated by a space, or delimited with a new line, 
-				 * increment num_arg */
-				num_arg = num_arg + 1;
-				numArgCheck = strtok(NULL, " \n");
-			}
-			/** If client did not send the correct number of arguments, send a "createtracker fail" protocol message. */
-			if (num_arg != 7)
-			{
-				write(clients[client_index].m_peer_socket, "<createtracker fail>\n", strlen("<createtracker fail>\n"));
+	if ((shard->m_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	{
+		perror("Server Error: Socket Failed");
+		exit(1);
+	}
+
+	/* Variable needed for setsokopt call. Every shard binds the same port, which SO_REUSEPORT allows. */
+	int setsock = 1;
+	if(setsockopt(shard->m_sock, SOL_SOCKET, SO_REUSEADDR, &setsock, sizeof(setsock)) == -1
+		|| setsockopt(shard->m_sock, SOL_SOCKET, SO_REUSEPORT, &setsock, sizeof(setsock)) == -1)
+	{
+		perror("Server Error: Setsockopt failed");
+		exit(1);
+	}
+
+	/** Bind the socket to an internet port. */
+	if (bind(shard->m_sock, (struct sockaddr*)server_addr, sizeof(*server_addr)) == -1 )
+	{
+		perror("Server Error: Bind Failed");
+		exit(1);
+	}
+
+	/** Listen for clients. The queue for pending connections is as long as the system allows, since accepting is no longer bounded by a fixed client array. */
+	if (listen(shard->m_sock, SOMAXCONN) == -1)
+	{
+		perror("Server Error: Listen failed");
+		exit(1);
+	}
+
+	/** The listening socket is non-blocking, so that the event loop can accept until the queue is drained without ever blocking. */
+	if (setNonBlocking(shard->m_sock) == -1)
+	{
+		perror("Server Error: Non-blocking listen socket failed");
+		exit(1);
+	}
+
+	pthread_mutex_init(&shard->m_closed_lock, NULL);
+
+	/** Create the shard's epoll instance. */
+	if ((shard->m_epoll_fd = epoll_create1(0)) == -1)
+	{
+		perror("Server Error: Epoll create failed");
+		exit(1);
+	}
+
+	/** The listening socket is edge-triggered. Its data pointer is NULL, which is how the event loop tells it apart from peers. */
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+	if (epoll_ctl(shard->m_epoll_fd, EPOLL_CTL_ADD, shard->m_sock, &event) == -1)
+	{
+		perror("Server Error: Epoll add failed");
+		exit(1);
+	}
+	/** The wake-up descriptor is level-triggered, so that every shard's event loop sees it however it is woken. */
+	event.events = EPOLLIN;
+	event.data.ptr = &wake_fd;
+	if (epoll_ctl(shard->m_epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1)
+	{
+		perror("Server Error: Epoll add failed");
+		exit(1);
+	}
+}
+
+void *event_loop(void * arg)
+{
+	struct shard *shard = (struct shard *) arg;
+	struct epoll_event events[MAX_EVENTS];
+	unsigned long long next_dump = monotonicNs() + stats_interval * 1000000000ULL;
+
+	while (CLOSE_PROGRAM == 0)
+	{
+		/** Every event returned by the last wait has been handled, so the watching peers closed since can be freed. */
+		freeClosedPeers(shard);
+
+		/** The first shard also writes the STATS report out, waking up in time to do so. */
+		int timeout = -1;
+		if (shard == &shards[0] && stats_interval > 0)
+		{
+			unsigned long long now = monotonicNs();
+			if (now >= next_dump)
+			{
+				dumpStats();
+				next_dump = now + stats_interval * 1000000000ULL;
+			}
+			timeout = (int) ((next_dump - now) / 1000000) + 1;
+		}
+
+		int num_events = epoll_wait(shard->m_epoll_fd, events, MAX_EVENTS, timeout);
+		if (num_events == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror("Server Error: Epoll wait failed");
+			break;
+		}
+
+		int i;
+		for (i = 0; i < num_events; i++)
+		{
+			if (events[i].data.ptr == NULL)
+			{
+				acceptClients(shard);
+			}
+			else if (events[i].data.ptr == &wake_fd)
+			{
+				/* The server is shutting down. */
+				break;
+			}
+			/** A watching peer can also be woken by notifyWatchers(), and is only handed over if nobody is servicing it already. */
+			else if (((struct peer *) events[i].data.ptr)->m_watching == 1 && claimPeer((struct peer *) events[i].data.ptr) == 0)
+			{
+				continue;
 			}
 			else
 			{
-				/** The create tracker command is broken up into 7 words:
-				 * createtracker, filename, filesize, description, md5, ip, and port.
-				 * We are interested in the last 6.
-				 */
-				char *filename, *filesize, *description, *md5, *ip, *port;
-				char tokenize[CHUNK_SIZE];
-				
-				/* We will copy the buffer into a new array, and parse. */
-				stpcpy(tokenize, clients[client_index].m_buf);
-				
-				/* Get the filename */
-				filename = strtok(tokenize, " "); /* Skip over the "createtracker" string. */
-				filename = strtok(NULL, " ");
-				strcpy(filename, filename);
-				
-				/* Get filesize */
-				filesize= strtok(NULL, " ");
-				strcpy(filesize, filesize);
-				
-				/* Get description */
-				description = strtok(NULL, " ");
-				strcpy(description, description);
-				
-				/* Get md5 */
-				md5 = strtok(NULL, " ");
-				strcpy(md5, md5);
-				
-				/* Get IP */
-				ip = strtok(NULL, " ");
-				strcpy(ip, ip);
-				
-				/* Get port */
-				port = strtok(NULL, ">");
-				strcpy(port, port);
-				
-				
-				/* We now need to check to see if this tracker file already exists. */
-				memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf));
-				sprintf(clients[client_index].m_buf, "Tracker Files/%s.track", filename);
-				
-				/* Ensure that only 1 thread is checking the directory at a time */
-				pthread_mutex_lock(&file_mutex);
-				
-				/** If this tracker file already exists, send a "createtracker ferr" protocol message. */
-				if (access(clients[client_index].m_buf, F_OK) == 0)
+				queuePeer((struct peer *) events[i].data.ptr);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void *worker_loop(void * arg)
+{
+	struct peer *client;
+
+	while ((client = (struct peer *) workPop()) != NULL)
+	{
+		servicePeer(client);
+		requeueBacklog();
+	}
+
+	return NULL;
+}
+
+void queuePeer(struct peer *client)
+{
+	if (workPush(client) == 0)
+	{
+		return;
+	}
+
+	/** The workers are far behind. Servicing the peer here could block every other peer of the shard on a log sync, so it waits. */
+	pthread_mutex_lock(&backlog_lock);
+	client->m_next_backlog = NULL;
+	if (backlog_tail != NULL)
+	{
+		backlog_tail->m_next_backlog = client;
+	}
+	else
+	{
+		__atomic_store_n(&backlog_head, client, __ATOMIC_RELEASE);
+	}
+	backlog_tail = client;
+	pthread_mutex_unlock(&backlog_lock);
+
+	/** The workers may have emptied the queue since the push failed, and gone to sleep without seeing the backlog. If nothing fits now,
+	 * the queue is full, and each worker taking a peer from it makes room for the backlog. */
+	requeueBacklog();
+}
+
+void requeueBacklog()
+{
+	/** The backlog is nearly always empty, and is checked without the lock. */
+	if (__atomic_load_n(&backlog_head, __ATOMIC_ACQUIRE) == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&backlog_lock);
+	struct peer *head = backlog_head;
+	while (head != NULL && workPush(head) == 0)
+	{
+		head = head->m_next_backlog;
+	}
+	__atomic_store_n(&backlog_head, head, __ATOMIC_RELEASE);
+	if (head == NULL)
+	{
+		backlog_tail = NULL;
+	}
+	pthread_mutex_unlock(&backlog_lock);
+}
+
+void acceptClients(struct shard *shard)
+{
+	int peer_socket;
+
+	/** Since the listening socket is edge-triggered, keep accepting until there are no connections left in the queue. */
+	while ((peer_socket = accept4(shard->m_sock, NULL, NULL, SOCK_NONBLOCK)) != -1)
+	{
+		struct peer *client;
+		if ((client = createPeer(peer_socket, shard)) == NULL)
+		{
+			close(peer_socket);
+			continue;
+		}
+
+		printf("A client has connected.\n");
+
+		/** Peers are one-shot, so a peer is only ever queued once, and only one worker thread services it at a time. */
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+		event.data.ptr = client;
+		if (epoll_ctl(shard->m_epoll_fd, EPOLL_CTL_ADD, peer_socket, &event) == -1)
+		{
+			perror("Server Error: Epoll add failed");
+			closePeer(client);
+		}
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && CLOSE_PROGRAM != 1)
+	{
+		perror("Server Error: Accepting issue");
+	}
+}
+
+void servicePeer(struct peer *client)
+{
+	int status;
+
+	while (1)
+	{
+		/** <b>Reading</b>: gather whatever the peer has sent, and process every complete command in it. */
+		if (client->m_state == PEER_READING)
+		{
+			if (readInput(client) == -1)
+			{
+				closePeer(client);
+				return;
+			}
+
+			/** Pipelined commands are processed back-to-back, but only while the responses are not piling up faster than they are sent. */
+			while (client->m_state == PEER_READING && pendingOutput(client) < PIPELINE_OUTPUT_LIMIT)
+			{
+				if ((status = nextCommand(client)) == -1)
 				{
-					write(clients[client_index].m_peer_socket, "<createtracker ferr>\n", strlen("<createtracker ferr>\n"));
+					closePeer(client);
+					return;
 				}
-				/** Otherwise, since this tracker file does not exist, create the tracker file. 
-				 * Start by creating an empty file.
-				 */
-				else if((clients[client_index].m_file = fopen(clients[client_index].m_buf, "w")) != NULL)
+				if (status == 0)
 				{
-					memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf));
-					
-					/* Copy the tracker file contents into the buffer. */
-					
-					//sprintf(clients[client_index].m_buf, "Filename: %s\nFilesize: %s\nDescription: %s\nMD5: %s\n%s:%s:0:%s:%d", filename, filesize, description, md5, ip, port, filesize,  (unsigned)time(NULL));
-					sprintf(clients[client_index].m_buf, "Filename: %s\nFilesize: %s\nDescription: %s\nMD5: %s", filename, filesize, description, md5);
-					
-					/* Write the buffer contents to the new tracker file. */
-					fwrite(clients[client_index].m_buf, sizeof(char), strlen(clients[client_index].m_buf), clients[client_index].m_file);
-					/** Let the client know that the creation was successful with a "createtracker succ" protocol message. */
-					write(clients[client_index].m_peer_socket, "<createtracker succ>\n", strlen("<createtracker succ>\n"));
-					
-					/* Close the tracker file. */
-					fclose(clients[client_index].m_file);
+					break;
 				}
-				/** If there was a problem creating the file, send the user a "createtracker fail" protocol message. */
-				else
+
+				processCommand(client);
+
+				/** Outside of keep-alive mode, a connection only ever serves a single command. */
+				if (client->m_keepalive == 0)
 				{
-					perror("can't write file");
-					write(clients[client_index].m_peer_socket, "<createtracker fail>\n", strlen("<createtracker fail>\n"));
+					client->m_state = PEER_CLOSING;
 				}
-				/* Unlock the mutex. */
-				pthread_mutex_unlock(&file_mutex);
 			}
+
+			/** Once the peer has shut down its side and every command it sent has been processed, there is nothing more to do. */
+			if (client->m_state == PEER_READING && client->m_eof == 1 && commandWaiting(client) == 0)
+			{
+				client->m_state = PEER_CLOSING;
+			}
+		}
+
+		/** Changes are only acknowledged once they are durable. */
+		if (client->m_acks.m_len > 0)
+		{
+			commitChanges(client);
+		}
+
+		/** Events pushed to a watching peer are sent between its responses. */
+		if (client->m_watching == 1)
+		{
+			takeEvents(client);
+		}
+
+		/** <b>Writing</b>: send as much of the responses as the socket will take. */
+		if ((status = writeResponse(client)) == -1)
+		{
+			closePeer(client);
+			return;
+		}
+		if (status == 0)
+		{
+			break;
+		}
+
+		/** <b> Closing the connection to the peer.</b> */
+		/** Once the peer's request has been handled (or the peer has gone away), the server closes that socket. */
+		if (client->m_state == PEER_CLOSING)
+		{
+			closePeer(client);
+			return;
+		}
+
+		/** Everything has been sent. If more pipelined commands are already waiting, keep going, otherwise wait for the peer. */
+		if (commandWaiting(client) == 0)
+		{
+			break;
+		}
+	}
+
+	/** Re-arm the peer, waiting for whichever direction it is blocked on. A watching peer is re-armed under its lock, so that an event
+	 * pushed meanwhile is either seen here, and sent as soon as the socket is writable, or wakes the peer itself. */
+	if (client->m_watching == 1)
+	{
+		pthread_mutex_lock(&client->m_lock);
+	}
+	struct epoll_event event;
+	event.events = ((pendingOutput(client) > 0 || client->m_events.m_len > 0 || client->m_overflow == 1) ? EPOLLOUT : EPOLLIN) | EPOLLET | EPOLLONESHOT;
+	event.data.ptr = client;
+	status = epoll_ctl(client->m_shard->m_epoll_fd, EPOLL_CTL_MOD, client->m_peer_socket, &event);
+	if (client->m_watching == 1)
+	{
+		client->m_running = (status == -1) ? 1 : 0;
+		pthread_mutex_unlock(&client->m_lock);
+	}
+	if (status == -1)
+	{
+		perror("Server Error: Epoll modify failed");
+		closePeer(client);
+	}
+}
+
+int claimPeer(struct peer *client)
+{
+	int claimed = 0;
+
+	pthread_mutex_lock(&client->m_lock);
+	if (client->m_running == 0)
+	{
+		client->m_running = 1;
+		client->m_woken = 0;
+		claimed = 1;
+	}
+	pthread_mutex_unlock(&client->m_lock);
+	return claimed;
+}
+
+void commitChanges(struct peer *client)
+{
+	struct pending_ack *acks = (struct pending_ack *) client->m_acks.m_data;
+	size_t num_acks = client->m_acks.m_len / sizeof(struct pending_ack);
+	size_t n;
+
+	/** Changes made concurrently are synced together, so after the first wait the others mostly return at once. */
+	for (n = 0; n < num_acks; n++)
+	{
+		settleAck(client, &acks[n]);
+	}
+	client->m_acks.m_len = 0;
+}
+
+void settleAck(struct peer *client, const struct pending_ack *ack)
+{
+	int status = PROTO_SUCC;
+	if (storeSync(ack->m_lsn) != STORE_OK)
+	{
+		status = PROTO_FAIL;
+		if (ack->m_binary == 1)
+		{
+			client->m_out.m_data[ack->m_status_offset] = (char) PROTO_FAIL;
+		}
+		else
+		{
+			memcpy(client->m_out.m_data + ack->m_status_offset, "fail", 4);
+		}
+	}
+	/** The latency of a change includes the wait for the sync, which is most of it. */
+	statsCommand(ack->m_command, status, monotonicNs() - ack->m_started);
+}
+
+void takeEvents(struct peer *client)
+{
+	pthread_mutex_lock(&client->m_lock);
+	/** While the peer is not reading what it was sent, events are left in the mailbox, where they are counted against WATCH_BACKLOG_LIMIT. */
+	if (client->m_events.m_len > 0 && pendingOutput(client) < WATCH_BACKLOG_LIMIT)
+	{
+		queueResponse(client, client->m_events.m_data, client->m_events.m_len);
+		client->m_events.m_len = 0;
+	}
+	int overflow = client->m_overflow;
+	pthread_mutex_unlock(&client->m_lock);
+
+	/** Events have been lost. The peer is told, rather than left to believe it has seen every change, and has to watch again. */
+	if (overflow == 1 && client->m_state == PEER_READING)
+	{
+		client->m_state = PEER_CLOSING;
+		if (client->m_binary == 1)
+		{
+			queueFrame(client, PROTO_EVENT, PROTO_FAIL, NULL, 0);
+		}
+		else
+		{
+			queueString(client, "<EVENT overflow>\n");
+		}
+	}
+}
+
+void freeClosedPeers(struct shard *shard)
+{
+	pthread_mutex_lock(&shard->m_closed_lock);
+	struct peer *closed = shard->m_closed_peers;
+	shard->m_closed_peers = NULL;
+	pthread_mutex_unlock(&shard->m_closed_lock);
+
+	while (closed != NULL)
+	{
+		struct peer *next = closed->m_next_closed;
+		freePeer(closed);
+		closed = next;
+	}
+}
+
+int readInput(struct peer *client)
+{
+	ssize_t received;
+
+	/** Make room behind the bytes that are still waiting to be processed. */
+	if (client->m_in_start > 0)
+	{
+		client->m_in_len -= client->m_in_start;
+		client->m_in_scanned -= client->m_in_start;
+		memmove(client->m_in, client->m_in + client->m_in_start, client->m_in_len);
+		client->m_in[client->m_in_len] = '\0';
+		client->m_in_start = 0;
+	}
+
+	while (client->m_eof == 0 && client->m_in_len < CHUNK_SIZE - 1)
+	{
+		received = read(client->m_peer_socket, client->m_in + client->m_in_len, CHUNK_SIZE - 1 - client->m_in_len);
+		if (received > 0)
+		{
+			statsTraffic(received, 0);
+			client->m_in_len += received;
+			client->m_in[client->m_in_len] = '\0';
+		}
+		else if (received == 0)
+		{
+			/** The peer shut down its side of the connection. Whatever it sent is still processed. */
+			client->m_eof = 1;
+			return (client->m_in_len > 0 || pendingOutput(client) > 0) ? 0 : -1;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return 0;
+		}
+		else if (errno != EINTR)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int nextCommand(struct peer *client)
+{
+	char *start = client->m_in + client->m_in_start;
+	size_t pending = client->m_in_len - client->m_in_start;
+	char *end;
+	size_t length;
+
+	/** A binary frame is complete once its header and the payload length it announces have been read. */
+	if (client->m_binary == 1)
+	{
+		if (pending < PROTO_HEADER_SIZE)
+		{
+			return 0;
+		}
+		struct proto_reader header = {(const unsigned char *) start, PROTO_HEADER_SIZE, 4, 0};
+		length = PROTO_HEADER_SIZE + protoReadInt(&header, 4);
+		/** A frame that does not fit in the buffer can never be completed. */
+		if (length > CHUNK_SIZE - 1)
+		{
+			return -1;
+		}
+		if (pending < length)
+		{
+			return 0;
+		}
+		client->m_cmd = start;
+		client->m_cmd_len = length;
+		client->m_in_start += length;
+		client->m_in_scanned = client->m_in_start;
+		return 1;
+	}
+
+	/** A command is terminated by its closing '>'. The bytes before \a m_in_scanned are already known not to contain one. */
+	if (client->m_in_scanned < client->m_in_start)
+	{
+		client->m_in_scanned = client->m_in_start;
+	}
+	if ((end = (char *) memchr(client->m_in + client->m_in_scanned, '>', client->m_in_len - client->m_in_scanned)) != NULL)
+	{
+		length = end - start + 1;
+		*end = '\0';
+		client->m_cmd_len = length - 1;
+	}
+	/** Outside of keep-alive mode, process what we have once no more can arrive, like a single read of CHUNK_SIZE bytes. */
+	else if (client->m_keepalive == 0 && pending > 0 && (pending == CHUNK_SIZE - 1 || client->m_eof == 1))
+	{
+		length = pending;
+		client->m_cmd_len = length;
+	}
+	/** In keep-alive mode, a command that does not fit in the buffer can never be completed. */
+	else if (client->m_keepalive == 1 && pending == CHUNK_SIZE - 1)
+	{
+		return -1;
+	}
+	else
+	{
+		client->m_in_scanned = client->m_in_len;
+		return 0;
+	}
+
+	/** The command is used where it lies. Any pipelined commands that follow it stay in \a m_in. */
+	client->m_cmd = start;
+	client->m_in_start += length;
+	client->m_in_scanned = client->m_in_start;
+
+	return 1;
+}
+
+int commandWaiting(struct peer *client)
+{
+	size_t pending = client->m_in_len - client->m_in_start;
+
+	if (client->m_binary == 1)
+	{
+		if (pending < PROTO_HEADER_SIZE)
+		{
+			return 0;
+		}
+		struct proto_reader header = {(const unsigned char *) client->m_in + client->m_in_start, PROTO_HEADER_SIZE, 4, 0};
+		uint64_t length = PROTO_HEADER_SIZE + protoReadInt(&header, 4);
+		/* An oversized frame counts as waiting, so that nextCommand() gets to reject it. */
+		return (length > CHUNK_SIZE - 1 || pending >= length) ? 1 : 0;
+	}
+	size_t scanned = (client->m_in_scanned > client->m_in_start) ? client->m_in_scanned : client->m_in_start;
+	return (memchr(client->m_in + scanned, '>', client->m_in_len - scanned) != NULL) ? 1 : 0;
+}
+
+void splitCommand(struct peer *client)
+{
+	char *cursor = client->m_cmd;
+
+	client->m_num_fields = 0;
+	cursor += strspn(cursor, COMMAND_SPACE);
+	if (*cursor == '<')
+	{
+		cursor++;
+	}
+	while (*(cursor += strspn(cursor, COMMAND_SPACE)) != '\0')
+	{
+		if (client->m_num_fields < COMMAND_FIELDS)
+		{
+			client->m_fields[client->m_num_fields] = cursor;
+		}
+		client->m_num_fields++;
+		cursor += strcspn(cursor, COMMAND_SPACE);
+		if (*cursor != '\0')
+		{
+			*cursor++ = '\0';
+		}
+	}
+}
+
+int writeResponse(struct peer *client)
+{
+	struct iovec iov[OUTPUT_SEGMENTS];
+	struct msghdr message;
+	ssize_t sent;
+	size_t remaining;
+	int i, count;
+
+	while (client->m_out_sent < client->m_out_queued)
+	{
+		struct out_segment *first = &client->m_segments[client->m_first_segment];
+		if (first->m_fd != -1)
+		{
+			/** A tracker file goes from the page cache to the socket. A file that is shorter than expected ends the connection. */
+			off_t offset = first->m_offset + client->m_segment_sent;
+			if ((sent = sendfile(client->m_peer_socket, first->m_fd, &offset, first->m_len - client->m_segment_sent)) == 0)
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			/** Gather every unsent segment up to the next tracker file, so that they go out in one call. */
+			count = 0;
+			for (i = client->m_first_segment; i < client->m_num_segments && client->m_segments[i].m_fd == -1; i++)
+			{
+				struct out_segment *segment = &client->m_segments[i];
+				const char *data = (segment->m_shared != NULL) ? segment->m_shared->m_data : client->m_out.m_data + segment->m_offset;
+				size_t skip = (i == client->m_first_segment) ? client->m_segment_sent : 0;
+
+				iov[count].iov_base = (void *) (data + skip);
+				iov[count].iov_len = segment->m_len - skip;
+				count++;
+			}
+
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = iov;
+			message.msg_iovlen = count;
+
+			sent = sendmsg(client->m_peer_socket, &message, MSG_NOSIGNAL);
+		}
+		if (sent >= 0)
+		{
+			statsTraffic(0, sent);
+			client->m_out_sent += sent;
+
+			/** Step past the segments that were written completely, dropping any shared responses and files among them. */
+			remaining = sent;
+			while (remaining > 0)
+			{
+				struct out_segment *segment = &client->m_segments[client->m_first_segment];
+				if (remaining < segment->m_len - client->m_segment_sent)
+				{
+					client->m_segment_sent += remaining;
+					break;
+				}
+				remaining -= segment->m_len - client->m_segment_sent;
+				releaseSegment(segment);
+				client->m_first_segment++;
+				client->m_segment_sent = 0;
+			}
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return 0;
+		}
+		else if (errno != EINTR)
+		{
+			return -1;
+		}
+	}
+
+	/** Everything has been sent. The buffer is emptied, but kept for the next response. */
+	client->m_out.m_len = 0;
+	client->m_num_segments = 0;
+	client->m_first_segment = 0;
+	client->m_segment_sent = 0;
+	client->m_out_queued = 0;
+	client->m_out_sent = 0;
+	return 1;
+}
+
+void processCommand(struct peer *client)
+{
+	/** Every command is timed, and counted by its kind (as a binary opcode) and outcome. Handlers set \a m_status when they fail. */
+	unsigned long long started = monotonicNs();
+	size_t queued = client->m_out.m_len;
+	int command = 0;
+	client->m_status = PROTO_SUCC;
+	client->m_commit_lsn = 0;
+
+	/** A text command is dispatched on its words, which are split where the command lies. */
+	const char *verb = "", *object = "";
+	if (client->m_binary == 0)
+	{
+		splitCommand(client);
+		verb = (client->m_num_fields > 0) ? client->m_fields[0] : "";
+		object = (client->m_num_fields > 1) ? client->m_fields[1] : "";
+	}
+
+	/** Once a peer has switched to binary frames, it never sends a text command again. */
+	if (client->m_binary == 1)
+	{
+		command = (unsigned char) client->m_cmd[0];
+		processFrame(client);
+	}
+	/** <b>CREATETRACKER Command</b> */
+	else if (strcmp(verb, "createtracker") == 0)
+	{
+		command = PROTO_CREATE;
+		createTracker(client);
+	}
+	/** <b>UPDATETRACKER Command</b>, with a list of ranges in place of the start and end bytes. */
+	else if (strcmp(verb, "updatetracker") == 0 && client->m_num_fields == 5)
+	{
+		command = PROTO_UPDATE_RANGES;
+		updateRanges(client);
+	}
+	/** <b>UPDATETRACKER Command</b> */
+	else if (strcmp(verb, "updatetracker") == 0)
+	{
+		command = PROTO_UPDATE;
+		updateTracker(client);
+	}
+	/** <b>REQ LIST Command</b> */
+	else if (strcmp(verb, "REQ") == 0 && strcmp(object, "LIST") == 0)
+	{
+		command = PROTO_LIST;
+		listTrackers(client);
+	}
+	/** <b>REQ STATS Command</b> */
+	else if (strcmp(verb, "REQ") == 0 && strcmp(object, "STATS") == 0 && client->m_num_fields == 2)
+	{
+		command = PROTO_STATS;
+		reportStats(client);
+	}
+	/** <b>GET Command</b>, counted as a \a PROTO_SELECT when it asks for a range. */
+	else if (strcmp(verb, "GET") == 0)
+	{
+		command = (client->m_num_fields > 2) ? PROTO_SELECT : PROTO_GET;
+		getTracker(client);
+	}
+	/** <b>WATCH Command</b>: the connection stays open, and the tracker's changes are pushed over it. */
+	else if (strcmp(verb, "WATCH") == 0)
+	{
+		command = PROTO_WATCH;
+		watchTracker(client);
+	}
+	/** <b>BINARY Command</b>: the connection stays open, and every following command is a binary frame. */
+	else if (strcmp(verb, "BINARY") == 0 && client->m_num_fields == 1)
+	{
+		client->m_keepalive = 1;
+		client->m_binary = 1;
+		queueString(client, "<BINARY ok>\n");
+	}
+	/** <b>KEEPALIVE Command</b>: the connection stays open after each response, and the client can pipeline commands. */
+	else if (strcmp(verb, "KEEPALIVE") == 0 && client->m_num_fields == 1)
+	{
+		client->m_keepalive = 1;
+		queueString(client, "<KEEPALIVE ok>\n");
+	}
+	else
+	{
+		client->m_status = PROTO_INVALID;
+		/** In keep-alive mode every command gets a response, so that the client's responses stay in order. */
+		if (client->m_keepalive == 1)
+		{
+			queueString(client, "<invalid command>\n");
+		}
+	}
+
+	/** A change is acknowledged with "succ" (or a \a PROTO_SUCC frame), which is held back until servicePeer() has synced it. */
+	if (client->m_commit_lsn != 0 && client->m_out.m_len > queued)
+	{
+		struct pending_ack ack;
+		ack.m_lsn = client->m_commit_lsn;
+		ack.m_binary = client->m_binary;
+		/** The acknowledgement is the only response queued by the command: a frame without a payload, or a line ending in "succ>\n". */
+		ack.m_status_offset = (client->m_binary == 1) ? queued + 1 : client->m_out.m_len - strlen("succ>\n");
+		ack.m_command = (command < STATS_COMMANDS) ? command : 0;
+		ack.m_started = started;
+		size_t acks_len = client->m_acks.m_len;
+		appendBuffer(&client->m_acks, (const char *) &ack, sizeof(ack));
+		/** The command is counted once it is known whether the change was durable. Without room to hold the acknowledgement back, the
+		 * change is synced at once. */
+		if (client->m_acks.m_len == acks_len)
+		{
+			settleAck(client, &ack);
+		}
+		return;
+	}
+
+	statsCommand((command < STATS_COMMANDS) ? command : 0, client->m_status, monotonicNs() - started);
+}
+
+void createTracker(struct peer *client)
+{
+	/** The create tracker command is broken up into 7 words:
+	 * createtracker, filename, filesize, description, md5, ip, and port.
+	 * We are interested in the last 6.
+	 */
+	/** If client did not send the correct number of arguments, send a "createtracker fail" protocol message. */
+	if (client->m_num_fields != 7)
+	{
+		client->m_status = PROTO_FAIL;
+		queueString(client, "<createtracker fail>\n");
+		return;
+	}
+
+	char *filename = client->m_fields[1];
+	char *filesize = client->m_fields[2];
+	char *description = client->m_fields[3];
+	char *md5 = client->m_fields[4];
+	char *ip = client->m_fields[5];
+	char *port = client->m_fields[6];
+
+	/** Create the tracker in the store. The store logs the creation, and writes the new tracker file in the background. */
+	unsigned long lsn;
+	switch (storeCreate(filename, filesize, description, md5, &lsn))
+	{
+		/** Let the client know that the creation was successful with a "createtracker succ" protocol message, once it is durable. */
+		case STORE_OK:
+			client->m_commit_lsn = lsn;
+			queueString(client, "<createtracker succ>\n");
+			notifyCreate(filename, filesize, description, md5);
+			break;
+		/** If this tracker file already exists, send a "createtracker ferr" protocol message. */
+		case STORE_EXISTS:
+			client->m_status = PROTO_FERR;
+			queueString(client, "<createtracker ferr>\n");
+			break;
+		/** If there was a problem creating the tracker, send the user a "createtracker fail" protocol message. */
+		default:
+			client->m_status = PROTO_FAIL;
+			queueString(client, "<createtracker fail>\n");
+			break;
+	}
+
+	(void) ip;
+	(void) port;
+}
+
+void updateTracker(struct peer *client)
+{
+	/** The update tracker command is broken up into 6 words:
+	 * updatetracker, filename, start byte, end byte, ip, and port.
+	 * We are interested in the last 5.
+	 */
+	struct tracker_range range;
+	long port;
+
+	if (client->m_num_fields < 6 || parseNumber(client->m_fields[2], &range.start_byte) == -1
+			|| parseNumber(client->m_fields[3], &range.end_byte) == -1 || parseNumber(client->m_fields[5], &port) == -1)
+	{
+		client->m_status = PROTO_FAIL;
+		queueString(client, "<updatetracker fail>\n");
+		return;
+	}
+
+	char *filename = client->m_fields[1];
+	char *ip = client->m_fields[4];
+
+	/** Append the new chunk record to the tracker. */
+	unsigned long lsn;
+	switch (storeUpdate(filename, ip, (int) port, range.start_byte, range.end_byte, &lsn))
+	{
+		/** Let the client know that the update was successful with a "updatetracker succ" protocol message, once it is durable. */
+		case STORE_OK:
+			client->m_commit_lsn = lsn;
+			queueString(client, "<updatetracker succ>\n");
+			notifyUpdate(filename, ip, (int) port, &range, 1);
+			break;
+		/** If this tracker file does not exist, send a "updatetracker ferr" protocol message. */
+		case STORE_NOT_FOUND:
+			client->m_status = PROTO_FERR;
+			queueString(client, "<updatetracker ferr>\n");
+			break;
+		/** If there was a problem updating the tracker, send the user a "updatetracker fail" protocol message. */
+		default:
+			client->m_status = PROTO_FAIL;
+			queueString(client, "<updatetracker fail>\n");
+			break;
+	}
+}
+
+void updateRanges(struct peer *client)
+{
+	/** The command is broken up into 5 words: updatetracker, filename, the ranges, ip, and port. */
+	struct tracker_range ranges[UPDATE_MAX_RANGES];
+	int parsed = parseRanges(client->m_fields[2], ranges, UPDATE_MAX_RANGES);
+	size_t count = (parsed > 0) ? parsed : 0;
+	long port;
+
+	if (parsed < 1 || parseNumber(client->m_fields[4], &port) == -1)
+	{
+		client->m_status = PROTO_FAIL;
+		queueString(client, "<updatetracker fail>\n");
+		return;
+	}
+
+	/** Every range is appended to the tracker as a single change. */
+	unsigned long lsn;
+	switch (storeUpdateRanges(client->m_fields[1], client->m_fields[3], (int) port, ranges, &count, &lsn))
+	{
+		case STORE_OK:
+			client->m_commit_lsn = lsn;
+			queueString(client, "<updatetracker succ>\n");
+			notifyUpdate(client->m_fields[1], client->m_fields[3], (int) port, ranges, (int) count);
+			break;
+		case STORE_NOT_FOUND:
+			client->m_status = PROTO_FERR;
+			queueString(client, "<updatetracker ferr>\n");
+			break;
+		default:
+			client->m_status = PROTO_FAIL;
+			queueString(client, "<updatetracker fail>\n");
+			break;
+	}
+}
+
+void listEntry(const struct tracker *t, void *arg)
+{
+	struct list_context *context = (struct list_context *) arg;
+	char line[CHUNK_SIZE];
+
+	context->m_num_files = context->m_num_files + 1;
+	context->m_last = t->filename;
+	/** Each tracker is listed with its: Filename, filesize, and md5, indexed by a number. */
+	if (context->m_format == LIST_TEXT)
+	{
+		snprintf(line, sizeof(line), "<%d %s %s %s>\n", context->m_num_files, t->filename, t->filesize, t->md5);
+		appendBuffer(&context->m_entries, line, strlen(line));
+	}
+	/** In a binary LIST, the entries are implicitly numbered by their position. */
+	else
+	{
+		struct proto_writer entry = {(unsigned char *) line, sizeof(line), 0, 0};
+		protoWriteString(&entry, t->filename);
+		protoWriteInt(&entry, strtoull(t->filesize, NULL, 10), 8);
+		protoWriteString(&entry, t->md5);
+		if (entry.m_error == 0)
+		{
+			appendBuffer(&context->m_entries, line, entry.m_len);
+		}
+	}
+}
+
+void listTrackers(struct peer *client)
+{
+	struct list_response *response;
+	struct buffer page;
+	long limit;
+
+	/** <REQ LIST prefix cursor limit> (optionally followed by a substring) lists a single page. '-' stands for no prefix, or no cursor. */
+	if (client->m_num_fields > 2)
+	{
+		if ((client->m_num_fields != 5 && client->m_num_fields != 6) || parseNumber(client->m_fields[4], &limit) == -1 || limit < 1)
+		{
+			client->m_status = PROTO_FAIL;
+			queueString(client, "<REP LIST fail>\n");
+			return;
+		}
+		listPage((strcmp(client->m_fields[2], LIST_WILDCARD) == 0) ? "" : client->m_fields[2],
+				(client->m_num_fields == 6) ? client->m_fields[5] : NULL,
+				(strcmp(client->m_fields[3], LIST_WILDCARD) == 0) ? NULL : client->m_fields[3], limit, LIST_TEXT, &page);
+		queueResponse(client, page.m_data, page.m_len);
+		free(page.m_data);
+		return;
+	}
+
+	/** The LIST response only changes when a tracker is created, so it is normally sent straight from the cache. */
+	if ((response = currentListResponse(LIST_TEXT)) == NULL)
+	{
+		queueString(client, "<REP LIST 0>\n<REP LIST END>\n");
+		return;
+	}
+	queueShared(client, response);
+}
+
+void listPage(const char *prefix, const char *substring, const char *cursor, long limit, enum list_format format, struct buffer *page)
+{
+	struct list_context context;
+	char line[CHUNK_SIZE];
+	int more;
+
+	memset(&context, 0, sizeof(context));
+	memset(page, 0, sizeof(struct buffer));
+	context.m_format = format;
+
+	/** The store keeps the trackers sorted by filename, so only the trackers on the page (and those the substring skips) are visited. */
+	storeForEachMatch(prefix, substring, cursor, (limit < LIST_PAGE_MAX) ? limit : LIST_PAGE_MAX, &listEntry, &context, &more);
+
+	if (format == LIST_TEXT)
+	{
+		sprintf(line, "<REP LIST %d>\n", context.m_num_files);
+		appendBuffer(page, line, strlen(line));
+		appendBuffer(page, context.m_entries.m_data, context.m_entries.m_len);
+		if (more == 1)
+		{
+			snprintf(line, sizeof(line), "<REP LIST END %s>\n", context.m_last);
+		}
+		else
+		{
+			sprintf(line, "<REP LIST END>\n");
+		}
+		appendBuffer(page, line, strlen(line));
+	}
+	else
+	{
+		struct proto_writer count = {(unsigned char *) line, 4, 0, 0};
+		protoWriteInt(&count, context.m_num_files, 4);
+		appendBuffer(page, line, 4);
+		appendBuffer(page, context.m_entries.m_data, context.m_entries.m_len);
+		struct proto_writer next = {(unsigned char *) line, sizeof(line), 0, 0};
+		protoWriteString(&next, (more == 1) ? context.m_last : "");
+		appendBuffer(page, line, next.m_len);
+	}
+	free(context.m_entries.m_data);
+}
+
+struct list_response *currentListResponse(enum list_format format)
+{
+	struct list_response *response, *replaced = NULL;
+	/** The version is read before the trackers are walked, so a response is never labelled newer than what it holds. */
+	unsigned long version = storeVersion();
+
+	pthread_mutex_lock(&list_cache_lock);
+	if (list_cache[format] != NULL && list_cache[format]->m_version == version)
+	{
+		response = list_cache[format];
+		response->m_refs++;
+		pthread_mutex_unlock(&list_cache_lock);
+		return response;
+	}
+	pthread_mutex_unlock(&list_cache_lock);
+
+	/** The cache is out of date. Walk every tracker in memory, building up the LIST lines. */
+	struct list_context context;
+	struct buffer whole;
+	char header[CHUNK_SIZE];
+	memset(&context, 0, sizeof(context));
+	memset(&whole, 0, sizeof(whole));
+	context.m_format = format;
+
+	storeForEach(&listEntry, &context);
+
+	if (format == LIST_TEXT)
+	{
+		/* The first line of the LIST response, the entries, and the footer of the "REQ" protocol message. */
+		sprintf(header, "<REP LIST %d>\n", context.m_num_files);
+		appendBuffer(&whole, header, strlen(header));
+		appendBuffer(&whole, context.m_entries.m_data, context.m_entries.m_len);
+		appendBuffer(&whole, "<REP LIST END>\n", strlen("<REP LIST END>\n"));
+	}
+	else
+	{
+		/* The frame header, the number of entries, and the entries. */
+		struct proto_writer count = {(unsigned char *) header + PROTO_HEADER_SIZE, 4, 0, 0};
+		protoWriteHeader((unsigned char *) header, PROTO_LIST | PROTO_RESPONSE, PROTO_SUCC, 4 + context.m_entries.m_len);
+		protoWriteInt(&count, context.m_num_files, 4);
+		appendBuffer(&whole, header, PROTO_HEADER_SIZE + 4);
+		appendBuffer(&whole, context.m_entries.m_data, context.m_entries.m_len);
+	}
+	free(context.m_entries.m_data);
+
+	if ((response = (struct list_response *) malloc(sizeof(struct list_response))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		free(whole.m_data);
+		return NULL;
+	}
+	response->m_data = whole.m_data;
+	response->m_len = whole.m_len;
+	response->m_version = version;
+	response->m_refs = 1;
+
+	/** Several threads may rebuild at once after a createtracker. Whichever built the newest response keeps it in the cache. */
+	pthread_mutex_lock(&list_cache_lock);
+	if (list_cache[format] == NULL || list_cache[format]->m_version < version)
+	{
+		if (list_cache[format] != NULL && --list_cache[format]->m_refs == 0)
+		{
+			replaced = list_cache[format];
+		}
+		list_cache[format] = response;
+		response->m_refs++;
+	}
+	pthread_mutex_unlock(&list_cache_lock);
+
+	if (replaced != NULL)
+	{
+		free(replaced->m_data);
+		free(replaced);
+	}
+	return response;
+}
+
+void releaseListResponse(struct list_response *response)
+{
+	if (response == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&list_cache_lock);
+	int refs = --response->m_refs;
+	pthread_mutex_unlock(&list_cache_lock);
+
+	if (refs == 0)
+	{
+		free(response->m_data);
+		free(response);
+	}
+}
+
+void watchTracker(struct peer *client)
+{
+	/** The watch command is broken up into 2 words: WATCH and filename. The tracker need not exist yet. */
+	if (client->m_num_fields != 2 || addWatch(client, client->m_fields[1]) == -1)
+	{
+		client->m_status = PROTO_FAIL;
+		queueString(client, "<WATCH fail>\n");
+		return;
+	}
+
+	/** The events are pushed over this connection, so it stays open. */
+	client->m_keepalive = 1;
+	queueString(client, "<WATCH ok>\n");
+}
+
+int addWatch(struct peer *client, const char *filename)
+{
+	struct watch *watch;
+
+	/** Only the thread servicing the peer changes its watches, so they can be read without the lock. */
+	for (watch = client->m_watches; watch != NULL; watch = watch->m_next_of_peer)
+	{
+		if (strcmp(watch->m_filename, filename) == 0)
+		{
+			return 0;
+		}
+	}
+
+	if ((watch = (struct watch *) malloc(sizeof(struct watch))) == NULL || (watch->m_filename = strdup(filename)) == NULL)
+	{
+		free(watch);
+		return -1;
+	}
+	watch->m_peer = client;
+	watch->m_binary = client->m_binary;
+
+	/** The first watch makes the peer wakeable by notifyWatchers(). This thread is servicing it, and re-arms it when it is done. */
+	if (client->m_watching == 0)
+	{
+		client->m_running = 1;
+		client->m_watching = 1;
+	}
+
+	unsigned long bucket = watchBucket(filename);
+	pthread_rwlock_wrlock(&watch_lock);
+	watch->m_next = watches[bucket];
+	watches[bucket] = watch;
+	watch->m_next_of_peer = client->m_watches;
+	client->m_watches = watch;
+	__atomic_add_fetch(&num_watches, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&watch_lock);
+	return 0;
+}
+
+void dropWatches(struct peer *client)
+{
+	pthread_rwlock_wrlock(&watch_lock);
+	while (client->m_watches != NULL)
+	{
+		struct watch *watch = client->m_watches;
+		struct watch **link = &watches[watchBucket(watch->m_filename)];
+		while (*link != watch)
+		{
+			link = &(*link)->m_next;
+		}
+		*link = watch->m_next;
+		client->m_watches = watch->m_next_of_peer;
+		__atomic_sub_fetch(&num_watches, 1, __ATOMIC_RELAXED);
+		free(watch->m_filename);
+		free(watch);
+	}
+	pthread_rwlock_unlock(&watch_lock);
+}
+
+unsigned long watchBucket(const char *filename)
+{
+	/** FNV-1a. */
+	unsigned long hash = 2166136261UL;
+	for (; *filename != '\0'; filename++)
+	{
+		hash = (hash ^ (unsigned char) *filename) * 16777619UL;
+	}
+	return hash % WATCH_BUCKETS;
+}
+
+void notifyCreate(const char *filename, const char *filesize, const char *description, const char *md5)
+{
+	/** Nothing is built for a change that nobody watches. */
+	if (__atomic_load_n(&num_watches, __ATOMIC_RELAXED) == 0)
+	{
+		return;
+	}
+
+	/** <EVENT createtracker filename filesize description md5> */
+	struct buffer text = {NULL, 0, 0};
+	const char *words[] = {"<EVENT createtracker ", filename, " ", filesize, " ", description, " ", md5, ">\n"};
+	size_t i;
+	for (i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+	{
+		appendBuffer(&text, words[i], strlen(words[i]));
+	}
+
+	unsigned char frame[PROTO_HEADER_SIZE + 4 * CHUNK_SIZE];
+	struct proto_writer payload = {frame + PROTO_HEADER_SIZE, sizeof(frame) - PROTO_HEADER_SIZE, 0, 0};
+	protoWriteInt(&payload, PROTO_CREATE, 1);
+	protoWriteString(&payload, filename);
+	protoWriteInt(&payload, strtoull(filesize, NULL, 10), 8);
+	protoWriteString(&payload, description);
+	protoWriteString(&payload, md5);
+	protoWriteHeader(frame, PROTO_EVENT | PROTO_RESPONSE, PROTO_SUCC, payload.m_len);
+
+	if (payload.m_error == 0)
+	{
+		notifyWatchers(filename, &text, frame, PROTO_HEADER_SIZE + payload.m_len);
+	}
+	free(text.m_data);
+}
+
+void notifyUpdate(const char *filename, const char *ip, int port, const struct tracker_range *ranges, int count)
+{
+	if (__atomic_load_n(&num_watches, __ATOMIC_RELAXED) == 0)
+	{
+		return;
+	}
+
+	/** <EVENT updatetracker filename start:end,start:end ip port>, the ranges as the store recorded them. */
+	struct buffer text = {NULL, 0, 0};
+	char word[64];
+	int i;
+	appendBuffer(&text, "<EVENT updatetracker ", strlen("<EVENT updatetracker "));
+	appendBuffer(&text, filename, strlen(filename));
+	for (i = 0; i < count; i++)
+	{
+		sprintf(word, "%c%ld:%ld", (i == 0) ? ' ' : ',', ranges[i].start_byte, ranges[i].end_byte);
+		appendBuffer(&text, word, strlen(word));
+	}
+	appendBuffer(&text, " ", 1);
+	appendBuffer(&text, ip, strlen(ip));
+	sprintf(word, " %d>\n", port);
+	appendBuffer(&text, word, strlen(word));
+
+	unsigned char frame[PROTO_HEADER_SIZE + 2 * CHUNK_SIZE + UPDATE_MAX_RANGES * 16];
+	struct proto_writer payload = {frame + PROTO_HEADER_SIZE, sizeof(frame) - PROTO_HEADER_SIZE, 0, 0};
+	protoWriteInt(&payload, PROTO_UPDATE_RANGES, 1);
+	protoWriteString(&payload, filename);
+	protoWriteInt(&payload, port, 2);
+	protoWriteString(&payload, ip);
+	protoWriteInt(&payload, count, 2);
+	for (i = 0; i < count; i++)
+	{
+		protoWriteInt(&payload, ranges[i].start_byte, 8);
+		protoWriteInt(&payload, ranges[i].end_byte, 8);
+	}
+	protoWriteHeader(frame, PROTO_EVENT | PROTO_RESPONSE, PROTO_SUCC, payload.m_len);
+
+	if (payload.m_error == 0)
+	{
+		notifyWatchers(filename, &text, frame, PROTO_HEADER_SIZE + payload.m_len);
+	}
+	free(text.m_data);
+}
+
+void notifyWatchers(const char *filename, const struct buffer *text, const unsigned char *frame, size_t frame_len)
+{
+	struct watch *watch;
+
+	pthread_rwlock_rdlock(&watch_lock);
+	for (watch = watches[watchBucket(filename)]; watch != NULL; watch = watch->m_next)
+	{
+		if (strcmp(watch->m_filename, filename) != 0)
+		{
+			continue;
+		}
+		struct peer *client = watch->m_peer;
+		const char *event = (watch->m_binary == 1) ? (const char *) frame : text->m_data;
+		size_t length = (watch->m_binary == 1) ? frame_len : text->m_len;
+
+		pthread_mutex_lock(&client->m_lock);
+		/** A peer that lets its events pile up is cut off, rather than allowed to hold on to unbounded memory. */
+		if (client->m_overflow == 0 && client->m_events.m_len + length > WATCH_BACKLOG_LIMIT)
+		{
+			client->m_overflow = 1;
+		}
+		else if (client->m_overflow == 0)
+		{
+			appendBuffer(&client->m_events, event, length);
+		}
+		/** A peer that nobody is servicing is woken through its own event loop: asking for EPOLLOUT on its socket, which is writable
+		 * unless the peer has stopped reading, gets it handed to a worker like any other ready peer. */
+		if (client->m_running == 0 && client->m_woken == 0)
+		{
+			struct epoll_event wake;
+			wake.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+			wake.data.ptr = client;
+			if (epoll_ctl(client->m_shard->m_epoll_fd, EPOLL_CTL_MOD, client->m_peer_socket, &wake) == 0)
+			{
+				client->m_woken = 1;
+			}
+		}
+		pthread_mutex_unlock(&client->m_lock);
+	}
+	pthread_rwlock_unlock(&watch_lock);
+}
+
+void reportStats(struct peer *client)
+{
+	struct buffer lines;
+	char header[CHUNK_SIZE];
+	memset(&lines, 0, sizeof(lines));
+
+	/** The report is framed like a LIST response, so that it is self-delimiting in keep-alive mode. */
+	sprintf(header, "<REP STATS %d>\n", buildStatsReport(&lines));
+	queueString(client, header);
+	queueResponse(client, lines.m_data, lines.m_len);
+	queueString(client, "<REP STATS END>\n");
+	free(lines.m_data);
+}
+
+int buildStatsReport(struct buffer *lines)
+{
+	/** Names of the kinds of command, by opcode. */
+	static const char *command_names[STATS_COMMANDS] = {"other", "createtracker", "updatetracker", "LIST", "GET", "GETRANGE", "STATS", "updateranges", "WATCH"};
+	struct stats_counts *totals;
+	struct work_stats queue;
+	char line[CHUNK_SIZE];
+	int num_lines = 0, i;
+
+	/* The totals hold every histogram, which is too much for the stack of a worker thread to hold comfortably. */
+	if ((totals = (struct stats_counts *) malloc(sizeof(struct stats_counts))) == NULL)
+	{
+		return 0;
+	}
+	statsCollect(totals);
+	workQueueStats(&queue);
+
+	snprintf(line, sizeof(line), "<uptime %ld>\n", (long) (time(NULL) - server_started));
+	appendBuffer(lines, line, strlen(line));
+	snprintf(line, sizeof(line), "<connections active %llu accepted %llu>\n",
+		totals->connections_opened - totals->connections_closed, totals->connections_opened);
+	appendBuffer(lines, line, strlen(line));
+	snprintf(line, sizeof(line), "<bytes in %llu out %llu>\n", totals->bytes_in, totals->bytes_out);
+	appendBuffer(lines, line, strlen(line));
+	snprintf(line, sizeof(line), "<queue depth %llu max %llu pushed %lu rejected %lu mean_wait_us %llu max_wait_us %llu>\n",
+		queue.depth, queue.max_depth, queue.pushed, queue.rejected, (queue.popped > 0) ? queue.total_wait_ns / queue.popped / 1000 : 0,
+		queue.max_wait_ns / 1000);
+	appendBuffer(lines, line, strlen(line));
+	num_lines = 4;
+
+	/** One line per kind of command: how many there were of each outcome, and how long they took in microseconds. */
+	for (i = 0; i < STATS_COMMANDS && command_names[i] != NULL; i++)
+	{
+		unsigned long long *outcomes = totals->commands[i];
+		unsigned long long count = outcomes[PROTO_SUCC] + outcomes[PROTO_FAIL] + outcomes[PROTO_FERR] + outcomes[PROTO_INVALID];
+		snprintf(line, sizeof(line), "<command %s count %llu succ %llu fail %llu ferr %llu invalid %llu "
+			"mean_us %.1f p50_us %.1f p90_us %.1f p99_us %.1f p999_us %.1f max_us %.1f>\n",
+			command_names[i], count, outcomes[PROTO_SUCC], outcomes[PROTO_FAIL], outcomes[PROTO_FERR], outcomes[PROTO_INVALID],
+			(count > 0) ? totals->latency_total_ns[i] / 1000.0 / count : 0.0,
+			statsPercentile(totals, i, 0.5) / 1000.0,
+			statsPercentile(totals, i, 0.9) / 1000.0,
+			statsPercentile(totals, i, 0.99) / 1000.0,
+			statsPercentile(totals, i, 0.999) / 1000.0,
+			totals->latency_max_ns[i] / 1000.0);
+		appendBuffer(lines, line, strlen(line));
+		num_lines++;
+	}
+
+	free(totals);
+	return num_lines;
+}
+
+void dumpStats()
+{
+	struct buffer lines;
+	FILE *stats_file;
+	int written = 0;
+	memset(&lines, 0, sizeof(lines));
+	buildStatsReport(&lines);
+
+	/** Readers of the file only ever see a whole report. */
+	if ((stats_file = fopen(STATS_FILE ".tmp", "w")) != NULL)
+	{
+		written = (fwrite(lines.m_data, 1, lines.m_len, stats_file) == lines.m_len);
+		written = (fclose(stats_file) == 0) && written;
+	}
+	if (written == 0 || rename(STATS_FILE ".tmp", STATS_FILE) != 0)
+	{
+		perror("Server Error: Writing stats failed");
+	}
+	free(lines.m_data);
+}
+
+unsigned long long monotonicNs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void getTracker(struct peer *client)
+{
+	long start_byte = 0, end_byte = 0, max_peers = 0;
+	int valid;
+
+	/** The GET command names the filename.track, optionally followed by a range and the most peers to return. */
+	if (client->m_num_fields == 2)
+	{
+		valid = 1;
+	}
+	else if (client->m_num_fields == 5)
+	{
+		valid = parseNumber(client->m_fields[2], &start_byte) == 0 && parseNumber(client->m_fields[3], &end_byte) == 0
+				&& parseNumber(client->m_fields[4], &max_peers) == 0 && max_peers >= 0 && max_peers <= INT_MAX;
+	}
+	else
+	{
+		valid = 0;
+	}
+	if (valid == 0)
+	{
+		client->m_status = PROTO_INVALID;
+		queueString(client, "<GET invalid>\n");
+		return;
+	}
+
+	const char *tracker_filename = client->m_fields[1];
+	struct get_contents contents;
+	/** The server looks the tracker file up in the store. If there is no such tracker, it sends the peer a "GET invalid" protocol error message. */
+	if ((client->m_num_fields == 2) ? openContents(client, tracker_filename, &contents) == -1
+			: selectContents(tracker_filename, start_byte, end_byte, (int) max_peers, &contents) == -1)
+	{
+		client->m_status = PROTO_INVALID;
+		queueString(client, "<GET invalid>\n");
+		return;
+	}
+
+	/** In keep-alive mode, the tracker file is framed so that the client knows where it ends. */
+	if (client->m_keepalive == 1)
+	{
+		sprintf(client->m_buf, "<REP GET BEGIN %lu>\n", (unsigned long) contents.m_len);
+		queueString(client, client->m_buf);
+	}
+
+	/** It then sends the peer the tracker file. */
+	queueContents(client, &contents);
+
+	/**Finally, it includes the md5 sum of the tracker file itself, and appends it to the end of the "GET" protocol footer.
+	 * The store keeps a running digest of every tracker, so the file does not have to be hashed again. */
+	if (client->m_keepalive == 1)
+	{
+		sprintf(client->m_buf, "\n<REP GET END %s>\n", contents.m_md5);
+		queueString(client, client->m_buf);
+	}
+}
+
+int openContents(struct peer *client, const char *tracker_filename, struct get_contents *contents)
+{
+	contents->m_fd = -1;
+	contents->m_data = NULL;
+
+	/** A file takes a segment of its own, and needs one before it (the response header) and one after it. */
+	if (client->m_num_segments + 3 <= OUTPUT_SEGMENTS)
+	{
+		int status = storeOpenFile(tracker_filename, &contents->m_fd, &contents->m_len, contents->m_md5);
+		if (status == STORE_OK)
+		{
+			return 0;
 		}
-		/** <b>UPDATETRACKER Command</b> */
-		else if (strncmp(clients[client_index].m_buf, "<updatetracker", strlen("<updatetracker")) == 0)
-		{
-			/** The update tracker command is broken up into 6 words:
-			 * updatetracker, filename, start byte, end byte, ip, and port.
-			 * We are interested in the last 5.
-			 */
-			char *filename, *start, *end, *ip, *port;
-			char tokenize[CHUNK_SIZE];
-			
-			strcpy(tokenize, clients[client_index].m_buf);
-			
-			/* Get the filename */
-			filename = strtok(tokenize, " ");
-			filename = strtok(NULL, " ");
-			strcpy(filename, filename);
-			
-			/* Get the start byte */
-			start = strtok(NULL, " ");
-			strcpy(start, start);
-			
-			/* Get the end byte */
-			end = strtok(NULL, " ");
-			strcpy(end, end);
-			
-			/* Get IP */
-			ip = strtok(NULL, " ");
-			strcpy(ip, ip);
-			
-			/* Get port */
-			port = strtok(NULL, ">");
-			strcpy(port, port);
-			
-			/* We now need to check to see if this tracker file already exists. */
-			memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf));
-			sprintf(clients[client_index].m_buf, "Tracker Files/%s.track", filename);
-			
-			pthread_mutex_lock(&file_mutex);
-			
-			/** If this tracker file does not exist, send a "createtracker ferr" protocol message. */
-			if (access(clients[client_index].m_buf, F_OK) == -1)
-			{
-				write(clients[client_index].m_peer_socket, "<updatetracker ferr>\n", strlen("<updatetracke ferr>\n"));
-			}
-			/** Otherwise, append the new chunk data to the end of the tracker file. */
-			else
-			{
-				if((clients[client_index].m_file = fopen(clients[client_index].m_buf, "a")) != NULL)
-				{
-					/* Copy contents into buffer. */
-					sprintf(clients[client_index].m_buf, "\n%s:%s:%s:%s:%d", ip, port, start, end,  (unsigned)time(NULL));
-					/* Append the buffer contents to the end of the tracker file. */
-					fwrite(clients[client_index].m_buf, sizeof(char), strlen(clients[client_index].m_buf), clients[client_index].m_file);
-					/** Let the client know that the update was successful with a "updatetracker succ" protocol message. */
-					write(clients[client_index].m_peer_socket, "<updatetracker succ>", strlen("<updatetracker succ>"));
-					
-					/* Close the tracker file. */
-					fclose(clients[client_index].m_file);
-				}
-				/** If there was a problem updating the file, send the user a "updatetracker fail" protocol message. */
-				else
-				{
-					write(clients[client_index].m_peer_socket, "<updatetracker fail>\n", strlen("<updatetracke fail>\n"));
-				}
-			}
-			/* Unlock the mutex. */
-			pthread_mutex_unlock(&file_mutex);
-		}
-		/** <b>REQ LIST Command</b> */
-		else if (strncmp(clients[client_index].m_buf, "<REQ LIST>", strlen("<REQ LIST>")) == 0)
-		{
-			DIR *tracker_directory;
-			struct dirent *individual_file;
-			
-			pthread_mutex_lock(&file_mutex);
-			/** First, opens the "Tracker Files" folder, and counts the number of files. */
-			if ((tracker_directory = opendir("Tracker Files")) != NULL)
-			{
-				int num_files = 0;
-				while ((individual_file = readdir(tracker_directory)) != NULL)
-				{
-					/*readdir returns root directories "." and ".."*/
-					/*We need to ignore them*/
-					if ((strncmp(individual_file->d_name, ".", 1) != 0) && (strncmp(individual_file->d_name, "..", 2) != 0))
-					{
-						num_files = num_files + 1;
-					}
-				}
-				if (closedir(tracker_directory) == -1)
-				{
-					perror("Closing dir error.\n");
-				}
-				
-				/* Send the first line of the LIST response. */
-				sprintf(clients[client_index].m_buf, "<REP LIST %d>\n", num_files);
-				write(clients[client_index].m_peer_socket, clients[client_index].m_buf, strlen(clients[client_index].m_buf));
-			}
-			
-			/** For each file in the "Tracker Files" folder, stores the tracker file's: Filename, filesize, and md5. */
-			if ((tracker_directory = opendir("Tracker Files")) != NULL)
-			{
-				int num_files = 0;
-				while ((individual_file = readdir(tracker_directory)) != NULL)
-				{
-					/*readdir returns root directories "." and ".."*/
-					/*We need to ignore them*/
-					if ((strncmp(individual_file->d_name, ".", 1) != 0) && (strncmp(individual_file->d_name, "..", 2) != 0))
-					{
-						num_files = num_files + 1;
-					
-						memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf));
-						char *line = NULL;
-						char *filename, *filesize, *md5;
-						size_t len = 0;
-						
-						sprintf(clients[client_index].m_buf, "Tracker Files/%s", individual_file->d_name);
-						
-						if((clients[client_index].m_file = fopen(clients[client_index].m_buf, "r")) != NULL)
-						{
-							memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf));
-							
-							sprintf(clients[client_index].m_buf, "<%d",num_files);
-						
-							/* Get the filename */
-							getline(&line, &len, clients[client_index].m_file);
-							filename = strtok(line, ": ");
-							filename = strtok(NULL, "\n");
-							strcat(clients[client_index].m_buf, filename);
-							
-							/* Get the filesize */
-							getline(&line, &len, clients[client_index].m_file);
-							filesize = strtok(line, ": ");
-							filesize = strtok(NULL, "\n");
-							strcat(clients[client_index].m_buf, filesize);
-							
-							/* Skip over the file description line */
-							getline(&line, &len, clients[client_index].m_file);
-							
-							/* Get the md5 */
-							getline(&line, &len, clients[client_index].m_file);
-							md5 = strtok(line, ": ");
-							md5 = strtok(NULL, "\n");
-							strcat(clients[client_index].m_buf, md5);
-							strcat(clients[client_index].m_buf, ">\n");
-							
-							fclose(clients[client_index].m_file);
-							free(line);
-							
-							/** Sends each tracker file info, indexed by a number. */
-							write(clients[client_index].m_peer_socket, clients[client_index].m_buf, strlen(clients[client_index].m_buf));
-						}
-					}
-				}
-				memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf));
-				strcpy(clients[client_index].m_buf, "<REP LIST END>\n");
-				/* Send the footer of the "REQ" protocol message */
-				write(clients[client_index].m_peer_socket, clients[client_index].m_buf, strlen(clients[client_index].m_buf));
-				
-				if (closedir(tracker_directory) == -1)
-				{
-					perror("Closing dir error.\n");
-				}
-			}
-			pthread_mutex_unlock(&file_mutex);
-		}
-		/** <b>GET Command</b> */
-		else if (strncmp(clients[client_index].m_buf, "<GET", strlen("<GET")) == 0)
-		{
-			char *tracker_filename;
-			char parseFileName[CHUNK_SIZE];
-			
-			/* Get the filename.track */
-			stpcpy(parseFileName, clients[client_index].m_buf);
-			tracker_filename = strtok(parseFileName, " ");
-			tracker_filename = strtok(NULL, ">");
-			
-			sprintf(clients[client_index].m_buf, "Tracker Files/%s", tracker_filename);
-			sprintf(tracker_filename, "%s", clients[client_index].m_buf);
-			
-			pthread_mutex_lock(&file_mutex);
-			/** First, the server checks to make sure that the requested tracker file already exists. */
-			if (access(clients[client_index].m_buf, F_OK) == 0) /* If that file exists..... */
-			{
-				/** Next, it opens the file, and copies it's contents. */
-				if((clients[client_index].m_file = fopen(tracker_filename, "r")) != NULL)
-				{
-				
-					/* ADD ME BACK LATER
-					//write(clients[client_index].m_peer_socket, "<REP GET BEGIN>\n", strlen("<REP GET BEGIN>\n"));					*
-					*/
-					
-					memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf));
-					int read;
-					/** It then sends the peer the tracker file, copied into a buffer. */
-					while((read = fread(clients[client_index].m_buf, sizeof(char), CHUNK_SIZE, clients[client_index].m_file)) > 0)
-					{
-						write(clients[client_index].m_peer_socket, clients[client_index].m_buf, read);
-						memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf)); 
-					}
-					
-					/**Finally, it includes the md5 sum of the tracker file itself, and appends it to the end of the "GET" protocol footer. */
-					char * md5_string;
-					md5_string = computeMD5(tracker_filename);
-					
-					memset(clients[client_index].m_buf, '\0', sizeof(clients[client_index].m_buf));
-					/* ADD ME BACK LATER
-					sprintf(clients[client_index].m_buf, "\n<REP GET END %s>", md5_string);
-					*/
-					free(md5_string);
-					
-					/* ADD ME BACK LATER
-					write(clients[client_index].m_peer_socket, clients[client_index].m_buf, strlen(clients[client_index].m_buf));
-					*/
-				}
-				/** If the tracker file could not be opened, the server sends the peer a "GET invalid" protocol error message. */
-				else
-				{
-					write(clients[client_index].m_peer_socket, "<GET invalid>", strlen("<GET invalid>"));
-				}
-			}
-			/** If the file does not exist, the server sends the peer a "GET invalid" protocol error message. */
-			else
-			{
-				write(clients[client_index].m_peer_socket, "<GET invalid>", strlen("<GET invalid>"));
-			}
-			pthread_mutex_unlock(&file_mutex);
+		if (status == STORE_NOT_FOUND)
+		{
+			return -1;
 		}
 	}
-	
-	/** <b> Closing the connection to the peer.</b> */
-	/** 
-	 * Once the peer's request has been handled, the server closes that socket, 
-	 * indicates that there is a new opening in the \a client array, 
-	 * and ends the thread. */
-	if (close(clients[client_index].m_peer_socket) != 0)
+
+	/** Changes that have not been written out yet are only in memory, so the tracker file is copied from there. */
+	if ((contents->m_data = storeSerialize(tracker_filename, &contents->m_len, contents->m_md5)) == NULL)
 	{
-		perror("Closing socket issue");
+		return -1;
 	}
-	/* Indicate that this element of the clients array is free to use. */
-	clients[client_index].m_peer_socket = -1;
-	
-	/* End the thread.
-	 * In this context, thread clean-up behaviour using pthread_cancel() and pthread_exit() are the same. */
-	if (pthread_cancel(clients[client_index].m_thread) != 0)
+	return 0;
+}
+
+int selectContents(const char *tracker_filename, long start_byte, long end_byte, int max_peers, struct get_contents *contents)
+{
+	contents->m_fd = -1;
+	if ((contents->m_data = storeSelect(tracker_filename, start_byte, end_byte, max_peers, &contents->m_len, contents->m_md5)) == NULL)
 	{
-		perror("Ending thread issue");
-		exit(1);
+		return -1;
 	}
-	
-	//return;
+	return 0;
 }
 
-void setUpClientArray()
+void queueContents(struct peer *client, struct get_contents *contents)
 {
-	int index;
-	for (index = 0; index < MAX_CLIENT; index++)
+	if (contents->m_fd != -1)
 	{
-		/* A m_socet value of -1 indicates that this element of the array is not being used. */
-		clients[index].m_peer_socket = -1;
-		/* Set each m_index = to it's index in the array.  */
-		clients[index].m_index = index;
+		struct out_segment *segment = &client->m_segments[client->m_num_segments++];
+		segment->m_shared = NULL;
+		segment->m_fd = contents->m_fd;
+		segment->m_offset = 0;
+		segment->m_len = contents->m_len;
+		client->m_out_queued += contents->m_len;
 	}
-	return;
+	else
+	{
+		queueResponse(client, contents->m_data, contents->m_len);
+		free(contents->m_data);
+	}
+}
+
+void processFrame(struct peer *client)
+{
+	struct proto_reader request = {(const unsigned char *) client->m_cmd + PROTO_HEADER_SIZE, client->m_cmd_len - PROTO_HEADER_SIZE, 0, 0};
+	int opcode = (unsigned char) client->m_cmd[0];
+
+	switch (opcode)
+	{
+		case PROTO_CREATE:
+			binaryCreate(client, &request);
+			break;
+		case PROTO_UPDATE:
+			binaryUpdate(client, &request);
+			break;
+		case PROTO_UPDATE_RANGES:
+			binaryUpdateRanges(client, &request);
+			break;
+		case PROTO_LIST:
+			binaryList(client, &request);
+			break;
+		case PROTO_GET:
+		case PROTO_SELECT:
+			binaryGet(client, opcode, &request);
+			break;
+		case PROTO_STATS:
+			binaryStats(client);
+			break;
+		case PROTO_WATCH:
+			binaryWatch(client, &request);
+			break;
+		/** Every frame gets a response, so that the client's responses stay in order. */
+		default:
+			queueFrame(client, opcode, PROTO_INVALID, NULL, 0);
+			break;
+	}
+}
+
+void binaryCreate(struct peer *client, struct proto_reader *request)
+{
+	char filename[CHUNK_SIZE], description[CHUNK_SIZE], md5[CHUNK_SIZE], ip[CHUNK_SIZE], filesize[32];
+	unsigned long lsn;
+	int status;
+
+	/** The fields arrive already split and sized, so there is nothing to tokenize. */
+	sprintf(filesize, "%llu", (unsigned long long) protoReadInt(request, 8));
+	protoReadInt(request, 2); /* port */
+	protoReadString(request, filename, sizeof(filename));
+	protoReadString(request, description, sizeof(description));
+	protoReadString(request, md5, sizeof(md5));
+	protoReadString(request, ip, sizeof(ip));
+
+	if (request->m_error == 1 || validWord(filename) == 0 || validWord(description) == 0 || validWord(md5) == 0)
+	{
+		queueFrame(client, PROTO_CREATE, PROTO_FAIL, NULL, 0);
+		return;
+	}
+
+	switch (storeCreate(filename, filesize, description, md5, &lsn))
+	{
+		case STORE_OK:
+			client->m_commit_lsn = lsn;
+			status = PROTO_SUCC;
+			notifyCreate(filename, filesize, description, md5);
+			break;
+		case STORE_EXISTS:
+			status = PROTO_FERR;
+			break;
+		default:
+			status = PROTO_FAIL;
+			break;
+	}
+	queueFrame(client, PROTO_CREATE, status, NULL, 0);
+}
+
+void binaryUpdate(struct peer *client, struct proto_reader *request)
+{
+	char filename[CHUNK_SIZE], ip[CHUNK_SIZE];
+	unsigned long lsn;
+	int status;
+
+	long start = (long) protoReadInt(request, 8);
+	long end = (long) protoReadInt(request, 8);
+	int port = (int) protoReadInt(request, 2);
+	struct tracker_range range = {start, end};
+	protoReadString(request, filename, sizeof(filename));
+	protoReadString(request, ip, sizeof(ip));
+
+	if (request->m_error == 1 || validWord(filename) == 0 || validWord(ip) == 0)
+	{
+		queueFrame(client, PROTO_UPDATE, PROTO_FAIL, NULL, 0);
+		return;
+	}
+
+	switch (storeUpdate(filename, ip, port, start, end, &lsn))
+	{
+		case STORE_OK:
+			client->m_commit_lsn = lsn;
+			status = PROTO_SUCC;
+			notifyUpdate(filename, ip, port, &range, 1);
+			break;
+		case STORE_NOT_FOUND:
+			status = PROTO_FERR;
+			break;
+		default:
+			status = PROTO_FAIL;
+			break;
+	}
+	queueFrame(client, PROTO_UPDATE, status, NULL, 0);
+}
+
+void binaryUpdateRanges(struct peer *client, struct proto_reader *request)
+{
+	char filename[CHUNK_SIZE], ip[CHUNK_SIZE];
+	struct tracker_range ranges[UPDATE_MAX_RANGES];
+	unsigned long lsn;
+	int status, n;
+
+	int port = (int) protoReadInt(request, 2);
+	protoReadString(request, filename, sizeof(filename));
+	protoReadString(request, ip, sizeof(ip));
+	size_t count = (size_t) protoReadInt(request, 2);
+	for (n = 0; n < (int) count && n < UPDATE_MAX_RANGES; n++)
+	{
+		ranges[n].start_byte = (long) protoReadInt(request, 8);
+		ranges[n].end_byte = (long) protoReadInt(request, 8);
+	}
+
+	if (request->m_error == 1 || count < 1 || count > UPDATE_MAX_RANGES || validWord(filename) == 0 || validWord(ip) == 0)
+	{
+		queueFrame(client, PROTO_UPDATE_RANGES, PROTO_FAIL, NULL, 0);
+		return;
+	}
+
+	switch (storeUpdateRanges(filename, ip, port, ranges, &count, &lsn))
+	{
+		case STORE_OK:
+			client->m_commit_lsn = lsn;
+			status = PROTO_SUCC;
+			notifyUpdate(filename, ip, port, ranges, (int) count);
+			break;
+		case STORE_NOT_FOUND:
+			status = PROTO_FERR;
+			break;
+		default:
+			status = PROTO_FAIL;
+			break;
+	}
+	queueFrame(client, PROTO_UPDATE_RANGES, status, NULL, 0);
+}
+
+void binaryList(struct peer *client, struct proto_reader *request)
+{
+	struct list_response *response;
+
+	/** A page is asked for with: prefix, cursor, u32 limit, substring. An empty cursor or substring is left out. */
+	if (request->m_len > 0)
+	{
+		char prefix[CHUNK_SIZE], cursor[CHUNK_SIZE], substring[CHUNK_SIZE];
+		struct buffer page;
+
+		protoReadString(request, prefix, sizeof(prefix));
+		protoReadString(request, cursor, sizeof(cursor));
+		long limit = (long) protoReadInt(request, 4);
+		protoReadString(request, substring, sizeof(substring));
+		if (request->m_error == 1 || limit < 1)
+		{
+			queueFrame(client, PROTO_LIST, PROTO_FAIL, NULL, 0);
+			return;
+		}
+		listPage(prefix, (substring[0] != '\0') ? substring : NULL, (cursor[0] != '\0') ? cursor : NULL, limit, LIST_BINARY, &page);
+		queueFrame(client, PROTO_LIST, PROTO_SUCC, page.m_data, page.m_len);
+		free(page.m_data);
+		return;
+	}
+
+	if ((response = currentListResponse(LIST_BINARY)) == NULL)
+	{
+		unsigned char empty[4] = {0, 0, 0, 0};
+		queueFrame(client, PROTO_LIST, PROTO_SUCC, empty, sizeof(empty));
+		return;
+	}
+	queueShared(client, response);
+}
+
+void binaryStats(struct peer *client)
+{
+	struct buffer lines;
+	memset(&lines, 0, sizeof(lines));
+	buildStatsReport(&lines);
+	queueFrame(client, PROTO_STATS, PROTO_SUCC, lines.m_data, lines.m_len);
+	free(lines.m_data);
+}
+
+void binaryWatch(struct peer *client, struct proto_reader *request)
+{
+	char filename[CHUNK_SIZE];
+
+	protoReadString(request, filename, sizeof(filename));
+	if (request->m_error == 1 || validWord(filename) == 0 || addWatch(client, filename) == -1)
+	{
+		queueFrame(client, PROTO_WATCH, PROTO_FAIL, NULL, 0);
+		return;
+	}
+	queueFrame(client, PROTO_WATCH, PROTO_SUCC, NULL, 0);
+}
+
+void binaryGet(struct peer *client, int opcode, struct proto_reader *request)
+{
+	char tracker_filename[CHUNK_SIZE];
+	unsigned char md5[PROTO_MD5_SIZE];
+	struct get_contents contents;
+	uint64_t start_byte = 0, end_byte = 0, max_peers = 0;
+	int i, found;
+
+	protoReadString(request, tracker_filename, sizeof(tracker_filename));
+	if (opcode == PROTO_SELECT)
+	{
+		start_byte = protoReadInt(request, 8);
+		end_byte = protoReadInt(request, 8);
+		max_peers = protoReadInt(request, 4);
+	}
+	if (request->m_error == 1 || start_byte > LONG_MAX || end_byte > LONG_MAX || max_peers > INT_MAX)
+	{
+		found = -1;
+	}
+	else
+	{
+		found = (opcode == PROTO_GET) ? openContents(client, tracker_filename, &contents)
+			: selectContents(tracker_filename, start_byte, end_byte, max_peers, &contents);
+	}
+	if (found == -1)
+	{
+		queueFrame(client, opcode, PROTO_INVALID, NULL, 0);
+		return;
+	}
+
+	/** The MD5 is sent as raw bytes, ahead of the tracker file. */
+	for (i = 0; i < PROTO_MD5_SIZE; i++)
+	{
+		unsigned int byte;
+		sscanf(&contents.m_md5[i * 2], "%2x", &byte);
+		md5[i] = (unsigned char) byte;
+	}
+
+	unsigned char header[PROTO_HEADER_SIZE];
+	protoWriteHeader(header, opcode | PROTO_RESPONSE, PROTO_SUCC, PROTO_MD5_SIZE + contents.m_len);
+	queueResponse(client, (const char *) header, sizeof(header));
+	queueResponse(client, (const char *) md5, sizeof(md5));
+	queueContents(client, &contents);
+}
+
+void queueFrame(struct peer *client, int opcode, int status, const void *payload, size_t length)
+{
+	unsigned char header[PROTO_HEADER_SIZE];
+	client->m_status = status;
+	protoWriteHeader(header, opcode | PROTO_RESPONSE, status, length);
+	queueResponse(client, (const char *) header, sizeof(header));
+	if (length > 0)
+	{
+		queueResponse(client, (const char *) payload, length);
+	}
+}
+
+int validWord(const char *text)
+{
+	if (*text == '\0')
+	{
+		return 0;
+	}
+	for (; *text != '\0'; text++)
+	{
+		if ((unsigned char) *text <= ' ' || *text == '<' || *text == '>')
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int parseNumber(const char *word, long *value)
+{
+	char *end;
+
+	errno = 0;
+	*value = strtol(word, &end, 10);
+	return (end == word || *end != '\0' || errno == ERANGE) ? -1 : 0;
 }
 
-int findClientArrayOpening()
+int parseRanges(const char *word, struct tracker_range *ranges, int size)
 {
-	int index;
-	/* Check each element of the clients array, until we find an opening. */
-	for (index = 0; index < MAX_CLIENT; index++)
+	const char *cursor = word;
+	char *end;
+	int count = 0;
+
+	while (count < size)
 	{
-		/* Once an opening is found, immediately leave the function. */
-		if (clients[index].m_peer_socket == -1)
+		errno = 0;
+		ranges[count].start_byte = strtol(cursor, &end, 10);
+		if (end == cursor || *end != ':' || errno == ERANGE)
+		{
+			return -1;
+		}
+		cursor = end + 1;
+		ranges[count].end_byte = strtol(cursor, &end, 10);
+		if (end == cursor || (*end != ',' && *end != '\0') || errno == ERANGE)
+		{
+			return -1;
+		}
+		count++;
+		if (*end == '\0')
 		{
-			return index;
+			return count;
 		}
+		cursor = end + 1;
 	}
 	return -1;
 }
 
+void appendBuffer(struct buffer *buffer, const char *data, size_t length)
+{
+	if (buffer->m_len + length > buffer->m_cap)
+	{
+		size_t capacity = (buffer->m_cap == 0) ? CHUNK_SIZE : buffer->m_cap;
+		while (capacity < buffer->m_len + length)
+		{
+			capacity *= 2;
+		}
+		char *grown;
+		if ((grown = (char *) realloc(buffer->m_data, capacity)) == NULL)
+		{
+			perror("Server Error: Out of memory");
+			return;
+		}
+		buffer->m_data = grown;
+		buffer->m_cap = capacity;
+	}
+	memcpy(buffer->m_data + buffer->m_len, data, length);
+	buffer->m_len += length;
+}
+
+void queueResponse(struct peer *client, const char *data, size_t length)
+{
+	size_t offset = client->m_out.m_len;
+
+	appendBuffer(&client->m_out, data, length);
+	if (length == 0 || client->m_out.m_len != offset + length)
+	{
+		return;
+	}
+
+	/** Bytes that follow on from the last segment extend it. A new segment is only needed after a shared response, and queueShared()
+	 * always leaves room for one. */
+	struct out_segment *segment = (client->m_num_segments > 0) ? &client->m_segments[client->m_num_segments - 1] : NULL;
+	if (segment != NULL && segment->m_shared == NULL && segment->m_fd == -1 && segment->m_offset + segment->m_len == offset)
+	{
+		segment->m_len += length;
+	}
+	else
+	{
+		segment = &client->m_segments[client->m_num_segments++];
+		segment->m_shared = NULL;
+		segment->m_fd = -1;
+		segment->m_offset = offset;
+		segment->m_len = length;
+	}
+	client->m_out_queued += length;
+}
+
+void queueString(struct peer *client, const char *data)
+{
+	queueResponse(client, data, strlen(data));
+}
+
+void queueShared(struct peer *client, struct list_response *response)
+{
+	/** Keep a segment free for whatever is queued after the shared response. */
+	if (client->m_num_segments + 2 > OUTPUT_SEGMENTS)
+	{
+		queueResponse(client, response->m_data, response->m_len);
+		releaseListResponse(response);
+		return;
+	}
+
+	struct out_segment *segment = &client->m_segments[client->m_num_segments++];
+	segment->m_shared = response;
+	segment->m_fd = -1;
+	segment->m_offset = 0;
+	segment->m_len = response->m_len;
+	client->m_out_queued += response->m_len;
+}
+
+void releaseSegment(struct out_segment *segment)
+{
+	releaseListResponse(segment->m_shared);
+	if (segment->m_fd != -1)
+	{
+		close(segment->m_fd);
+	}
+}
+
+size_t pendingOutput(struct peer *client)
+{
+	return client->m_out_queued - client->m_out_sent;
+}
+
+struct peer *createPeer(int peer_socket, struct shard *shard)
+{
+	struct peer *client;
+	if ((client = (struct peer *) calloc(1, sizeof(struct peer))) == NULL)
+	{
+		perror("Server Error: Out of memory");
+		return NULL;
+	}
+	client->m_peer_socket = peer_socket;
+	client->m_shard = shard;
+	pthread_mutex_init(&client->m_lock, NULL);
+	statsConnection(1);
+	client->m_state = PEER_READING;
+	return client;
+}
+
+void closePeer(struct peer *client)
+{
+	/** A watching peer stops getting events first, so that notifyWatchers() never re-arms a closed socket. */
+	if (client->m_watching == 1)
+	{
+		dropWatches(client);
+	}
+
+	/** Closing the socket also removes it from its shard's epoll instance. */
+	if (close(client->m_peer_socket) != 0)
+	{
+		perror("Closing socket issue");
+	}
+	/** Drop any shared responses and files that were never sent. */
+	int i;
+	for (i = client->m_first_segment; i < client->m_num_segments; i++)
+	{
+		releaseSegment(&client->m_segments[i]);
+	}
+	statsConnection(0);
+
+	/** Its event loop may still hold an event for a watching peer that notifyWatchers() re-armed. Such an event is dropped, since
+	 * \a m_running stays 1, and the peer is freed once the event loop is done with what it holds. */
+	if (client->m_watching == 1)
+	{
+		pthread_mutex_lock(&client->m_shard->m_closed_lock);
+		client->m_next_closed = client->m_shard->m_closed_peers;
+		client->m_shard->m_closed_peers = client;
+		pthread_mutex_unlock(&client->m_shard->m_closed_lock);
+		return;
+	}
+	freePeer(client);
+}
+
+void freePeer(struct peer *client)
+{
+	free(client->m_out.m_data);
+	free(client->m_acks.m_data);
+	free(client->m_events.m_data);
+	pthread_mutex_destroy(&client->m_lock);
+	free(client);
+}
+
+int setNonBlocking(int fd)
+{
+	int flags;
+	if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
+	{
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 void readConfig()
 {
- 	char* line;
+ 	char* line = NULL;
 	size_t length = 0;
 	ssize_t read;
 	FILE* configFile;
- 
+
 	if ((configFile = fopen("server.conf", "r")) != NULL)
 	{
 		int lineCount = 0;
 		while((read = getline(&line, &length, configFile)) != -1)
 		{
-			switch(lineCount) 
+			switch(lineCount)
 			{
 				/** The first line of the config file contains the server port */
 				case 0:
@@ -648,15 +2848,36 @@ void readConfig()
 				case 2:
 					chunk_size = atoi(line);
 					break;
+				/** The fourth line contains the number of worker threads that service peers. */
+				case 3:
+					worker_threads = atoi(line);
+					break;
+				/** The fifth line contains the number of seconds a peer is kept after its latest announcement. */
+				case 4:
+					peer_ttl = atol(line);
+					break;
+				/** The sixth line contains the number of event loops that accept and wait on peers. */
+				case 5:
+					event_loops = atoi(line);
+					break;
+				/** The seventh line contains the number of seconds between writes of the STATS report to a file. */
+				case 6:
+					stats_interval = atoi(line);
+					break;
 			}
 			lineCount++;
 		}
+		free(line);
 		fclose(configFile);
 	}
 	/** If a config file could not be opened, default values will be assigned:
-	 * server_port = 3456, 
-	 * max_client = 10, and 
-	 * chunk_size = 1024.
+	 * server_port = 3456,
+	 * max_client = 10,
+	 * chunk_size = 1024, and
+	 * worker_threads = WORKERS_PER_CPU per CPU,
+	 * peer_ttl = PEER_TTL_S,
+	 * event_loops = 1, and
+	 * stats_interval = 0.
 	 */
 	else
 	{
@@ -664,17 +2885,42 @@ void readConfig()
  		max_client = 10;
  		chunk_size = 1024;
 	}
-	
+
+	/** Workers spend much of their time waiting for the log to sync, so there are several per CPU. */
+	if (worker_threads <= 0)
+	{
+		worker_threads = WORKERS_PER_CPU * ((sysconf(_SC_NPROCESSORS_ONLN) > 0) ? sysconf(_SC_NPROCESSORS_ONLN) : 1);
+	}
+	if (peer_ttl == 0)
+	{
+		peer_ttl = PEER_TTL_S;
+	}
+	if (event_loops <= 0)
+	{
+		event_loops = 1;
+	}
+
 	return;
 }
 
 void signalhandler(int sig)
 {
-	if(close(sock) != 0)
+	int i;
+	for (i = 0; i < num_shards; i++)
 	{
-		perror("Error closing server socket");
+		if(close(shards[i].m_sock) != 0)
+		{
+			perror("Error closing server socket");
+		}
 	}
 	CLOSE_PROGRAM = 1;
-	
+
+	/** Wake up the event loops, so they notice \a CLOSE_PROGRAM. */
+	uint64_t wake = 1;
+	if (write(wake_fd, &wake, sizeof(wake)) == -1)
+	{
+		perror("Error waking event loop");
+	}
+
 	return;
-}
\ No newline at end of file
+}
@@ -0,0 +1,197 @@
+/**
+ * @file server_stats.c
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @section COMPILE
+ * g++ -c server_stats.c
+ *  (or use make in root directory)
+ */
+
+/*-----------------------------------
+            Includes
+-----------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "server_stats.h"
+
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * The counters of one thread.
+ */
+struct thread_stats
+{
+	struct stats_counts counts;				///< The counters. Only written by the thread they belong to.
+	struct thread_stats *next;				///< Next thread's counters
+};
+
+
+/*-----------------------------------
+            Variables
+-----------------------------------*/
+static __thread struct thread_stats *local = NULL;		///< The calling thread's counters, allocated the first time it counts anything
+
+static struct thread_stats *threads = NULL;				///< Every thread's counters. Never freed, so that totals survive threads exiting.
+
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;	///< Protects \a threads
+
+
+/*-----------------------------------
+        Internal functions
+-----------------------------------*/
+
+/**
+ * The calling thread's counters, or NULL if they could not be allocated.
+ */
+static struct stats_counts* localCounts()
+{
+	if( local == NULL )
+	{
+		if( ( local = (struct thread_stats*) calloc( 1, sizeof( struct thread_stats ) ) ) == NULL )
+		{
+			return NULL;
+		}
+		pthread_mutex_lock( &threads_mutex );
+		local->next = threads;
+		threads = local;
+		pthread_mutex_unlock( &threads_mutex );
+	}
+	return &local->counts;
+}
+
+/**
+ * Add to a counter of the calling thread. Only this thread writes it, so a plain add is enough; the atomic load and store only keep
+ * statsCollect() from reading a torn value.
+ */
+static void bump( unsigned long long* counter, unsigned long long amount )
+{
+	__atomic_store_n( counter, __atomic_load_n( counter, __ATOMIC_RELAXED ) + amount, __ATOMIC_RELAXED );
+}
+
+/**
+ * Histogram bucket a value is counted in.
+ */
+static int bucketOf( unsigned long long value )
+{
+	if( value < STATS_SUB_BUCKETS )
+	{
+		return (int) value;
+	}
+	int exponent = 63 - __builtin_clzll( value );
+	return ( exponent - STATS_SUB_BITS + 1 ) * STATS_SUB_BUCKETS + (int)( ( value >> ( exponent - STATS_SUB_BITS ) ) & ( STATS_SUB_BUCKETS - 1 ) );
+}
+
+/**
+ * Highest value counted in a histogram bucket.
+ */
+static unsigned long long bucketLimit( int bucket )
+{
+	if( bucket < STATS_SUB_BUCKETS )
+	{
+		return bucket;
+	}
+	int exponent = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+	unsigned long long width = 1ULL << ( exponent - STATS_SUB_BITS );
+	return ( (unsigned long long)( STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS ) << ( exponent - STATS_SUB_BITS ) ) + width - 1;
+}
+
+
+/*-----------------------------------
+            Functions
+-----------------------------------*/
+
+void statsCommand( int command, int status, unsigned long long latency_ns )
+{
+	struct stats_counts *counts = localCounts();
+	if( counts == NULL ) return;
+
+	bump( &counts->commands[ command ][ status ], 1 );
+	bump( &counts->latency[ command ][ bucketOf( latency_ns ) ], 1 );
+	bump( &counts->latency_total_ns[ command ], latency_ns );
+	if( latency_ns > counts->latency_max_ns[ command ] )
+	{
+		__atomic_store_n( &counts->latency_max_ns[ command ], latency_ns, __ATOMIC_RELAXED );
+	}
+}
+
+void statsTraffic( unsigned long long bytes_in, unsigned long long bytes_out )
+{
+	struct stats_counts *counts = localCounts();
+	if( counts == NULL ) return;
+
+	if( bytes_in > 0 ) bump( &counts->bytes_in, bytes_in );
+	if( bytes_out > 0 ) bump( &counts->bytes_out, bytes_out );
+}
+
+void statsConnection( int opened )
+{
+	struct stats_counts *counts = localCounts();
+	if( counts == NULL ) return;
+
+	bump( opened ? &counts->connections_opened : &counts->connections_closed, 1 );
+}
+
+void statsCollect( struct stats_counts* totals )
+{
+	memset( totals, 0, sizeof( struct stats_counts ) );
+
+	pthread_mutex_lock( &threads_mutex );
+	struct thread_stats *thread = threads;
+	pthread_mutex_unlock( &threads_mutex );
+
+	/** Threads are only ever added at the head of the list, so the rest of it can be walked without the lock. */
+	for( ; thread != NULL; thread = thread->next )
+	{
+		const struct stats_counts *counts = &thread->counts;
+		for( int c = 0; c < STATS_COMMANDS; c++ )
+		{
+			for( int s = 0; s < STATS_STATUSES; s++ )
+			{
+				totals->commands[c][s] += __atomic_load_n( &counts->commands[c][s], __ATOMIC_RELAXED );
+			}
+			for( int b = 0; b < STATS_BUCKETS; b++ )
+			{
+				totals->latency[c][b] += __atomic_load_n( &counts->latency[c][b], __ATOMIC_RELAXED );
+			}
+			totals->latency_total_ns[c] += __atomic_load_n( &counts->latency_total_ns[c], __ATOMIC_RELAXED );
+			unsigned long long max_ns = __atomic_load_n( &counts->latency_max_ns[c], __ATOMIC_RELAXED );
+			if( max_ns > totals->latency_max_ns[c] ) totals->latency_max_ns[c] = max_ns;
+		}
+		totals->bytes_in += __atomic_load_n( &counts->bytes_in, __ATOMIC_RELAXED );
+		totals->bytes_out += __atomic_load_n( &counts->bytes_out, __ATOMIC_RELAXED );
+		totals->connections_opened += __atomic_load_n( &counts->connections_opened, __ATOMIC_RELAXED );
+		totals->connections_closed += __atomic_load_n( &counts->connections_closed, __ATOMIC_RELAXED );
+	}
+}
+
+unsigned long long statsPercentile( const struct stats_counts* totals, int command, double fraction )
+{
+	const unsigned long long *histogram = totals->latency[ command ];
+	unsigned long long count = 0;
+	for( int b = 0; b < STATS_BUCKETS; b++ )
+	{
+		count += histogram[b];
+	}
+	if( count == 0 ) return 0;
+
+	/** The rank of the value wanted, counting from 1. */
+	unsigned long long rank = (unsigned long long)( fraction * count + 0.5 );
+	if( rank < 1 ) rank = 1;
+	if( rank > count ) rank = count;
+
+	unsigned long long seen = 0;
+	int b;
+	for( b = 0; b < STATS_BUCKETS - 1; b++ )
+	{
+		seen += histogram[b];
+		if( seen >= rank ) break;
+	}
+	/** The bucket only bounds the value; the longest time recorded is an exact bound on the top buckets. */
+	unsigned long long limit = bucketLimit( b );
+	return ( limit < totals->latency_max_ns[ command ] ) ? limit : totals->latency_max_ns[ command ];
+}
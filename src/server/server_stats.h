@@ -0,0 +1,92 @@
+/**
+ * @file server_stats.h
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @brief Header file for server_stats.c
+ * @details Counters and latency histograms for the commands the server processes.
+ *
+ * Every thread counts into its own block of counters, which only it ever writes, so recording never takes a lock or a contended cache line.
+ * statsCollect() adds the blocks of every thread up. Latencies go into log-linear histograms in the style of HdrHistogram: each power of 2
+ * is split into \a STATS_SUB_BUCKETS equal buckets, so every value is recorded to within 1 part in \a STATS_SUB_BUCKETS.
+ */
+
+#ifndef __SERVER_STATS_H__
+#define __SERVER_STATS_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*-----------------------------------
+            Defines
+-----------------------------------*/
+#define STATS_COMMANDS 9						///< Number of command kinds counted. Commands are counted by their tracker_proto.h opcode, 0 for any other.
+#define STATS_STATUSES 4						///< Number of outcomes counted. Outcomes are counted by their tracker_proto.h status.
+#define STATS_SUB_BITS 4						///< log2 of \a STATS_SUB_BUCKETS
+#define STATS_SUB_BUCKETS ( 1 << STATS_SUB_BITS )	///< Number of buckets each power of 2 is split into
+#define STATS_BUCKETS ( ( 64 - STATS_SUB_BITS + 1 ) * STATS_SUB_BUCKETS )	///< Number of buckets in a histogram, enough for any 64 bit value
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * Counters, either of one thread or added up over every thread.
+ */
+struct stats_counts
+{
+	unsigned long long commands[ STATS_COMMANDS ][ STATS_STATUSES ];	///< Number of commands processed, by kind and outcome
+	unsigned long long latency[ STATS_COMMANDS ][ STATS_BUCKETS ];		///< Histogram of the time taken to process each kind of command, in nanoseconds
+	unsigned long long latency_total_ns[ STATS_COMMANDS ];			///< Time taken to process each kind of command, added up, in nanoseconds
+	unsigned long long latency_max_ns[ STATS_COMMANDS ];				///< Longest time taken to process each kind of command, in nanoseconds
+	unsigned long long bytes_in;									///< Bytes read from peers
+	unsigned long long bytes_out;									///< Bytes written to peers
+	unsigned long long connections_opened;							///< Connections accepted
+	unsigned long long connections_closed;							///< Connections closed
+};
+
+/*-----------------------------------
+            Prototypes
+-----------------------------------*/
+/**
+ * Count a processed command.
+ *
+ * @param command Kind of command, below \a STATS_COMMANDS, INPUT.
+ * @param status Outcome of the command, below \a STATS_STATUSES, INPUT.
+ * @param latency_ns Time taken to process it, in nanoseconds. For a change, this includes waiting until it is durable, INPUT.
+ */
+void statsCommand( int command, int status, unsigned long long latency_ns );
+
+/**
+ * Count bytes read from and written to peers.
+ *
+ * @param bytes_in Bytes read, INPUT.
+ * @param bytes_out Bytes written, INPUT.
+ */
+void statsTraffic( unsigned long long bytes_in, unsigned long long bytes_out );
+
+/**
+ * Count a connection being accepted or closed.
+ *
+ * @param opened 1 if the connection was accepted, 0 if it was closed, INPUT.
+ */
+void statsConnection( int opened );
+
+/**
+ * Add up the counters of every thread. Counters being updated meanwhile may or may not be included.
+ *
+ * @param totals Filled in with the totals, OUTPUT.
+ */
+void statsCollect( struct stats_counts* totals );
+
+/**
+ * Find a percentile of the time taken to process a kind of command.
+ *
+ * @param totals Counters from statsCollect(), INPUT.
+ * @param command Kind of command, below \a STATS_COMMANDS, INPUT.
+ * @param fraction Fraction of the commands that took at most the result, between 0 and 1, INPUT.
+ *
+ * @return The highest value the histogram bucket holding the percentile covers, but no more than the longest time recorded, in
+ * nanoseconds. 0 if no such command has been processed.
+ */
+unsigned long long statsPercentile( const struct stats_counts* totals, int command, double fraction );
+
+#endif
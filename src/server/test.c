@@ -0,0 +1,920 @@
+/**
+ * @file test.c
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @brief Behavior tests for the tracker server.
+ * @details The store and the log keep their state in globals, so each test runs in its own child process, on its own temporary
+ * folder. The command parser is tested through a server started from "server.out". The histogram buckets are internal to
+ * server_stats.c, which is included here rather than linked. Exits with the number of tests that failed.
+ *
+ * @section COMPILE
+ * Run "make test-server" in root directory, then run "src/server/test.out" from the same directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "tracker_store.h"
+#include "tracker_wal.h"
+#include "timer_wheel.h"
+#include "server_stats.c"
+
+/*-----------------------------------
+            Defines
+-----------------------------------*/
+#define TEST_FOLDER "/tmp/tracker_test.XXXXXX"		///< Template of each test's temporary folder
+#define TEST_MD5 "0123456789abcdef0123456789abcdef"	///< MD5 of every shared file in the tests
+#define TEST_HEADER "Filename: a.txt\nFilesize: 30\nDescription: d\nMD5: " TEST_MD5	///< Header of the "a.txt" tracker
+#define TEST_MAX_RECORDS 16							///< Most records a test collects from walReplay()
+#define TEST_WHEEL_START 1000037L					///< Clock of the wheel in the timer tests, not on a slot boundary of any level
+#define TEST_SERVER "server.out"					///< Server binary the parser tests run, relative to the current folder
+#define TEST_PORT_BASE 20000						///< The parser tests' server listens on this port plus the test's process ID modulo 10000
+#define TEST_TIMEOUT_MS 2000						///< Longest wait for the server to start or to answer
+#define TEST_WHEEL_RANGE ( 1L << ( WHEEL_BITS * WHEEL_LEVELS ) )	///< Furthest deadline the wheel holds without clamping it
+
+/*-----------------------------------
+            Globals
+-----------------------------------*/
+static int failures = 0;								///< Number of failed checks in the current test
+static char replayed[ TEST_MAX_RECORDS ][ 128 ];		///< Records handed to collectRecord() by walReplay()
+static unsigned long replayed_lsn[ TEST_MAX_RECORDS ];	///< LSNs of \a replayed
+static int num_replayed = 0;							///< Number of records in \a replayed
+
+
+/*-----------------------------------
+            Helpers
+-----------------------------------*/
+
+/**
+ * Report one check.
+ */
+static void check( int passed, const char* name )
+{
+	printf( "[TEST] %s ... %s\n", name, passed ? "PASSED" : "FAILED" );
+	if( !passed ) failures++;
+}
+
+/**
+ * Write \a text to \a name in \a folder.
+ */
+static void writeFile( const char* folder, const char* name, const char* text )
+{
+	char path[ PATH_MAX ];
+	FILE *file;
+
+	snprintf( path, sizeof( path ), "%s/%s", folder, name );
+	if( ( file = fopen( path, "w" ) ) == NULL )
+	{
+		perror( "Test Error: can't write test file" );
+		exit( 1 );
+	}
+	fputs( text, file );
+	fclose( file );
+}
+
+/**
+ * Delete a test folder and everything in it.
+ */
+static void removeFolder( const char* folder )
+{
+	char path[ PATH_MAX ];
+	DIR *directory;
+	struct dirent *entry;
+
+	if( ( directory = opendir( folder ) ) == NULL ) return;
+	while( ( entry = readdir( directory ) ) != NULL )
+	{
+		if( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 ) continue;
+		snprintf( path, sizeof( path ), "%s/%s", folder, entry->d_name );
+		if( unlink( path ) != 0 ) removeFolder( path );
+	}
+	closedir( directory );
+	rmdir( folder );
+}
+
+/**
+ * Run a test in a child process, with a fresh temporary folder. Returns 1 if it failed or crashed.
+ */
+static int runTest( void (*test)( const char* ), const char* name )
+{
+	char folder[] = TEST_FOLDER;
+	int status;
+	pid_t pid;
+
+	printf( "\n[TEST] ======== %s ========\n", name );
+	fflush( stdout );
+	if( mkdtemp( folder ) == NULL )
+	{
+		perror( "Test Error: can't create test folder" );
+		return 1;
+	}
+	if( ( pid = fork() ) == 0 )
+	{
+		test( folder );
+		fflush( stdout );
+		_exit( failures > 0 ? 1 : 0 );
+	}
+	waitpid( pid, &status, 0 );
+	removeFolder( folder );
+
+	if( !WIFEXITED( status ) )
+	{
+		printf( "[TEST] %s ... CRASHED\n", name );
+		return 1;
+	}
+	return WEXITSTATUS( status ) != 0;
+}
+
+/**
+ * Check that text returned by the store is exactly \a expected, and free it.
+ */
+static void checkText( char* text, size_t length, const char* expected, const char* name )
+{
+	check( text != NULL && length == strlen( expected ) && memcmp( text, expected, length ) == 0, name );
+	if( text != NULL && ( length != strlen( expected ) || memcmp( text, expected, length ) != 0 ) )
+	{
+		printf( "       got: \"%.*s\"\n  expected: \"%s\"\n", (int) length, text, expected );
+	}
+	free( text );
+}
+
+/**
+ * Check that a selection of a tracker is exactly \a expected.
+ */
+static void checkSelect( long start_byte, long end_byte, int max_peers, const char* expected, const char* name )
+{
+	size_t length;
+	char *text = storeSelect( "a.txt" TRACKER_SUFFIX, start_byte, end_byte, max_peers, &length, NULL );
+	checkText( text, length, expected, name );
+}
+
+/**
+ * Check that a tracker, as served from memory, is exactly \a expected.
+ */
+static void checkTracker( const char* tracker_filename, const char* expected, const char* name )
+{
+	size_t length;
+	char *text = storeSerialize( tracker_filename, &length, NULL );
+	checkText( text, length, expected, name );
+}
+
+
+/*-----------------------------------
+        Write-ahead log
+-----------------------------------*/
+
+/**
+ * Keep each record walReplay() hands back.
+ */
+static void collectRecord( unsigned long lsn, char* record )
+{
+	if( num_replayed < TEST_MAX_RECORDS )
+	{
+		replayed_lsn[ num_replayed ] = lsn;
+		snprintf( replayed[ num_replayed ], sizeof( replayed[0] ), "%s", record );
+	}
+	num_replayed++;
+}
+
+/**
+ * A line without its newline was torn by a crash: replay stops at it, and its LSN is never reused as the last one.
+ */
+static void testTornLine( const char* folder )
+{
+	unsigned long last_lsn;
+
+	writeFile( folder, "wal.00000000000000000001.log",
+		"1 C a.txt 30 d " TEST_MD5 "\n"
+		"2 U a.txt 1.2.3.4 5 0 9 100\n"
+		"3 U a.txt 1.2.3.4 5 10 1" );
+
+	int count = walReplay( folder, &collectRecord, &last_lsn );
+
+	check( count == 2 && num_replayed == 2, "replays the complete lines only" );
+	check( num_replayed >= 2 && replayed_lsn[0] == 1 && strcmp( replayed[0], "C a.txt 30 d " TEST_MD5 ) == 0
+		&& replayed_lsn[1] == 2 && strcmp( replayed[1], "U a.txt 1.2.3.4 5 0 9 100" ) == 0, "hands back each record without its LSN or newline" );
+	check( last_lsn == 2, "last LSN is the last complete line" );
+}
+
+/**
+ * A group the log writer could not finish writing leaves no part of it in front of the next group: replay reads the groups
+ * on either side of it whole. A file size limit makes the write stop partway through the group.
+ */
+static void testTornGroup( const char* folder )
+{
+	unsigned long last_lsn;
+	struct rlimit limit;
+
+	walReplay( folder, &collectRecord, &last_lsn );
+	walOpen( folder, last_lsn );
+	signal( SIGXFSZ, SIG_IGN );
+	getrlimit( RLIMIT_FSIZE, &limit );
+
+	struct rlimit small = limit;
+	small.rlim_cur = 40;
+	setrlimit( RLIMIT_FSIZE, &small );
+
+	check( walSync( walAppend( "U a.txt 1.2.3.4 5 0 9 100" ) ) == 0, "syncs a group that fits" );
+	check( walSync( walAppend( "U a.txt 1.2.3.4 5 10 19 101" ) ) == -1, "fails a group cut short" );
+	setrlimit( RLIMIT_FSIZE, &limit );
+	walSync( walAppend( "U a.txt 1.2.3.4 5 20 29 102" ) );
+	walClose();
+
+	num_replayed = 0;
+	int count = walReplay( folder, &collectRecord, &last_lsn );
+
+	check( count == 2 && num_replayed == 2, "replays the groups around the failed one" );
+	check( num_replayed >= 2 && replayed_lsn[0] == 1 && strcmp( replayed[0], "U a.txt 1.2.3.4 5 0 9 100" ) == 0
+		&& replayed_lsn[1] == 3 && strcmp( replayed[1], "U a.txt 1.2.3.4 5 20 29 102" ) == 0, "replays no part of the failed group" );
+}
+
+/**
+ * Changes up to the checkpoint are already in the tracker files, and are not replayed.
+ */
+static void testCheckpoint( const char* folder )
+{
+	unsigned long last_lsn;
+
+	writeFile( folder, WAL_CHECKPOINT, "2\n" );
+	writeFile( folder, "wal.00000000000000000001.log",
+		"1 C a.txt 30 d " TEST_MD5 "\n"
+		"2 U a.txt 1.2.3.4 5 0 9 100\n" );
+	writeFile( folder, "wal.00000000000000000003.log",
+		"3 U a.txt 1.2.3.4 5 10 19 101\n" );
+
+	int count = walReplay( folder, &collectRecord, &last_lsn );
+
+	check( count == 1 && num_replayed == 1 && replayed_lsn[0] == 3, "skips changes covered by the checkpoint" );
+	check( last_lsn == 3, "last LSN spans every segment" );
+}
+
+/**
+ * The server crashed after writing the tracker file but before the checkpoint: the records at the end of the file are
+ * replayed again, and must not be doubled.
+ */
+static void testReplayedDuplicates( const char* folder )
+{
+	writeFile( folder, "a.txt" TRACKER_SUFFIX, TEST_HEADER
+		"\n1.2.3.4:5:0:9:100"
+		"\n1.2.3.4:5:10:19:101" );
+	writeFile( folder, "wal.00000000000000000001.log",
+		"1 C a.txt 30 d " TEST_MD5 "\n"
+		"2 U a.txt 1.2.3.4 5 0 9 100\n"
+		"3 U a.txt 1.2.3.4 5 10 19 101\n"
+		"4 U a.txt 1.2.3.4 5 20 29 102\n" );
+
+	check( storeInit( folder, 0 ) == STORE_OK, "store starts" );
+	checkTracker( "a.txt" TRACKER_SUFFIX, TEST_HEADER
+		"\n1.2.3.4:5:0:9:100"
+		"\n1.2.3.4:5:10:19:101"
+		"\n1.2.3.4:5:20:29:102", "drops replayed records already in the tracker file" );
+	storeShutdown();
+}
+
+/**
+ * Replayed records that do not repeat the end of the tracker file are all kept, even when they repeat an earlier record.
+ */
+static void testReplayedNewRecords( const char* folder )
+{
+	writeFile( folder, "a.txt" TRACKER_SUFFIX, TEST_HEADER
+		"\n1.2.3.4:5:0:9:100"
+		"\n1.2.3.4:5:10:19:101" );
+	writeFile( folder, "wal.00000000000000000003.log",
+		"3 U a.txt 1.2.3.4 5 0 9 100\n"
+		"4 U a.txt 1.2.3.4 5 20 29 102\n" );
+
+	check( storeInit( folder, 0 ) == STORE_OK, "store starts" );
+	checkTracker( "a.txt" TRACKER_SUFFIX, TEST_HEADER
+		"\n1.2.3.4:5:0:9:100"
+		"\n1.2.3.4:5:10:19:101"
+		"\n1.2.3.4:5:0:9:100"
+		"\n1.2.3.4:5:20:29:102", "keeps replayed records that are not a repeat of the file's end" );
+	storeShutdown();
+}
+
+
+/*-----------------------------------
+            Filenames
+-----------------------------------*/
+
+/**
+ * A tracker can only be created under a plain name, so that its tracker file lies in the tracker folder.
+ */
+static void testFilenames( const char* folder )
+{
+	char path[ PATH_MAX ];
+	const char *names[] = { "../escaped", "sub/escaped", "/tmp/escaped", ".", "..", "" };
+	int refused = 1;
+
+	check( storeInit( folder, 0 ) == STORE_OK, "store starts" );
+	for( size_t n = 0; n < sizeof( names ) / sizeof( names[0] ); n++ )
+	{
+		if( storeCreate( names[n], "30", "d", TEST_MD5, NULL ) != STORE_FAIL )
+		{
+			printf( "       \"%s\" was not refused\n", names[n] );
+			refused = 0;
+		}
+	}
+	check( refused, "refuses names with a '/', \".\", \"..\" and the empty name" );
+	check( storeCreate( "..a.txt", "30", "d", TEST_MD5, NULL ) == STORE_OK, "accepts other names with dots" );
+	storeShutdown();
+
+	snprintf( path, sizeof( path ), "%s/../escaped" TRACKER_SUFFIX, folder );
+	check( access( path, F_OK ) != 0, "writes no tracker file outside the tracker folder" );
+}
+
+/*-----------------------------------
+            Paging
+-----------------------------------*/
+
+/**
+ * Names of the trackers visited, across pages.
+ */
+struct page_context
+{
+	char	names[ 512 ];						///< Filenames visited, each followed by a space
+	char	last[ 64 ];							///< Last filename visited, the cursor of the next page
+};
+
+/**
+ * Keep the name of each tracker storeForEachMatch() visits.
+ */
+static void collectName( const struct tracker* t, void* arg )
+{
+	struct page_context *context = (struct page_context*) arg;
+	strcat( context->names, t->filename );
+	strcat( context->names, " " );
+	strcpy( context->last, t->filename );
+}
+
+/**
+ * Page through the trackers starting with "a" that match \a substring, \a limit at a time, and check that every page but the
+ * last is full and says there is more, and that the pages visit \a expected, each once, in order.
+ */
+static void checkPages( const char* substring, size_t limit, const char* expected, const char* name )
+{
+	struct page_context context;
+	int more = 1, pages_valid = 1;
+
+	context.names[0] = '\0';
+	context.last[0] = '\0';
+	for( int pages = 0; more == 1; pages++ )
+	{
+		int count = storeForEachMatch( "a", substring, context.last[0] == '\0' ? NULL : context.last, limit, &collectName, &context, &more );
+		if( count < 0 || (size_t) count > limit || ( more == 1 && (size_t) count != limit ) || ( count == 0 && more == 1 )
+			|| strlen( context.names ) > strlen( expected ) || pages > TEST_MAX_RECORDS )
+		{
+			printf( "       a page of %d says there is %smore\n", count, more ? "" : "no " );
+			pages_valid = 0;
+			break;
+		}
+	}
+	if( strcmp( context.names, expected ) != 0 )
+	{
+		printf( "       visited \"%s\"\n", context.names );
+	}
+	check( pages_valid && strcmp( context.names, expected ) == 0, name );
+}
+
+/**
+ * Pages of the trackers with a prefix, filtered by a substring of their filename or description, resume after the cursor.
+ */
+static void testPaging( const char* folder )
+{
+	char filename[ 16 ];
+	struct page_context context;
+	int more;
+
+	check( storeInit( folder, 0 ) == STORE_OK, "store starts" );
+
+	/** The even trackers of "a0.txt" to "a9.txt" match "keep" by description, "akeep.txt" by filename. Trackers before and
+	 * after the prefix match it too. */
+	for( int n = 0; n < 10; n++ )
+	{
+		snprintf( filename, sizeof( filename ), "a%d.txt", n );
+		storeCreate( filename, "30", ( n % 2 == 0 ) ? "keep" : "drop", TEST_MD5, NULL );
+	}
+	storeCreate( "akeep.txt", "30", "d", TEST_MD5, NULL );
+	storeCreate( "a.txt", "30", "keep", TEST_MD5, NULL );
+	storeCreate( "Z.txt", "30", "keep", TEST_MD5, NULL );
+	storeCreate( "b.txt", "30", "keep", TEST_MD5, NULL );
+
+	const char *kept = "a.txt a0.txt a2.txt a4.txt a6.txt a8.txt akeep.txt ";
+	checkPages( "keep", 1, kept, "pages one match at a time" );
+	checkPages( "keep", 2, kept, "pages two matches at a time, the last page short" );
+	checkPages( "keep", 7, kept, "fits every match in a full page with no more after it" );
+	checkPages( "keep", 100, kept, "fits every match in a page that is not full" );
+	checkPages( NULL, 4, "a.txt a0.txt a1.txt a2.txt a3.txt a4.txt a5.txt a6.txt a7.txt a8.txt a9.txt akeep.txt ",
+		"pages every tracker with the prefix without a substring" );
+
+	/** A page with room for nothing visits nothing, but still says whether there are matches. */
+	context.names[0] = '\0';
+	check( storeForEachMatch( "a", "keep", NULL, 0, &collectName, &context, &more ) == 0 && more == 1 && context.names[0] == '\0',
+		"a limit of 0 visits nothing and says there is more" );
+	check( storeForEachMatch( "a", "nothing", NULL, 0, &collectName, &context, &more ) == 0 && more == 0,
+		"a limit of 0 says there is no more when nothing matches" );
+
+	/** A tracker created before the cursor between two pages does not shift the next one. */
+	context.names[0] = '\0';
+	storeForEachMatch( "a", "keep", NULL, 3, &collectName, &context, &more );
+	storeCreate( "a.a.txt", "30", "keep", TEST_MD5, NULL );
+	storeForEachMatch( "a", "keep", "a2.txt", 3, &collectName, &context, &more );
+	storeForEachMatch( "a", "keep", "a8.txt", 3, &collectName, &context, &more );
+	check( strcmp( context.names, kept ) == 0 && more == 0, "resumes after the cursor when a tracker is created before it" );
+
+	storeShutdown();
+}
+
+
+/*-----------------------------------
+        Spans and selection
+-----------------------------------*/
+
+/**
+ * Records that overlap or touch are merged into one span per contiguous range, carrying the latest time among them. End bytes are
+ * inclusive, so 0:9 and 10:19 touch, while 60:69 and 71:79 leave byte 70 between them.
+ */
+static void testSpanMerge( const char* folder )
+{
+	size_t length;
+
+	writeFile( folder, "a.txt" TRACKER_SUFFIX, TEST_HEADER
+		"\n1.2.3.4:5:0:9:100"
+		"\n1.2.3.4:5:10:19:101"
+		"\n1.2.3.4:5:30:39:102"
+		"\n1.2.3.4:5:35:49:103"
+		"\n1.2.3.4:5:60:69:104"
+		"\n1.2.3.4:5:71:79:105"
+		"\n1.2.3.4:5:90:99:106"
+		"\n1.2.3.4:5:80:89:107" );
+
+	check( storeInit( folder, 0 ) == STORE_OK, "store starts" );
+	checkSelect( 0, 1000, 0, TEST_HEADER
+		"\n1.2.3.4:5:0:19:101"
+		"\n1.2.3.4:5:30:49:103"
+		"\n1.2.3.4:5:60:69:104"
+		"\n1.2.3.4:5:71:99:107", "merges records that overlap or touch, and no others" );
+
+	/** Announced ranges are collapsed the same way before they are logged. */
+	struct tracker_range ranges[] = { { 110, 119 }, { 100, 109 }, { 125, 120 }, { 130, 139 } };
+	size_t num_ranges = sizeof( ranges ) / sizeof( ranges[0] );
+	check( storeUpdateRanges( "a.txt", "1.2.3.4", 6, ranges, &num_ranges, NULL ) == STORE_OK
+		&& num_ranges == 2 && ranges[0].start_byte == 100 && ranges[0].end_byte == 125
+		&& ranges[1].start_byte == 130 && ranges[1].end_byte == 139, "collapses announced ranges that overlap or touch" );
+
+	char *text = storeSelect( "a.txt" TRACKER_SUFFIX, 100, 139, 0, &length, NULL );
+	check( text != NULL && strstr( text, "\n1.2.3.4:6:100:125:" ) != NULL && strstr( text, "\n1.2.3.4:6:130:139:" ) != NULL
+		&& strstr( text, "1.2.3.4:5:" ) == NULL, "indexes the collapsed ranges as spans" );
+	free( text );
+	storeShutdown();
+}
+
+/**
+ * A byte range selects every peer with a span that holds any byte of it, both ends included, latest first.
+ */
+static void testSelectInclusive( const char* folder )
+{
+	writeFile( folder, "a.txt" TRACKER_SUFFIX, TEST_HEADER
+		"\n1.2.3.4:6:0:9:200"
+		"\n1.2.3.4:7:10:19:201"
+		"\n1.2.3.4:8:20:29:202" );
+
+	check( storeInit( folder, 0 ) == STORE_OK, "store starts" );
+	checkSelect( 9, 9, 0, TEST_HEADER
+		"\n1.2.3.4:6:0:9:200", "selects a span by its last byte" );
+	checkSelect( 10, 10, 0, TEST_HEADER
+		"\n1.2.3.4:7:10:19:201", "selects a span by its first byte" );
+	checkSelect( 19, 20, 0, TEST_HEADER
+		"\n1.2.3.4:8:20:29:202"
+		"\n1.2.3.4:7:10:19:201", "selects every span the range touches, latest first" );
+	checkSelect( 0, 29, 1, TEST_HEADER
+		"\n1.2.3.4:8:20:29:202", "keeps only the latest peers" );
+	checkSelect( 30, 40, 0, TEST_HEADER,
+		"selects no peer past the last span" );
+	storeShutdown();
+}
+
+
+/*-----------------------------------
+            Peer expiry
+-----------------------------------*/
+
+/**
+ * Count the records of peer \a port_num in tracker text.
+ */
+static int countRecords( const char* text, int port_num )
+{
+	char pattern[ 32 ];
+	int count = 0;
+
+	snprintf( pattern, sizeof( pattern ), "\n1.2.3.4:%d:", port_num );
+	for( const char *found = text; ( found = strstr( found, pattern ) ) != NULL; found++ ) count++;
+	return count;
+}
+
+/**
+ * Peers that stop announcing have their records dropped, even from a tracker other peers keep announcing to. A peer that announces
+ * again after expiring keeps only its new records.
+ */
+static void testExpiry( const char* folder )
+{
+	char path[ PATH_MAX ];
+	size_t length;
+	char *text = NULL;
+	int updates = 0, announced_again = 0, dropped = 0;
+
+	writeFile( folder, "a.txt" TRACKER_SUFFIX, TEST_HEADER
+		"\n1.2.3.4:5:0:9:100"
+		"\n1.2.3.4:5:10:19:100"
+		"\n1.2.3.4:7:20:29:100" );
+
+	check( storeInit( folder, 3 ) == STORE_OK, "store starts" );
+
+	/** Peer 6 announces every 50 milliseconds; peers 5 and 7 are long past their deadline and expire on the first pass. */
+	for( int waited = 0; waited < 6000 && dropped < 30; waited += 50 )
+	{
+		if( storeUpdate( "a.txt", "1.2.3.4", 6, updates * 10, updates * 10 + 9, NULL ) == STORE_OK ) updates++;
+
+		if( announced_again == 0 )
+		{
+			char *selected = storeSelect( "a.txt" TRACKER_SUFFIX, 20, 29, 0, &length, NULL );
+			if( selected != NULL && countRecords( selected, 7 ) == 0 )
+			{
+				announced_again = ( storeUpdate( "a.txt", "1.2.3.4", 7, 1000, 1009, NULL ) == STORE_OK );
+			}
+			free( selected );
+		}
+
+		/** Once the records are dropped, keep going long enough for the file to be rewritten. */
+		free( text );
+		text = storeSerialize( "a.txt" TRACKER_SUFFIX, &length, NULL );
+		if( text != NULL && countRecords( text, 5 ) == 0 && strstr( text, "\n1.2.3.4:7:20:29:" ) == NULL ) dropped++;
+		usleep( 50000 );
+	}
+
+	check( dropped > 0, "drops the records of expired peers while the tracker keeps changing" );
+	check( text != NULL && countRecords( text, 6 ) == updates, "keeps every record of the peer still announcing" );
+	check( announced_again == 1 && text != NULL && strstr( text, "\n1.2.3.4:7:1000:1009:" ) != NULL && countRecords( text, 7 ) == 1,
+		"keeps only the new records of a peer that announced again" );
+	storeShutdown();
+
+	/** The tracker file is rewritten without the dropped records. */
+	free( text );
+	text = storeSerialize( "a.txt" TRACKER_SUFFIX, &length, NULL );
+	snprintf( path, sizeof( path ), "%s/a.txt" TRACKER_SUFFIX, folder );
+	FILE *file = fopen( path, "r" );
+	char *on_disk = (char*) calloc( 1, length + 2 );
+	size_t read = ( file != NULL && on_disk != NULL ) ? fread( on_disk, 1, length + 1, file ) : 0;
+	check( text != NULL && read == length && memcmp( on_disk, text, length ) == 0, "rewrites the tracker file without them" );
+	if( file != NULL ) fclose( file );
+	free( on_disk );
+	free( text );
+}
+
+
+/*-----------------------------------
+            Timer wheel
+-----------------------------------*/
+
+/**
+ * Deadlines of the timer tests, as seconds after \a TEST_WHEEL_START: already due, on level 0, on either side of each level's
+ * boundary, and beyond the wheel's range.
+ */
+static const long wheel_offsets[] = { -5, 0, 1, 2, 63, 64, 65, 100, 4095, 4096, 4097, 200000, 262143, 262144, 300000,
+									  TEST_WHEEL_RANGE - 1, TEST_WHEEL_RANGE, TEST_WHEEL_RANGE + 1000 };
+#define TEST_WHEEL_TIMERS ( sizeof( wheel_offsets ) / sizeof( wheel_offsets[0] ) )
+
+/**
+ * Add a timer for each of \a wheel_offsets, whose \a data is its index.
+ */
+static void addTimers( struct wheel_timer* timers )
+{
+	wheelInit( TEST_WHEEL_START );
+	for( size_t n = 0; n < TEST_WHEEL_TIMERS; n++ )
+	{
+		timers[n].deadline = TEST_WHEEL_START + wheel_offsets[n];
+		timers[n].data = (void*) n;
+		wheelAdd( &timers[n] );
+	}
+}
+
+/**
+ * Advancing one second at a time, each timer is cascaded down the levels and expires in exactly the second it is due, once.
+ * A timer that was already due when it was added expires in the first second.
+ */
+static void testWheelCascade( const char* folder )
+{
+	struct wheel_timer timers[ TEST_WHEEL_TIMERS ];
+	long expired_at[ TEST_WHEEL_TIMERS ];
+	int expired_twice = 0;
+	long now;
+
+	addTimers( timers );
+	for( size_t n = 0; n < TEST_WHEEL_TIMERS; n++ ) expired_at[n] = 0;
+
+	for( now = TEST_WHEEL_START + 1; now <= TEST_WHEEL_START + TEST_WHEEL_RANGE + 1000; now++ )
+	{
+		for( struct wheel_timer *timer = wheelAdvance( now ); timer != NULL; timer = timer->next )
+		{
+			size_t n = (size_t) timer->data;
+			if( expired_at[n] != 0 ) expired_twice = 1;
+			expired_at[n] = now;
+		}
+	}
+
+	int on_time = 1;
+	for( size_t n = 0; n < TEST_WHEEL_TIMERS; n++ )
+	{
+		long due = ( wheel_offsets[n] < 1 ) ? TEST_WHEEL_START + 1 : TEST_WHEEL_START + wheel_offsets[n];
+		if( expired_at[n] != due )
+		{
+			printf( "       timer due at +%ld expired at +%ld\n", wheel_offsets[n], expired_at[n] - TEST_WHEEL_START );
+			on_time = 0;
+		}
+	}
+	check( on_time, "every timer expires in the second it is due" );
+	check( !expired_twice, "no timer expires twice" );
+	check( wheelAdvance( now + TEST_WHEEL_RANGE ) == NULL, "wheel is empty once every timer has expired" );
+}
+
+/**
+ * Advancing several seconds at once expires every timer due in between, and none that are due later.
+ */
+static void testWheelJump( const char* folder )
+{
+	struct wheel_timer timers[ TEST_WHEEL_TIMERS ];
+	size_t expected = 0, count = 0;
+	int early = 0;
+
+	addTimers( timers );
+	for( size_t n = 0; n < TEST_WHEEL_TIMERS; n++ )
+	{
+		if( wheel_offsets[n] <= 4096 ) expected++;
+	}
+
+	for( struct wheel_timer *timer = wheelAdvance( TEST_WHEEL_START + 4096 ); timer != NULL; timer = timer->next )
+	{
+		if( timer->deadline > TEST_WHEEL_START + 4096 ) early = 1;
+		count++;
+	}
+	check( count == expected && !early, "expires exactly the timers due up to the new time" );
+
+	count = 0;
+	for( struct wheel_timer *timer = wheelAdvance( TEST_WHEEL_START + 4097 ); timer != NULL; timer = timer->next )
+	{
+		if( timer->deadline == TEST_WHEEL_START + 4097 ) count++;
+		else early = 1;
+	}
+	check( count == 1 && !early, "expires the next timer a second later" );
+}
+
+
+/*-----------------------------------
+        Latency histograms
+-----------------------------------*/
+static const unsigned long long bucket_values[] = { 0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 1000, 1ULL << 62, ( 1ULL << 63 ) - 1,
+													1ULL << 63, ULLONG_MAX };	///< Values around the bucket boundaries
+
+/**
+ * Values below \a STATS_SUB_BUCKETS each have a bucket, and every power of 2 above is split into \a STATS_SUB_BUCKETS buckets.
+ */
+static void testBuckets( const char* folder )
+{
+	(void) folder;
+
+	check( bucketOf( 15 ) == 15 && bucketLimit( 15 ) == 15, "counts a value below the sub-buckets exactly" );
+	check( bucketOf( 16 ) == 16 && bucketLimit( 16 ) == 16 && bucketOf( 31 ) == 31 && bucketLimit( 31 ) == 31,
+		"counts the first power of 2 exactly" );
+	check( bucketOf( 32 ) == 32 && bucketOf( 33 ) == 32 && bucketLimit( 32 ) == 33, "counts two values a bucket above 32" );
+	check( bucketOf( 1ULL << 63 ) == ( 64 - STATS_SUB_BITS ) * STATS_SUB_BUCKETS
+		&& bucketLimit( bucketOf( 1ULL << 63 ) ) == ( 1ULL << 63 ) + ( 1ULL << ( 63 - STATS_SUB_BITS ) ) - 1, "splits 2^63 and above evenly" );
+	check( bucketOf( ULLONG_MAX ) == STATS_BUCKETS - 1 && bucketLimit( STATS_BUCKETS - 1 ) == ULLONG_MAX, "counts the largest value in the last bucket" );
+
+	/** Each value lands in the one bucket whose range holds it. */
+	int passed = 1;
+	for( size_t i = 0; i < sizeof( bucket_values ) / sizeof( bucket_values[0] ); i++ )
+	{
+		int bucket = bucketOf( bucket_values[i] );
+		if( bucketLimit( bucket ) < bucket_values[i] || ( bucket > 0 && bucketLimit( bucket - 1 ) >= bucket_values[i] ) )
+		{
+			printf( "       %llu is counted in bucket %d\n", bucket_values[i], bucket );
+			passed = 0;
+		}
+	}
+	check( passed, "counts every value in the bucket that covers it" );
+}
+
+/**
+ * A percentile is the limit of the bucket holding it, but never past the longest time recorded.
+ */
+static void testPercentiles( const char* folder )
+{
+	struct stats_counts totals;
+	(void) folder;
+
+	/** 89 commands of 10 ns, 10 of 1000 ns and 1 of 5000 ns. */
+	for( int i = 0; i < 89; i++ ) statsCommand( 1, 0, 10 );
+	for( int i = 0; i < 10; i++ ) statsCommand( 1, 0, 1000 );
+	statsCommand( 1, 0, 5000 );
+	statsCollect( &totals );
+
+	check( statsPercentile( &totals, 1, 0.5 ) == 10, "p50 is exact for a value below the sub-buckets" );
+	check( statsPercentile( &totals, 1, 0.89 ) == 10, "p89 is the last of the shortest commands" );
+	check( statsPercentile( &totals, 1, 0.9 ) == 1023 && statsPercentile( &totals, 1, 0.99 ) == 1023, "p90 and p99 are the limit of the bucket of 1000 ns" );
+	check( statsPercentile( &totals, 1, 1.0 ) == 5000, "p100 is the longest time recorded" );
+	check( statsPercentile( &totals, 1, 0.0 ) == 10, "p0 is the shortest bucket recorded" );
+	check( statsPercentile( &totals, 2, 0.5 ) == 0, "no command processed gives 0" );
+}
+
+
+/*-----------------------------------
+            Command parser
+-----------------------------------*/
+
+#define TEST_CREATE "<createtracker a.txt 30 d " TEST_MD5 " 1.2.3.4 5>"	///< Creates the "a.txt" tracker
+#define TEST_LIST_REPLY "<REP LIST 1>\n<1 a.txt 30 " TEST_MD5 ">\n<REP LIST END>\n"	///< REQ LIST once "a.txt" exists
+
+/**
+ * Start a server in \a folder, listening on \a port. Returns its process ID.
+ */
+static pid_t startServer( const char* folder, int port )
+{
+	char server[ PATH_MAX ], port_text[ 16 ];
+	pid_t pid;
+
+	if( realpath( TEST_SERVER, server ) == NULL )
+	{
+		perror( "Test Error: can't find " TEST_SERVER ", run \"make server\" first" );
+		exit( 1 );
+	}
+	snprintf( port_text, sizeof( port_text ), "%d", port );
+	if( ( pid = fork() ) == 0 )
+	{
+		if( chdir( folder ) != 0 || freopen( "/dev/null", "w", stdout ) == NULL ) _exit( 1 );
+		execl( server, server, port_text, (char*) NULL );
+		_exit( 1 );
+	}
+	return pid;
+}
+
+/**
+ * Connect to the server on \a port, waiting for it to start. Returns the socket, or -1.
+ */
+static int connectServer( int port )
+{
+	struct sockaddr_in address;
+	int one = 1;
+
+	memset( &address, 0, sizeof( address ) );
+	address.sin_family = AF_INET;
+	address.sin_port = htons( port );
+	address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+	for( int waited = 0; waited < TEST_TIMEOUT_MS; waited += 10 )
+	{
+		int sock = socket( AF_INET, SOCK_STREAM, 0 );
+		if( connect( sock, (struct sockaddr*) &address, sizeof( address ) ) == 0 )
+		{
+			/** Each fragment goes out in its own segment. */
+			setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+			return sock;
+		}
+		close( sock );
+		usleep( 10000 );
+	}
+	return -1;
+}
+
+/**
+ * Send \a text in pieces of \a fragment bytes, pausing between them so that the server reads each one on its own.
+ */
+static void sendFragments( int sock, const char* text, size_t fragment )
+{
+	size_t length = strlen( text );
+	for( size_t sent = 0; sent < length; sent += fragment )
+	{
+		size_t piece = ( length - sent < fragment ) ? length - sent : fragment;
+		if( send( sock, text + sent, piece, MSG_NOSIGNAL ) != (ssize_t) piece ) return;
+		if( sent + piece < length ) usleep( 2000 );
+	}
+}
+
+/**
+ * Read what the server answers, until it has sent as much as \a expected, closed the connection, or fallen silent, and compare.
+ */
+static void checkReply( int sock, const char* expected, const char* name )
+{
+	size_t length = strlen( expected ), received = 0;
+	char *reply = (char*) malloc( length + 1 );
+	struct pollfd ready = { sock, POLLIN, 0 };
+	ssize_t got = 1;
+
+	while( received < length && got > 0 && poll( &ready, 1, TEST_TIMEOUT_MS ) == 1 )
+	{
+		if( ( got = recv( sock, reply + received, length - received, 0 ) ) > 0 ) received += got;
+	}
+	checkText( reply, received, expected, name );
+}
+
+/**
+ * Commands are found by their closing '>', however they are split across reads and however many arrive in one.
+ */
+static void testParser( const char* folder )
+{
+	int port = TEST_PORT_BASE + getpid() % 10000;
+	pid_t server = startServer( folder, port );
+	int sock;
+
+	/** Several commands in one write, some with nothing between them. */
+	const char *batch = "<KEEPALIVE>\n" TEST_CREATE "\n" TEST_CREATE "<updatetracker a.txt 0 9 1.2.3.4 5><updatetracker b.txt 0 9 1.2.3.4 5>\n<REQ LIST>\n";
+	const char *batch_reply = "<KEEPALIVE ok>\n<createtracker succ>\n<createtracker ferr>\n<updatetracker succ>\n<updatetracker ferr>\n" TEST_LIST_REPLY;
+
+	check( ( sock = connectServer( port ) ) != -1, "server starts" );
+	if( sock != -1 )
+	{
+		sendFragments( sock, batch, strlen( batch ) );
+		checkReply( sock, batch_reply, "answers every command of a batch, in order" );
+		close( sock );
+	}
+
+	/** The same commands one byte at a time, and in pieces that split them anywhere, including right before a '>'. */
+	const size_t fragments[] = { 1, 2, 7 };
+	const char *fragment_names[] = { "answers commands sent one byte at a time", "answers commands sent two bytes at a time",
+									 "answers commands sent seven bytes at a time" };
+	for( size_t n = 0; n < sizeof( fragments ) / sizeof( fragments[0] ); n++ )
+	{
+		if( ( sock = connectServer( port ) ) == -1 ) continue;
+		sendFragments( sock, "<KEEPALIVE>\n" TEST_CREATE "\n<updatetracker a.txt 10 19 1.2.3.4 5>\n<REQ LIST>\n", fragments[n] );
+		checkReply( sock, "<KEEPALIVE ok>\n<createtracker ferr>\n<updatetracker succ>\n" TEST_LIST_REPLY, fragment_names[n] );
+		close( sock );
+	}
+
+	/** A filename that would put the tracker file outside the tracker folder is refused. */
+	if( ( sock = connectServer( port ) ) != -1 )
+	{
+		sendFragments( sock, "<createtracker ../a.txt 30 d " TEST_MD5 " 1.2.3.4 5>", 64 );
+		checkReply( sock, "<createtracker fail>\n", "refuses a filename with a path in it" );
+		close( sock );
+	}
+
+	/** An update with a field that is not a number is refused, rather than stored as byte or port 0. */
+	if( ( sock = connectServer( port ) ) != -1 )
+	{
+		const char *updates = "<KEEPALIVE>\n<updatetracker a.txt abc 10 1.2.3.4 5>\n<updatetracker a.txt 0 1x 1.2.3.4 5>\n"
+							  "<updatetracker a.txt 0 10 1.2.3.4 xyz>\n";
+		sendFragments( sock, updates, strlen( updates ) );
+		checkReply( sock, "<KEEPALIVE ok>\n<updatetracker fail>\n<updatetracker fail>\n<updatetracker fail>\n", "refuses an update with a field that is not a number" );
+		close( sock );
+	}
+
+	/** Without keep-alive, a command split across reads is still answered once it is complete. */
+	if( ( sock = connectServer( port ) ) != -1 )
+	{
+		sendFragments( sock, "<REQ LIST>", 3 );
+		checkReply( sock, TEST_LIST_REPLY, "answers a single command split across reads" );
+		close( sock );
+	}
+
+	kill( server, SIGTERM );
+	waitpid( server, NULL, 0 );
+}
+
+
+/*-----------------------------------
+            Main for testing
+-----------------------------------*/
+int main()
+{
+	int failed = 0;
+
+	failed += runTest( &testTornLine, "WAL replay of a torn line" );
+	failed += runTest( &testTornGroup, "WAL replay after a failed group" );
+	failed += runTest( &testCheckpoint, "WAL replay after a checkpoint" );
+	failed += runTest( &testReplayedDuplicates, "WAL replay over a tracker file written before the crash" );
+	failed += runTest( &testReplayedNewRecords, "WAL replay of new records" );
+	failed += runTest( &testFilenames, "Tracker filenames" );
+	failed += runTest( &testPaging, "Paging through matching trackers" );
+	failed += runTest( &testSpanMerge, "Span merge" );
+	failed += runTest( &testSelectInclusive, "Selection over an inclusive byte range" );
+	failed += runTest( &testExpiry, "Peer expiry" );
+	failed += runTest( &testWheelCascade, "Timer wheel, one second at a time" );
+	failed += runTest( &testWheelJump, "Timer wheel, several seconds at once" );
+	failed += runTest( &testBuckets, "Latency histogram buckets" );
+	failed += runTest( &testPercentiles, "Latency percentiles over known samples" );
+	failed += runTest( &testParser, "Command parser on fragmented and batched input" );
+
+	printf( "\n[TEST] %d test(s) failed\n", failed );
+	return failed;
+}
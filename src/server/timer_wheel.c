@@ -0,0 +1,132 @@
+/**
+ * @file timer_wheel.c
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @section COMPILE
+ * g++ -c timer_wheel.c
+ *  (or use make in root directory)
+ */
+
+/*-----------------------------------
+            Includes
+-----------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "timer_wheel.h"
+
+
+/*-----------------------------------
+            Variables
+-----------------------------------*/
+static struct wheel_timer *slots[ WHEEL_LEVELS ][ WHEEL_SLOTS ];	///< Timers waiting in each slot
+
+static long current = 0;									///< Last second the wheel has expired timers for
+
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;	///< Protects \a slots and \a current
+
+
+/*-----------------------------------
+        Internal functions
+-----------------------------------*/
+
+/**
+ * Put a timer in the slot it belongs in, given the wheel's clock. A timer due at \a current itself goes in level 0's current slot,
+ * which is only right while that slot is being expired. The wheel must be locked.
+ */
+static void place( struct wheel_timer* timer )
+{
+	long deadline = ( timer->deadline < current ) ? current : timer->deadline;
+	long delta = deadline - current;
+	int level = 0;
+
+	/** Level n holds timers due within WHEEL_SLOTS ^ ( n + 1 ) seconds. Anything further away waits on the top level, and is placed
+	 * again each time it is cascaded until it comes within range. */
+	while( level < WHEEL_LEVELS - 1 && delta >= ( 1L << ( WHEEL_BITS * ( level + 1 ) ) ) )
+	{
+		level++;
+	}
+	if( delta >= ( 1L << ( WHEEL_BITS * WHEEL_LEVELS ) ) )
+	{
+		deadline = current + ( 1L << ( WHEEL_BITS * WHEEL_LEVELS ) ) - 1;
+	}
+
+	struct wheel_timer **slot = &slots[ level ][ ( deadline >> ( WHEEL_BITS * level ) ) & ( WHEEL_SLOTS - 1 ) ];
+	timer->next = *slot;
+	*slot = timer;
+}
+
+
+/*-----------------------------------
+            Functions
+-----------------------------------*/
+
+void wheelInit( long now )
+{
+	pthread_mutex_lock( &wheel_mutex );
+	for( int level = 0; level < WHEEL_LEVELS; level++ )
+	{
+		for( int n = 0; n < WHEEL_SLOTS; n++ )
+		{
+			slots[ level ][ n ] = NULL;
+		}
+	}
+	current = now;
+	pthread_mutex_unlock( &wheel_mutex );
+}
+
+void wheelAdd( struct wheel_timer* timer )
+{
+	pthread_mutex_lock( &wheel_mutex );
+	/** The current second has already been expired, so a timer that is due goes in the next one. */
+	long deadline = timer->deadline;
+	if( timer->deadline <= current )
+	{
+		timer->deadline = current + 1;
+	}
+	place( timer );
+	timer->deadline = deadline;
+	pthread_mutex_unlock( &wheel_mutex );
+}
+
+struct wheel_timer* wheelAdvance( long now )
+{
+	struct wheel_timer *expired = NULL;
+
+	pthread_mutex_lock( &wheel_mutex );
+	while( current < now )
+	{
+		current++;
+
+		/** Whenever the slots of a level wrap around, the next slot of the level above is spread over the levels below. */
+		for( int level = 1; level < WHEEL_LEVELS; level++ )
+		{
+			if( ( ( current >> ( WHEEL_BITS * ( level - 1 ) ) ) & ( WHEEL_SLOTS - 1 ) ) != 0 )
+			{
+				break;
+			}
+			struct wheel_timer **slot = &slots[ level ][ ( current >> ( WHEEL_BITS * level ) ) & ( WHEEL_SLOTS - 1 ) ];
+			struct wheel_timer *timer = *slot;
+			*slot = NULL;
+			while( timer != NULL )
+			{
+				struct wheel_timer *next = timer->next;
+				place( timer );
+				timer = next;
+			}
+		}
+
+		struct wheel_timer **slot = &slots[0][ current & ( WHEEL_SLOTS - 1 ) ];
+		while( *slot != NULL )
+		{
+			struct wheel_timer *timer = *slot;
+			*slot = timer->next;
+			timer->next = expired;
+			expired = timer;
+		}
+	}
+	pthread_mutex_unlock( &wheel_mutex );
+
+	return expired;
+}
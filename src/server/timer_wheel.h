@@ -0,0 +1,67 @@
+/**
+ * @file timer_wheel.h
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @brief Header file for timer_wheel.c
+ * @details Hierarchical timer wheel, counting in whole seconds.
+ *
+ * The wheel has \a WHEEL_LEVELS levels of \a WHEEL_SLOTS slots. A timer due within \a WHEEL_SLOTS seconds sits in the slot of
+ * the second it is due in on level 0; one due later sits on the level whose slots are wide enough to hold it, and is moved down a
+ * level (cascaded) when the wheel reaches its slot. Adding a timer and expiring one are O(1), and cascading touches each timer at
+ * most once per level.
+ */
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/*-----------------------------------
+            Defines
+-----------------------------------*/
+#define WHEEL_BITS 6						///< log2 of \a WHEEL_SLOTS
+#define WHEEL_SLOTS ( 1 << WHEEL_BITS )		///< Number of slots on each level
+#define WHEEL_LEVELS 4						///< Number of levels, so timers up to WHEEL_SLOTS ^ WHEEL_LEVELS seconds away are held exactly
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * A timer. It is owned by the wheel from wheelAdd() until wheelAdvance() hands it back.
+ */
+struct wheel_timer
+{
+	long	deadline;						///< Time the timer is due, in seconds since the epoch
+	void	*data;							///< Left for the owner of the timer
+	struct wheel_timer *next;				///< Next timer in the same slot, or in the list returned by wheelAdvance()
+};
+
+/*-----------------------------------
+            Prototypes
+-----------------------------------*/
+/**
+ * Empty the wheel and set its clock.
+ *
+ * @param now Current time, in seconds since the epoch, INPUT.
+ */
+void wheelInit( long now );
+
+/**
+ * Add a timer to the wheel. A timer that is already due is expired by the next call to wheelAdvance().
+ *
+ * @param timer The timer, with its \a deadline set, INPUT.
+ */
+void wheelAdd( struct wheel_timer* timer );
+
+/**
+ * Move the wheel's clock forward, one second at a time, and take every timer that has become due.
+ *
+ * @param now Current time, in seconds since the epoch, INPUT.
+ *
+ * @return The timers that are due, linked through \a next, or NULL if there are none.
+ */
+struct wheel_timer* wheelAdvance( long now );
+
+#endif
@@ -0,0 +1,207 @@
+/**
+ * @file tracker_proto.h
+ * @authors Matthew Lindner, Xiao Deng, Madeline Cameron
+ *
+ * @brief Binary framing of the tracker protocol, shared by the server and the client.
+ * @details A connection starts out speaking the text protocol. A client that sends \<BINARY\> and gets \<BINARY ok\> back switches the
+ * connection to binary frames for the rest of its life (which also keeps it alive, as with \<KEEPALIVE\>).
+ *
+ * Every frame is an 8 byte header followed by \a length bytes of payload:
+ * 	-# opcode (1 byte). Responses carry the request's opcode with \a PROTO_RESPONSE set.
+ * 	-# status (1 byte). Always \a PROTO_SUCC in a request.
+ * 	-# reserved (2 bytes, zero).
+ * 	-# length (4 bytes).
+ *
+ * All integers are big-endian and fixed width. Strings are a 2 byte length followed by that many bytes, without a NUL.
+ *
+ * Payloads:
+ * 	-# PROTO_CREATE: u64 filesize, u16 port, filename, description, md5, ip. The response has no payload.
+ * 	-# PROTO_UPDATE: u64 start byte, u64 end byte, u16 port, filename, ip. The response has no payload.
+ * 	-# PROTO_LIST: empty. The response is u32 count, then for each tracker: filename, u64 filesize, md5.
+ * 	   For a single page of the trackers in filename order, the payload is instead: prefix, cursor, u32 most trackers, substring. Only
+ * 	   trackers whose filename starts with the prefix, sorts after the cursor (if not empty) and has the substring in it or in its
+ * 	   description (if not empty) are listed. The response is laid out as above, followed by the cursor for the next page, which is
+ * 	   empty on the last page.
+ * 	-# PROTO_GET: the tracker file name (filename.track). The response is the 16 byte MD5 of the tracker file, then its contents.
+ * 	-# PROTO_SELECT: the tracker file name, u64 start byte, u64 end byte, u32 most peers (0 for no limit). The response is laid out as for
+ * 	   PROTO_GET, with only the peers that announced bytes in [start, end], both inclusive (see storeSelect() on the server).
+ * 	-# PROTO_STATS: empty. The response is the server's counters, as the lines of the text \<REP STATS\> response.
+ * 	-# PROTO_UPDATE_RANGES: u16 port, filename, ip, u16 count, then count times u64 start byte, u64 end byte. The ranges are announced
+ * 	   as a single change. The response has no payload.
+ * 	-# PROTO_WATCH: the filename of a tracker. The response has no payload. From then on, every change to that tracker is pushed to
+ * 	   the client as a PROTO_EVENT frame, without a request, for as long as the connection stays open.
+ * 	-# PROTO_EVENT: only ever sent by the server, with \a PROTO_RESPONSE set. The payload is u8 kind (PROTO_CREATE or PROTO_UPDATE_RANGES)
+ * 	   and the filename, then for PROTO_CREATE: u64 filesize, description, md5, and for PROTO_UPDATE_RANGES: u16 port, ip, u16 count, then
+ * 	   count times u64 start byte, u64 end byte. A client that falls too far behind gets a single PROTO_EVENT with \a PROTO_FAIL and no
+ * 	   payload instead, and the connection is closed.
+ *
+ * A request frame, header included, is at most PROTO_MAX_FRAME bytes long.
+ *
+ * Note: This file is kept identical in src/client and src/server.
+ */
+
+#ifndef __TRACKER_PROTO_H__
+#define __TRACKER_PROTO_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/*-----------------------------------
+            Defines
+-----------------------------------*/
+#define PROTO_HEADER_SIZE 8				///< Size of a frame header
+#define PROTO_RESPONSE 0x80				///< Set in the opcode of every response
+#define PROTO_MD5_SIZE 16				///< Size of a raw MD5 digest
+#define PROTO_MAX_FRAME 1023			///< Longest request frame the server accepts, header included
+
+/*-----------------------------------
+        Enums & const string
+-----------------------------------*/
+/**
+ * Frame opcodes.
+ */
+enum proto_opcode
+{
+	PROTO_CREATE = 1,					///< createtracker
+	PROTO_UPDATE = 2,					///< updatetracker
+	PROTO_LIST = 3,						///< REQ LIST
+	PROTO_GET = 4,						///< GET
+	PROTO_SELECT = 5,					///< GET for a byte range
+	PROTO_STATS = 6,					///< REQ STATS
+	PROTO_UPDATE_RANGES = 7,			///< updatetracker with several ranges
+	PROTO_WATCH = 8,					///< WATCH
+	PROTO_EVENT = 9						///< A change pushed to a watching client
+};
+
+/**
+ * Response statuses, matching the text protocol's succ / fail / ferr / invalid responses.
+ */
+enum proto_status
+{
+	PROTO_SUCC = 0,						///< The command succeeded
+	PROTO_FAIL = 1,						///< The command was malformed, or the server could not carry it out
+	PROTO_FERR = 2,						///< The tracker already exists (create), or does not exist (update)
+	PROTO_INVALID = 3					///< Unknown opcode, or no such tracker (GET)
+};
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * Cursor for building a payload in a caller supplied buffer. Writes past the end set \a m_error instead of overflowing.
+ */
+struct proto_writer
+{
+	unsigned char *m_data;				///< Buffer being written
+	size_t	m_cap;						///< Size of \a m_data
+	size_t	m_len;						///< Number of bytes written
+	int		m_error;					///< 1 if anything did not fit
+};
+
+/**
+ * Cursor for decoding a payload. Reads past the end set \a m_error and return zeros.
+ */
+struct proto_reader
+{
+	const unsigned char *m_data;		///< Payload being read
+	size_t	m_len;						///< Size of \a m_data
+	size_t	m_pos;						///< Number of bytes consumed
+	int		m_error;					///< 1 if the payload was too short, or a string did not fit
+};
+
+/*-----------------------------------
+            Functions
+-----------------------------------*/
+/**
+ * Append an unsigned integer of \a width bytes, big-endian.
+ */
+static inline void protoWriteInt( struct proto_writer* w, uint64_t value, int width )
+{
+	if( w->m_len + width > w->m_cap )
+	{
+		w->m_error = 1;
+		return;
+	}
+	for( int n = width - 1; n >= 0; n-- )
+	{
+		w->m_data[ w->m_len++ ] = (unsigned char)( value >> ( n * 8 ) );
+	}
+}
+
+/**
+ * Append raw bytes.
+ */
+static inline void protoWriteBytes( struct proto_writer* w, const void* data, size_t length )
+{
+	if( w->m_len + length > w->m_cap )
+	{
+		w->m_error = 1;
+		return;
+	}
+	memcpy( w->m_data + w->m_len, data, length );
+	w->m_len += length;
+}
+
+/**
+ * Append a length-prefixed string.
+ */
+static inline void protoWriteString( struct proto_writer* w, const char* text )
+{
+	size_t length = strlen( text );
+	if( length > 0xFFFF )
+	{
+		w->m_error = 1;
+		return;
+	}
+	protoWriteInt( w, length, 2 );
+	protoWriteBytes( w, text, length );
+}
+
+/**
+ * Write a frame header at the start of \a header.
+ */
+static inline void protoWriteHeader( unsigned char* header, int opcode, int status, uint32_t length )
+{
+	struct proto_writer w = { header, PROTO_HEADER_SIZE, 0, 0 };
+	protoWriteInt( &w, opcode, 1 );
+	protoWriteInt( &w, status, 1 );
+	protoWriteInt( &w, 0, 2 );
+	protoWriteInt( &w, length, 4 );
+}
+
+/**
+ * Read an unsigned integer of \a width bytes, big-endian.
+ */
+static inline uint64_t protoReadInt( struct proto_reader* r, int width )
+{
+	uint64_t value = 0;
+	if( r->m_pos + width > r->m_len )
+	{
+		r->m_error = 1;
+		return 0;
+	}
+	for( int n = 0; n < width; n++ )
+	{
+		value = ( value << 8 ) | r->m_data[ r->m_pos++ ];
+	}
+	return value;
+}
+
+/**
+ * Read a length-prefixed string into \a text, NUL terminated. \a size is the size of \a text.
+ */
+static inline void protoReadString( struct proto_reader* r, char* text, size_t size )
+{
+	size_t length = protoReadInt( r, 2 );
+	if( r->m_error == 1 || r->m_pos + length > r->m_len || length >= size )
+	{
+		r->m_error = 1;
+		text[0] = '\0';
+		return;
+	}
+	memcpy( text, r->m_data + r->m_pos, length );
+	text[ length ] = '\0';
+	r->m_pos += length;
+}
+
+#endif
@@ -0,0 +1,1722 @@
+/**
+ * @file tracker_store.c
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @section COMPILE
+ * g++ -c tracker_store.c
+ *  (or use make in root directory)
+ */
+
+/*-----------------------------------
+            Includes
+-----------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "server_constants.ini"
+#include "tracker_store.h"
+#include "tracker_wal.h"
+
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * A peer picked by storeSelect(), with the spans that overlap the range asked for.
+ */
+struct selected_peer
+{
+	const struct tracker_peer *peer;		///< The peer
+	size_t	first;							///< Index of its first overlapping span
+	size_t	last;							///< Index one past its last overlapping span
+	long	latest;							///< Latest time among the overlapping spans
+	size_t	order;							///< Index of the peer in its tracker's \a peers
+};
+
+
+/*-----------------------------------
+            Variables
+-----------------------------------*/
+static struct tracker *buckets[ TRACKER_BUCKETS ];		///< Hash index, keyed on filename
+
+static pthread_rwlock_t stripe_locks[ STORE_LOCK_STRIPES ];	///< Protect the hash chains, bucket n is covered by stripe n % STORE_LOCK_STRIPES
+
+static struct tracker **registry = NULL;				///< Every tracker, in the order they were created
+
+static size_t registry_count = 0;						///< Number of trackers in \a registry
+
+static size_t registry_capacity = 0;					///< Allocated length of \a registry
+
+static size_t registry_reserved = 0;					///< Number of slots of \a registry set aside by reserveRegistry() for trackers not yet registered
+
+static struct tracker **by_name = NULL;					///< Every tracker, sorted by filename. Has the same capacity as \a registry
+static int by_name_sorted = 0;							///< 0 while storeInit() loads trackers, which are only sorted into \a by_name once it is done
+static pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_INITIALIZER;	///< Protects \a registry, \a by_name and \a store_version
+
+static unsigned long store_version = 0;					///< Bumped whenever a tracker is added to \a registry
+
+static struct tracker *dirty_list = NULL;				///< Trackers with changes not yet written to disk
+
+static pthread_mutex_t dirty_mutex = PTHREAD_MUTEX_INITIALIZER;	///< Protects \a dirty_list, the \a dirty flags and \a stopping
+
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;	///< Signalled when the write-behind thread should stop
+
+static pthread_t writer_thread;							///< The write-behind thread
+
+static int stopping = 0;								///< Set by storeShutdown()
+
+static struct tracker **expiring = NULL;				///< Trackers with expired peers whose records are still in the tracker file, only used by the write-behind thread
+
+static size_t num_expiring = 0;							///< Number of trackers in \a expiring
+
+static size_t expiring_capacity = 0;					///< Allocated length of \a expiring
+
+static char store_directory[ PATH_MAX ];				///< Folder holding the tracker files
+
+static long store_peer_ttl = 0;							///< Seconds after its latest record that a peer expires, 0 for never
+
+
+/*-----------------------------------
+        Internal functions
+-----------------------------------*/
+
+/**
+ * FNV-1a hash of a filename, used to pick its bucket.
+ */
+static unsigned long hashFilename( const char* filename )
+{
+	unsigned long hash = 2166136261UL;
+	while( *filename != '\0' )
+	{
+		hash ^= (unsigned char) *filename++;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/**
+ * Look up a tracker by filename in one bucket. The bucket's stripe must be locked.
+ */
+static struct tracker* findInBucket( unsigned long bucket, const char* filename )
+{
+	struct tracker *t = buckets[ bucket ];
+	while( t != NULL && strcmp( t->filename, filename ) != 0 )
+	{
+		t = t->next;
+	}
+	return t;
+}
+
+/**
+ * Look up a tracker by filename, holding its stripe's read lock only for the lookup.
+ * Trackers are never freed, so the pointer stays valid after the stripe is unlocked.
+ */
+static struct tracker* findTracker( const char* filename )
+{
+	unsigned long bucket = hashFilename( filename ) & ( TRACKER_BUCKETS - 1 );
+	pthread_rwlock_t *stripe = &stripe_locks[ bucket & ( STORE_LOCK_STRIPES - 1 ) ];
+
+	pthread_rwlock_rdlock( stripe );
+	struct tracker *t = findInBucket( bucket, filename );
+	pthread_rwlock_unlock( stripe );
+
+	return t;
+}
+
+/**
+ * True if \a filename is a plain name, so that its tracker file lies in the tracker folder.
+ */
+static int validFilename( const char* filename )
+{
+	return filename[0] != '\0' && strchr( filename, '/' ) == NULL && strcmp( filename, "." ) != 0 && strcmp( filename, ".." ) != 0;
+}
+
+/**
+ * Look up the tracker a tracker file name ("filename.track") refers to. Returns NULL if there is no such tracker.
+ */
+static struct tracker* findTrackerFile( const char* tracker_filename )
+{
+	size_t name_len = strlen( tracker_filename );
+	size_t suffix_len = strlen( TRACKER_SUFFIX );
+
+	/** Only "filename.track" names refer to a tracker. */
+	if( name_len <= suffix_len || strcmp( tracker_filename + name_len - suffix_len, TRACKER_SUFFIX ) != 0 )
+	{
+		return NULL;
+	}
+
+	char filename[ FILENAME_MAX ];
+	snprintf( filename, sizeof( filename ), "%.*s", (int)( name_len - suffix_len ), tracker_filename );
+
+	return findTracker( filename );
+}
+
+/**
+ * Finish a copy of a running digest, as 32 hex characters plus a NUL.
+ */
+static void finishDigest( MD5_CTX* digest, char* md5 )
+{
+	unsigned char md5_sum[ MD5_DIGEST_LENGTH ];
+	MD5_Final( md5_sum, digest );
+	for( int n = 0; n < MD5_DIGEST_LENGTH; n++ )
+	{
+		sprintf( &md5[ n * 2 ], "%02x", (unsigned int) md5_sum[n] );
+	}
+}
+
+/**
+ * Index in \a by_name of the first tracker whose filename sorts after \a filename, or at or after it if \a inclusive is 1.
+ * The registry must be locked.
+ */
+static size_t findByName( const char* filename, int inclusive )
+{
+	size_t low = 0, high = registry_count;
+	while( low < high )
+	{
+		size_t middle = ( low + high ) / 2;
+		int order = strcmp( by_name[ middle ]->filename, filename );
+		if( order < 0 || ( order == 0 && inclusive == 0 ) ) low = middle + 1;
+		else high = middle;
+	}
+	return low;
+}
+
+/**
+ * Sort order of \a by_name.
+ */
+static int compareNames( const void* a, const void* b )
+{
+	return strcmp( ( *(struct tracker* const*) a )->filename, ( *(struct tracker* const*) b )->filename );
+}
+
+/**
+ * Set aside a slot in the registry, so that registerTracker() cannot fail once a tracker has been made.
+ */
+static int reserveRegistry()
+{
+	int rtn = STORE_OK;
+
+	pthread_rwlock_wrlock( &registry_lock );
+	if( registry_count + registry_reserved == registry_capacity )
+	{
+		size_t capacity = ( registry_capacity == 0 ) ? 1024 : registry_capacity * 2;
+		struct tracker **grown = (struct tracker**) realloc( registry, capacity * sizeof( struct tracker* ) );
+		struct tracker **grown_by_name = ( grown == NULL ) ? NULL : (struct tracker**) realloc( by_name, capacity * sizeof( struct tracker* ) );
+		if( grown != NULL ) registry = grown;
+		if( grown_by_name != NULL )
+		{
+			by_name = grown_by_name;
+			registry_capacity = capacity;
+		}
+	}
+	if( registry_count + registry_reserved < registry_capacity )
+	{
+		registry_reserved++;
+	}
+	else
+	{
+		rtn = STORE_FAIL;
+	}
+	pthread_rwlock_unlock( &registry_lock );
+
+	return rtn;
+}
+
+/**
+ * Add a tracker to the end of the registry, and to its place in \a by_name, in the slot reserved for it by insertTracker(). From then on
+ * it is listed, so this is the last step of making a tracker.
+ */
+static void registerTracker( struct tracker* t )
+{
+	pthread_rwlock_wrlock( &registry_lock );
+	registry_reserved--;
+	/** Once the store is up, each new tracker is inserted in order, which only moves pointers. */
+	size_t slot = ( by_name_sorted == 1 ) ? findByName( t->filename, 1 ) : registry_count;
+	memmove( &by_name[ slot + 1 ], &by_name[ slot ], ( registry_count - slot ) * sizeof( struct tracker* ) );
+	by_name[ slot ] = t;
+	registry[ registry_count++ ] = t;
+	store_version++;
+	pthread_rwlock_unlock( &registry_lock );
+}
+
+/**
+ * Format the header of a tracker file. \a text must hold at least headerLength() bytes.
+ */
+static size_t formatHeader( const struct tracker* t, char* text )
+{
+	return sprintf( text, "Filename: %s\nFilesize: %s\nDescription: %s\nMD5: %s", t->filename, t->filesize, t->description, t->md5 );
+}
+
+/**
+ * Upper bound on the length of a tracker file header, including the terminating NUL.
+ */
+static size_t headerLength( const struct tracker* t )
+{
+	return strlen( t->filename ) + strlen( t->filesize ) + strlen( t->description ) + strlen( t->md5 ) + 64;
+}
+
+/**
+ * Format a chunk record as it appears in a tracker file, including the newline that separates it from the line before.
+ * \a text must hold at least \a TRACKER_LINE_SIZE bytes.
+ */
+static size_t formatChunk( const struct tracker_chunk* chunk, char* text )
+{
+	return sprintf( text, "\n%s:%d:%ld:%ld:%ld",
+					chunk->ip_addr,
+					chunk->port_num,
+					chunk->start_byte,
+					chunk->end_byte,
+					chunk->time_stamp
+					);
+}
+
+/**
+ * Recompute a tracker's running digest from its header and every chunk record.
+ */
+static int resetDigest( struct tracker* t )
+{
+	char *header = (char*) malloc( headerLength( t ) );
+	if( header == NULL ) return STORE_FAIL;
+
+	MD5_Init( &t->digest );
+	t->length = formatHeader( t, header );
+	MD5_Update( &t->digest, header, t->length );
+	free( header );
+
+	char line[ TRACKER_LINE_SIZE ];
+	for( size_t n = 0; n < t->num_chunks; n++ )
+	{
+		size_t line_length = formatChunk( &t->chunks[n], line );
+		MD5_Update( &t->digest, line, line_length );
+		t->length += line_length;
+	}
+	return STORE_OK;
+}
+
+/**
+ * Allocate a tracker and link it into \a bucket. The bucket's stripe must be write locked, and stay locked until the caller has finished
+ * making the tracker and passed it to registerTracker().
+ */
+static struct tracker* insertTracker( unsigned long bucket, const char* filename, const char* filesize, const char* description, const char* md5 )
+{
+	struct tracker *t = (struct tracker*) calloc( 1, sizeof( struct tracker ) );
+	if( t == NULL ) return NULL;
+
+	t->filename = strdup( filename );
+	t->filesize = strdup( filesize );
+	t->description = strdup( description );
+	t->md5 = strdup( md5 );
+	/** The digest starts with the header, which never changes. */
+	if( t->filename == NULL || t->filesize == NULL || t->description == NULL || t->md5 == NULL || resetDigest( t ) != STORE_OK
+		|| reserveRegistry() != STORE_OK )
+	{
+		free( t->filename );
+		free( t->filesize );
+		free( t->description );
+		free( t->md5 );
+		free( t );
+		return NULL;
+	}
+
+	pthread_rwlock_init( &t->lock, NULL );
+	t->next = buckets[ bucket ];
+	buckets[ bucket ] = t;
+	return t;
+}
+
+/**
+ * FNV-1a hash of a peer's address and port, used to pick its slot in a tracker's \a peer_index.
+ */
+static unsigned long hashPeer( const char* ip_addr, int port_num )
+{
+	unsigned long hash = hashFilename( ip_addr );
+	for( int n = 0; n < (int) sizeof( port_num ); n++ )
+	{
+		hash ^= (unsigned char)( port_num >> ( n * 8 ) );
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/**
+ * Find a peer of a tracker, adding it if \a create is 1. Returns NULL if there is no such peer, or it could not be added.
+ * The tracker must be read locked to find a peer, and write locked to add one.
+ */
+static struct tracker_peer* findPeer( struct tracker* t, const char* ip_addr, int port_num, int create )
+{
+	size_t slot = 0;
+	if( t->peer_index_size > 0 )
+	{
+		slot = hashPeer( ip_addr, port_num ) & ( t->peer_index_size - 1 );
+		while( t->peer_index[ slot ] != 0 )
+		{
+			struct tracker_peer *p = &t->peers[ t->peer_index[ slot ] - 1 ];
+			if( p->port_num == port_num && strcmp( p->ip_addr, ip_addr ) == 0 )
+			{
+				return p;
+			}
+			slot = ( slot + 1 ) & ( t->peer_index_size - 1 );
+		}
+	}
+	if( create == 0 )
+	{
+		return NULL;
+	}
+
+	/** The index is kept at most half full, and rebuilt at twice the size when it would not be. */
+	if( ( t->num_peers + 1 ) * 2 > t->peer_index_size )
+	{
+		size_t size = ( t->peer_index_size == 0 ) ? 16 : t->peer_index_size * 2;
+		size_t *index = (size_t*) calloc( size, sizeof( size_t ) );
+		if( index == NULL ) return NULL;
+		for( size_t n = 0; n < t->num_peers; n++ )
+		{
+			size_t s = hashPeer( t->peers[n].ip_addr, t->peers[n].port_num ) & ( size - 1 );
+			while( index[s] != 0 ) s = ( s + 1 ) & ( size - 1 );
+			index[s] = n + 1;
+		}
+		free( t->peer_index );
+		t->peer_index = index;
+		t->peer_index_size = size;
+		slot = hashPeer( ip_addr, port_num ) & ( size - 1 );
+		while( index[ slot ] != 0 ) slot = ( slot + 1 ) & ( size - 1 );
+	}
+	if( t->num_peers == t->peer_capacity )
+	{
+		size_t capacity = ( t->peer_capacity == 0 ) ? 4 : t->peer_capacity * 2;
+		struct tracker_peer *grown = (struct tracker_peer*) realloc( t->peers, capacity * sizeof( struct tracker_peer ) );
+		if( grown == NULL ) return NULL;
+		t->peers = grown;
+		t->peer_capacity = capacity;
+	}
+
+	struct tracker_peer *p = &t->peers[ t->num_peers++ ];
+	memset( p, 0, sizeof( struct tracker_peer ) );
+	snprintf( p->ip_addr, sizeof( p->ip_addr ), "%s", ip_addr );
+	p->port_num = port_num;
+	p->expired_until = -1;
+	t->peer_index[ slot ] = t->num_peers;
+	return p;
+}
+
+/**
+ * Index of the first span of a peer that ends at or after \a byte.
+ */
+static size_t firstSpanEndingFrom( const struct tracker_peer* p, long byte )
+{
+	size_t low = 0, high = p->num_spans;
+	while( low < high )
+	{
+		size_t middle = ( low + high ) / 2;
+		if( p->spans[ middle ].end_byte < byte ) low = middle + 1;
+		else high = middle;
+	}
+	return low;
+}
+
+/**
+ * Add a chunk record to its peer's spans, merging it with every span it overlaps or touches. The tracker must be write locked.
+ */
+static int indexChunk( struct tracker* t, const struct tracker_chunk* chunk )
+{
+	struct tracker_peer *p = findPeer( t, chunk->ip_addr, chunk->port_num, 1 );
+	if( p == NULL ) return STORE_FAIL;
+
+	struct tracker_span span = { chunk->start_byte, chunk->end_byte, chunk->time_stamp };
+	if( span.end_byte < span.start_byte )
+	{
+		span.start_byte = chunk->end_byte;
+		span.end_byte = chunk->start_byte;
+	}
+
+	/** Spans [first, last) are the ones the record overlaps or touches. End bytes are inclusive, so a span ending at the byte before the
+	 * record, or starting at the byte after it, touches it. */
+	size_t first = firstSpanEndingFrom( p, span.start_byte - 1 );
+	size_t last = first;
+	while( last < p->num_spans && p->spans[ last ].start_byte <= span.end_byte + 1 )
+	{
+		if( p->spans[ last ].start_byte < span.start_byte ) span.start_byte = p->spans[ last ].start_byte;
+		if( p->spans[ last ].end_byte > span.end_byte ) span.end_byte = p->spans[ last ].end_byte;
+		if( p->spans[ last ].time_stamp > span.time_stamp ) span.time_stamp = p->spans[ last ].time_stamp;
+		last++;
+	}
+
+	if( first == last && p->num_spans == p->span_capacity )
+	{
+		size_t capacity = ( p->span_capacity == 0 ) ? 4 : p->span_capacity * 2;
+		struct tracker_span *grown = (struct tracker_span*) realloc( p->spans, capacity * sizeof( struct tracker_span ) );
+		if( grown == NULL ) return STORE_FAIL;
+		p->spans = grown;
+		p->span_capacity = capacity;
+	}
+
+	/** Replace the merged spans with the single span covering them all. */
+	size_t merged = last - first;
+	if( merged != 1 )
+	{
+		memmove( &p->spans[ first + 1 ], &p->spans[ last ], ( p->num_spans - last ) * sizeof( struct tracker_span ) );
+		p->num_spans = p->num_spans + 1 - merged;
+		t->num_spans = t->num_spans + 1 - merged;
+	}
+	p->spans[ first ] = span;
+
+	/** A new peer, or one that had expired, is given a deadline. Later records only move \a last_seen, which the deadline is checked against
+	 * when it comes, so announcing does not touch the wheel. */
+	if( chunk->time_stamp > p->last_seen ) p->last_seen = chunk->time_stamp;
+	if( p->expiry == NULL && store_peer_ttl > 0 )
+	{
+		struct peer_expiry *expiry = (struct peer_expiry*) malloc( sizeof( struct peer_expiry ) );
+		if( expiry == NULL ) return STORE_FAIL;
+		expiry->timer.deadline = p->last_seen + store_peer_ttl;
+		expiry->timer.data = expiry;
+		expiry->tracker = t;
+		expiry->peer = p - t->peers;
+		p->expiry = expiry;
+		wheelAdd( &expiry->timer );
+	}
+	return STORE_OK;
+}
+
+/**
+ * Append a chunk record to a tracker, growing its chunk array if necessary. The tracker must be write locked.
+ */
+static int appendRecord( struct tracker* t, const struct tracker_chunk* chunk )
+{
+	if( t->num_chunks == t->chunk_capacity )
+	{
+		size_t capacity = ( t->chunk_capacity == 0 ) ? 16 : t->chunk_capacity * 2;
+		struct tracker_chunk *grown = (struct tracker_chunk*) realloc( t->chunks, capacity * sizeof( struct tracker_chunk ) );
+		if( grown == NULL ) return STORE_FAIL;
+		t->chunks = grown;
+		t->chunk_capacity = capacity;
+	}
+	if( indexChunk( t, chunk ) != STORE_OK ) return STORE_FAIL;
+	t->chunks[ t->num_chunks++ ] = *chunk;
+
+	/** Tracker files only ever grow at the end, so the digest is kept up to date one record at a time. */
+	char line[ TRACKER_LINE_SIZE ];
+	size_t line_length = formatChunk( chunk, line );
+	MD5_Update( &t->digest, line, line_length );
+	t->length += line_length;
+	return STORE_OK;
+}
+
+/**
+ * Make room for \a count more records from one peer, so that appending them does not run out of memory part way through.
+ * The tracker must be write locked.
+ */
+static int reserveRecords( struct tracker* t, const char* ip_addr, int port_num, size_t count )
+{
+	if( t->num_chunks + count > t->chunk_capacity )
+	{
+		size_t capacity = ( t->chunk_capacity == 0 ) ? 16 : t->chunk_capacity;
+		while( capacity < t->num_chunks + count ) capacity *= 2;
+		struct tracker_chunk *grown = (struct tracker_chunk*) realloc( t->chunks, capacity * sizeof( struct tracker_chunk ) );
+		if( grown == NULL ) return STORE_FAIL;
+		t->chunks = grown;
+		t->chunk_capacity = capacity;
+	}
+
+	/** Each record adds at most one span. */
+	struct tracker_peer *p = findPeer( t, ip_addr, port_num, 1 );
+	if( p == NULL ) return STORE_FAIL;
+	if( p->num_spans + count > p->span_capacity )
+	{
+		size_t capacity = ( p->span_capacity == 0 ) ? 4 : p->span_capacity;
+		while( capacity < p->num_spans + count ) capacity *= 2;
+		struct tracker_span *grown = (struct tracker_span*) realloc( p->spans, capacity * sizeof( struct tracker_span ) );
+		if( grown == NULL ) return STORE_FAIL;
+		p->spans = grown;
+		p->span_capacity = capacity;
+	}
+	return STORE_OK;
+}
+
+/**
+ * Sort order of storeUpdateRanges(): by starting byte.
+ */
+static int compareRanges( const void* a, const void* b )
+{
+	const struct tracker_range *x = (const struct tracker_range*) a;
+	const struct tracker_range *y = (const struct tracker_range*) b;
+	return ( x->start_byte < y->start_byte ) ? -1 : ( x->start_byte > y->start_byte );
+}
+
+/**
+ * Put a tracker on the dirty list, so the write-behind thread picks it up.
+ */
+static void markDirty( struct tracker* t )
+{
+	pthread_mutex_lock( &dirty_mutex );
+	if( t->dirty == 0 )
+	{
+		t->dirty = 1;
+		t->next_dirty = dirty_list;
+		dirty_list = t;
+	}
+	pthread_mutex_unlock( &dirty_mutex );
+}
+
+/**
+ * Format part of a tracker file into a new buffer: optionally the header, followed by the chunk records from \a first_chunk up to
+ * (but not including) \a last_chunk. The tracker must be read locked. Note: You should call free() on the return value of this function.
+ */
+static char* formatTracker( const struct tracker* t, int include_header, size_t first_chunk, size_t last_chunk, size_t* length )
+{
+	size_t capacity = headerLength( t ) + ( last_chunk - first_chunk ) * TRACKER_LINE_SIZE;
+
+	char *text = (char*) malloc( capacity );
+	if( text == NULL ) return NULL;
+
+	size_t used = 0;
+	if( include_header == 1 )
+	{
+		used += formatHeader( t, text );
+	}
+	for( size_t n = first_chunk; n < last_chunk; n++ )
+	{
+		used += formatChunk( &t->chunks[n], text + used );
+	}
+
+	*length = used;
+	return text;
+}
+
+/**
+ * Strip a "Key: " prefix and the trailing newline from a tracker file header line.
+ */
+static char* headerValue( char* line )
+{
+	char *value = strchr( line, ':' );
+	value = ( value == NULL ) ? line : value + 1;
+	while( *value == ' ' ) value++;
+	value[ strcspn( value, "\r\n" ) ] = '\0';
+	return value;
+}
+
+/**
+ * Read a tracker file from disk into the index. Only called by storeInit(), before any other thread uses the store.
+ */
+static void loadTrackerFile( const char* path, const char* filename )
+{
+	FILE *tracker_file;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t line_length;
+	char *header[4];
+	int n;
+	MD5_CTX raw_digest;
+
+	if( ( tracker_file = fopen( path, "r" ) ) == NULL )
+	{
+		perror( "Store Error: can't read tracker file" );
+		return;
+	}
+
+	/** The raw bytes are hashed as they are read, to find out whether the file is exactly what the store would have written. */
+	MD5_Init( &raw_digest );
+
+	/** The first four lines are Filename, Filesize, Description and MD5. */
+	for( n = 0; n < 4; n++ )
+	{
+		if( ( line_length = getline( &line, &len, tracker_file ) ) == -1 ) break;
+		MD5_Update( &raw_digest, line, line_length );
+		header[n] = strdup( headerValue( line ) );
+	}
+
+	struct tracker *t = NULL;
+	if( n == 4 )
+	{
+		t = insertTracker( hashFilename( filename ) & ( TRACKER_BUCKETS - 1 ), filename, header[1], header[2], header[3] );
+	}
+	while( n > 0 ) free( header[--n] );
+
+	if( t != NULL )
+	{
+		/** Every other non-empty, non-comment line is a chunk record. */
+		struct tracker_chunk chunk;
+		chunk.lsn = 0;
+		while( ( line_length = getline( &line, &len, tracker_file ) ) != -1 )
+		{
+			MD5_Update( &raw_digest, line, line_length );
+			if( line[0] == '#' ) continue;
+			if( sscanf( line, "%63[^:]:%d:%ld:%ld:%ld", chunk.ip_addr, &chunk.port_num, &chunk.start_byte, &chunk.end_byte, &chunk.time_stamp ) == 5 )
+			{
+				appendRecord( t, &chunk );
+			}
+		}
+		t->persisted_header = 1;
+		t->persisted_chunks = t->num_chunks;
+
+		/** A file written by another program (with comments, say) is still loaded, but cannot be sent as it is. */
+		unsigned char raw_sum[ MD5_DIGEST_LENGTH ], formatted_sum[ MD5_DIGEST_LENGTH ];
+		MD5_CTX formatted_digest = t->digest;
+		MD5_Final( raw_sum, &raw_digest );
+		MD5_Final( formatted_sum, &formatted_digest );
+		t->persisted_length = ( memcmp( raw_sum, formatted_sum, MD5_DIGEST_LENGTH ) == 0 ) ? t->length : 0;
+		registerTracker( t );
+	}
+	else
+	{
+		printf( "[ERROR] Invalid tracker file \"%s\"\n", path );
+	}
+
+	free( line );
+	fclose( tracker_file );
+}
+
+/**
+ * Write text to a file, opened with \a mode, and sync it. Returns 1 on success.
+ */
+static int syncFile( const char* path, const char* mode, const char* text, size_t length )
+{
+	FILE *tracker_file = NULL;
+	int written = 0;
+	if( ( tracker_file = fopen( path, mode ) ) != NULL )
+	{
+		written = ( fwrite( text, sizeof( char ), length, tracker_file ) == length );
+		written = ( fflush( tracker_file ) == 0 ) && ( fsync( fileno( tracker_file ) ) == 0 ) && written;
+		written = ( fclose( tracker_file ) == 0 ) && written;
+	}
+	return written;
+}
+
+/**
+ * Build the path of a tracker's file, with \a suffix after its name. Returns 0, or -1 if the path does not fit in \a size bytes.
+ */
+static int trackerPath( const struct tracker* t, const char* suffix, char* path, size_t size )
+{
+	if( snprintf( path, size, "%s/%s%s", store_directory, t->filename, suffix ) >= (int) size )
+	{
+		fprintf( stderr, "Store Error: path of tracker file \"%s\" is too long\n", t->filename );
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Write text to a tracker file and sync it. With \a replace set, the text is written to a temporary file which is then renamed over
+ * the tracker file, so that the file is never seen half written and anyone still reading the old one keeps reading it.
+ * Otherwise the text is appended. Returns 1 on success.
+ */
+static int writeTrackerFile( const struct tracker* t, const char* text, size_t length, int replace )
+{
+	char path[ PATH_MAX ];
+	char temp_path[ PATH_MAX ];
+	if( trackerPath( t, TRACKER_SUFFIX, path, sizeof( path ) ) == -1
+		|| trackerPath( t, TRACKER_SUFFIX TRACKER_TEMP_SUFFIX, temp_path, sizeof( temp_path ) ) == -1 )
+	{
+		return 0;
+	}
+
+	int written = syncFile( replace ? temp_path : path, replace ? "w" : "a", text, length );
+	if( replace == 1 && written == 1 )
+	{
+		written = ( rename( temp_path, path ) == 0 );
+	}
+	if( replace == 1 && written == 0 )
+	{
+		unlink( temp_path );
+	}
+	return written;
+}
+
+/**
+ * Write the pending changes of every dirty tracker to disk, up to and including the change logged as \a lsn.
+ * New trackers are written out in full, existing ones only have their new chunk records appended. Every file written is synced, so that
+ * the log can be checkpointed at \a lsn afterwards. Returns the number of trackers that could not be written.
+ */
+static int flushDirtyTrackers( unsigned long lsn )
+{
+	int failures = 0;
+
+	/** Take the dirty list as an array. Once a tracker's flag is cleared, a concurrent markDirty() reuses its \a next_dirty link. */
+	pthread_mutex_lock( &dirty_mutex );
+	size_t count = 0;
+	for( struct tracker *d = dirty_list; d != NULL; d = d->next_dirty )
+	{
+		count++;
+	}
+	struct tracker **pending = (struct tracker**) malloc( ( count > 0 ? count : 1 ) * sizeof( struct tracker* ) );
+	if( pending == NULL )
+	{
+		pthread_mutex_unlock( &dirty_mutex );
+		return 1;
+	}
+	count = 0;
+	for( struct tracker *d = dirty_list; d != NULL; d = d->next_dirty )
+	{
+		pending[ count++ ] = d;
+	}
+	for( size_t n = 0; n < count; n++ )
+	{
+		pending[ n ]->dirty = 0;
+	}
+	dirty_list = NULL;
+	pthread_mutex_unlock( &dirty_mutex );
+
+	for( size_t n = 0; n < count; n++ )
+	{
+		struct tracker *t = pending[ n ];
+
+		/** Take a copy of what needs to be written, so the tracker is unlocked during the file I/O. */
+		pthread_rwlock_rdlock( &t->lock );
+		int rewrite = ( t->persisted_header == 0 );
+		size_t length = 0;
+		size_t num_chunks = t->num_chunks;
+		/** Changes logged after \a lsn are left for the next pass. Chunks are appended in LSN order, so they are all at the end. */
+		while( num_chunks > t->persisted_chunks && t->chunks[ num_chunks - 1 ].lsn > lsn )
+		{
+			num_chunks--;
+		}
+		int later = ( t->lsn > lsn || num_chunks < t->num_chunks );
+		char *text = NULL;
+		if( t->lsn <= lsn && ( rewrite == 1 || num_chunks > t->persisted_chunks ) )
+		{
+			text = formatTracker( t, rewrite, rewrite ? 0 : t->persisted_chunks, num_chunks, &length );
+			if( text == NULL ) failures++;
+		}
+		pthread_rwlock_unlock( &t->lock );
+
+		if( text != NULL )
+		{
+			int written = writeTrackerFile( t, text, length, rewrite );
+			free( text );
+
+			/** On success, remember how much is on disk. On failure, the tracker goes back on the dirty list to be retried. */
+			if( written == 1 )
+			{
+				pthread_rwlock_wrlock( &t->lock );
+				t->persisted_header = 1;
+				t->persisted_chunks = num_chunks;
+				if( rewrite == 1 || t->persisted_length != 0 )
+				{
+					t->persisted_length = ( rewrite ? 0 : t->persisted_length ) + length;
+				}
+				pthread_rwlock_unlock( &t->lock );
+			}
+			else
+			{
+				/** Part of the text may have been written, so the file can no longer be sent as it is. */
+				pthread_rwlock_wrlock( &t->lock );
+				t->persisted_length = 0;
+				pthread_rwlock_unlock( &t->lock );
+				perror( "Store Error: can't write tracker file" );
+				failures++;
+				later = 1;
+			}
+		}
+
+		if( later == 1 )
+		{
+			markDirty( t );
+		}
+	}
+	free( pending );
+
+	return failures;
+}
+
+/**
+ * Drop the records of a tracker's expired peers from before they expired, so that the tracker file is rewritten without them. Only records
+ * covered by the checkpoint at \a covered are dropped; otherwise replaying the log after a crash would add them back. Records a peer made
+ * after announcing again are kept. The tracker must be write locked.
+ *
+ * @return 1 if every expired record was dropped, or 0 if some are not covered yet.
+ */
+static int dropExpiredRecords( struct tracker* t, unsigned long covered )
+{
+	size_t kept = 0;
+	int uncovered = 0;
+	for( size_t n = 0; n < t->num_chunks; n++ )
+	{
+		const struct tracker_chunk *chunk = &t->chunks[n];
+		const struct tracker_peer *p = findPeer( t, chunk->ip_addr, chunk->port_num, 0 );
+		if( p != NULL && chunk->time_stamp <= p->expired_until )
+		{
+			if( chunk->lsn <= covered ) continue;
+			uncovered = 1;
+		}
+		t->chunks[ kept++ ] = *chunk;
+	}
+	if( uncovered == 0 ) t->expired = 0;
+	if( kept == t->num_chunks ) return !uncovered;
+
+	t->num_chunks = kept;
+	resetDigest( t );
+	t->persisted_header = 0;
+	t->persisted_chunks = 0;
+	t->persisted_length = 0;
+	return !uncovered;
+}
+
+/**
+ * Drop the expired records of every tracker in \a expiring that are covered by the checkpoint at \a covered. Each tracker is rewritten
+ * once, however many of its peers expired.
+ */
+static void dropExpiredPeers( unsigned long covered )
+{
+	size_t kept = 0;
+	for( size_t n = 0; n < num_expiring; n++ )
+	{
+		struct tracker *t = expiring[n];
+		pthread_rwlock_wrlock( &t->lock );
+		size_t num_chunks = t->num_chunks;
+		int done = dropExpiredRecords( t, covered );
+		int dropped = ( t->num_chunks != num_chunks );
+		pthread_rwlock_unlock( &t->lock );
+		if( dropped == 1 ) markDirty( t );
+		if( done == 0 ) expiring[ kept++ ] = t;
+	}
+	num_expiring = kept;
+}
+
+/**
+ * Write every change logged so far to the tracker files, and checkpoint the log once they are all on disk. Then drop the expired records
+ * the checkpoint covers, to be rewritten by the next pass.
+ */
+static void checkpoint()
+{
+	unsigned long lsn = walRotate();
+	if( flushDirtyTrackers( lsn ) == 0 )
+	{
+		walCheckpoint( lsn );
+	}
+	dropExpiredPeers( walCheckpointLsn() );
+}
+
+/**
+ * Expire every peer whose deadline has passed without a newer record. Peers that announced since their deadline was set are given a new one.
+ * An expired peer is only left out of the index here; its tracker waits in \a expiring until checkpoint() drops its records.
+ */
+static void expirePeers( long now )
+{
+	struct wheel_timer *timer = wheelAdvance( now );
+	while( timer != NULL )
+	{
+		struct wheel_timer *next = timer->next;
+		struct peer_expiry *expiry = (struct peer_expiry*) timer->data;
+		struct tracker *t = expiry->tracker;
+
+		pthread_rwlock_wrlock( &t->lock );
+		struct tracker_peer *p = &t->peers[ expiry->peer ];
+		if( p->last_seen + store_peer_ttl > now )
+		{
+			timer->deadline = p->last_seen + store_peer_ttl;
+			wheelAdd( timer );
+		}
+		else
+		{
+			/** The peer stays in the index, with no ranges, so that announcing again finds it. */
+			t->num_spans -= p->num_spans;
+			p->num_spans = 0;
+			p->expired_until = p->last_seen;
+			p->expiry = NULL;
+			free( expiry );
+			if( t->expired == 0 )
+			{
+				if( num_expiring == expiring_capacity )
+				{
+					size_t capacity = ( expiring_capacity == 0 ) ? 16 : expiring_capacity * 2;
+					struct tracker **grown = (struct tracker**) realloc( expiring, capacity * sizeof( struct tracker* ) );
+					if( grown != NULL )
+					{
+						expiring = grown;
+						expiring_capacity = capacity;
+					}
+				}
+				/* Without room, the records are dropped when another peer of the tracker expires. */
+				if( num_expiring < expiring_capacity )
+				{
+					t->expired = 1;
+					expiring[ num_expiring++ ] = t;
+				}
+			}
+		}
+		pthread_rwlock_unlock( &t->lock );
+		timer = next;
+	}
+}
+
+/**
+ * Sort order of compacted records: oldest first, as if each range had been announced once, at the time of its latest record. Ranges
+ * from the same second keep the order the index lists them in, which is stashed in \a lsn.
+ */
+static int compareCompacted( const void* a, const void* b )
+{
+	const struct tracker_chunk *x = (const struct tracker_chunk*) a;
+	const struct tracker_chunk *y = (const struct tracker_chunk*) b;
+	if( x->time_stamp != y->time_stamp ) return ( x->time_stamp < y->time_stamp ) ? -1 : 1;
+	return ( x->lsn < y->lsn ) ? -1 : ( x->lsn > y->lsn );
+}
+
+/**
+ * Replace a tracker's records with one per range in its peer index, if that would leave fewer than 1 in \a COMPACT_RATIO of them.
+ * Only trackers whose every record is on disk and covered by a checkpoint are compacted, so the log never has to be replayed on top of a
+ * compacted file. A record can be on disk without being covered, when a flush of another tracker failed and the checkpoint was skipped. The new file is written without holding the tracker's lock; if the tracker changes meanwhile, the
+ * compaction is abandoned until the next pass. Returns 1 if the tracker was compacted.
+ */
+static int compactTracker( struct tracker* t )
+{
+	struct tracker_chunk *chunks = NULL;
+	size_t count = 0;
+
+	unsigned long covered = walCheckpointLsn();
+	pthread_rwlock_rdlock( &t->lock );
+	size_t num_chunks = t->num_chunks;
+	if( t->persisted_header == 1 && t->persisted_chunks == num_chunks && t->last_lsn <= covered && num_chunks >= COMPACT_MIN_RECORDS
+		&& num_chunks >= t->num_spans * COMPACT_RATIO
+		&& ( chunks = (struct tracker_chunk*) malloc( ( t->num_spans > 0 ? t->num_spans : 1 ) * sizeof( struct tracker_chunk ) ) ) != NULL )
+	{
+		for( size_t n = 0; n < t->num_peers; n++ )
+		{
+			const struct tracker_peer *p = &t->peers[n];
+			for( size_t i = 0; i < p->num_spans; i++ )
+			{
+				struct tracker_chunk *chunk = &chunks[ count ];
+				snprintf( chunk->ip_addr, sizeof( chunk->ip_addr ), "%s", p->ip_addr );
+				chunk->port_num = p->port_num;
+				chunk->start_byte = p->spans[i].start_byte;
+				chunk->end_byte = p->spans[i].end_byte;
+				chunk->time_stamp = p->spans[i].time_stamp;
+				chunk->lsn = count++;
+			}
+		}
+	}
+	pthread_rwlock_unlock( &t->lock );
+	if( chunks == NULL ) return 0;
+
+	qsort( chunks, count, sizeof( struct tracker_chunk ), compareCompacted );
+
+	/** The header never changes, so it can be formatted without the lock. */
+	char *text = (char*) malloc( headerLength( t ) + count * TRACKER_LINE_SIZE );
+	size_t length = 0;
+	MD5_CTX digest;
+	if( text != NULL )
+	{
+		length = formatHeader( t, text );
+		for( size_t n = 0; n < count; n++ )
+		{
+			chunks[n].lsn = 0;
+			length += formatChunk( &chunks[n], text + length );
+		}
+		MD5_Init( &digest );
+		MD5_Update( &digest, text, length );
+	}
+
+	/** Write the compacted file beside the old one. It is only renamed over it if nothing was appended to the tracker meanwhile. */
+	char path[ PATH_MAX ];
+	char temp_path[ PATH_MAX ];
+	if( trackerPath( t, TRACKER_SUFFIX, path, sizeof( path ) ) == -1
+		|| trackerPath( t, TRACKER_SUFFIX TRACKER_TEMP_SUFFIX, temp_path, sizeof( temp_path ) ) == -1 )
+	{
+		free( text );
+		free( chunks );
+		return 0;
+	}
+	int written = ( text != NULL ) && syncFile( temp_path, "w", text, length );
+	free( text );
+
+	int compacted = 0;
+	if( written == 1 )
+	{
+		pthread_rwlock_wrlock( &t->lock );
+		if( t->num_chunks == num_chunks && rename( temp_path, path ) == 0 )
+		{
+			free( t->chunks );
+			t->chunks = chunks;
+			t->num_chunks = count;
+			t->chunk_capacity = count;
+			t->persisted_chunks = count;
+			t->persisted_length = length;
+			t->length = length;
+			t->digest = digest;
+			chunks = NULL;
+			compacted = 1;
+		}
+		pthread_rwlock_unlock( &t->lock );
+	}
+	if( compacted == 0 )
+	{
+		unlink( temp_path );
+	}
+	free( chunks );
+	return compacted;
+}
+
+/**
+ * Compact every tracker that is worth it.
+ */
+static void compactTrackers()
+{
+	/** Take a snapshot of the registry, as storeForEach() does. Trackers created after it are picked up by the next pass. */
+	pthread_rwlock_rdlock( &registry_lock );
+	size_t count = registry_count;
+	struct tracker **snapshot = (struct tracker**) malloc( ( count > 0 ? count : 1 ) * sizeof( struct tracker* ) );
+	if( snapshot != NULL && count > 0 )
+	{
+		memcpy( snapshot, registry, count * sizeof( struct tracker* ) );
+	}
+	pthread_rwlock_unlock( &registry_lock );
+	if( snapshot == NULL ) return;
+
+	int compacted = 0;
+	for( size_t n = 0; n < count; n++ )
+	{
+		compacted += compactTracker( snapshot[n] );
+	}
+	free( snapshot );
+
+	if( compacted > 0 )
+	{
+		printf( "Compacted %d trackers\n", compacted );
+	}
+}
+
+/**
+ * Body of the write-behind thread. Expires peers and checkpoints every \a STORE_FLUSH_MS milliseconds, and compacts every \a COMPACT_INTERVAL_MS
+ * milliseconds, until storeShutdown() is called.
+ */
+static void* writeBehind( void* arg )
+{
+	long since_compaction = 0;
+
+	pthread_mutex_lock( &dirty_mutex );
+	while( stopping == 0 )
+	{
+		struct timespec deadline;
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_sec += STORE_FLUSH_MS / 1000;
+		deadline.tv_nsec += ( STORE_FLUSH_MS % 1000 ) * 1000000L;
+		if( deadline.tv_nsec >= 1000000000L )
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait( &flush_cond, &dirty_mutex, &deadline );
+
+		pthread_mutex_unlock( &dirty_mutex );
+		if( store_peer_ttl > 0 )
+		{
+			expirePeers( (long) time( NULL ) );
+		}
+		checkpoint();
+		since_compaction += STORE_FLUSH_MS;
+		if( since_compaction >= COMPACT_INTERVAL_MS )
+		{
+			compactTrackers();
+			since_compaction = 0;
+		}
+		pthread_mutex_lock( &dirty_mutex );
+	}
+	pthread_mutex_unlock( &dirty_mutex );
+	return NULL;
+}
+
+/**
+ * Apply one logged change while replaying the log. Only called by storeInit(), before any other thread uses the store.
+ * Records are "C filename filesize description md5" for a createtracker, "U filename ip port start end time" for an updatetracker, and
+ * "R filename ip port time start end start end ..." for an updatetracker carrying several ranges.
+ */
+static void replayRecord( unsigned long lsn, char* record )
+{
+	char *type = strtok( record, " " );
+	char *filename = strtok( NULL, " " );
+	if( type == NULL || filename == NULL ) return;
+
+	if( strcmp( type, "C" ) == 0 )
+	{
+		char *filesize = strtok( NULL, " " );
+		char *description = strtok( NULL, " " );
+		char *md5 = strtok( NULL, " " );
+		unsigned long bucket = hashFilename( filename ) & ( TRACKER_BUCKETS - 1 );
+
+		/** A tracker that already has a file was written out before the crash. */
+		if( md5 != NULL && validFilename( filename ) && findInBucket( bucket, filename ) == NULL )
+		{
+			struct tracker *t = insertTracker( bucket, filename, filesize, description, md5 );
+			if( t != NULL )
+			{
+				t->lsn = lsn;
+				t->last_lsn = lsn;
+				markDirty( t );
+				registerTracker( t );
+			}
+		}
+	}
+	else if( strcmp( type, "U" ) == 0 )
+	{
+		struct tracker_chunk chunk;
+		struct tracker *t = findTracker( filename );
+		char *ip_addr = strtok( NULL, " " );
+		char *fields = strtok( NULL, "" );
+
+		if( t != NULL && ip_addr != NULL && fields != NULL
+			&& sscanf( fields, "%d %ld %ld %ld", &chunk.port_num, &chunk.start_byte, &chunk.end_byte, &chunk.time_stamp ) == 4 )
+		{
+			snprintf( chunk.ip_addr, sizeof( chunk.ip_addr ), "%s", ip_addr );
+			chunk.lsn = lsn;
+			if( appendRecord( t, &chunk ) == STORE_OK )
+			{
+				t->last_lsn = lsn;
+				markDirty( t );
+			}
+		}
+	}
+	else if( strcmp( type, "R" ) == 0 )
+	{
+		struct tracker_chunk chunk;
+		struct tracker *t = findTracker( filename );
+		char *ip_addr = strtok( NULL, " " );
+		char *port = strtok( NULL, " " );
+		char *time_stamp = strtok( NULL, " " );
+		char *start, *end;
+
+		if( t == NULL || ip_addr == NULL || port == NULL || time_stamp == NULL ) return;
+		snprintf( chunk.ip_addr, sizeof( chunk.ip_addr ), "%s", ip_addr );
+		chunk.port_num = atoi( port );
+		chunk.time_stamp = atol( time_stamp );
+		chunk.lsn = lsn;
+		while( ( start = strtok( NULL, " " ) ) != NULL && ( end = strtok( NULL, " " ) ) != NULL )
+		{
+			chunk.start_byte = atol( start );
+			chunk.end_byte = atol( end );
+			if( appendRecord( t, &chunk ) == STORE_OK )
+			{
+				t->last_lsn = lsn;
+				markDirty( t );
+			}
+		}
+	}
+}
+
+/**
+ * True if two runs of chunk records are identical.
+ */
+static int sameChunks( const struct tracker_chunk* a, const struct tracker_chunk* b, size_t count )
+{
+	for( size_t n = 0; n < count; n++ )
+	{
+		if( strcmp( a[n].ip_addr, b[n].ip_addr ) != 0 || a[n].port_num != b[n].port_num || a[n].start_byte != b[n].start_byte
+			|| a[n].end_byte != b[n].end_byte || a[n].time_stamp != b[n].time_stamp )
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Drop replayed records that were already in a tracker file.
+ * If the server crashed after writing a tracker file but before the checkpoint, the file ends with the first few records that were
+ * just replayed for it. Those are found by matching the end of what was loaded against the start of what was replayed.
+ */
+static void dropReplayedDuplicates()
+{
+	for( size_t i = 0; i < registry_count; i++ )
+	{
+		struct tracker *t = registry[i];
+		size_t loaded = t->persisted_chunks;
+		size_t replayed = t->num_chunks - loaded;
+		size_t overlap = ( loaded < replayed ) ? loaded : replayed;
+
+		while( overlap > 0 && sameChunks( &t->chunks[ loaded - overlap ], &t->chunks[ loaded ], overlap ) == 0 )
+		{
+			overlap--;
+		}
+		if( overlap > 0 )
+		{
+			memmove( &t->chunks[ loaded ], &t->chunks[ loaded + overlap ], ( replayed - overlap ) * sizeof( struct tracker_chunk ) );
+			t->num_chunks -= overlap;
+			resetDigest( t );
+		}
+	}
+}
+
+
+/**
+ * Sort order of storeSelect(): latest record first, and peers with records from the same second in the order they first announced.
+ */
+static int compareSelected( const void* a, const void* b )
+{
+	const struct selected_peer *x = (const struct selected_peer*) a;
+	const struct selected_peer *y = (const struct selected_peer*) b;
+	if( x->latest != y->latest ) return ( x->latest > y->latest ) ? -1 : 1;
+	return ( x->order < y->order ) ? -1 : ( x->order > y->order );
+}
+
+
+/*-----------------------------------
+            Functions
+-----------------------------------*/
+
+int storeInit( const char* directory, long peer_ttl )
+{
+	DIR *tracker_directory;
+	struct dirent *individual_file;
+	size_t suffix_len = strlen( TRACKER_SUFFIX );
+
+	snprintf( store_directory, sizeof( store_directory ), "%s", directory );
+	store_peer_ttl = peer_ttl;
+	/** Peers loaded from disk are scheduled as they are indexed; those already past their deadline expire on the first pass. */
+	wheelInit( (long) time( NULL ) );
+
+	for( int n = 0; n < STORE_LOCK_STRIPES; n++ )
+	{
+		pthread_rwlock_init( &stripe_locks[n], NULL );
+	}
+
+	/** Load every "*.track" file in the folder. */
+	if( ( tracker_directory = opendir( directory ) ) != NULL )
+	{
+		while( ( individual_file = readdir( tracker_directory ) ) != NULL )
+		{
+			size_t name_len = strlen( individual_file->d_name );
+			size_t temp_len = suffix_len + strlen( TRACKER_TEMP_SUFFIX );
+			/** A replacement that was still being written when the server stopped is left over; the file it was replacing is intact. */
+			if( name_len > temp_len && strcmp( individual_file->d_name + name_len - temp_len, TRACKER_SUFFIX TRACKER_TEMP_SUFFIX ) == 0 )
+			{
+				char path[ PATH_MAX ];
+				if( snprintf( path, sizeof( path ), "%s/%s", directory, individual_file->d_name ) < (int) sizeof( path ) )
+				{
+					unlink( path );
+				}
+			}
+			else if( name_len > suffix_len && strcmp( individual_file->d_name + name_len - suffix_len, TRACKER_SUFFIX ) == 0 )
+			{
+				char path[ PATH_MAX ];
+				char filename[ FILENAME_MAX ];
+				if( snprintf( path, sizeof( path ), "%s/%s", directory, individual_file->d_name ) < (int) sizeof( path ) )
+				{
+					snprintf( filename, sizeof( filename ), "%.*s", (int)( name_len - suffix_len ), individual_file->d_name );
+					loadTrackerFile( path, filename );
+				}
+			}
+		}
+		closedir( tracker_directory );
+	}
+	/** If the folder does not exist yet, create it so that new trackers can be written out. */
+	else if( errno != ENOENT || mkdir( directory, 0755 ) != 0 )
+	{
+		perror( "Store Error: can't open tracker folder" );
+	}
+
+	/** Bring the trackers up to date with every change logged since the last checkpoint. */
+	unsigned long last_lsn;
+	int replayed = walReplay( directory, &replayRecord, &last_lsn );
+	if( replayed > 0 )
+	{
+		dropReplayedDuplicates();
+		printf( "Replayed %d changes from the log\n", replayed );
+	}
+
+	/** The trackers were loaded in directory order. Sort them once, rather than one insertion at a time. */
+	qsort( by_name, registry_count, sizeof( struct tracker* ), &compareNames );
+	by_name_sorted = 1;
+
+	if( walOpen( directory, last_lsn ) != 0 )
+	{
+		return STORE_FAIL;
+	}
+	if( pthread_create( &writer_thread, NULL, &writeBehind, NULL ) != 0 )
+	{
+		return STORE_FAIL;
+	}
+	return STORE_OK;
+}
+
+void storeShutdown()
+{
+	pthread_mutex_lock( &dirty_mutex );
+	stopping = 1;
+	pthread_cond_signal( &flush_cond );
+	pthread_mutex_unlock( &dirty_mutex );
+
+	pthread_join( writer_thread, NULL );
+
+	/** One last checkpoint, for anything that changed while the thread was stopping. */
+	checkpoint();
+	walClose();
+}
+
+int storeCreate( const char* filename, const char* filesize, const char* description, const char* md5, unsigned long* lsn )
+{
+	char record[ FILENAME_MAX ];
+	int rtn = STORE_OK;
+	struct tracker *t = NULL;
+	if( !validFilename( filename ) )
+	{
+		return STORE_FAIL;
+	}
+	unsigned long bucket = hashFilename( filename ) & ( TRACKER_BUCKETS - 1 );
+	pthread_rwlock_t *stripe = &stripe_locks[ bucket & ( STORE_LOCK_STRIPES - 1 ) ];
+
+	/** Only the stripe holding this filename is write locked, so creates of unrelated trackers run in parallel. */
+	pthread_rwlock_wrlock( stripe );
+	if( findInBucket( bucket, filename ) != NULL )
+	{
+		rtn = STORE_EXISTS;
+	}
+	else if( ( t = insertTracker( bucket, filename, filesize, description, md5 ) ) == NULL )
+	{
+		rtn = STORE_FAIL;
+	}
+	else
+	{
+		/** Log the creation. The tracker goes on the dirty list first, so that a checkpoint covering its LSN always writes it out. */
+		snprintf( record, sizeof( record ), "C %s %s %s %s", filename, filesize, description, md5 );
+		pthread_rwlock_wrlock( &t->lock );
+		markDirty( t );
+		t->lsn = walAppend( record );
+		t->last_lsn = t->lsn;
+		if( lsn != NULL ) *lsn = t->lsn;
+		pthread_rwlock_unlock( &t->lock );
+		registerTracker( t );
+	}
+	pthread_rwlock_unlock( stripe );
+
+	return rtn;
+}
+
+int storeUpdate( const char* filename, const char* ip_addr, int port_num, long start_byte, long end_byte, unsigned long* lsn )
+{
+	struct tracker_chunk chunk;
+	char record[ FILENAME_MAX ];
+	snprintf( chunk.ip_addr, sizeof( chunk.ip_addr ), "%s", ip_addr );
+	chunk.port_num = port_num;
+	chunk.start_byte = start_byte;
+	chunk.end_byte = end_byte;
+	chunk.time_stamp = (unsigned) time( NULL );
+	chunk.lsn = 0;
+
+	struct tracker *t = findTracker( filename );
+	if( t == NULL )
+	{
+		return STORE_NOT_FOUND;
+	}
+
+	snprintf( record, sizeof( record ), "U %s %s %d %ld %ld %ld", filename, chunk.ip_addr, port_num, start_byte, end_byte, chunk.time_stamp );
+
+	/** Only this tracker is write locked while the record is appended and logged, which keeps its chunks in LSN order. */
+	pthread_rwlock_wrlock( &t->lock );
+	int rtn = appendRecord( t, &chunk );
+	if( rtn == STORE_OK )
+	{
+		markDirty( t );
+		t->chunks[ t->num_chunks - 1 ].lsn = walAppend( record );
+		t->last_lsn = t->chunks[ t->num_chunks - 1 ].lsn;
+		if( lsn != NULL ) *lsn = t->last_lsn;
+	}
+	pthread_rwlock_unlock( &t->lock );
+
+	return rtn;
+}
+
+int storeUpdateRanges( const char* filename, const char* ip_addr, int port_num, struct tracker_range* ranges, size_t* num_ranges, unsigned long* lsn )
+{
+	struct tracker *t = findTracker( filename );
+	if( t == NULL )
+	{
+		return STORE_NOT_FOUND;
+	}
+	size_t count = *num_ranges;
+	if( count == 0 )
+	{
+		return STORE_FAIL;
+	}
+
+	/** Collapse the ranges that overlap or touch, as the peer's spans would be, so the change takes as few records as possible. */
+	for( size_t n = 0; n < count; n++ )
+	{
+		if( ranges[n].end_byte < ranges[n].start_byte )
+		{
+			long start_byte = ranges[n].end_byte;
+			ranges[n].end_byte = ranges[n].start_byte;
+			ranges[n].start_byte = start_byte;
+		}
+	}
+	qsort( ranges, count, sizeof( struct tracker_range ), &compareRanges );
+	size_t merged = 0;
+	for( size_t n = 1; n < count; n++ )
+	{
+		if( ranges[n].start_byte <= ranges[ merged ].end_byte + 1 )
+		{
+			if( ranges[n].end_byte > ranges[ merged ].end_byte ) ranges[ merged ].end_byte = ranges[n].end_byte;
+		}
+		else
+		{
+			ranges[ ++merged ] = ranges[n];
+		}
+	}
+	count = merged + 1;
+	*num_ranges = count;
+
+	struct tracker_chunk chunk;
+	snprintf( chunk.ip_addr, sizeof( chunk.ip_addr ), "%s", ip_addr );
+	chunk.port_num = port_num;
+	chunk.time_stamp = (unsigned) time( NULL );
+	chunk.lsn = 0;
+
+	/** The whole change is logged as one record. */
+	size_t record_size = FILENAME_MAX + count * 44;
+	char *record = (char*) malloc( record_size );
+	if( record == NULL )
+	{
+		return STORE_FAIL;
+	}
+	size_t record_len = snprintf( record, record_size, "R %s %s %d %ld", filename, chunk.ip_addr, port_num, chunk.time_stamp );
+	for( size_t n = 0; n < count && record_len < record_size; n++ )
+	{
+		record_len += snprintf( record + record_len, record_size - record_len, " %ld %ld", ranges[n].start_byte, ranges[n].end_byte );
+	}
+
+	/** Room for every record is made before any is appended, so the change is applied whole while the tracker stays write locked. */
+	pthread_rwlock_wrlock( &t->lock );
+	int rtn = reserveRecords( t, chunk.ip_addr, port_num, count );
+	size_t first = t->num_chunks;
+	for( size_t n = 0; n < count && rtn == STORE_OK; n++ )
+	{
+		chunk.start_byte = ranges[n].start_byte;
+		chunk.end_byte = ranges[n].end_byte;
+		rtn = appendRecord( t, &chunk );
+	}
+	if( rtn == STORE_OK )
+	{
+		markDirty( t );
+		unsigned long change = walAppend( record );
+		for( size_t n = first; n < t->num_chunks; n++ )
+		{
+			t->chunks[n].lsn = change;
+		}
+		t->last_lsn = change;
+		if( lsn != NULL ) *lsn = change;
+	}
+	pthread_rwlock_unlock( &t->lock );
+	free( record );
+
+	return rtn;
+}
+
+int storeSync( unsigned long lsn )
+{
+	return ( walSync( lsn ) == 0 ) ? STORE_OK : STORE_FAIL;
+}
+
+int storeForEach( void (*callback)( const struct tracker*, void* ), void* arg )
+{
+	/** Take a snapshot of the registry. The registry is only locked while it is copied, not while \a callback runs. */
+	pthread_rwlock_rdlock( &registry_lock );
+	size_t count = registry_count;
+	struct tracker **snapshot = (struct tracker**) malloc( ( count > 0 ? count : 1 ) * sizeof( struct tracker* ) );
+	if( snapshot != NULL && count > 0 )
+	{
+		memcpy( snapshot, registry, count * sizeof( struct tracker* ) );
+	}
+	pthread_rwlock_unlock( &registry_lock );
+
+	if( snapshot == NULL )
+	{
+		return 0;
+	}
+
+	for( size_t n = 0; n < count; n++ )
+	{
+		callback( snapshot[n], arg );
+	}
+	free( snapshot );
+
+	return (int) count;
+}
+
+int storeForEachMatch( const char* prefix, const char* substring, const char* cursor, size_t limit, void (*callback)( const struct tracker*, void* ), void* arg, int* more )
+{
+	struct tracker **page = (struct tracker**) malloc( ( limit > 0 ? limit : 1 ) * sizeof( struct tracker* ) );
+	size_t prefix_len = strlen( prefix );
+	size_t count = 0;
+
+	*more = 0;
+	if( page == NULL )
+	{
+		return 0;
+	}
+
+	/** The matches are collected while the registry is read locked, and \a callback runs once it is unlocked, as in storeForEach().
+	 * The walk starts at the prefix, or right after the cursor, and stops at the first filename past the prefix. */
+	pthread_rwlock_rdlock( &registry_lock );
+	size_t n = ( cursor != NULL && strcmp( cursor, prefix ) >= 0 ) ? findByName( cursor, 0 ) : findByName( prefix, 1 );
+	for( ; n < registry_count && strncmp( by_name[n]->filename, prefix, prefix_len ) == 0; n++ )
+	{
+		struct tracker *t = by_name[n];
+		if( substring != NULL && strstr( t->filename, substring ) == NULL && strstr( t->description, substring ) == NULL )
+		{
+			continue;
+		}
+		if( count == limit )
+		{
+			*more = 1;
+			break;
+		}
+		page[ count++ ] = t;
+	}
+	pthread_rwlock_unlock( &registry_lock );
+
+	for( n = 0; n < count; n++ )
+	{
+		callback( page[n], arg );
+	}
+	free( page );
+
+	return (int) count;
+}
+
+unsigned long storeVersion()
+{
+	pthread_rwlock_rdlock( &registry_lock );
+	unsigned long version = store_version;
+	pthread_rwlock_unlock( &registry_lock );
+
+	return version;
+}
+
+char* storeSerialize( const char* tracker_filename, size_t* length, char* md5 )
+{
+	struct tracker *t = findTrackerFile( tracker_filename );
+	if( t == NULL )
+	{
+		return NULL;
+	}
+
+	/** Readers of the same tracker share its lock. */
+	pthread_rwlock_rdlock( &t->lock );
+	char *text = formatTracker( t, 1, 0, t->num_chunks, length );
+	/** The digest already covers everything formatted above; finishing a copy of it costs a single MD5 block. */
+	MD5_CTX digest = t->digest;
+	pthread_rwlock_unlock( &t->lock );
+
+	if( md5 != NULL )
+	{
+		finishDigest( &digest, md5 );
+	}
+
+	return text;
+}
+
+char* storeSelect( const char* tracker_filename, long start_byte, long end_byte, int max_peers, size_t* length, char* md5 )
+{
+	struct tracker *t = findTrackerFile( tracker_filename );
+	if( t == NULL )
+	{
+		return NULL;
+	}
+
+	pthread_rwlock_rdlock( &t->lock );
+
+	/** Find each peer's spans that overlap the range, and the latest time among them. */
+	struct selected_peer *selected = (struct selected_peer*) malloc( ( t->num_peers > 0 ? t->num_peers : 1 ) * sizeof( struct selected_peer ) );
+	char *text = NULL;
+	size_t num_selected = 0, num_spans = 0;
+	if( selected != NULL )
+	{
+		for( size_t n = 0; n < t->num_peers; n++ )
+		{
+			const struct tracker_peer *p = &t->peers[n];
+			size_t first = firstSpanEndingFrom( p, start_byte );
+			size_t last = first;
+			long latest = 0;
+			while( last < p->num_spans && p->spans[ last ].start_byte <= end_byte )
+			{
+				if( p->spans[ last ].time_stamp > latest ) latest = p->spans[ last ].time_stamp;
+				last++;
+			}
+			if( last > first )
+			{
+				struct selected_peer match = { p, first, last, latest, n };
+				selected[ num_selected++ ] = match;
+			}
+		}
+		qsort( selected, num_selected, sizeof( struct selected_peer ), compareSelected );
+		if( max_peers > 0 && num_selected > (size_t) max_peers )
+		{
+			num_selected = max_peers;
+		}
+		for( size_t n = 0; n < num_selected; n++ )
+		{
+			num_spans += selected[n].last - selected[n].first;
+		}
+
+		text = (char*) malloc( headerLength( t ) + num_spans * TRACKER_LINE_SIZE );
+	}
+
+	/** The result is laid out exactly like a tracker file, so the client parses it the same way. */
+	if( text != NULL )
+	{
+		struct tracker_chunk chunk;
+		chunk.lsn = 0;
+		*length = formatHeader( t, text );
+		for( size_t n = 0; n < num_selected; n++ )
+		{
+			snprintf( chunk.ip_addr, sizeof( chunk.ip_addr ), "%s", selected[n].peer->ip_addr );
+			chunk.port_num = selected[n].peer->port_num;
+			for( size_t i = selected[n].first; i < selected[n].last; i++ )
+			{
+				chunk.start_byte = selected[n].peer->spans[i].start_byte;
+				chunk.end_byte = selected[n].peer->spans[i].end_byte;
+				chunk.time_stamp = selected[n].peer->spans[i].time_stamp;
+				*length += formatChunk( &chunk, text + *length );
+			}
+		}
+	}
+	pthread_rwlock_unlock( &t->lock );
+	free( selected );
+
+	if( text != NULL && md5 != NULL )
+	{
+		MD5_CTX digest;
+		MD5_Init( &digest );
+		MD5_Update( &digest, text, *length );
+		finishDigest( &digest, md5 );
+	}
+
+	return text;
+}
+
+int storeOpenFile( const char* tracker_filename, int* fd, size_t* length, char* md5 )
+{
+	struct tracker *t = findTrackerFile( tracker_filename );
+	if( t == NULL )
+	{
+		return STORE_NOT_FOUND;
+	}
+
+	/** The file matches memory only once every change has been written out. Tracker files are only ever appended to, so the bytes
+	 * covered by the digest stay the same even if the tracker is updated while the file is being sent. */
+	int rtn = STORE_FAIL;
+	pthread_rwlock_rdlock( &t->lock );
+	MD5_CTX digest = t->digest;
+	*length = t->length;
+	if( t->persisted_length == t->length )
+	{
+		char path[ PATH_MAX ];
+		if( trackerPath( t, TRACKER_SUFFIX, path, sizeof( path ) ) == 0 && ( *fd = open( path, O_RDONLY ) ) != -1 )
+		{
+			rtn = STORE_OK;
+		}
+	}
+	pthread_rwlock_unlock( &t->lock );
+
+	if( rtn == STORE_OK && md5 != NULL )
+	{
+		finishDigest( &digest, md5 );
+	}
+
+	return rtn;
+}
@@ -0,0 +1,314 @@
+/**
+ * @file tracker_store.h
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @brief Header file for tracker_store.c
+ * @details In-memory index of every tracker file on the server.
+ *
+ * All four commands are served from memory. Every change is first appended to a write-ahead log (tracker_wal.c), and
+ * is durable once storeSync() has returned for it. The .track files in the "Tracker Files" folder are materialized
+ * from memory by a background thread, which then checkpoints the log.
+ *
+ * The same thread compacts trackers every \a COMPACT_INTERVAL_MS milliseconds. A tracker whose records could be collapsed to
+ * fewer than 1 in \a COMPACT_RATIO has them replaced with one record per contiguous range each peer has announced, carrying
+ * the time of the peer's latest record in that range. The new file is written beside the old one and renamed over it.
+ *
+ * A peer that has not announced anything for \a peer_ttl seconds (see storeInit()) has expired. Every peer has a deadline in a timer wheel
+ * (timer_wheel.c), which the same thread advances; an expired peer's records are dropped from memory once a checkpoint covers them, and its
+ * tracker file is rewritten without them. Announcing again brings the peer back, without the records it had before it expired.
+ *
+ * There is no global lock. The hash buckets are guarded by \a STORE_LOCK_STRIPES striped reader/writer locks, and
+ * each tracker has its own reader/writer lock, so commands for different trackers never wait on each other.
+ * Trackers are never removed, and their Filename, Filesize, Description and MD5 never change once created.
+ */
+
+#ifndef __TRACKER_STORE_H__
+#define __TRACKER_STORE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/md5.h>
+
+#include "timer_wheel.h"
+
+/*-----------------------------------
+            Defines
+-----------------------------------*/
+#define TRACKER_BUCKETS 4096		///< Number of hash buckets in the index, must be a power of 2
+#define STORE_LOCK_STRIPES 64		///< Number of locks guarding the hash buckets, must be a power of 2
+#define TRACKER_IP_SIZE 64			///< IP address (or host name) buffer string size for a chunk record
+#define TRACKER_LINE_SIZE ( TRACKER_IP_SIZE + 4 * 21 + 6 )	///< Longest chunk record line: "\n" + ip + 4 numbers with separators
+#define TRACKER_SUFFIX ".track"		///< Suffix of every tracker file name
+#define TRACKER_TEMP_SUFFIX ".tmp"	///< Appended to a tracker file's name while its replacement is being written
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * A byte range announced by storeUpdateRanges().
+ */
+struct tracker_range
+{
+	long	start_byte;						///< Starting byte of the range
+	long	end_byte;						///< Ending byte of the range
+};
+
+/**
+ * A single "ip:port:start:end:time" line of a tracker file.
+ */
+struct tracker_chunk
+{
+	char	ip_addr[ TRACKER_IP_SIZE ];		///< IP address of the sharing peer
+	int		port_num;						///< Port of the sharing peer
+	long	start_byte;						///< Starting byte of the chunk
+	long	end_byte;						///< Ending byte of the chunk
+	long	time_stamp;						///< Time the chunk was announced
+	unsigned long lsn;						///< LSN of the log record that added the chunk, 0 if it was loaded from its tracker file
+};
+
+/**
+ * A contiguous byte range a peer has announced, merged from one or more chunk records.
+ */
+struct tracker_span
+{
+	long	start_byte;						///< Starting byte of the range
+	long	end_byte;						///< Ending byte of the range
+	long	time_stamp;						///< Time of the most recent record within the range
+};
+
+/**
+ * Everything one peer (ip:port) has announced for a tracker. This is the index range queries are answered from.
+ */
+struct tracker_peer
+{
+	char	ip_addr[ TRACKER_IP_SIZE ];		///< IP address of the peer
+	int		port_num;						///< Port of the peer
+	struct tracker_span *spans;				///< Announced ranges, sorted by starting byte. They never overlap or touch.
+	size_t	num_spans;						///< Number of ranges in \a spans
+	size_t	span_capacity;					///< Allocated length of \a spans
+	long	last_seen;						///< Time of the peer's latest record
+	long	expired_until;					///< Time of the peer's latest record when it last expired, -1 if it never did. Records up to then are dropped
+	struct peer_expiry *expiry;				///< The peer's expiry timer, or NULL once the peer has expired
+};
+
+/**
+ * Deadline of a peer in the timer wheel. The peer is found through its tracker, as the tracker's \a peers array may move.
+ */
+struct peer_expiry
+{
+	struct wheel_timer timer;				///< The timer, whose \a data points back to this structure
+	struct tracker *tracker;				///< Tracker the peer belongs to
+	size_t	peer;							///< Index of the peer in the tracker's \a peers
+};
+
+/**
+ * A tracker file held in memory.
+ */
+struct tracker
+{
+	char	*filename;						///< Name of the shared file (the tracker file is filename.track)
+	char	*filesize;						///< Size of the shared file, as sent by the client
+	char	*description;					///< Description of the shared file
+	char	*md5;							///< MD5 of the shared file
+
+	struct tracker_chunk *chunks;			///< Chunk records, in the order they were announced
+	size_t	num_chunks;						///< Number of records in \a chunks
+	size_t	chunk_capacity;					///< Allocated length of \a chunks
+	struct tracker_peer *peers;				///< Every peer that has announced a chunk, in the order they first did
+	size_t	num_peers;						///< Number of peers in \a peers
+	size_t	peer_capacity;					///< Allocated length of \a peers
+	size_t	*peer_index;					///< Open addressing hash of ip:port to index + 1 in \a peers, 0 for an empty slot
+	size_t	peer_index_size;				///< Number of slots in \a peer_index, a power of 2
+	size_t	num_spans;						///< Number of spans across every peer, which is how many records the tracker compacts to
+
+	unsigned long lsn;						///< LSN of the log record that created the tracker, 0 if it was loaded from its tracker file
+	unsigned long last_lsn;					///< LSN of the latest log record that changed the tracker, 0 if none did since it was loaded
+	size_t	length;							///< Length of the tracker file, as formatted from memory
+	int		persisted_header;				///< 1 once the header has been written to disk
+	size_t	persisted_chunks;				///< Number of \a chunks already written to disk
+	size_t	persisted_length;				///< Length of the tracker file on disk, or 0 if it is not laid out exactly as formatted from memory
+	int		dirty;							///< 1 while this tracker is on the dirty list
+	int		expired;						///< 1 while this tracker has expired peers whose records have not been dropped
+
+	MD5_CTX	digest;							///< Running MD5 of the tracker file, covering the header and every record in \a chunks
+
+	pthread_rwlock_t lock;					///< Guards \a chunks, \a peers, \a digest and the persisted counters
+
+	struct tracker *next;					///< Next tracker in the same hash bucket
+	struct tracker *next_dirty;				///< Next tracker waiting to be written to disk
+};
+
+/*-----------------------------------
+        Enums & const string
+-----------------------------------*/
+/**
+ * Return values of the store functions.
+ */
+enum store_rtn_val
+{
+	STORE_FAIL = -1,					///< Out of memory, or invalid arguments
+	STORE_OK = 0,						///< Normal return value
+	STORE_EXISTS = 1,					///< Tracker already exists - storeCreate()
+	STORE_NOT_FOUND = 2					///< Tracker does not exist - storeUpdate(), storeUpdateRanges(), storeSerialize(), storeOpenFile(), storeSelect()
+};
+
+/*-----------------------------------
+            Prototypes
+-----------------------------------*/
+/**
+ * Load every tracker file in a folder into memory, replay the changes logged since the last checkpoint, and start the
+ * log writer and write-behind threads.
+ *
+ * @param directory Folder holding the tracker files, INPUT.
+ * @param peer_ttl Seconds after its latest record that a peer expires, or 0 for peers never to expire, INPUT.
+ *
+ * @return \b STORE_OK, or \b STORE_FAIL if the log could not be opened or a thread could not be started.
+ */
+int storeInit( const char* directory, long peer_ttl );
+
+/**
+ * Stop the write-behind thread, write every outstanding change to the tracker files, checkpoint and close the log.
+ */
+void storeShutdown();
+
+/**
+ * Create a new tracker.
+ *
+ * @param filename Name of the shared file. A name that would put the tracker file outside the tracker folder (empty, ".", "..", or
+ * containing a '/') is refused, INPUT.
+ * @param filesize Size of the shared file, INPUT.
+ * @param description Description of the shared file, INPUT.
+ * @param md5 MD5 of the shared file, INPUT.
+ * @param lsn LSN of the change, to pass to storeSync() before acknowledging it. Only set on \b STORE_OK. May be NULL, OUTPUT.
+ *
+ * @return \b STORE_OK, \b STORE_EXISTS, or \b STORE_FAIL.
+ */
+int storeCreate( const char* filename, const char* filesize, const char* description, const char* md5, unsigned long* lsn );
+
+/**
+ * Append a chunk record to an existing tracker. The record is time stamped with the current time.
+ *
+ * @param filename Name of the shared file, INPUT.
+ * @param ip_addr IP address of the sharing peer, INPUT.
+ * @param port_num Port of the sharing peer, INPUT.
+ * @param start_byte Starting byte of the chunk, INPUT.
+ * @param end_byte Ending byte of the chunk, INPUT.
+ * @param lsn LSN of the change, to pass to storeSync() before acknowledging it. Only set on \b STORE_OK. May be NULL, OUTPUT.
+ *
+ * @return \b STORE_OK, \b STORE_NOT_FOUND, or \b STORE_FAIL.
+ */
+int storeUpdate( const char* filename, const char* ip_addr, int port_num, long start_byte, long end_byte, unsigned long* lsn );
+
+/**
+ * Append the chunk records for several byte ranges of one peer to an existing tracker, as a single change.
+ * The ranges are sorted and those that overlap or touch are merged first, so each record covers as much as it can. Either every record
+ * is appended and logged (as one log record, so a crash cannot keep only some of them), or none is. Readers never see part of the
+ * change. The records are all time stamped with the current time.
+ *
+ * @param filename Name of the shared file, INPUT.
+ * @param ip_addr IP address of the sharing peer, INPUT.
+ * @param port_num Port of the sharing peer, INPUT.
+ * @param ranges The ranges. Sorted and merged in place, INPUT/OUTPUT.
+ * @param num_ranges Number of \a ranges, at least 1. Set to the number left once they are merged, INPUT/OUTPUT.
+ * @param lsn LSN of the change, to pass to storeSync() before acknowledging it. Only set on \b STORE_OK. May be NULL, OUTPUT.
+ *
+ * @return \b STORE_OK, \b STORE_NOT_FOUND, or \b STORE_FAIL.
+ */
+int storeUpdateRanges( const char* filename, const char* ip_addr, int port_num, struct tracker_range* ranges, size_t* num_ranges, unsigned long* lsn );
+
+/**
+ * Wait until a change is durable. Changes made concurrently are synced together, so waiting once for the highest LSN of a batch
+ * is enough. A change that could not be logged is still applied, but must not be acknowledged as durable.
+ *
+ * @param lsn LSN returned by storeCreate(), storeUpdate() or storeUpdateRanges(), INPUT.
+ *
+ * @return \b STORE_OK, or \b STORE_FAIL if the change, or one made before it, could not be logged.
+ */
+int storeSync( unsigned long lsn );
+
+/**
+ * Call a function for every tracker in the store, in the order they were created.
+ * The trackers visited are a snapshot taken when the function is called. No lock is held while \a callback runs, so it may
+ * only read the header fields (filename, filesize, description, md5) of the tracker it is given.
+ *
+ * @param callback Function called with each tracker and \a arg, INPUT.
+ * @param arg Passed through to \a callback, INPUT.
+ *
+ * @return Number of trackers visited.
+ */
+int storeForEach( void (*callback)( const struct tracker*, void* ), void* arg );
+
+/**
+ * Call a function for one page of the trackers whose filename starts with a prefix, in filename order.
+ * Trackers are kept sorted by filename, so a page costs the trackers it skips with \a substring rather than the whole store. Pages are
+ * resumed from the last filename of the previous one, so trackers created in the meantime never shift them. As in storeForEach(),
+ * no lock is held while \a callback runs.
+ *
+ * @param prefix Only trackers whose filename starts with it are visited. Empty for every tracker, INPUT.
+ * @param substring Only trackers whose filename or description contains it are visited. May be NULL, INPUT.
+ * @param cursor Only trackers whose filename sorts after it are visited. NULL to start from the first match, INPUT.
+ * @param limit Most trackers to visit, INPUT.
+ * @param callback Function called with each tracker and \a arg, INPUT.
+ * @param arg Passed through to \a callback, INPUT.
+ * @param more Set to 1 if there are more matches after the last tracker visited, 0 otherwise, OUTPUT.
+ *
+ * @return Number of trackers visited.
+ */
+int storeForEachMatch( const char* prefix, const char* substring, const char* cursor, size_t limit, void (*callback)( const struct tracker*, void* ), void* arg, int* more );
+
+/**
+ * Version of the set of trackers. It changes whenever a tracker is created, and at no other time, so anything derived only from the
+ * trackers' header fields (such as the LIST response) stays valid for as long as the version does not change.
+ *
+ * @return The current version.
+ */
+unsigned long storeVersion();
+
+/**
+ * Build the contents of a tracker file, exactly as it is stored on disk.
+ * Note: You should call free() on the return value of this function.
+ *
+ * @param tracker_filename Name of the tracker file (filename.track), INPUT.
+ * @param length Number of bytes returned, OUTPUT.
+ * @param md5 The MD5 of the returned contents as 32 hex digits, NUL terminated. Must hold 33 bytes, or be NULL, OUTPUT.
+ *
+ * @return The tracker file contents (NUL terminated), or NULL if the tracker does not exist.
+ */
+char* storeSerialize( const char* tracker_filename, size_t* length, char* md5 );
+
+/**
+ * Build a tracker file holding only the peers that have announced bytes within a range. It has the same header as the full tracker file,
+ * followed by one record per contiguous range each selected peer has announced that overlaps [\a start_byte, \a end_byte]. A peer that
+ * announced the same bytes many times appears once, with the time of its latest record. Peers are ordered by the latest time among their
+ * records, most recent first.
+ * Note: You should call free() on the return value of this function.
+ *
+ * @param tracker_filename Name of the tracker file (filename.track), INPUT.
+ * @param start_byte Starting byte of the range, INPUT.
+ * @param end_byte Ending byte of the range, inclusive, INPUT.
+ * @param max_peers Most peers to return, or 0 for no limit, INPUT.
+ * @param length Length of the returned text, OUTPUT.
+ * @param md5 MD5 of the returned text, as 32 hex characters plus a NUL. May be NULL, OUTPUT.
+ *
+ * @return The tracker file contents (NUL terminated), or NULL if the tracker does not exist or memory could not be allocated.
+ */
+char* storeSelect( const char* tracker_filename, long start_byte, long end_byte, int max_peers, size_t* length, char* md5 );
+
+/**
+ * Open a tracker file on disk, so that it can be sent without copying it. Only possible once every change to the tracker has been
+ * written out; until then, storeSerialize() has to be used. The file may grow after this returns, but its first \a length bytes
+ * never change.
+ * Note: You should call close() on \a fd.
+ *
+ * @param tracker_filename Name of the tracker file (filename.track), INPUT.
+ * @param fd Descriptor of the tracker file, open for reading. Only set on \b STORE_OK, OUTPUT.
+ * @param length Number of bytes of the file to send, OUTPUT.
+ * @param md5 MD5 of those bytes, as 32 hex characters plus a NUL. May be NULL, OUTPUT.
+ *
+ * @return \b STORE_OK, \b STORE_NOT_FOUND, or \b STORE_FAIL if the file on disk is behind memory or could not be opened.
+ */
+int storeOpenFile( const char* tracker_filename, int* fd, size_t* length, char* md5 );
+
+#endif
@@ -0,0 +1,499 @@
+/**
+ * @file tracker_wal.c
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @section COMPILE
+ * g++ -c tracker_wal.c
+ *  (or use make in root directory)
+ */
+
+/*-----------------------------------
+            Includes
+-----------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "server_constants.ini"
+#include "tracker_wal.h"
+
+
+/*-----------------------------------
+            Variables
+-----------------------------------*/
+static char *pending = NULL;							///< Records appended but not yet handed to the log writer
+
+static size_t pending_len = 0;							///< Number of bytes in \a pending
+
+static size_t pending_capacity = 0;						///< Allocated length of \a pending
+
+static unsigned long next_lsn = 1;						///< LSN given to the next record
+
+static unsigned long durable_lsn = 0;					///< Every record up to this LSN is on disk
+
+static unsigned long processed_lsn = 0;					///< Every record up to this LSN has been through the log writer, whether it reached the disk or not
+
+static unsigned long failed_lsn = 0;					///< Highest LSN of a record that could not be logged, 0 if none since the last checkpoint that covers it
+
+static unsigned long rotated_lsn = 0;					///< Highest LSN in the segments closed by walRotate()
+
+static int rotate_requested = 0;						///< Set by walRotate(), cleared by the log writer once it has rotated
+
+static int closing = 0;									///< Set by walClose()
+
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;	///< Protects all of the above
+
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;	///< Signalled when the log writer has work
+
+static pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;	///< Broadcast whenever the log writer finishes a group, or a rotation completes
+
+static pthread_t writer_thread;							///< The log writer thread
+
+static int segment_fd = -1;								///< The segment being written, only used by the log writer
+
+static off_t segment_len = 0;							///< Length of the segment up to the end of its last group written whole, only used by the log writer
+
+static unsigned long segment_first_lsn = 0;				///< First LSN of the current segment, protected by \a wal_mutex
+
+static unsigned long checkpoint_lsn = 0;				///< LSN of the last checkpoint, only changed by walReplay() and walCheckpoint()
+
+static char wal_directory[ PATH_MAX ];				///< Folder holding the log
+
+
+/*-----------------------------------
+        Internal functions
+-----------------------------------*/
+
+/**
+ * Create the segment that starts at \a first_lsn.
+ */
+static int openSegment( unsigned long first_lsn )
+{
+	char path[ PATH_MAX ];
+	if( snprintf( path, sizeof( path ), "%s/%s%020lu%s", wal_directory, WAL_PREFIX, first_lsn, WAL_SUFFIX ) >= (int) sizeof( path ) )
+	{
+		fprintf( stderr, "WAL Error: log folder path is too long\n" );
+		segment_fd = -1;
+		return -1;
+	}
+
+	if( ( segment_fd = open( path, O_WRONLY | O_CREAT | O_APPEND, 0644 ) ) == -1 )
+	{
+		perror( "WAL Error: can't create log segment" );
+		return -1;
+	}
+	segment_len = lseek( segment_fd, 0, SEEK_END );
+	return 0;
+}
+
+/**
+ * Write a whole buffer to a descriptor.
+ */
+static int writeAll( int fd, const char* data, size_t length )
+{
+	while( length > 0 )
+	{
+		ssize_t written = write( fd, data, length );
+		if( written == -1 )
+		{
+			if( errno == EINTR ) continue;
+			return -1;
+		}
+		data += written;
+		length -= written;
+	}
+	return 0;
+}
+
+/**
+ * Sync a folder, so that files created or renamed in it survive a crash.
+ */
+static void syncDirectory( const char* directory )
+{
+	int fd = open( directory, O_RDONLY );
+	if( fd != -1 )
+	{
+		fsync( fd );
+		close( fd );
+	}
+}
+
+/**
+ * Parse the first LSN out of a segment file name. Returns 0 if \a name is not a segment.
+ */
+static unsigned long segmentLsn( const char* name )
+{
+	size_t prefix_len = strlen( WAL_PREFIX );
+	size_t suffix_len = strlen( WAL_SUFFIX );
+	size_t name_len = strlen( name );
+
+	if( name_len <= prefix_len + suffix_len || strncmp( name, WAL_PREFIX, prefix_len ) != 0
+		|| strcmp( name + name_len - suffix_len, WAL_SUFFIX ) != 0 )
+	{
+		return 0;
+	}
+	return strtoul( name + prefix_len, NULL, 10 );
+}
+
+/**
+ * scandir() filter selecting the log segments.
+ */
+static int isSegment( const struct dirent* entry )
+{
+	return segmentLsn( entry->d_name ) != 0;
+}
+
+/**
+ * Body of the log writer thread.
+ * Each pass takes everything appended since the last one, writes it with a single write(), and syncs it with a single fdatasync(),
+ * so every announce that arrived in the meantime is committed together.
+ */
+static void* logWriter( void* arg )
+{
+	pthread_mutex_lock( &wal_mutex );
+	while( 1 )
+	{
+		/** Records dropped by walAppend() are waited on too, so that their failure gets reported. */
+		while( next_lsn - 1 == processed_lsn && rotate_requested == 0 && closing == 0 )
+		{
+			pthread_cond_wait( &writer_cond, &wal_mutex );
+		}
+		if( next_lsn - 1 == processed_lsn && rotate_requested == 0 && closing == 1 )
+		{
+			break;
+		}
+
+		/** Hold the group open for up to \a WAL_SYNC_MS, so that more announces can share the sync. */
+		if( WAL_SYNC_MS > 0 && rotate_requested == 0 && closing == 0 )
+		{
+			struct timespec deadline;
+			clock_gettime( CLOCK_REALTIME, &deadline );
+			deadline.tv_nsec += WAL_SYNC_MS * 1000000L;
+			while( deadline.tv_nsec >= 1000000000L )
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait( &writer_cond, &wal_mutex, &deadline );
+		}
+
+		/** Take the whole group. Appends can carry on into a fresh buffer while it is written. */
+		char *group = pending;
+		size_t group_len = pending_len;
+		unsigned long group_lsn = next_lsn - 1;
+		int rotate = rotate_requested;
+		pending = NULL;
+		pending_len = 0;
+		pending_capacity = 0;
+		pthread_mutex_unlock( &wal_mutex );
+
+		int failed = 0, fresh = 0;
+		if( group_len > 0 && ( segment_fd == -1 || writeAll( segment_fd, group, group_len ) == -1 || fdatasync( segment_fd ) == -1 ) )
+		{
+			perror( "WAL Error: can't write log segment" );
+			failed = 1;
+
+			/** Part of the group may have reached the segment, and the next group would be appended right after it, to be replayed as
+			 * a corrupt record. Cut it off. If that fails too, the segment is left to end with it, where replay stops, for a new one. */
+			if( segment_fd != -1 && ftruncate( segment_fd, segment_len ) == -1 )
+			{
+				perror( "WAL Error: can't truncate log segment" );
+				close( segment_fd );
+				segment_fd = -1;
+				fresh = 1;
+			}
+		}
+		else
+		{
+			segment_len += group_len;
+		}
+		free( group );
+
+		/** A rotation closes the segment after this group, so it holds exactly the changes up to \a group_lsn. A segment that can not be
+		 * created leaves the log without one, and every group fails until a later rotation manages to create it. */
+		if( rotate == 1 || fresh == 1 )
+		{
+			if( segment_fd != -1 ) close( segment_fd );
+			openSegment( group_lsn + 1 );
+			syncDirectory( wal_directory );
+		}
+
+		/** The changes stay in memory and still reach the tracker files, but those after a group that failed are not durable until a
+		 * checkpoint covers it. */
+		pthread_mutex_lock( &wal_mutex );
+		if( failed == 1 && group_lsn > failed_lsn ) failed_lsn = group_lsn;
+		if( failed_lsn == 0 ) durable_lsn = group_lsn;
+		processed_lsn = group_lsn;
+		if( rotate == 1 )
+		{
+			rotated_lsn = group_lsn;
+			segment_first_lsn = group_lsn + 1;
+			rotate_requested = 0;
+		}
+		pthread_cond_broadcast( &durable_cond );
+	}
+	pthread_mutex_unlock( &wal_mutex );
+	return NULL;
+}
+
+
+/*-----------------------------------
+            Functions
+-----------------------------------*/
+
+int walReplay( const char* directory, void (*apply)( unsigned long, char* ), unsigned long* last_lsn )
+{
+	char path[ PATH_MAX ];
+	struct dirent **segments;
+	int num_segments, replayed = 0;
+	FILE *file;
+
+	snprintf( wal_directory, sizeof( wal_directory ), "%s", directory );
+
+	/** Everything up to the checkpoint is already in the tracker files. */
+	if( snprintf( path, sizeof( path ), "%s/%s", directory, WAL_CHECKPOINT ) >= (int) sizeof( path ) )
+	{
+		fprintf( stderr, "WAL Error: log folder path is too long\n" );
+		*last_lsn = 0;
+		return 0;
+	}
+	if( ( file = fopen( path, "r" ) ) != NULL )
+	{
+		if( fscanf( file, "%lu", &checkpoint_lsn ) != 1 )
+		{
+			checkpoint_lsn = 0;
+		}
+		fclose( file );
+	}
+	*last_lsn = checkpoint_lsn;
+
+	/** Segment names are zero padded, so sorting them by name sorts them by LSN. */
+	if( ( num_segments = scandir( directory, &segments, &isSegment, &alphasort ) ) == -1 )
+	{
+		return 0;
+	}
+
+	char *line = NULL;
+	size_t len = 0;
+	for( int n = 0; n < num_segments; n++ )
+	{
+		if( snprintf( path, sizeof( path ), "%s/%s", directory, segments[n]->d_name ) < (int) sizeof( path )
+			&& ( file = fopen( path, "r" ) ) != NULL )
+		{
+			ssize_t line_len;
+			while( ( line_len = getline( &line, &len, file ) ) != -1 )
+			{
+				unsigned long lsn;
+				int offset;
+
+				/** A line without its newline was torn by the crash, and was never acknowledged. */
+				if( line[ line_len - 1 ] != '\n' || sscanf( line, "%lu %n", &lsn, &offset ) != 1 )
+				{
+					break;
+				}
+				line[ line_len - 1 ] = '\0';
+
+				if( lsn > *last_lsn ) *last_lsn = lsn;
+				if( lsn > checkpoint_lsn )
+				{
+					apply( lsn, line + offset );
+					replayed++;
+				}
+			}
+			fclose( file );
+		}
+		free( segments[n] );
+	}
+	free( segments );
+	free( line );
+
+	return replayed;
+}
+
+int walOpen( const char* directory, unsigned long last_lsn )
+{
+	snprintf( wal_directory, sizeof( wal_directory ), "%s", directory );
+
+	next_lsn = last_lsn + 1;
+	durable_lsn = last_lsn;
+	processed_lsn = last_lsn;
+	failed_lsn = 0;
+	rotated_lsn = last_lsn;
+	segment_first_lsn = next_lsn;
+
+	if( openSegment( segment_first_lsn ) == -1 )
+	{
+		return -1;
+	}
+	syncDirectory( wal_directory );
+
+	if( pthread_create( &writer_thread, NULL, &logWriter, NULL ) != 0 )
+	{
+		return -1;
+	}
+	return 0;
+}
+
+void walClose()
+{
+	pthread_mutex_lock( &wal_mutex );
+	closing = 1;
+	pthread_cond_signal( &writer_cond );
+	pthread_mutex_unlock( &wal_mutex );
+
+	pthread_join( writer_thread, NULL );
+	if( segment_fd != -1 ) close( segment_fd );
+	segment_fd = -1;
+}
+
+unsigned long walAppend( const char* record )
+{
+	char prefix[ 32 ];
+	size_t record_len = strlen( record );
+
+	pthread_mutex_lock( &wal_mutex );
+	unsigned long lsn = next_lsn++;
+	size_t prefix_len = sprintf( prefix, "%lu ", lsn );
+
+	if( pending_len + prefix_len + record_len + 1 > pending_capacity )
+	{
+		size_t capacity = ( pending_capacity == 0 ) ? 4096 : pending_capacity;
+		while( capacity < pending_len + prefix_len + record_len + 1 ) capacity *= 2;
+		char *grown = (char*) realloc( pending, capacity );
+		if( grown == NULL )
+		{
+			/** The change is still applied in memory, and reaches the tracker files in the background, but it is not durable. */
+			perror( "WAL Error: out of memory" );
+			if( lsn > failed_lsn ) failed_lsn = lsn;
+			pthread_cond_signal( &writer_cond );
+			pthread_mutex_unlock( &wal_mutex );
+			return lsn;
+		}
+		pending = grown;
+		pending_capacity = capacity;
+	}
+	memcpy( pending + pending_len, prefix, prefix_len );
+	memcpy( pending + pending_len + prefix_len, record, record_len );
+	pending[ pending_len + prefix_len + record_len ] = '\n';
+	pending_len += prefix_len + record_len + 1;
+
+	/** Only the first record of a group needs to wake the writer. */
+	if( pending_len == prefix_len + record_len + 1 )
+	{
+		pthread_cond_signal( &writer_cond );
+	}
+	pthread_mutex_unlock( &wal_mutex );
+
+	return lsn;
+}
+
+int walSync( unsigned long lsn )
+{
+	pthread_mutex_lock( &wal_mutex );
+	while( processed_lsn < lsn )
+	{
+		pthread_cond_wait( &durable_cond, &wal_mutex );
+	}
+	int rtn = ( durable_lsn >= lsn ) ? 0 : -1;
+	pthread_mutex_unlock( &wal_mutex );
+
+	return rtn;
+}
+
+unsigned long walRotate()
+{
+	pthread_mutex_lock( &wal_mutex );
+	if( next_lsn - 1 > rotated_lsn )
+	{
+		rotate_requested = 1;
+		pthread_cond_signal( &writer_cond );
+		while( rotate_requested == 1 )
+		{
+			pthread_cond_wait( &durable_cond, &wal_mutex );
+		}
+	}
+	unsigned long lsn = rotated_lsn;
+	pthread_mutex_unlock( &wal_mutex );
+
+	return lsn;
+}
+
+int walCheckpoint( unsigned long lsn )
+{
+	char path[ PATH_MAX ];
+	char temp_path[ PATH_MAX ];
+	char text[ 32 ];
+
+	if( lsn <= checkpoint_lsn )
+	{
+		return 0;
+	}
+
+	/** The tracker files written since the last checkpoint may be new, so their folder entries are synced first. */
+	syncDirectory( wal_directory );
+
+	/** Replace the checkpoint atomically: write a new file, sync it, and rename it over the old one. */
+	if( snprintf( path, sizeof( path ), "%s/%s", wal_directory, WAL_CHECKPOINT ) >= (int) sizeof( path )
+		|| snprintf( temp_path, sizeof( temp_path ), "%s.tmp", path ) >= (int) sizeof( temp_path ) )
+	{
+		fprintf( stderr, "WAL Error: log folder path is too long\n" );
+		return -1;
+	}
+	int fd = open( temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	size_t text_len = sprintf( text, "%lu\n", lsn );
+	if( fd == -1 || writeAll( fd, text, text_len ) == -1 || fsync( fd ) == -1 || close( fd ) == -1 || rename( temp_path, path ) == -1 )
+	{
+		perror( "WAL Error: can't write checkpoint" );
+		return -1;
+	}
+	syncDirectory( wal_directory );
+
+	/** Once the tracker files hold every record that could not be logged, the records logged since are durable again. */
+	pthread_mutex_lock( &wal_mutex );
+	checkpoint_lsn = lsn;
+	if( failed_lsn != 0 && failed_lsn <= lsn )
+	{
+		failed_lsn = 0;
+		durable_lsn = processed_lsn;
+		pthread_cond_broadcast( &durable_cond );
+	}
+
+	/** Every segment before the current one only holds changes up to \a lsn, so they can go. */
+	unsigned long current = segment_first_lsn;
+	pthread_mutex_unlock( &wal_mutex );
+
+	struct dirent **segments;
+	int num_segments;
+	if( ( num_segments = scandir( wal_directory, &segments, &isSegment, &alphasort ) ) != -1 )
+	{
+		for( int n = 0; n < num_segments; n++ )
+		{
+			if( segmentLsn( segments[n]->d_name ) < current && segmentLsn( segments[n]->d_name ) <= lsn )
+			{
+				if( snprintf( path, sizeof( path ), "%s/%s", wal_directory, segments[n]->d_name ) < (int) sizeof( path ) )
+				{
+					unlink( path );
+				}
+			}
+			free( segments[n] );
+		}
+		free( segments );
+	}
+	return 0;
+}
+
+unsigned long walCheckpointLsn()
+{
+	pthread_mutex_lock( &wal_mutex );
+	unsigned long lsn = checkpoint_lsn;
+	pthread_mutex_unlock( &wal_mutex );
+
+	return lsn;
+}
@@ -0,0 +1,104 @@
+/**
+ * @file tracker_wal.h
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @brief Header file for tracker_wal.c
+ * @details Write-ahead log of every change made to the tracker store.
+ *
+ * Each change is given a log sequence number (LSN) and appended, as one text line, to a log segment in the tracker folder.
+ * A single log writer thread writes and fdatasync()s whatever has been appended since its last pass, so concurrent announces
+ * share one sync (group commit). The tracker files are only a materialized copy of the log: once every change up to some LSN has
+ * been written to them, walCheckpoint() records that LSN and deletes the segments it covers. After a crash, walReplay() hands back
+ * every change made since the last checkpoint.
+ *
+ * Segment files are named "wal.<first LSN>.log" and the checkpoint is kept in "wal.checkpoint".
+ */
+
+#ifndef __TRACKER_WAL_H__
+#define __TRACKER_WAL_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*-----------------------------------
+            Defines
+-----------------------------------*/
+#define WAL_PREFIX "wal."						///< Prefix of every log file
+#define WAL_SUFFIX ".log"						///< Suffix of a log segment
+#define WAL_CHECKPOINT "wal.checkpoint"			///< Name of the checkpoint file
+
+/*-----------------------------------
+            Prototypes
+-----------------------------------*/
+/**
+ * Read every change recorded in the log after the last checkpoint, in LSN order. Must be called before walOpen().
+ *
+ * @param directory Folder holding the log, INPUT.
+ * @param apply Function called with each change's LSN and record. The record may be modified by \a apply, INPUT.
+ * @param last_lsn The highest LSN that has ever been used, OUTPUT.
+ *
+ * @return Number of changes replayed.
+ */
+int walReplay( const char* directory, void (*apply)( unsigned long, char* ), unsigned long* last_lsn );
+
+/**
+ * Start a new log segment, and the log writer thread.
+ *
+ * @param directory Folder holding the log, INPUT.
+ * @param last_lsn The highest LSN that has ever been used, as returned by walReplay(), INPUT.
+ *
+ * @return 0, or -1 if the segment could not be created or the thread could not be started.
+ */
+int walOpen( const char* directory, unsigned long last_lsn );
+
+/**
+ * Write out and sync everything appended so far, and stop the log writer thread.
+ */
+void walClose();
+
+/**
+ * Append a change to the log. The change is not durable until walSync() has returned for its LSN.
+ *
+ * @param record The change, a single line without the newline, INPUT.
+ *
+ * @return The change's LSN.
+ */
+unsigned long walAppend( const char* record );
+
+/**
+ * Wait until every change up to and including \a lsn has been through the log writer.
+ *
+ * A change that could not be logged (out of memory, a failed write or sync, or a missing segment) is still applied in memory and
+ * reaches the tracker files, but it and every change after it are reported as not durable until a checkpoint covers it.
+ *
+ * @param lsn The LSN to wait for, INPUT.
+ *
+ * @return 0 if every change up to \a lsn is on disk, or -1 if any of them may be lost in a crash.
+ */
+int walSync( unsigned long lsn );
+
+/**
+ * Close the current log segment, so that a checkpoint can later delete it, and start a new one. Does nothing if nothing has been
+ * appended since the last call.
+ *
+ * @return The highest LSN in the closed segments. Every change up to it has been appended (and synced) before this returns.
+ */
+unsigned long walRotate();
+
+/**
+ * Record that every change up to and including \a lsn has been written to the tracker files, and delete the log segments that are
+ * no longer needed. The caller must have synced the tracker files first.
+ *
+ * @param lsn A value returned by walRotate(), INPUT.
+ *
+ * @return 0, or -1 if the checkpoint could not be written.
+ */
+int walCheckpoint( unsigned long lsn );
+
+/**
+ * @return The LSN of the last checkpoint. Every change up to and including it is in the tracker files, and will not be replayed.
+ */
+unsigned long walCheckpointLsn();
+
+#endif
@@ -0,0 +1,232 @@
+/**
+ * @file work_queue.c
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @section COMPILE
+ * g++ -c work_queue.c
+ *  (or use make in root directory)
+ */
+
+/*-----------------------------------
+            Includes
+-----------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+
+#include "work_queue.h"
+
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * One slot of the ring.
+ */
+struct work_cell
+{
+	unsigned long	sequence;				///< Position this slot can next be pushed at, or that position + 1 once it holds an item
+	void	*item;							///< The item held
+	unsigned long long pushed_ns;			///< When the item was pushed
+};
+
+
+/*-----------------------------------
+            Variables
+-----------------------------------*/
+static struct work_cell *cells = NULL;					///< The ring
+
+static size_t mask = 0;									///< Number of slots - 1
+
+static unsigned long push_pos = 0;						///< Position of the next push
+
+static unsigned long pop_pos = 0;						///< Position of the next pop
+
+static sem_t available;									///< Posted once per item pushed, and once per consumer by workQueueClose()
+
+static int closed = 0;									///< Set by workQueueClose()
+
+static struct work_stats stats;							///< Counters, updated atomically
+
+
+/*-----------------------------------
+        Internal functions
+-----------------------------------*/
+
+/**
+ * Current time on the monotonic clock, in nanoseconds.
+ */
+static unsigned long long nowNs()
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Raise a counter to \a value, if it is below it.
+ */
+static void raiseTo( unsigned long long* counter, unsigned long long value )
+{
+	unsigned long long seen = __atomic_load_n( counter, __ATOMIC_RELAXED );
+	while( seen < value && !__atomic_compare_exchange_n( counter, &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+	{
+	}
+}
+
+/**
+ * Take the item at the front of the queue without waiting. Returns NULL if the front slot has not been filled yet.
+ */
+static void* tryPop()
+{
+	unsigned long pos = __atomic_load_n( &pop_pos, __ATOMIC_RELAXED );
+	struct work_cell *cell;
+
+	while( 1 )
+	{
+		cell = &cells[ pos & mask ];
+		long diff = (long)( __atomic_load_n( &cell->sequence, __ATOMIC_ACQUIRE ) - ( pos + 1 ) );
+		if( diff == 0 )
+		{
+			if( __atomic_compare_exchange_n( &pop_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+			{
+				break;
+			}
+		}
+		else if( diff < 0 )
+		{
+			return NULL;
+		}
+		else
+		{
+			pos = __atomic_load_n( &pop_pos, __ATOMIC_RELAXED );
+		}
+	}
+
+	void *item = cell->item;
+	unsigned long long waited = nowNs() - cell->pushed_ns;
+	/** Hand the slot back to producers, one lap ahead. */
+	__atomic_store_n( &cell->sequence, pos + mask + 1, __ATOMIC_RELEASE );
+
+	__atomic_fetch_sub( &stats.depth, 1, __ATOMIC_RELAXED );
+	__atomic_fetch_add( &stats.popped, 1, __ATOMIC_RELAXED );
+	__atomic_fetch_add( &stats.total_wait_ns, waited, __ATOMIC_RELAXED );
+	raiseTo( &stats.max_wait_ns, waited );
+	return item;
+}
+
+
+/*-----------------------------------
+            Functions
+-----------------------------------*/
+
+int workQueueInit( size_t capacity )
+{
+	if( capacity == 0 || ( capacity & ( capacity - 1 ) ) != 0 )
+	{
+		return -1;
+	}
+	if( ( cells = (struct work_cell*) calloc( capacity, sizeof( struct work_cell ) ) ) == NULL )
+	{
+		return -1;
+	}
+	for( size_t n = 0; n < capacity; n++ )
+	{
+		cells[n].sequence = n;
+	}
+	mask = capacity - 1;
+	push_pos = 0;
+	pop_pos = 0;
+	closed = 0;
+	sem_init( &available, 0, 0 );
+	return 0;
+}
+
+void workQueueDestroy()
+{
+	sem_destroy( &available );
+	free( cells );
+	cells = NULL;
+}
+
+int workPush( void* item )
+{
+	unsigned long pos = __atomic_load_n( &push_pos, __ATOMIC_RELAXED );
+	struct work_cell *cell;
+
+	while( 1 )
+	{
+		cell = &cells[ pos & mask ];
+		long diff = (long)( __atomic_load_n( &cell->sequence, __ATOMIC_ACQUIRE ) - pos );
+		if( diff == 0 )
+		{
+			if( __atomic_compare_exchange_n( &push_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+			{
+				break;
+			}
+		}
+		else if( diff < 0 )
+		{
+			/** The slot still holds the item from the previous lap: the queue is full. */
+			__atomic_fetch_add( &stats.rejected, 1, __ATOMIC_RELAXED );
+			return -1;
+		}
+		else
+		{
+			pos = __atomic_load_n( &push_pos, __ATOMIC_RELAXED );
+		}
+	}
+
+	cell->item = item;
+	cell->pushed_ns = nowNs();
+	/** The depth is counted before the item can be popped, so that it never drops below zero. */
+	__atomic_fetch_add( &stats.pushed, 1, __ATOMIC_RELAXED );
+	raiseTo( &stats.max_depth, __atomic_add_fetch( &stats.depth, 1, __ATOMIC_RELAXED ) );
+	/** Publish the item to consumers. */
+	__atomic_store_n( &cell->sequence, pos + 1, __ATOMIC_RELEASE );
+	sem_post( &available );
+	return 0;
+}
+
+void* workPop()
+{
+	while( sem_wait( &available ) == -1 && errno == EINTR )
+	{
+	}
+
+	/** Every post but the closing ones stands for an item that has been published. It may sit behind a slot another producer
+	 * has claimed but not filled yet, which only takes a moment. */
+	void *item;
+	while( ( item = tryPop() ) == NULL )
+	{
+		if( __atomic_load_n( &closed, __ATOMIC_ACQUIRE ) == 1 )
+		{
+			return NULL;
+		}
+		sched_yield();
+	}
+	return item;
+}
+
+void workQueueClose( int consumers )
+{
+	__atomic_store_n( &closed, 1, __ATOMIC_RELEASE );
+	for( int n = 0; n < consumers; n++ )
+	{
+		sem_post( &available );
+	}
+}
+
+void workQueueStats( struct work_stats* out )
+{
+	out->pushed = __atomic_load_n( &stats.pushed, __ATOMIC_RELAXED );
+	out->rejected = __atomic_load_n( &stats.rejected, __ATOMIC_RELAXED );
+	out->depth = __atomic_load_n( &stats.depth, __ATOMIC_RELAXED );
+	out->max_depth = __atomic_load_n( &stats.max_depth, __ATOMIC_RELAXED );
+	out->total_wait_ns = __atomic_load_n( &stats.total_wait_ns, __ATOMIC_RELAXED );
+	out->max_wait_ns = __atomic_load_n( &stats.max_wait_ns, __ATOMIC_RELAXED );
+	out->popped = __atomic_load_n( &stats.popped, __ATOMIC_RELAXED );
+}
@@ -0,0 +1,84 @@
+/**
+ * @file work_queue.h
+ * @authors Matthew Lindner, Xiao Deng
+ *
+ * @brief Header file for work_queue.c
+ * @details Bounded multi-producer, multi-consumer queue that hands work from the event loop to the worker threads.
+ *
+ * Pushing and popping never take a lock: each slot of the ring carries a sequence number that tells producers and consumers whose turn
+ * it is (D. Vyukov's bounded MPMC queue). Consumers that find the queue empty sleep on a semaphore, which is posted once per item.
+ * The queue also counts how deep it gets and how long items wait in it, see workQueueStats().
+ */
+
+#ifndef __WORK_QUEUE_H__
+#define __WORK_QUEUE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*-----------------------------------
+        Types & Structures
+-----------------------------------*/
+/**
+ * Counters kept by the queue since workQueueInit().
+ */
+struct work_stats
+{
+	unsigned long	pushed;					///< Number of items pushed
+	unsigned long	rejected;				///< Number of pushes refused because the queue was full
+	unsigned long long depth;				///< Number of items in the queue right now
+	unsigned long long max_depth;			///< Most items that have ever been in the queue at once
+	unsigned long long total_wait_ns;		///< Time every popped item spent in the queue, added up, in nanoseconds
+	unsigned long long max_wait_ns;			///< Longest time an item spent in the queue, in nanoseconds
+	unsigned long	popped;					///< Number of items popped
+};
+
+/*-----------------------------------
+            Prototypes
+-----------------------------------*/
+/**
+ * Allocate the queue.
+ *
+ * @param capacity Number of slots, must be a power of 2, INPUT.
+ *
+ * @return 0, or -1 if \a capacity is not a power of 2 or memory could not be allocated.
+ */
+int workQueueInit( size_t capacity );
+
+/**
+ * Free the queue. No thread may be using it.
+ */
+void workQueueDestroy();
+
+/**
+ * Add an item to the back of the queue, and wake a consumer.
+ *
+ * @param item The item, must not be NULL, INPUT.
+ *
+ * @return 0, or -1 if the queue is full.
+ */
+int workPush( void* item );
+
+/**
+ * Take the item at the front of the queue, waiting for one if the queue is empty.
+ *
+ * @return The item, or NULL once workQueueClose() has been called and the queue is empty.
+ */
+void* workPop();
+
+/**
+ * Wake every consumer waiting in workPop(), so that they return NULL once the queue is empty. Must only be called once nothing but the
+ * consumers themselves will push any more.
+ *
+ * @param consumers Number of threads that may be waiting, INPUT.
+ */
+void workQueueClose( int consumers );
+
+/**
+ * Read the queue's counters.
+ *
+ * @param stats Filled in with the counters, OUTPUT.
+ */
+void workQueueStats( struct work_stats* stats );
+
+#endif